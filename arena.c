@@ -0,0 +1,81 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* arena.c : a bump allocator which is released as a whole */
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+/* Every allocation, and the start of the data in a chunk, is aligned to
+ * the widest of the types stored in an arena.
+ */
+#define ARENA_ALIGN 8
+#define arena_round(size) (((size) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define arena_data(chunk) (((char *) (chunk)) + arena_round(sizeof(arena_chunk_t)))
+
+void arena_init (arena_t *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size;
+    arena->n_bytes = 0;
+}
+
+void *arena_alloc (arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = arena->current;
+    void *result;
+
+    size = arena_round (size);
+
+    /* Continue in the chunks kept by a reset, before allocating new ones */
+    while (chunk == NULL || chunk->used + size > chunk->size) {
+        if (chunk && chunk->next) {
+            chunk = chunk->next;
+        } else {
+            size_t chunk_size = (size > arena->chunk_size ? size : arena->chunk_size);
+            arena_chunk_t *new_chunk = (arena_chunk_t *)
+                    malloc (arena_round(sizeof(arena_chunk_t)) + chunk_size);
+
+            if (new_chunk == NULL) return NULL;
+
+            new_chunk->next = NULL;
+            new_chunk->size = chunk_size;
+            if (chunk) {
+                chunk->next = new_chunk;
+            } else {
+                arena->head = new_chunk;
+            }
+            chunk = new_chunk;
+        }
+        chunk->used = 0;
+    }
+
+    result = arena_data (chunk) + chunk->used;
+    chunk->used += size;
+    arena->current = chunk;
+    arena->n_bytes += size;
+
+    return result;
+}
+
+void arena_reset (arena_t *arena) {
+    arena->current = arena->head;
+    if (arena->head) arena->head->used = 0;
+    arena->n_bytes = 0;
+}
+
+void arena_destroy (arena_t *arena) {
+    arena_chunk_t *chunk = arena->head;
+
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free (chunk);
+        chunk = next;
+    }
+
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->n_bytes = 0;
+}
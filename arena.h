@@ -0,0 +1,49 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* arena.h : a bump allocator which is released as a whole
+ *
+ * Allocations are carved from large chunks and are never freed one by one.
+ * arena_reset makes all chunks available again without returning them to
+ * the heap, so a workload that fills the arena, resets it and fills it again
+ * reuses the same memory.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct arena_chunk arena_chunk_t;
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t size;
+    size_t used;
+};
+
+typedef struct arena arena_t;
+struct arena {
+    arena_chunk_t *head;
+    /* the chunk allocations are taken from */
+    arena_chunk_t *current;
+    size_t chunk_size;
+    /* the number of bytes handed out since the last reset */
+    size_t n_bytes;
+};
+
+/* Initialise an empty arena, the first chunk is allocated on first use. */
+void arena_init (arena_t *arena, size_t chunk_size);
+
+/* Returns size bytes aligned for any type, or NULL when out of memory. */
+void *arena_alloc (arena_t *arena, size_t size);
+
+/* Invalidate all allocations, keeping the chunks for reuse. */
+void arena_reset (arena_t *arena);
+
+/* Return all chunks to the heap. */
+void arena_destroy (arena_t *arena);
+
+#endif /* _ARENA_H */
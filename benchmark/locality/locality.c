@@ -0,0 +1,278 @@
+/* locality.c : measures how well the stop numbering of a timetable fits
+ * the memory access pattern of the router.
+ *
+ * The router keeps its state in arrays indexed by stop. A journey_pattern
+ * scan touches the entries of all its stops, applying transfers touches
+ * the entries of all transfer targets. For every timetable given on the
+ * commandline this reports the number of distinct cache lines touched by
+ * those scans, the miss rate of a simulated cache while running all scans
+ * once, and the time it takes to replay them on a state array.
+ *
+ * The order of the journey_patterns is measured by flagging the patterns of
+ * blocks of consecutive stops, as apply_transfers does for updated stops, and
+ * scanning the flagged patterns in index order through the simulated cache:
+ * their structs, journey_pattern_points and the stop_times of a vj.
+ *
+ * usage: locality timetable.dat [timetable_renumbered.dat ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "tdata.h"
+
+#define CACHE_LINE 64
+#define N_REPEAT 200
+
+/* Simulated direct-mapped caches of 32kB and 256kB */
+#define L1_LINES 512
+#define L2_LINES 4096
+
+/* The number of consecutive stops updated together in a simulated round */
+#define FLAG_BLOCK 64
+
+/* Distinct line numbers for the arrays holding the journey_pattern data */
+#define LINE_JP  0x10000000
+#define LINE_JPP 0x20000000
+#define LINE_ST  0x30000000
+
+/* The size of the per stop state touched when scanning, in bytes:
+ * best_time, states_time, states_walk_time and their back pointers.
+ */
+#define STATE_SIZE 16
+
+typedef struct locality locality_t;
+struct locality {
+    uint64_t jp_lines;
+    uint64_t jp_points;
+    uint64_t tr_lines;
+    uint64_t tr_targets;
+    uint64_t jump;
+    uint64_t l1_misses;
+    uint64_t l2_misses;
+    uint64_t accesses;
+    uint64_t jp_l1_misses;
+    uint64_t jp_l2_misses;
+    uint64_t jp_accesses;
+    double   seconds;
+};
+
+typedef struct cache cache_t;
+struct cache {
+    uint32_t l1[L1_LINES];
+    uint32_t l2[L2_LINES];
+};
+
+/* Access one line in the simulated caches, counting the misses. */
+static void cache_line (cache_t *cache, uint32_t line, uint64_t *accesses,
+                        uint64_t *l1_misses, uint64_t *l2_misses) {
+    (*accesses)++;
+    if (cache->l1[line % L1_LINES] != line) {
+        cache->l1[line % L1_LINES] = line;
+        (*l1_misses)++;
+        if (cache->l2[line % L2_LINES] != line) {
+            cache->l2[line % L2_LINES] = line;
+            (*l2_misses)++;
+        }
+    }
+}
+
+/* Access the state of one stop in the simulated caches. */
+static void cache_access (cache_t *cache, locality_t *loc, spidx_t stop) {
+    cache_line (cache, ((uint32_t) stop) * STATE_SIZE / CACHE_LINE,
+                &loc->accesses, &loc->l1_misses, &loc->l2_misses);
+}
+
+/* Access the data of one journey_pattern scan in the simulated caches. */
+static void cache_journey_pattern (cache_t *cache, locality_t *loc,
+                                   tdata_t *td, uint32_t jp_index) {
+    journey_pattern_t *jp = td->journey_patterns + jp_index;
+    vehicle_journey_t *vj = td->vjs + jp->vj_ids_offset;
+    uint32_t i;
+
+    cache_line (cache, LINE_JP + jp_index * sizeof(journey_pattern_t) / CACHE_LINE,
+                &loc->jp_accesses, &loc->jp_l1_misses, &loc->jp_l2_misses);
+    for (i = 0; i < jp->n_stops; ++i) {
+        cache_line (cache, LINE_JPP + (jp->journey_pattern_point_offset + i) *
+                    sizeof(spidx_t) / CACHE_LINE,
+                    &loc->jp_accesses, &loc->jp_l1_misses, &loc->jp_l2_misses);
+        cache_line (cache, LINE_ST + (vj->stop_times_offset + i) *
+                    sizeof(stoptime_t) / CACHE_LINE,
+                    &loc->jp_accesses, &loc->jp_l1_misses, &loc->jp_l2_misses);
+    }
+}
+
+/* Flag the journey_patterns at blocks of consecutive stops, and scan the
+ * flagged patterns in index order, like a router round would.
+ */
+static void measure_journey_patterns (tdata_t *td, locality_t *loc) {
+    uint8_t *flagged = (uint8_t *) calloc (td->n_journey_patterns, 1);
+    cache_t *cache = (cache_t *) malloc (sizeof(cache_t));
+    uint32_t block;
+
+    memset (cache, 0xFF, sizeof(cache_t));
+
+    for (block = 0; block < td->n_stops; block += FLAG_BLOCK) {
+        uint32_t stop_index, jp_index;
+        uint32_t jp_min = td->n_journey_patterns, jp_max = 0;
+
+        for (stop_index = block;
+             stop_index < block + FLAG_BLOCK && stop_index < td->n_stops;
+             ++stop_index) {
+            uint32_t *jps;
+            uint32_t n_jps = tdata_journey_patterns_for_stop (td, (spidx_t) stop_index, &jps);
+            while (n_jps--) {
+                flagged[jps[n_jps]] = 1;
+                if (jps[n_jps] < jp_min) jp_min = jps[n_jps];
+                if (jps[n_jps] > jp_max) jp_max = jps[n_jps];
+            }
+        }
+
+        for (jp_index = jp_min; jp_index <= jp_max && jp_index < td->n_journey_patterns; ++jp_index) {
+            if ( ! flagged[jp_index]) continue;
+            flagged[jp_index] = 0;
+            cache_journey_pattern (cache, loc, td, jp_index);
+        }
+    }
+
+    free (flagged);
+    free (cache);
+}
+
+/* Count the distinct cache lines in an array of elements of the given size,
+ * touched by the given stops. stamp is used to remember the last scan that
+ * touched a line.
+ */
+static uint32_t lines_touched (uint32_t *stamp, uint32_t scan,
+                               spidx_t *stops, uint32_t n, uint32_t size) {
+    uint32_t n_lines = 0;
+    uint32_t i;
+
+    for (i = 0; i < n; ++i) {
+        uint32_t line = ((uint32_t) stops[i]) * size / CACHE_LINE;
+        if (stamp[line] != scan) {
+            stamp[line] = scan;
+            n_lines++;
+        }
+    }
+
+    return n_lines;
+}
+
+static void measure (tdata_t *td, locality_t *loc) {
+    uint32_t n_lines = td->n_stops * STATE_SIZE / CACHE_LINE + 1;
+    uint32_t *stamp = (uint32_t *) malloc (sizeof(uint32_t) * n_lines);
+    uint8_t *states = (uint8_t *) calloc (td->n_stops, STATE_SIZE);
+    uint32_t scan = 0;
+    uint32_t jp_index, stop_index, i_repeat;
+    clock_t start;
+    uint32_t sum = 0;
+    cache_t *cache = (cache_t *) malloc (sizeof(cache_t));
+
+    memset (loc, 0, sizeof(locality_t));
+    memset (stamp, 0xFF, sizeof(uint32_t) * n_lines);
+    memset (cache, 0xFF, sizeof(cache_t));
+
+    for (jp_index = 0; jp_index < td->n_journey_patterns; ++jp_index) {
+        spidx_t *jpp = tdata_points_for_journey_pattern (td, jp_index);
+        uint16_t n = td->journey_patterns[jp_index].n_stops;
+        uint16_t i;
+
+        loc->jp_lines += lines_touched (stamp, scan++, jpp, n, STATE_SIZE);
+        loc->jp_points += n;
+        cache_access (cache, loc, jpp[0]);
+        for (i = 1; i < n; ++i) {
+            cache_access (cache, loc, jpp[i]);
+            loc->jump += (jpp[i] > jpp[i - 1] ? jpp[i] - jpp[i - 1]
+                                              : jpp[i - 1] - jpp[i]);
+        }
+    }
+
+    for (stop_index = 0; stop_index < td->n_stops; ++stop_index) {
+        uint32_t t  = td->stops[stop_index    ].transfers_offset;
+        uint32_t tN = td->stops[stop_index + 1].transfers_offset;
+        loc->tr_lines += lines_touched (stamp, scan++,
+                                        td->transfer_target_stops + t,
+                                        tN - t, STATE_SIZE);
+        loc->tr_targets += tN - t;
+        cache_access (cache, loc, (spidx_t) stop_index);
+        for ( ; t < tN; ++t) {
+            cache_access (cache, loc, td->transfer_target_stops[t]);
+        }
+    }
+
+    /* Replay all journey_pattern scans and transfers on a state array */
+    start = clock ();
+    for (i_repeat = 0; i_repeat < N_REPEAT; ++i_repeat) {
+        for (jp_index = 0; jp_index < td->n_journey_patterns; ++jp_index) {
+            spidx_t *jpp = tdata_points_for_journey_pattern (td, jp_index);
+            uint16_t n = td->journey_patterns[jp_index].n_stops;
+            uint16_t i;
+            for (i = 0; i < n; ++i) {
+                uint8_t *state = states + ((uint32_t) jpp[i]) * STATE_SIZE;
+                sum += state[0];
+                state[1] = (uint8_t) i;
+            }
+        }
+        for (stop_index = 0; stop_index < td->n_transfer_target_stops; ++stop_index) {
+            uint8_t *state = states + ((uint32_t) td->transfer_target_stops[stop_index]) * STATE_SIZE;
+            sum += state[0];
+            state[2] = (uint8_t) stop_index;
+        }
+    }
+    loc->seconds = ((double) (clock () - start)) / CLOCKS_PER_SEC;
+
+    /* keep the replay from being optimised away */
+    if (sum == 1) fprintf (stderr, "\n");
+
+    free (stamp);
+    free (states);
+    free (cache);
+
+    measure_journey_patterns (td, loc);
+}
+
+int main (int argc, char *argv[]) {
+    int i_arg;
+
+    if (argc < 2) {
+        fprintf (stderr, "usage: %s timetable.dat [timetable_renumbered.dat ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf ("%-24s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "timetable",
+            "lines/jp", "lines/jpp", "lines/tr", "jump/jpp",
+            "L1 miss%", "L2 miss%", "jp L1%", "jp L2%", "replay s");
+
+    for (i_arg = 1; i_arg < argc; ++i_arg) {
+        tdata_t td;
+        locality_t loc;
+
+        memset (&td, 0, sizeof(tdata_t));
+        if ( ! tdata_load (&td, argv[i_arg])) {
+            fprintf (stderr, "could not load %s\n", argv[i_arg]);
+            return EXIT_FAILURE;
+        }
+
+        measure (&td, &loc);
+
+        printf ("%-24s %9.2f %9.3f %9.3f %9.1f %9.2f %9.2f %9.2f %9.2f %9.3f\n",
+                argv[i_arg],
+                (double) loc.jp_lines / td.n_journey_patterns,
+                (double) loc.jp_lines / (loc.jp_points ? loc.jp_points : 1),
+                (double) loc.tr_lines / (loc.tr_targets ? loc.tr_targets : 1),
+                (double) loc.jump / (loc.jp_points ? loc.jp_points : 1),
+                100.0 * loc.l1_misses / loc.accesses,
+                100.0 * loc.l2_misses / loc.accesses,
+                100.0 * loc.jp_l1_misses / loc.jp_accesses,
+                100.0 * loc.jp_l2_misses / loc.jp_accesses,
+                loc.seconds);
+
+        tdata_close (&td);
+    }
+
+    return EXIT_SUCCESS;
+}
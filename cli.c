@@ -5,6 +5,9 @@
 
 /* cli.c : single-threaded commandline interface to the library */
 
+/* sigaction is POSIX, not ANSI C */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +24,14 @@
 
 #ifdef RRRR_FEATURE_REALTIME_EXPANDED
 #include "tdata_realtime_expanded.h"
+#include "tdata_realtime_shared.h"
+#include "tdata_realtime_snapshot.h"
+#include "tdata_realtime_stream.h"
+#include "util.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
 #endif
 
 #endif
@@ -31,8 +42,13 @@ typedef struct cli_arguments cli_arguments_t;
 struct cli_arguments {
     char *gtfsrt_alerts_filename;
     char *gtfsrt_tripupdates_filename;
+    char *gtfsrt_shared_filename;
+    char *gtfsrt_stream_source;
+    char *gtfsrt_snapshot_filename;
     uint32_t repeat;
     bool verbose;
+    /* applies trip updates, rather than using the ones of an updater */
+    bool gtfsrt_updater;
 };
 
 #if RRRR_MAX_BANNED_JOURNEY_PATTERNS > 0
@@ -89,6 +105,104 @@ static void set_add_trip (uint32_t *set1, uint16_t *set2,
 }
 #endif
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* the stream a signal ends, and whether a signal came before it opened */
+static tdata_rt_stream_t *cli_stream;
+static volatile sig_atomic_t cli_stream_stopped;
+
+static void cli_stream_stop (int signum) {
+    UNUSED(signum);
+    cli_stream_stopped = 1;
+    if (cli_stream) tdata_rt_stream_stop (cli_stream);
+}
+
+/* Without SA_RESTART, so the blocking open of a named pipe returns EINTR */
+static void cli_stream_signals (void (*handler) (int)) {
+    struct sigaction sa;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset (&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+}
+
+/* Apply every feed message read from source, until the stream ends, and
+ * publish the result to the workers after each message. A snapshot, when
+ * given, is written at most every RRRR_REALTIME_SNAPSHOT_INTERVAL seconds.
+ */
+static bool cli_gtfsrt_stream (tdata_t *tdata, char *source,
+                               tdata_rt_shared_t *shared, char *snapshot) {
+    tdata_rt_stream_t stream;
+    time_t snapshot_time = time (NULL);
+    bool snapshot_pending = false;
+    uint32_t n_feeds = 0;
+    uint32_t n_failed = 0;
+    uint8_t *buf;
+    size_t len;
+
+    /* Before the open, which blocks on a named pipe until its producer
+     * shows up.
+     */
+    cli_stream_stopped = 0;
+    cli_stream_signals (cli_stream_stop);
+
+    if ( ! tdata_rt_stream_open (&stream, source)) {
+        cli_stream_signals (SIG_DFL);
+        return (bool) cli_stream_stopped;
+    }
+
+    cli_stream = &stream;
+    if (cli_stream_stopped) tdata_rt_stream_stop (&stream);
+
+    while (tdata_rt_stream_next (&stream, &buf, &len)) {
+        tdata_rt_feed_stats_t stats;
+        struct timeval start, end;
+        bool published = false;
+
+        gettimeofday (&start, NULL);
+        if ( ! tdata_apply_gtfsrt_feed (tdata, buf, len, true, &stats)) {
+            n_failed++;
+        } else if (shared->header) {
+            published = tdata_rt_shared_publish (shared, tdata);
+        }
+        gettimeofday (&end, NULL);
+
+        /* One line per feed, for the logs to be scraped */
+        fprintf (stderr, "gtfsrt feed=%u bytes=%lu entities=%u applied=%u "
+                         "unchanged=%u reverted=%u errors=%u published=%d "
+                         "latency_us=%ld\n",
+                         n_feeds, (unsigned long) len, stats.n_entities,
+                         stats.n_applied, stats.n_unchanged, stats.n_reverted,
+                         stats.n_errors, published,
+                         (long) (end.tv_sec - start.tv_sec) * 1000000L +
+                         (long) (end.tv_usec - start.tv_usec));
+        n_feeds++;
+
+        if (snapshot) {
+            snapshot_pending = true;
+            if (end.tv_sec - snapshot_time >= RRRR_REALTIME_SNAPSHOT_INTERVAL) {
+                tdata_realtime_snapshot_write (tdata, snapshot);
+                snapshot_time = end.tv_sec;
+                snapshot_pending = false;
+            }
+        }
+    }
+
+    if (snapshot_pending) tdata_realtime_snapshot_write (tdata, snapshot);
+
+    cli_stream_signals (SIG_DFL);
+    cli_stream = NULL;
+
+    tdata_rt_stream_close (&stream);
+
+    fprintf (stderr, "gtfsrt stream %s ended after %u feeds, "
+                     "%u could not be decoded\n", source, n_feeds, n_failed);
+    return true;
+}
+#endif
+
 int main (int argc, char *argv[]) {
     /* our return value */
     int status = EXIT_SUCCESS;
@@ -105,10 +219,20 @@ int main (int argc, char *argv[]) {
     /* the router structure, should not be manually changed */
     router_t router;
 
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* the realtime stoptimes published by an updater process */
+    tdata_rt_shared_t shared;
+    uint32_t shared_ticket = 0;
+    bool shared_pinned = false;
+    #endif
+
     /* initialise the structs so we can always trust NULL values */
     memset (&tdata,    0, sizeof(tdata_t));
     memset (&router,   0, sizeof(router_t));
     memset (&cli_args, 0, sizeof(cli_args));
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    memset (&shared,   0, sizeof(shared));
+    #endif
 
     /* * * * * * * * * * * * * * * * * * * * * *
      * PHASE ZERO: HANDLE COMMANDLINE ARGUMENTS
@@ -138,11 +262,15 @@ int main (int argc, char *argv[]) {
 #if RRRR_FEATURE_REALTIME_ALERTS == 1
                         "[ --gtfsrt-alerts=filename.pb ]\n"
 #endif
+                        , argv[0]);
 #if RRRR_FEATURE_REALTIME_EXPANDED == 1
-                        "[ --gtfsrt-tripupdates=filename.pb ]\n"
+        /* C89 compilers only need to support strings of 509 characters */
+        fprintf(stderr, "[ --gtfsrt-tripupdates=filename.pb ]\n"
+                        "[ --gtfsrt-shared=/dev/shm/filename ]\n"
+                        "[ --gtfsrt-stream=directory | fifo | unix:socket ]\n"
+                        "[ --gtfsrt-snapshot=filename ]\n");
 #endif
-                        "[ --repeat=n ]\n"
-                        , argv[0]);
+        fprintf(stderr, "[ --repeat=n ]\n");
     }
 
     /* The first mandartory argument is the timetable file. We must initialise
@@ -216,6 +344,15 @@ int main (int argc, char *argv[]) {
                     if (strncmp(argv[i], "--gtfsrt-tripupdates=", 21) == 0) {
                         cli_args.gtfsrt_tripupdates_filename = &argv[i][21];
                     }
+                    else if (strncmp(argv[i], "--gtfsrt-shared=", 16) == 0) {
+                        cli_args.gtfsrt_shared_filename = &argv[i][16];
+                    }
+                    else if (strncmp(argv[i], "--gtfsrt-stream=", 16) == 0) {
+                        cli_args.gtfsrt_stream_source = &argv[i][16];
+                    }
+                    else if (strncmp(argv[i], "--gtfsrt-snapshot=", 18) == 0) {
+                        cli_args.gtfsrt_snapshot_filename = &argv[i][18];
+                    }
                     #endif
                     #ifdef RRRR_FEATURE_REALTIME_ALERTS
                     if (strncmp(argv[i], "--gtfsrt-alerts=", 16) == 0) {
@@ -339,13 +476,24 @@ int main (int argc, char *argv[]) {
 
     /* */
 
+    cli_args.gtfsrt_updater = (cli_args.gtfsrt_tripupdates_filename != NULL ||
+                               cli_args.gtfsrt_stream_source != NULL);
+
+    /* A worker using the trip updates of an updater ignores the snapshot */
+    if (cli_args.gtfsrt_shared_filename != NULL &&
+        ! cli_args.gtfsrt_updater) {
+        cli_args.gtfsrt_snapshot_filename = NULL;
+    }
+
     #ifdef RRRR_FEATURE_REALTIME
     if (cli_args.gtfsrt_alerts_filename != NULL ||
-        cli_args.gtfsrt_tripupdates_filename != NULL) {
+        cli_args.gtfsrt_snapshot_filename != NULL ||
+        cli_args.gtfsrt_updater) {
 
-        tdata.stopid_index = radixtree_load_strings_from_tdata (tdata.stop_ids, tdata.stop_ids_width, tdata.n_stops);
-        tdata.vjid_index = radixtree_load_strings_from_tdata (tdata.vj_ids, tdata.vj_ids_width, tdata.n_vjs);
-        tdata.lineid_index = radixtree_load_strings_from_tdata (tdata.line_ids, tdata.line_ids_width, tdata.n_journey_patterns);
+        /* unless the timetable contains them already */
+        if (!tdata.stopid_index) tdata.stopid_index = radixtree_load_strings_from_tdata (tdata.stop_ids, tdata.stop_ids_width, tdata.n_stops);
+        if (!tdata.vjid_index) tdata.vjid_index = radixtree_load_strings_from_tdata (tdata.vj_ids, tdata.vj_ids_width, tdata.n_vjs);
+        if (!tdata.lineid_index) tdata.lineid_index = radixtree_load_strings_from_tdata (tdata.line_ids, tdata.line_ids_width, tdata.n_journey_patterns);
 
         /* Validate the radixtrees are actually created. */
         if (!(tdata.stopid_index &&
@@ -361,11 +509,59 @@ int main (int argc, char *argv[]) {
         }
         #endif
         #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+        if (cli_args.gtfsrt_updater) {
+            /* As the updater, publish the applied trip updates */
+            if (cli_args.gtfsrt_shared_filename != NULL &&
+                ! tdata_rt_shared_create (&shared, &tdata, cli_args.gtfsrt_shared_filename, 0)) {
+                status = EXIT_FAILURE;
+                goto clean_exit;
+            }
+        }
+
+        /* Start from the realtime state of a previous run, if any */
+        if (cli_args.gtfsrt_snapshot_filename != NULL &&
+            access (cli_args.gtfsrt_snapshot_filename, R_OK) == 0 &&
+            tdata_realtime_snapshot_load (&tdata, cli_args.gtfsrt_snapshot_filename) &&
+            shared.header != NULL &&
+            ! tdata_rt_shared_publish (&shared, &tdata)) {
+            status = EXIT_FAILURE;
+            goto clean_exit;
+        }
+
         if (cli_args.gtfsrt_tripupdates_filename != NULL) {
             tdata_apply_gtfsrt_tripupdates_file (&tdata, cli_args.gtfsrt_tripupdates_filename);
+
+            if (cli_args.gtfsrt_shared_filename != NULL &&
+                ! tdata_rt_shared_publish (&shared, &tdata)) {
+                status = EXIT_FAILURE;
+                goto clean_exit;
+            }
+
+            if (cli_args.gtfsrt_snapshot_filename != NULL) {
+                tdata_realtime_snapshot_write (&tdata, cli_args.gtfsrt_snapshot_filename);
+            }
+        }
+
+        /* Keep applying feeds until the stream ends, then plan as usual */
+        if (cli_args.gtfsrt_stream_source != NULL &&
+            ! cli_gtfsrt_stream (&tdata, cli_args.gtfsrt_stream_source, &shared,
+                                cli_args.gtfsrt_snapshot_filename)) {
+            status = EXIT_FAILURE;
+            goto clean_exit;
         }
         #endif
     }
+
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* As a worker, use the trip updates published by an updater */
+    if (cli_args.gtfsrt_shared_filename != NULL &&
+        ! cli_args.gtfsrt_updater) {
+        if ( ! tdata_rt_shared_open (&shared, &tdata, cli_args.gtfsrt_shared_filename)) {
+            status = EXIT_FAILURE;
+            goto clean_exit;
+        }
+    }
+    #endif
     #endif
 
     /* The internal time representation uses a resolution of 4 seconds per
@@ -402,6 +598,16 @@ int main (int argc, char *argv[]) {
      * * * * * * * * * * * * * * * * * * */
 
 plan:
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* As a worker, pin the current shared realtime buffer for the searches
+     * and the rendering of one request.
+     */
+    if (shared.header && ! cli_args.gtfsrt_updater) {
+        shared_ticket = tdata_rt_shared_acquire (&shared, &tdata);
+        shared_pinned = true;
+    }
+    #endif
+
     /* While the scratch space remains allocated, each new search may require
      * reinitialisation of this memory.
      */
@@ -499,6 +705,13 @@ plan:
         /* For benchmarking: repeat the search up to n time */
         if (cli_args.repeat > 0) {
             cli_args.repeat--;
+            #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+            /* the updater may publish a new version in between */
+            if (shared_pinned) {
+                tdata_rt_shared_release (&shared, shared_ticket);
+                shared_pinned = false;
+            }
+            #endif
             goto plan;
         }
 
@@ -516,6 +729,13 @@ plan:
      */
 
 clean_exit:
+    /* A pin on the shared realtime buffer would block the updater */
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    if (shared_pinned) {
+        tdata_rt_shared_release (&shared, shared_ticket);
+    }
+    #endif
+
     #ifndef RRRR_VALGRIND
     goto fast_exit;
     #endif
@@ -523,6 +743,10 @@ clean_exit:
     /* Deallocate the scratchspace of the router */
     router_teardown (&router);
 
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    if (shared.header) tdata_rt_shared_close (&shared, &tdata);
+    #endif
+
     #ifdef RRRR_FEATURE_REALTIME
     if (tdata.stopid_index) radixtree_destroy (tdata.stopid_index);
     if (tdata.vjid_index) radixtree_destroy (tdata.vjid_index);
@@ -25,6 +25,17 @@
 
 #define RRRR_FEATURE_LATLON 1
 
+/* The hashgrid of the stops has RRRR_HASHGRID_DIM by RRRR_HASHGRID_DIM
+ * bins of RRRR_HASHGRID_BIN_METERS, wrapping around.
+ */
+#define RRRR_HASHGRID_DIM 100
+#define RRRR_HASHGRID_BIN_METERS 500.0
+
+/* Prune the search using per-query lower bounds on the travel time
+ * from each stop to the target (goal-directed search).
+ */
+#define RRRR_FEATURE_LOWER_BOUND 1
+
 #define RRRR_WALK_COMP 1.2
 
 #define RRRR_BANNED_JOURNEY_PATTERNS_BITMASK 0
@@ -37,21 +48,45 @@
 #define RRRR_TDATA_IO_DYNAMIC 1
 #endif
 
-#ifndef RRRR_TDATA_IO_MMAP
+/* The mmap loader supports realtime with RRRR_FEATURE_REALTIME_MMAP,
+ * the columns realtime changes are then mapped copy-on-write.
+ */
+#if !defined(RRRR_TDATA_IO_MMAP) || defined(RRRR_FEATURE_REALTIME_MMAP)
 #define RRRR_FEATURE_REALTIME_EXPANDED 1
 #define RRRR_FEATURE_REALTIME_ALERTS 1
 #define RRRR_FEATURE_REALTIME 1
 
 #define RRRR_DYNAMIC_SLACK 2
+
+/* Size in bytes of the blocks realtime stoptimes are allocated from */
+#define RRRR_REALTIME_ARENA_CHUNK (1 << 20)
+
+/* The largest GTFS-RT message read from a stream, and the seconds between
+ * two scans of a streamed directory.
+ */
+#define RRRR_REALTIME_STREAM_MAX_MESSAGE (64 << 20)
+#define RRRR_REALTIME_STREAM_POLL 1
+
+/* The minimum number of seconds between two realtime snapshots written
+ * while applying a stream.
+ */
+#define RRRR_REALTIME_SNAPSHOT_INTERVAL 60
+
+/* The percentage of a delay a vehicle recovers from the scheduled running
+ * time of a segment, and from the scheduled dwell time at a stop, when a
+ * delay is propagated to the stops a TripUpdate doesn't predict.
+ */
+#define RRRR_REALTIME_RECOVERY_RUNTIME 5
+#define RRRR_REALTIME_RECOVERY_DWELL 50
 #endif
 
 /* roughly the length of common prefixes in IDs */
 #define RRRR_RADIXTREE_PREFIX_SIZE 4
 
-/* with prefix size of 4 and -m32, edge size is 16 bytes, total 11.9MB
- * with prefix size of 4 and -m64, edge size is 24 bytes, total 17.8MB
+/* with prefix size of 4, edge size is 16 bytes on both -m32 and -m64,
+ * as edges refer to each other by 32-bit indices into a single pool,
+ * total 11.9MB where pointers took 17.8MB on -m64.
  * total size of all ids is 15.6 MB
- * could use int indexes into a fixed-size, pre-allocated edge pool.
  */
 
 #endif
@@ -76,180 +76,391 @@ void hashgrid_result_reset (hashgrid_result_t *result) {
     result->x = result->xmin;
     result->y = result->ymin;
 
-    /* TODO: should start at -1, which will increment to 0? */
+    /* the index within the bin of the next item */
     result->i = 0;
     result->has_next = true;
+    result->batch_mask = 0;
 }
 
-uint32_t hashgrid_result_next (hashgrid_result_t *r) {
-    uint32_t ret_item;
+/* The position in items of the next n items in a bin of the result,
+ * skipping empty bins. At most max_n items are taken from the bin.
+ */
+static uint32_t hashgrid_result_next_positions (hashgrid_result_t *r,
+                                                uint32_t max_n, uint32_t *n) {
+    hashgrid_t *hg = r->hg;
+
+    while (r->has_next) {
+        uint32_t bin = r->y * hg->grid_dim + r->x;
+        uint32_t n_bin = hg->bin_offsets[bin + 1] - hg->bin_offsets[bin];
+        if (r->i < n_bin) {
+            uint32_t position = hg->bin_offsets[bin] + r->i;
+            *n = (n_bin - r->i < max_n ? n_bin - r->i : max_n);
+            r->i += *n;
+            return position;
+        }
 
-    if ( ! (r->has_next))
-        return HASHGRID_NONE;
-    r->i += 1;
-    if (r->i >= r->hg->counts[r->y * r->hg->grid_dim + r->x]) {
         r->i = 0;
         /* note '==': inequalities do not work due to wrapping */
         if (r->x == r->xmax) {
             r->x = r->xmin;
             if (r->y == r->ymax) {
                 r->has_next = false;
-                return HASHGRID_NONE;
             } else {
-                r->y = (r->y + 1) % r->hg->grid_dim;
+                r->y = (r->y + 1) % hg->grid_dim;
             }
         } else {
-            r->x = (r->x + 1) % r->hg->grid_dim;
+            r->x = (r->x + 1) % hg->grid_dim;
         }
     }
 
-    ret_item = r->hg->bins[r->y * r->hg->grid_dim + r->x][r->i];
+    return HASHGRID_NONE;
+}
+
+static uint32_t hashgrid_result_next_position (hashgrid_result_t *r) {
+    uint32_t n;
+    return hashgrid_result_next_positions (r, 1, &n);
+}
+
+uint32_t hashgrid_result_next (hashgrid_result_t *r) {
+    uint32_t position = hashgrid_result_next_position (r);
+
+    if (position == HASHGRID_NONE) return HASHGRID_NONE;
+
     #ifdef RRRR_DEBUG
-    printf ("x=%d y=%d i=%d item=%d ", r->x, r->y, r->i, ret_item);
+    printf ("x=%d y=%d i=%d item=%d ", r->x, r->y, r->i - 1, r->hg->items[position]);
     #endif
-    return ret_item;
+    return r->hg->items[position];
+}
+
+/* A bit for each coordinate of a batch within the bounding box of the
+ * result and near enough by its ersatz distance, in a loop of fixed length
+ * the compiler can vectorize.
+ */
+static uint32_t hashgrid_batch_filter (hashgrid_result_t *r, const coord_t *coords,
+                                       double limit) {
+    uint32_t i, mask = 0;
+    for (i = 0; i < HASHGRID_BATCH; ++i) {
+        double dx = (double) coords[i].x - r->coord.x;
+        double dy = (double) coords[i].y - r->coord.y;
+        mask |= (uint32_t) (coords[i].x > r->min.x && coords[i].x < r->max.x &&
+                            coords[i].y > r->min.y && coords[i].y < r->max.y &&
+                            dx * dx + dy * dy <= limit) << i;
+    }
+    return mask;
 }
 
 /* Pre-filter the results, removing most false positives using a bounding box.
- * This will only work if the initial coordinate list is still available (was
- * not freed or did not go out of scope). We could also return a boolean to
- * indicate whether there is a result, and have an out-parameter for the index.
+ * We could also return a boolean to indicate whether there is a result, and
+ * have an out-parameter for the index.
  *
  * The hashgrid can provide many false positives, but no false negatives
  * (what is the term?). A bounding box or the squared distance can both be
  * used to filter points. Note that most false positives are quite far away
- * so a bounding box is effective.
+ * so a bounding box is effective. Both are checked for a batch of items of
+ * a bin at once, only the items passing them get their distance in meters.
  */
 uint32_t hashgrid_result_next_filtered (hashgrid_result_t *r, double *distance) {
-    uint32_t item;
-    while ((item = hashgrid_result_next(r)) != HASHGRID_NONE) {
-        coord_t *coord = r->hg->coords + item;
-        latlon_t latlon;
-        latlon_from_coord (&latlon, coord);
-        #ifdef RRRR_DEBUG_HASHGRID
-        fprintf (stderr, "%f,%f\n", latlon.lat, latlon.lon);
-        #endif
-        if (coord->x > r->min.x && coord->x < r->max.x &&
-            coord->y > r->min.y && coord->y < r->max.y) {
-            /* item's coordinate is within bounding box,
-             * calculate actual distance
-             */
+    /* The limit is widened a little, the ersatz and meter distances round
+     * differently.
+     */
+    double limit = ersatz_from_distance (r->radius_meters) * 1.000001;
+
+    for (;;) {
+        while (r->batch_mask != 0) {
+            uint32_t i = 0, position;
+            coord_t *coord;
+
+            while ( ! (r->batch_mask & (1u << i))) i++;
+            r->batch_mask &= ~(1u << i);
+
+            position = r->batch + i;
+            coord = r->hg->item_coords + position;
             *distance = coord_distance_meters (&(r->coord), coord);
             #ifdef RRRR_DEBUG_HASHGRID
             fprintf (stderr, "%d,%d,%f\n", coord->x, coord->y, *distance);
             #endif
             if (*distance < r->radius_meters) {
-                return item;
+                return r->hg->items[position];
             }
         }
+
+        {
+            uint32_t n;
+            r->batch = hashgrid_result_next_positions (r, HASHGRID_BATCH, &n);
+            if (r->batch == HASHGRID_NONE) return HASHGRID_NONE;
+
+            /* The coordinates are padded, a batch can pass the end of the bin */
+            r->batch_mask = hashgrid_batch_filter (r, r->hg->item_coords + r->batch, limit) &
+                            ((1u << n) - 1);
+        }
     }
-    return HASHGRID_NONE;
 }
 
 uint32_t hashgrid_result_closest (hashgrid_result_t *r) {
     uint32_t item;
-    uint32_t best_item = HASHGRID_NONE;
-    double   best_distance = INFINITY;
-    while ((item = hashgrid_result_next(r)) != HASHGRID_NONE) {
-        coord_t *coord = r->hg->coords + item;
-        latlon_t latlon;
-        latlon_from_coord (&latlon, coord);
-        #ifdef RRRR_DEBUG_HASHGRID
-        fprintf (stderr, "%f,%f\n", latlon.lat, latlon.lon);
-        #endif
-        if (coord->x > r->min.x && coord->x < r->max.x &&
-            coord->y > r->min.y && coord->y < r->max.y) {
-            /* false positives filtered,
-             * item's coordinate is within bounding box
-             */
-            double distance = coord_distance_meters (&(r->coord), coord);
-            if (distance < best_distance) {
-                best_item = item;
-                best_distance = distance;
+    double distance;
+
+    if (hashgrid_knn (r->hg, r->coord, r->radius_meters, 1,
+                      &item, &distance) == 0) return HASHGRID_NONE;
+
+    return item;
+}
+
+/* Insert an item into the n results sorted by distance, keeping at most k.
+ * Equal distances are ordered by item, so the results do not depend on the
+ * order of the bins.
+ */
+static uint32_t knn_insert (uint32_t *items, double *distances,
+                            uint32_t n, uint32_t k,
+                            uint32_t item, double distance) {
+    uint32_t i;
+
+    if (n == k) {
+        if (distance > distances[k - 1] ||
+            (distance == distances[k - 1] && item > items[k - 1])) return n;
+        i = k - 1;
+    } else {
+        i = n++;
+    }
+
+    while (i > 0 && (distances[i - 1] > distance ||
+                     (distances[i - 1] == distance && items[i - 1] > item))) {
+        items[i] = items[i - 1];
+        distances[i] = distances[i - 1];
+        i--;
+    }
+    items[i] = item;
+    distances[i] = distance;
+
+    return n;
+}
+
+/* The ersatz distances from coord to a batch of coordinates, in a loop of
+ * fixed length the compiler can vectorize.
+ */
+static void hashgrid_batch_ersatz (const coord_t *coords, const coord_t *coord,
+                                   double *ersatz) {
+    uint32_t i;
+    for (i = 0; i < HASHGRID_BATCH; ++i) {
+        double dx = (double) coords[i].x - coord->x;
+        double dy = (double) coords[i].y - coord->y;
+        ersatz[i] = dx * dx + dy * dy;
+    }
+}
+
+uint32_t hashgrid_knn (hashgrid_t *hg, coord_t coord, double radius_meters,
+                       uint32_t k, uint32_t *items, double *distances) {
+    coord_t origin, step;
+    double bin_meters, ersatz[HASHGRID_BATCH];
+    int32_t dim = (int32_t) hg->grid_dim;
+    int32_t cx = (int32_t) xbin (hg, &coord);
+    int32_t cy = (int32_t) ybin (hg, &coord);
+    int32_t r;
+    uint32_t n = 0;
+
+    if (k == 0) return 0;
+
+    /* Every item outside of the rings up to r is at least r bins away,
+     * measured along the narrower side of a bin.
+     */
+    origin.x = origin.y = step.y = 0;
+    step.x = (hg->bin_size.x < hg->bin_size.y ? hg->bin_size.x : hg->bin_size.y);
+    bin_meters = coord_distance_meters (&origin, &step);
+
+    for (r = 0; 2 * r <= dim; ++r) {
+        int32_t dx, dy;
+
+        for (dy = -r; dy <= r; ++dy) {
+            for (dx = -r; dx <= r; dx += ((dy == -r || dy == r || r == 0) ? 1 : 2 * r)) {
+                uint32_t bin, position, end;
+
+                /* With an even grid_dim the last ring wraps onto itself */
+                if (2 * r == dim && (dx == r || dy == r)) continue;
+
+                bin = (uint32_t) (((cy + dy + dim) % dim) * dim + (cx + dx + dim) % dim);
+                end = hg->bin_offsets[bin + 1];
+                for (position = hg->bin_offsets[bin]; position < end;
+                     position += HASHGRID_BATCH) {
+                    /* Only items near the current limit need their distance
+                     * in meters. The limit is widened a little, the ersatz
+                     * and meter distances round differently.
+                     */
+                    double limit = ersatz_from_distance (n == k ? distances[k - 1]
+                                                                : radius_meters) * 1.000001;
+                    uint32_t i;
+
+                    /* The coordinates are padded, a batch can pass end */
+                    hashgrid_batch_ersatz (hg->item_coords + position, &coord, ersatz);
+                    for (i = 0; i < HASHGRID_BATCH && position + i < end; ++i) {
+                        double distance;
+                        if (ersatz[i] > limit) continue;
+
+                        distance = coord_distance_meters (&coord, hg->item_coords + position + i);
+                        if (distance < radius_meters) {
+                            n = knn_insert (items, distances, n, k,
+                                            hg->items[position + i], distance);
+                        }
+                    }
+                }
             }
         }
+
+        if (r * bin_meters >= radius_meters ||
+            (n == k && distances[k - 1] <= r * bin_meters)) break;
     }
-    return best_item;
+
+    return n;
+}
+
+/* The header of the block of a hashgrid, which is followed by bin_offsets,
+ * items and the padded item_coords.
+ */
+typedef struct hashgrid_header_s hashgrid_header_t;
+struct hashgrid_header_s {
+    uint32_t version;
+    uint32_t grid_dim;
+    uint32_t n_items;
+    uint32_t reserved;
+    double   bin_size_meters;
+};
+
+static uint64_t hashgrid_block_size (uint32_t grid_dim, uint32_t n_items) {
+    uint64_t n_bins = (uint64_t) grid_dim * grid_dim;
+
+    return sizeof(hashgrid_header_t) +
+           sizeof(uint32_t) * (n_bins + 1) +
+           sizeof(uint32_t) * (uint64_t) n_items +
+           sizeof(coord_t) * ((uint64_t) n_items + HASHGRID_BATCH);
+}
+
+/* Point the members of the grid into a block of the expected size */
+static bool hashgrid_layout (hashgrid_t *hg, void *block, uint64_t size) {
+    hashgrid_header_t *header = (hashgrid_header_t *) block;
+
+    if (size < sizeof(hashgrid_header_t) ||
+        header->version != HASHGRID_VERSION ||
+        header->grid_dim == 0 || header->grid_dim > UINT16_MAX ||
+        ! (header->bin_size_meters > 0.0) ||
+        size != hashgrid_block_size (header->grid_dim, header->n_items)) {
+        return false;
+    }
+
+    hg->block = block;
+    hg->size = size;
+    hg->grid_dim = header->grid_dim;
+    hg->n_items = header->n_items;
+    hg->bin_size_meters = header->bin_size_meters;
+    coord_from_meters (&(hg->bin_size), hg->bin_size_meters, hg->bin_size_meters);
+
+    hg->bin_offsets = (uint32_t *) (header + 1);
+    hg->items = hg->bin_offsets + hg->grid_dim * hg->grid_dim + 1;
+    hg->item_coords = (coord_t *) (hg->items + hg->n_items);
+
+    return true;
 }
 
-void hashgrid_init (hashgrid_t *hg, uint32_t grid_dim, double bin_size_meters,
+bool hashgrid_init (hashgrid_t *hg, uint32_t grid_dim, double bin_size_meters,
                     coord_t *coords, uint32_t n_items) {
-    /* Initialize all struct members. */
-    hg->grid_dim = grid_dim;
-    hg->coords = coords;
-    hg->bin_size_meters = bin_size_meters;
-    coord_from_meters (&(hg->bin_size), bin_size_meters, bin_size_meters);
-    hg->n_items = n_items;
-    hg->counts = (uint32_t *) malloc(sizeof(uint32_t)  * grid_dim * grid_dim);
-    hg->bins   = (uint32_t **) malloc(sizeof(uint32_t *) * grid_dim * grid_dim);
-    hg->items  = (uint32_t *) malloc(sizeof(uint32_t) * n_items);
+    uint32_t n_bins = grid_dim * grid_dim;
+    uint64_t size = hashgrid_block_size (grid_dim, n_items);
+    hashgrid_header_t *header;
 
-    {
-        /* Initalize all dynamically allocated arrays. */
-        uint32_t y;
-        for (y = 0; y < grid_dim; ++y) {
-            uint32_t x;
-            for (x = 0; x < grid_dim; ++x) {
-                hg->counts[y * grid_dim + x] = 0;
-                hg->bins[y * grid_dim + x] = NULL;
-            }
-        }
+    hg->block = NULL;
+    hg->allocated = true;
+
+    /* The item_coords are padded with zeroes for the last batch of
+     * hashgrid_knn.
+     */
+    header = (hashgrid_header_t *) calloc (1, (size_t) size);
+    if (!header) return false;
+
+    header->version = HASHGRID_VERSION;
+    header->grid_dim = grid_dim;
+    header->n_items = n_items;
+    header->bin_size_meters = bin_size_meters;
+
+    if ( ! hashgrid_layout (hg, header, size)) {
+        free (header);
+        return false;
     }
 
     {
-        /* Count the number of items that will fall into each bin. */
+        /* Count the number of items that will fall into each bin, two
+         * entries on. The count of the last bin is not needed.
+         */
         uint32_t i_coord;
         for (i_coord = 0; i_coord < n_items; ++i_coord) {
+            uint32_t bin = ybin(hg, coords + i_coord) * grid_dim +
+                           xbin(hg, coords + i_coord);
             #ifdef RRRR_DEBUG_HASHGRID
             fprintf(stderr, "binning coordinate x=%d y=%d \n",
                             (coords + i_coord)->x, (coords + i_coord)->y);
             #endif
-            hg->counts[ybin(hg, coords + i_coord) * grid_dim +
-                                xbin(hg, coords + i_coord)] += 1;
+            if (bin + 2 <= n_bins) hg->bin_offsets[bin + 2] += 1;
         }
     }
 
     {
-        /* Set bin pointers to alias subregions of
-         * the items array (which will be filled later).
-         */
-        uint32_t *bin = hg->items;
-        uint32_t y;
-        for (y = 0; y < grid_dim; ++y) {
-            uint32_t x;
-            for (x = 0; x < grid_dim; ++x) {
-                hg->bins[y * grid_dim + x] = bin;
-                bin += hg->counts[y * grid_dim + x];
-                /* Reset bin item count for reuse when filling up bins. */
-                hg->counts[y * grid_dim + x] = 0;
-            }
+        /* Sum the counts, bin_offsets[bin + 1] becomes the start of bin. */
+        uint32_t i;
+        for (i = 2; i <= n_bins; ++i) {
+            hg->bin_offsets[i] += hg->bin_offsets[i - 1];
         }
     }
 
     {
-        /* Add the item indexes to the bins, which are pointers
-         * to regions within the items array.
+        /* Add the items and their coordinates to the bins, moving
+         * bin_offsets[bin + 1] on to the end of bin.
          */
         uint32_t i_coord;
         for (i_coord = 0; i_coord < n_items; ++i_coord) {
             coord_t *coord = coords + i_coord;
-            uint32_t x = xbin (hg, coord);
-            uint32_t y = ybin (hg, coord);
-            uint32_t i = hg->counts[y * grid_dim + x];
-            hg->bins[y * grid_dim + x][i] = i_coord;
-            hg->counts[y * grid_dim + x] += 1;
+            uint32_t bin = ybin (hg, coord) * grid_dim + xbin (hg, coord);
+            uint32_t position = hg->bin_offsets[bin + 1]++;
+            hg->items[position] = i_coord;
+            hg->item_coords[position] = *coord;
         }
     }
+
+    return true;
 }
 
 
+bool hashgrid_from_block (hashgrid_t *hg, void *block, uint64_t size,
+                          bool allocated) {
+    hashgrid_t check;
+    uint32_t bin, position;
+
+    if ( ! hashgrid_layout (&check, block, size)) goto fail;
+
+    /* Every item must be in the bin of its coordinate */
+    if (check.bin_offsets[0] != 0 ||
+        check.bin_offsets[check.grid_dim * check.grid_dim] != check.n_items) goto fail;
+    for (bin = 0; bin < check.grid_dim * check.grid_dim; ++bin) {
+        if (check.bin_offsets[bin] > check.bin_offsets[bin + 1]) goto fail;
+        for (position = check.bin_offsets[bin];
+             position < check.bin_offsets[bin + 1]; ++position) {
+            coord_t *coord = check.item_coords + position;
+            if (check.items[position] >= check.n_items ||
+                ybin (&check, coord) * check.grid_dim + xbin (&check, coord) != bin) goto fail;
+        }
+    }
+
+    *hg = check;
+    hg->allocated = allocated;
+    return true;
+
+fail:
+    fprintf (stderr, "The hashgrid is corrupt.\n");
+    return false;
+}
+
 void hashgrid_teardown (hashgrid_t *hg) {
-    /* Free up dynamically allocated arrays.
-     * Individual bins do not need to be freed separately from items.
-     */
-    free (hg->counts);
-    free (hg->bins);
-    free (hg->items);
+    if (hg->allocated) free (hg->block);
+    hg->block = NULL;
+    hg->bin_offsets = NULL;
+    hg->items = NULL;
+    hg->item_coords = NULL;
 }
 
 #ifdef RRRR_DEBUG
@@ -265,8 +476,9 @@ void hashgrid_dump (hashgrid_t *hg) {
     for (y = 0; y < hg->grid_dim; ++y) {
         uint32_t x;
         for (x = 0; x < hg->grid_dim; ++x) {
-            fprintf (stderr, "%2d ", hg->counts[y * hg->grid_dim + x]);
-            total += hg->counts[y * hg->grid_dim + x];
+            uint32_t bin = y * hg->grid_dim + x;
+            fprintf (stderr, "%2d ", hg->bin_offsets[bin + 1] - hg->bin_offsets[bin]);
+            total += hg->bin_offsets[bin + 1] - hg->bin_offsets[bin];
         }
         fprintf (stderr, "\n");
     }
@@ -275,10 +487,11 @@ void hashgrid_dump (hashgrid_t *hg) {
     for (y = 0; y < hg->grid_dim; ++y) {
         uint32_t x;
         for (x = 0; x < hg->grid_dim; ++x) {
+            uint32_t bin = y * hg->grid_dim + x;
             uint32_t i;
             fprintf (stderr, "Bin [%02d][%02d] ", y, x);
-            for (i = 0; i < hg->counts[y * hg->grid_dim + x]; ++i) {
-                fprintf (stderr, "%d ", hg->bins[y * hg->grid_dim + x][i]);
+            for (i = hg->bin_offsets[bin]; i < hg->bin_offsets[bin + 1]; ++i) {
+                fprintf (stderr, "%d ", hg->items[i]);
             }
             fprintf (stderr, "\n");
         }
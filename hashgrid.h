@@ -19,23 +19,32 @@
 #define INFINITY 9999999.0
 #endif
 
+#define HASHGRID_VERSION 1
+
+/* The number of items filtered at once, see hashgrid_knn and
+ * hashgrid_result_next_filtered
+ */
+#define HASHGRID_BATCH 8
+
 typedef struct hashgrid_s hashgrid_t;
 struct hashgrid_s {
-    /* the array of coords that were indexed
-     * note: may have been deallocated by caller
-     */
-    coord_t *coords;
+    /* the block the arrays below are part of */
+    void         *block;
+    uint64_t     size;
+    bool         allocated;
 
-    /* array containing all the binned items,
-     * aliased by the bins array
+    /* the items of bin y * grid_dim + x are items[bin_offsets[bin]] up to
+     * items[bin_offsets[bin + 1]]
      */
-    uint32_t     *items;
+    uint32_t     *bin_offsets;
 
-    /* 2D array of counts */
-    uint32_t     *counts;
+    /* all binned items, ordered by bin */
+    uint32_t     *items;
 
-    /* 2D array of uint32_t pointers */
-    uint32_t     **bins;
+    /* the coordinate of each item in items, copied from the indexed
+     * coords so the grid does not depend on them
+     */
+    coord_t      *item_coords;
 
     double       bin_size_meters;
     coord_t      bin_size;
@@ -62,9 +71,21 @@ struct hashgrid_result_s {
     /* current position within the hashgrid for iterating over results */
     uint32_t x, y, i;
     bool has_next;
+
+    /* the batch of items being filtered, see hashgrid_result_next_filtered:
+     * the position of its first item and a bit for each of its items
+     * still to be returned
+     */
+    uint32_t batch;
+    uint32_t batch_mask;
 };
 
-void hashgrid_init (hashgrid_t *hg, uint32_t grid_dim, double bin_size_meters, coord_t *coords, uint32_t n_items);
+bool hashgrid_init (hashgrid_t *hg, uint32_t grid_dim, double bin_size_meters, coord_t *coords, uint32_t n_items);
+
+/* Use the block of a grid built by hashgrid_init, for example read from a
+ * timetable. The block is freed with the grid when allocated is true.
+ */
+bool hashgrid_from_block (hashgrid_t *hg, void *block, uint64_t size, bool allocated);
 
 void hashgrid_query (hashgrid_t *, hashgrid_result_t *, coord_t, double radius_meters);
 
@@ -78,6 +99,14 @@ uint32_t hashgrid_result_next (hashgrid_result_t *r);
 
 uint32_t hashgrid_result_closest (hashgrid_result_t *r);
 
+/* Store up to k items closer than radius_meters to coord in items, the
+ * nearest first, and their distances in distances. Returns the number of
+ * items found. Searches rings of bins around coord, stopping as soon as the
+ * k nearest items are known.
+ */
+uint32_t hashgrid_knn (hashgrid_t *hg, coord_t coord, double radius_meters,
+                       uint32_t k, uint32_t *items, double *distances);
+
 #ifdef RRRR_DEBUG
 void hashgrid_dump (hashgrid_t *);
 #endif
@@ -0,0 +1,139 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* hashindex.c : finds a string in a table of fixed-width strings */
+
+#include "hashindex.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* 32-bit FNV-1a, which must not change as long as the slots may have been
+ * stored with the timetable.
+ */
+static uint32_t hi_hash (const char *key, uint32_t width) {
+    uint32_t hash = 2166136261UL;
+    uint32_t i;
+    for (i = 0; i < width && key[i] != '\0'; ++i) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/* A string in the table need not be terminated when it takes all of width */
+static bool hi_equal (const char *s, const char *key, uint32_t width) {
+    uint32_t i;
+    for (i = 0; i < width; ++i) {
+        if (s[i] != key[i]) return false;
+        if (key[i] == '\0') return true;
+    }
+    return key[width] == '\0';
+}
+
+void hashindex_init (hashindex_t *hi) {
+    hi->slots = NULL;
+    hi->n_slots = 0;
+    hi->slots_allocated = false;
+    hi->strings = NULL;
+    hi->width = 0;
+    hi->n_strings = 0;
+}
+
+bool hashindex_build (hashindex_t *hi, const char *strings, uint32_t width,
+                      uint32_t n_strings) {
+    uint32_t n_slots = 8;
+    uint32_t i_string;
+
+    hashindex_init (hi);
+    hi->strings = strings;
+    hi->width = width;
+    hi->n_strings = n_strings;
+
+    if (n_strings == 0) return true;
+
+    if (n_strings > (UINT32_MAX >> 2)) {
+        fprintf (stderr, "Can not index %u strings.\n", n_strings);
+        return false;
+    }
+
+    /* at most half of the slots are in use */
+    while (n_slots < n_strings * 2) n_slots <<= 1;
+
+    hi->slots = (uint32_t *) malloc (sizeof(uint32_t) * n_slots);
+    if (hi->slots == NULL) return false;
+
+    /* all bytes set results in HASHINDEX_NONE */
+    memset (hi->slots, 0xff, sizeof(uint32_t) * n_slots);
+    hi->n_slots = n_slots;
+    hi->slots_allocated = true;
+
+    for (i_string = 0; i_string < n_strings; ++i_string) {
+        const char *s = strings + (uint64_t) i_string * width;
+        uint32_t i_slot = hi_hash (s, width) & (n_slots - 1);
+
+        while (hi->slots[i_slot] != HASHINDEX_NONE &&
+               ! hi_equal (strings + (uint64_t) hi->slots[i_slot] * width, s, width)) {
+            i_slot = (i_slot + 1) & (n_slots - 1);
+        }
+
+        if (hi->slots[i_slot] == HASHINDEX_NONE) hi->slots[i_slot] = i_string;
+    }
+
+    return true;
+}
+
+bool hashindex_from_slots (hashindex_t *hi, uint32_t *slots, uint32_t n_slots,
+                           bool allocated, const char *strings, uint32_t width,
+                           uint32_t n_strings) {
+    uint32_t i_slot;
+
+    /* lookups end at an empty slot, so there must be one */
+    if ((n_slots & (n_slots - 1)) != 0 || n_slots <= n_strings) {
+        fprintf (stderr, "A hash index of %u slots can not hold %u strings.\n",
+                         n_slots, n_strings);
+        return false;
+    }
+
+    for (i_slot = 0; i_slot < n_slots; ++i_slot) {
+        if (slots[i_slot] != HASHINDEX_NONE && slots[i_slot] >= n_strings) {
+            fprintf (stderr, "Slot %u of the hash index refers outside of its %u strings.\n",
+                             i_slot, n_strings);
+            return false;
+        }
+    }
+
+    hi->slots = slots;
+    hi->n_slots = n_slots;
+    hi->slots_allocated = allocated;
+    hi->strings = strings;
+    hi->width = width;
+    hi->n_strings = n_strings;
+
+    return true;
+}
+
+uint32_t hashindex_find (hashindex_t *hi, const char *key) {
+    uint32_t i_slot;
+
+    if (hi->n_slots == 0) return HASHINDEX_NONE;
+
+    i_slot = hi_hash (key, hi->width) & (hi->n_slots - 1);
+    while (hi->slots[i_slot] != HASHINDEX_NONE) {
+        if (hi_equal (hi->strings + (uint64_t) hi->slots[i_slot] * hi->width,
+                      key, hi->width)) {
+            return hi->slots[i_slot];
+        }
+        i_slot = (i_slot + 1) & (hi->n_slots - 1);
+    }
+
+    return HASHINDEX_NONE;
+}
+
+void hashindex_destroy (hashindex_t *hi) {
+    if (hi->slots_allocated) free (hi->slots);
+    hashindex_init (hi);
+}
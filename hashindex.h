@@ -0,0 +1,61 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* hashindex.h : finds a string in a table of fixed-width strings
+ *
+ * An open addressing hash table with linear probing, holding the index of
+ * each string in the table. It is filled at most to half, so a lookup
+ * usually compares a single string. The slots only contain indices and use
+ * a fixed hash function, so they can be stored in a timetable as well.
+ */
+
+#ifndef _HASHINDEX_H
+#define _HASHINDEX_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HASHINDEX_NONE UINT32_MAX
+
+typedef struct hashindex hashindex_t;
+struct hashindex {
+    /* the index of a string, or HASHINDEX_NONE for an empty slot */
+    uint32_t *slots;
+
+    /* a power of two larger than n_strings, or zero when empty */
+    uint32_t n_slots;
+
+    /* whether the slots are freed by hashindex_destroy */
+    bool slots_allocated;
+
+    const char *strings;
+    uint32_t width;
+    uint32_t n_strings;
+};
+
+/* An index without any strings */
+void hashindex_init (hashindex_t *hi);
+
+/* Index the n_strings strings of width bytes. When a string occurs more
+ * than once, the first one is found.
+ */
+bool hashindex_build (hashindex_t *hi, const char *strings, uint32_t width,
+                      uint32_t n_strings);
+
+/* Use the slots of an index built by hashindex_build on the same strings,
+ * for example read from a timetable. Returns false when they can not be.
+ */
+bool hashindex_from_slots (hashindex_t *hi, uint32_t *slots, uint32_t n_slots,
+                           bool allocated, const char *strings, uint32_t width,
+                           uint32_t n_strings);
+
+/* Returns the index of key, or HASHINDEX_NONE */
+uint32_t hashindex_find (hashindex_t *hi, const char *key);
+
+void hashindex_destroy (hashindex_t *hi);
+
+#endif /* _HASHINDEX_H */
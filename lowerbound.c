@@ -0,0 +1,279 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* lowerbound.c : time-independent lower bounds towards the search target */
+
+#include "lowerbound.h"
+
+#include "config.h"
+#include "rrrr_types.h"
+#include "tdata.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* The fastest ride between journey_pattern_point jpp and jpp + 1, over
+ * all vehicle_journeys in the journey_pattern, including the realtime
+ * stoptimes which are already present.
+ */
+static rtime_t fastest_ride (tdata_t *td, uint32_t jp_index, uint16_t jpp) {
+    journey_pattern_t *jp = td->journey_patterns + jp_index;
+    vehicle_journey_t *vjs = tdata_vehicle_journeys_in_journey_pattern(td, jp_index);
+    rtime_t best = UNREACHED;
+    uint16_t i_vj;
+
+    for (i_vj = 0; i_vj < jp->n_vjs; ++i_vj) {
+        stoptime_t *st = td->stop_times + vjs[i_vj].stop_times_offset;
+
+        if (st[jpp + 1].arrival >= st[jpp].departure &&
+            (rtime_t) (st[jpp + 1].arrival - st[jpp].departure) < best) {
+            best = st[jpp + 1].arrival - st[jpp].departure;
+        }
+
+        #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+        if (td->vj_stoptimes) {
+            tdata_rt_stoptimes_t *rt;
+            for (rt = td->vj_stoptimes[jp->vj_ids_offset + i_vj]; rt; rt = rt->next) {
+                st = rt->stop_times;
+                if (st[jpp + 1].arrival >= st[jpp].departure &&
+                    (rtime_t) (st[jpp + 1].arrival - st[jpp].departure) < best) {
+                    best = st[jpp + 1].arrival - st[jpp].departure;
+                }
+            }
+        }
+        #endif
+    }
+
+    /* inconsistent data, never overestimate */
+    if (best == UNREACHED) best = 0;
+
+    return best;
+}
+
+/* Place the edges in compressed adjacency form, grouped by key. */
+static void lowerbound_csr (uint32_t n_stops, uint32_t n_edges,
+                            spidx_t *key, spidx_t *value, rtime_t *times,
+                            uint32_t *offsets, spidx_t *stops_out,
+                            rtime_t *times_out) {
+    uint32_t i_edge, i_stop;
+
+    memset (offsets, 0, sizeof(uint32_t) * (n_stops + 1));
+    for (i_edge = 0; i_edge < n_edges; ++i_edge) offsets[key[i_edge] + 1]++;
+    for (i_stop = 0; i_stop < n_stops; ++i_stop) {
+        offsets[i_stop + 1] += offsets[i_stop];
+    }
+
+    for (i_edge = 0; i_edge < n_edges; ++i_edge) {
+        uint32_t pos = offsets[key[i_edge]]++;
+        stops_out[pos] = value[i_edge];
+        times_out[pos] = times[i_edge];
+    }
+
+    /* restore the offsets, which have been moved one group ahead */
+    for (i_stop = n_stops; i_stop > 0; --i_stop) {
+        offsets[i_stop] = offsets[i_stop - 1];
+    }
+    offsets[0] = 0;
+}
+
+bool lowerbound_init (lowerbound_t *lb, tdata_t *td) {
+    spidx_t *from = NULL, *to = NULL;
+    rtime_t *times = NULL;
+    /* the updater may fork journey_patterns while the graph is built */
+    uint32_t n_journey_patterns = td->n_journey_patterns;
+    uint32_t n_edges = td->n_transfer_target_stops;
+    uint32_t i_edge = 0;
+    uint32_t jp_index, i_stop;
+
+    for (jp_index = 0; jp_index < n_journey_patterns; ++jp_index) {
+        if (td->journey_patterns[jp_index].n_stops > 1) {
+            n_edges += td->journey_patterns[jp_index].n_stops - 1u;
+        }
+    }
+
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    lb->rt_version = rrrr_atomic_get (&td->rt_version);
+    #endif
+    lb->n_stops = td->n_stops;
+    lb->fwd_offsets = (uint32_t *) malloc (sizeof(uint32_t) * (td->n_stops + 1));
+    lb->rev_offsets = (uint32_t *) malloc (sizeof(uint32_t) * (td->n_stops + 1));
+    lb->fwd_stops = (spidx_t *) malloc (sizeof(spidx_t) * (n_edges + 1));
+    lb->rev_stops = (spidx_t *) malloc (sizeof(spidx_t) * (n_edges + 1));
+    lb->fwd_times = (rtime_t *) malloc (sizeof(rtime_t) * (n_edges + 1));
+    lb->rev_times = (rtime_t *) malloc (sizeof(rtime_t) * (n_edges + 1));
+
+    from = (spidx_t *) malloc (sizeof(spidx_t) * (n_edges + 1));
+    to = (spidx_t *) malloc (sizeof(spidx_t) * (n_edges + 1));
+    times = (rtime_t *) malloc (sizeof(rtime_t) * (n_edges + 1));
+
+    if (!(lb->fwd_offsets && lb->rev_offsets &&
+          lb->fwd_stops && lb->rev_stops &&
+          lb->fwd_times && lb->rev_times &&
+          from && to && times)) goto fail;
+
+    for (jp_index = 0; jp_index < n_journey_patterns; ++jp_index) {
+        spidx_t *jpp = tdata_points_for_journey_pattern (td, jp_index);
+        uint16_t n_stops = td->journey_patterns[jp_index].n_stops;
+        uint16_t i_jpp;
+
+        for (i_jpp = 0; i_jpp + 1 < n_stops; ++i_jpp) {
+            /* a fork may skip stops */
+            if (jpp[i_jpp] == jpp[i_jpp + 1] ||
+                jpp[i_jpp] >= td->n_stops || jpp[i_jpp + 1] >= td->n_stops) continue;
+            from[i_edge]  = jpp[i_jpp];
+            to[i_edge]    = jpp[i_jpp + 1];
+            times[i_edge] = fastest_ride (td, jp_index, i_jpp);
+            i_edge++;
+        }
+    }
+
+    for (i_stop = 0; i_stop < td->n_stops; ++i_stop) {
+        uint32_t tr     = td->stops[i_stop    ].transfers_offset;
+        uint32_t tr_end = td->stops[i_stop + 1].transfers_offset;
+        for ( ; tr < tr_end; ++tr) {
+            from[i_edge]  = (spidx_t) i_stop;
+            to[i_edge]    = td->transfer_target_stops[tr];
+            times[i_edge] = td->transfer_dist_meters[tr];
+            i_edge++;
+        }
+    }
+
+    lb->n_edges = i_edge;
+    lowerbound_csr (lb->n_stops, lb->n_edges, from, to, times,
+                    lb->fwd_offsets, lb->fwd_stops, lb->fwd_times);
+    lowerbound_csr (lb->n_stops, lb->n_edges, to, from, times,
+                    lb->rev_offsets, lb->rev_stops, lb->rev_times);
+
+    free (from);
+    free (to);
+    free (times);
+
+    return true;
+
+fail:
+    free (from);
+    free (to);
+    free (times);
+    lowerbound_teardown (lb);
+
+    return false;
+}
+
+void lowerbound_teardown (lowerbound_t *lb) {
+    free (lb->fwd_offsets);
+    free (lb->rev_offsets);
+    free (lb->fwd_stops);
+    free (lb->rev_stops);
+    free (lb->fwd_times);
+    free (lb->rev_times);
+    lb->fwd_offsets = NULL;
+    lb->rev_offsets = NULL;
+    lb->fwd_stops = NULL;
+    lb->rev_stops = NULL;
+    lb->fwd_times = NULL;
+    lb->rev_times = NULL;
+}
+
+bool lowerbound_scratch_reserve (lowerbound_scratch_t *scratch,
+                                 const lowerbound_t *lb) {
+    /* every stop is pushed once as a target, and once more at most
+     * for every edge leading towards it
+     */
+    uint32_t size = lb->n_edges + lb->n_stops;
+    uint32_t *heap;
+
+    if (scratch->heap && scratch->size >= size) return true;
+
+    heap = (uint32_t *) realloc (scratch->heap, sizeof(uint32_t) * size);
+    if (!heap) return false;
+
+    scratch->heap = heap;
+    scratch->size = size;
+
+    return true;
+}
+
+void lowerbound_scratch_teardown (lowerbound_scratch_t *scratch) {
+    free (scratch->heap);
+    scratch->heap = NULL;
+    scratch->n_heap = 0;
+    scratch->size = 0;
+}
+
+static void heap_push (uint32_t *heap, uint32_t *n_heap, uint32_t item) {
+    uint32_t i = (*n_heap)++;
+    while (i > 0) {
+        uint32_t parent = (i - 1) >> 1;
+        if (heap[parent] <= item) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = item;
+}
+
+static uint32_t heap_pop (uint32_t *heap, uint32_t *n_heap) {
+    uint32_t top = heap[0];
+    uint32_t last = heap[--(*n_heap)];
+    uint32_t i = 0;
+
+    for (;;) {
+        uint32_t child = (i << 1) + 1;
+        if (child >= *n_heap) break;
+        if (child + 1 < *n_heap && heap[child + 1] < heap[child]) child++;
+        if (last <= heap[child]) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
+
+void lowerbound_reset (const lowerbound_t *lb, lowerbound_scratch_t *scratch,
+                       rtime_t *times) {
+    rrrr_memset (times, UNREACHED, lb->n_stops);
+    scratch->n_heap = 0;
+}
+
+void lowerbound_add_target (const lowerbound_t *lb,
+                            lowerbound_scratch_t *scratch,
+                            rtime_t *times, spidx_t stop) {
+    if (stop >= lb->n_stops || times[stop] == 0) return;
+    times[stop] = 0;
+    heap_push (scratch->heap, &scratch->n_heap, (uint32_t) stop);
+}
+
+void lowerbound_compute (const lowerbound_t *lb, lowerbound_scratch_t *scratch,
+                         rtime_t *times, bool arrive_by, rtime_t max_time) {
+    /* Towards the target we follow edges backwards, from the target
+     * outwards (arrive-by) we follow them in their own direction.
+     */
+    uint32_t *offsets = arrive_by ? lb->fwd_offsets : lb->rev_offsets;
+    spidx_t  *stops   = arrive_by ? lb->fwd_stops   : lb->rev_stops;
+    rtime_t  *weights = arrive_by ? lb->fwd_times   : lb->rev_times;
+    uint32_t *n_heap = &scratch->n_heap;
+
+    while (*n_heap > 0) {
+        uint32_t item = heap_pop (scratch->heap, n_heap);
+        spidx_t  stop = (spidx_t) (item & 0xFFFF);
+        rtime_t  time = (rtime_t) (item >> 16);
+        uint32_t e, e_end;
+
+        /* stale entry, the stop has been settled before */
+        if (time != times[stop]) continue;
+
+        e_end = offsets[stop + 1];
+        for (e = offsets[stop]; e < e_end; ++e) {
+            uint32_t next = (uint32_t) time + weights[e];
+            spidx_t  to   = stops[e];
+            if (next > max_time || next >= times[to]) continue;
+            times[to] = (rtime_t) next;
+            heap_push (scratch->heap, n_heap, (next << 16) | to);
+        }
+    }
+}
@@ -0,0 +1,85 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* lowerbound.h */
+
+#ifndef _LOWERBOUND_H
+#define _LOWERBOUND_H
+
+#include "config.h"
+#include "rrrr_types.h"
+#include "tdata.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* A time-independent graph over all stops, used to compute per-query
+ * lower bounds on the travel time between any stop and the target.
+ * Every pair of consecutive journey_pattern_points becomes one edge,
+ * weighted with the fastest ride over all its vehicle_journeys. Every
+ * transfer becomes an edge weighted with its walking distance.
+ * Both directions are stored in compressed adjacency form, so the
+ * depart-after (towards the target) and arrive-by (from the target)
+ * searches can share the same structure. The graph is never changed once
+ * built, any number of routers may search it at the same time.
+ */
+typedef struct lowerbound lowerbound_t;
+struct lowerbound {
+    /* edges leaving each stop: [offsets[s], offsets[s + 1]) */
+    uint32_t *fwd_offsets;
+    spidx_t  *fwd_stops;
+    rtime_t  *fwd_times;
+
+    /* edges arriving at each stop, stored at their destination */
+    uint32_t *rev_offsets;
+    spidx_t  *rev_stops;
+    rtime_t  *rev_times;
+
+    uint32_t n_stops;
+    uint32_t n_edges;
+
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* The tdata_t.rt_version of the stoptimes the graph was built from */
+    uint32_t rt_version;
+    #endif
+};
+
+/* The scratch space of one search, owned by a router */
+typedef struct lowerbound_scratch lowerbound_scratch_t;
+struct lowerbound_scratch {
+    /* binary heap, packed as (time << 16 | stop) */
+    uint32_t *heap;
+    uint32_t n_heap;
+    uint32_t size;
+};
+
+bool lowerbound_init (lowerbound_t *lb, tdata_t *td);
+
+void lowerbound_teardown (lowerbound_t *lb);
+
+/* Make sure the scratch space is large enough to search lb. */
+bool lowerbound_scratch_reserve (lowerbound_scratch_t *scratch,
+                                 const lowerbound_t *lb);
+
+void lowerbound_scratch_teardown (lowerbound_scratch_t *scratch);
+
+/* Reset the n_stops long array times to UNREACHED. */
+void lowerbound_reset (const lowerbound_t *lb, lowerbound_scratch_t *scratch,
+                       rtime_t *times);
+
+/* Add a stop that is considered to be the target, at no extra cost. */
+void lowerbound_add_target (const lowerbound_t *lb,
+                            lowerbound_scratch_t *scratch,
+                            rtime_t *times, spidx_t stop);
+
+/* Fill times with the lower bound between each stop and the nearest target.
+ * For depart-after searches this is the time from a stop to the target, for
+ * arrive-by searches the time from the target to a stop. Stops that cannot
+ * be reached within max_time remain UNREACHED.
+ */
+void lowerbound_compute (const lowerbound_t *lb, lowerbound_scratch_t *scratch,
+                         rtime_t *times, bool arrive_by, rtime_t max_time);
+
+#endif /* _LOWERBOUND_H */
@@ -0,0 +1,414 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* namesearch.c : finds names containing a query, while typing */
+
+#include "namesearch.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* the header of a block, followed by the arrays in the order of the struct */
+#define NS_HEADER 5
+
+/* The base letters of U+00C0 up to U+017F, a space for × and ÷ */
+static const char ns_latin[] =
+    "aaaaaaaceeeeiiii" "dnooooo ouuuuyts"
+    "aaaaaaaceeeeiiii" "dnooooo ouuuuyty"
+    "aaaaaaccccccccdd" "ddeeeeeeeeeegggg"
+    "gggghhhhiiiiiiii" "iiiijjkkklllllll"
+    "lllnnnnnnnnnoooo" "oooorrrrrrssssss"
+    "sstttttttuuuuuuu" "uuuuwwyyyzzzzzzs";
+
+/* Fold s into out, which holds size bytes including the terminator.
+ * Other non-ASCII characters are copied, runs of separators become a
+ * single space and there are none at either end. Returns the length.
+ */
+static uint32_t ns_fold (const char *s, char *out, uint32_t size) {
+    const uint8_t *c = (const uint8_t *) s;
+    uint32_t n = 0;
+    bool separated = false;
+
+    while (*c != '\0' && n + 1 < size) {
+        char folded;
+
+        if (*c < 0x80) {
+            if (*c >= 'A' && *c <= 'Z') {
+                folded = (char) (*c - 'A' + 'a');
+            } else if ((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')) {
+                folded = (char) *c;
+            } else {
+                folded = ' ';
+            }
+            c++;
+        } else if (*c >= 0xC3 && *c <= 0xC5 && (c[1] & 0xC0) == 0x80) {
+            uint32_t cp = ((uint32_t) (*c & 0x1F) << 6) | (c[1] & 0x3F);
+            folded = ns_latin[cp - 0xC0];
+            c += 2;
+        } else {
+            folded = (char) *c;
+            c++;
+        }
+
+        if (folded == ' ') {
+            separated = (n > 0);
+            continue;
+        }
+        if (separated) {
+            if (n + 2 >= size) break;
+            out[n++] = ' ';
+            separated = false;
+        }
+        out[n++] = folded;
+    }
+
+    out[n] = '\0';
+    return n;
+}
+
+static uint32_t ns_class (char c) {
+    if (c >= 'a' && c <= 'z') return 1 + (uint32_t) (c - 'a');
+    if (c >= '0' && c <= '9') return 27 + (uint32_t) (c - '0');
+    return 0;
+}
+
+static uint32_t ns_trigram (const char *f) {
+    return (ns_class (f[0]) * NAMESEARCH_N_CLASSES + ns_class (f[1])) *
+           NAMESEARCH_N_CLASSES + ns_class (f[2]);
+}
+
+/* Merge sort of the word pairs, by the folded text and then the name */
+static bool ns_word_before (const char *folded, const uint32_t *a, const uint32_t *b) {
+    int cmp = strcmp (folded + a[1], folded + b[1]);
+    return (cmp < 0 || (cmp == 0 && a[0] < b[0]));
+}
+
+static void ns_sort_words (uint32_t *words, uint32_t *tmp, uint32_t n,
+                           const char *folded) {
+    uint32_t half = n / 2, i = 0, j = half, k = 0;
+
+    if (n < 2) return;
+
+    ns_sort_words (words, tmp, half, folded);
+    ns_sort_words (words + half * 2, tmp, n - half, folded);
+
+    while (i < half && j < n) {
+        if (ns_word_before (folded, words + j * 2, words + i * 2)) {
+            tmp[k * 2] = words[j * 2]; tmp[k * 2 + 1] = words[j * 2 + 1]; ++j;
+        } else {
+            tmp[k * 2] = words[i * 2]; tmp[k * 2 + 1] = words[i * 2 + 1]; ++i;
+        }
+        ++k;
+    }
+    while (i < half) {
+        tmp[k * 2] = words[i * 2]; tmp[k * 2 + 1] = words[i * 2 + 1]; ++i; ++k;
+    }
+    /* the rest of the second half is in place already */
+    memcpy (words, tmp, sizeof(uint32_t) * 2 * k);
+}
+
+/* Point the arrays into the block, after checking the header */
+static bool ns_layout (namesearch_t *ns, void *block, uint64_t size) {
+    uint32_t *header = (uint32_t *) block;
+    uint64_t n_words;
+
+    if (size < sizeof(uint32_t) * NS_HEADER || header[0] != NAMESEARCH_VERSION) return false;
+
+    ns->n_strings = header[1];
+    ns->n_postings = header[2];
+    ns->n_words = header[3];
+    ns->n_folded = header[4];
+
+    n_words = NS_HEADER + (uint64_t) ns->n_strings + NAMESEARCH_N_TRIGRAMS + 1 +
+              ns->n_postings + (uint64_t) ns->n_words * 2;
+    if (size != n_words * sizeof(uint32_t) + ns->n_folded) return false;
+
+    ns->block = block;
+    ns->size = size;
+    ns->folded_idx = header + NS_HEADER;
+    ns->trigram_offsets = ns->folded_idx + ns->n_strings;
+    ns->postings = ns->trigram_offsets + NAMESEARCH_N_TRIGRAMS + 1;
+    ns->words = ns->postings + ns->n_postings;
+    ns->folded = (char *) (ns->words + (uint64_t) ns->n_words * 2);
+
+    return true;
+}
+
+void namesearch_init (namesearch_t *ns) {
+    memset (ns, 0, sizeof(namesearch_t));
+}
+
+bool namesearch_build (namesearch_t *ns, const char *strings,
+                       const uint32_t *offsets, uint32_t n_strings) {
+    uint32_t *header, *counts = NULL, *last = NULL, *tmp = NULL;
+    char *folded = NULL;
+    uint32_t *folded_idx = NULL;
+    uint64_t n_folded = 0, n_postings = 0, n_words = 0, size;
+    uint32_t i_string, t;
+    bool success = false;
+
+    namesearch_init (ns);
+
+    for (i_string = 0; i_string < n_strings; ++i_string) {
+        n_folded += strlen (strings + offsets[i_string]) + 1;
+    }
+    if (n_folded > UINT32_MAX) return false;
+
+    folded = (char *) malloc ((size_t) n_folded + sizeof(uint32_t));
+    folded_idx = (uint32_t *) malloc (sizeof(uint32_t) * (n_strings + 1));
+    counts = (uint32_t *) calloc (NAMESEARCH_N_TRIGRAMS + 1, sizeof(uint32_t));
+    last = (uint32_t *) malloc (sizeof(uint32_t) * NAMESEARCH_N_TRIGRAMS);
+    if (!folded || !folded_idx || !counts || !last) goto clean_exit;
+
+    /* Fold the names, count their distinct trigrams and their words */
+    n_folded = 0;
+    memset (last, 0xff, sizeof(uint32_t) * NAMESEARCH_N_TRIGRAMS);
+    for (i_string = 0; i_string < n_strings; ++i_string) {
+        const char *s = strings + offsets[i_string];
+        char *f = folded + n_folded;
+        uint32_t len = ns_fold (s, f, (uint32_t) strlen (s) + 1), i;
+
+        folded_idx[i_string] = (uint32_t) n_folded;
+        n_folded += len + 1;
+
+        for (i = 0; i + 3 <= len; ++i) {
+            t = ns_trigram (f + i);
+            if (last[t] != i_string) {
+                last[t] = i_string;
+                counts[t]++;
+                n_postings++;
+            }
+        }
+        for (i = 0; i < len; ++i) {
+            if (i == 0 || f[i - 1] == ' ') n_words++;
+        }
+    }
+    /* keep the arrays after the folded names aligned */
+    while (n_folded % sizeof(uint32_t)) folded[n_folded++] = '\0';
+
+    size = (NS_HEADER + (uint64_t) n_strings + NAMESEARCH_N_TRIGRAMS + 1 +
+            n_postings + n_words * 2) * sizeof(uint32_t) + n_folded;
+    if (n_postings > UINT32_MAX || n_words > UINT32_MAX / 2) goto clean_exit;
+
+    header = (uint32_t *) malloc ((size_t) size);
+    tmp = (uint32_t *) malloc (sizeof(uint32_t) * 2 * (size_t) (n_words > 0 ? n_words : 1));
+    if (!header || !tmp) {
+        free (header);
+        goto clean_exit;
+    }
+
+    header[0] = NAMESEARCH_VERSION;
+    header[1] = n_strings;
+    header[2] = (uint32_t) n_postings;
+    header[3] = (uint32_t) n_words;
+    header[4] = (uint32_t) n_folded;
+    ns_layout (ns, header, size);
+    ns->allocated = true;
+
+    memcpy (ns->folded_idx, folded_idx, sizeof(uint32_t) * n_strings);
+    memcpy (ns->folded, folded, (size_t) n_folded);
+
+    /* The offsets are the running sum of the counts, filling the postings
+     * moves each offset to the start of the next list, which is undone.
+     */
+    ns->trigram_offsets[0] = 0;
+    for (t = 0; t < NAMESEARCH_N_TRIGRAMS; ++t) {
+        ns->trigram_offsets[t + 1] = ns->trigram_offsets[t] + counts[t];
+    }
+
+    memset (last, 0xff, sizeof(uint32_t) * NAMESEARCH_N_TRIGRAMS);
+    n_words = 0;
+    for (i_string = 0; i_string < n_strings; ++i_string) {
+        const char *f = ns->folded + ns->folded_idx[i_string];
+        uint32_t i;
+        for (i = 0; f[i] != '\0' && f[i + 1] != '\0' && f[i + 2] != '\0'; ++i) {
+            t = ns_trigram (f + i);
+            if (last[t] != i_string) {
+                last[t] = i_string;
+                ns->postings[ns->trigram_offsets[t]++] = i_string;
+            }
+        }
+        for (i = 0; f[i] != '\0'; ++i) {
+            if (i == 0 || f[i - 1] == ' ') {
+                ns->words[n_words * 2] = i_string;
+                ns->words[n_words * 2 + 1] = ns->folded_idx[i_string] + i;
+                n_words++;
+            }
+        }
+    }
+    for (t = NAMESEARCH_N_TRIGRAMS; t > 0; --t) {
+        ns->trigram_offsets[t] = ns->trigram_offsets[t - 1];
+    }
+    ns->trigram_offsets[0] = 0;
+
+    ns_sort_words (ns->words, tmp, ns->n_words, ns->folded);
+    success = true;
+
+clean_exit:
+    free (tmp);
+    free (last);
+    free (counts);
+    free (folded_idx);
+    free (folded);
+
+    return success;
+}
+
+bool namesearch_from_block (namesearch_t *ns, void *block, uint64_t size,
+                            bool allocated) {
+    namesearch_t check;
+    uint32_t i;
+
+    namesearch_init (&check);
+    if ( ! ns_layout (&check, block, size)) goto fail;
+
+    /* Every name and word must end within the folded names */
+    if (check.n_folded == 0 ? check.n_strings > 0 : check.folded[check.n_folded - 1] != '\0') goto fail;
+    for (i = 0; i < check.n_strings; ++i) {
+        if (check.folded_idx[i] >= check.n_folded) goto fail;
+    }
+    for (i = 0; i < check.n_words; ++i) {
+        if (check.words[i * 2] >= check.n_strings ||
+            check.words[i * 2 + 1] >= check.n_folded) goto fail;
+    }
+    for (i = 0; i < NAMESEARCH_N_TRIGRAMS; ++i) {
+        if (check.trigram_offsets[i] > check.trigram_offsets[i + 1]) goto fail;
+    }
+    if (check.trigram_offsets[0] != 0 ||
+        check.trigram_offsets[NAMESEARCH_N_TRIGRAMS] != check.n_postings) goto fail;
+    for (i = 0; i < check.n_postings; ++i) {
+        if (check.postings[i] >= check.n_strings) goto fail;
+    }
+
+    *ns = check;
+    ns->allocated = allocated;
+    return true;
+
+fail:
+    fprintf (stderr, "The name search index is corrupt.\n");
+    return false;
+}
+
+/* The rank of a match of q, of length m, in the folded name f */
+static int ns_rank (const char *f, const char *q, uint32_t m) {
+    const char *hit = strstr (f, q);
+
+    if (hit == NULL) return -1;
+    if (hit == f) return (f[m] == '\0' ? 0 : 1);
+
+    for (; hit != NULL; hit = strstr (hit + 1, q)) {
+        if (hit[-1] == ' ') return 2;
+    }
+    return 3;
+}
+
+/* Keep the k lowest scores, in order and without duplicates */
+static uint32_t ns_keep (uint64_t *best, uint32_t n_best, uint32_t k, uint64_t score) {
+    uint32_t i;
+
+    if (n_best == k && score >= best[k - 1]) return n_best;
+    for (i = 0; i < n_best; ++i) if (best[i] == score) return n_best;
+
+    i = (n_best == k ? k - 1 : n_best++);
+    while (i > 0 && best[i - 1] > score) {
+        best[i] = best[i - 1];
+        --i;
+    }
+    best[i] = score;
+
+    return n_best;
+}
+
+static uint64_t ns_score (namesearch_t *ns, uint32_t i_string, int rank) {
+    uint64_t len = strlen (ns->folded + ns->folded_idx[i_string]);
+    if (len > 0xFFFF) len = 0xFFFF;
+    return ((uint64_t) rank << 48) | (len << 32) | i_string;
+}
+
+/* The postings of the rarest trigram of the folded query q */
+static void ns_rarest (namesearch_t *ns, const char *q, uint32_t m,
+                       uint32_t *begin, uint32_t *end) {
+    uint32_t i;
+
+    *begin = 0;
+    *end = UINT32_MAX;
+    for (i = 0; i + 3 <= m; ++i) {
+        uint32_t t = ns_trigram (q + i);
+        if (ns->trigram_offsets[t + 1] - ns->trigram_offsets[t] < *end - *begin) {
+            *begin = ns->trigram_offsets[t];
+            *end = ns->trigram_offsets[t + 1];
+        }
+    }
+}
+
+uint32_t namesearch_find (namesearch_t *ns, const char *query,
+                          uint32_t *results, uint32_t k) {
+    char q[NAMESEARCH_MAX_QUERY];
+    uint64_t best[NAMESEARCH_MAX_RESULTS];
+    uint32_t m, n_best = 0, i;
+
+    if (k > NAMESEARCH_MAX_RESULTS) k = NAMESEARCH_MAX_RESULTS;
+    m = ns_fold (query, q, NAMESEARCH_MAX_QUERY);
+    if (m == 0 || k == 0 || ns->block == NULL) return 0;
+
+    if (m < 3) {
+        /* the words starting with the query are adjacent */
+        uint32_t lo = 0, hi = ns->n_words;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (strncmp (ns->folded + ns->words[mid * 2 + 1], q, m) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (i = lo; i < ns->n_words &&
+                     strncmp (ns->folded + ns->words[i * 2 + 1], q, m) == 0; ++i) {
+            uint32_t i_string = ns->words[i * 2];
+            int rank = ns_rank (ns->folded + ns->folded_idx[i_string], q, m);
+            n_best = ns_keep (best, n_best, k, ns_score (ns, i_string, rank));
+        }
+    } else {
+        uint32_t begin, end;
+        ns_rarest (ns, q, m, &begin, &end);
+        for (i = begin; i < end; ++i) {
+            uint32_t i_string = ns->postings[i];
+            int rank = ns_rank (ns->folded + ns->folded_idx[i_string], q, m);
+            if (rank >= 0) n_best = ns_keep (best, n_best, k, ns_score (ns, i_string, rank));
+        }
+    }
+
+    for (i = 0; i < n_best; ++i) results[i] = (uint32_t) (best[i] & UINT32_MAX);
+    return n_best;
+}
+
+bool namesearch_candidates (namesearch_t *ns, const char *query,
+                            const uint32_t **candidates, uint32_t *n_candidates) {
+    char q[NAMESEARCH_MAX_QUERY];
+    uint32_t m, begin, end;
+    const char *c;
+
+    if (ns->block == NULL) return false;
+
+    /* Only for ASCII a folded query is found in every folded name which
+     * contains the query regardless of case.
+     */
+    for (c = query; *c != '\0'; ++c) if ((uint8_t) *c >= 0x80) return false;
+
+    /* a truncated query still shares its trigrams with those names */
+    m = ns_fold (query, q, NAMESEARCH_MAX_QUERY);
+    if (m < 3) return false;
+
+    ns_rarest (ns, q, m, &begin, &end);
+    *candidates = ns->postings + begin;
+    *n_candidates = end - begin;
+    return true;
+}
+
+void namesearch_destroy (namesearch_t *ns) {
+    if (ns->allocated) free (ns->block);
+    namesearch_init (ns);
+}
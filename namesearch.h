@@ -0,0 +1,94 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* namesearch.h : finds names containing a query, while typing
+ *
+ * Names and queries are folded: letters are lowercased, the accented
+ * Latin letters lose their accents and any other ASCII character
+ * separates words. Queries shorter than three characters are looked up
+ * in the sorted list of words. Longer queries only check the names sharing
+ * their rarest trigram.
+ *
+ * All arrays are stored in a single block, which may also be read from
+ * a timetable section.
+ */
+
+#ifndef _NAMESEARCH_H
+#define _NAMESEARCH_H
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NAMESEARCH_VERSION 1
+
+/* a trigram of the classes 0 (separator), a-z and 0-9 */
+#define NAMESEARCH_N_CLASSES 37
+#define NAMESEARCH_N_TRIGRAMS (NAMESEARCH_N_CLASSES * NAMESEARCH_N_CLASSES * NAMESEARCH_N_CLASSES)
+
+/* the maximum number of ranked matches, and of folded query bytes */
+#define NAMESEARCH_MAX_RESULTS 64
+#define NAMESEARCH_MAX_QUERY 256
+
+typedef struct namesearch namesearch_t;
+struct namesearch {
+    /* the block the arrays below are part of */
+    void *block;
+    uint64_t size;
+    bool allocated;
+
+    uint32_t n_strings;
+    uint32_t n_postings;
+    uint32_t n_words;
+    uint32_t n_folded;
+
+    /* the offset of the folded form of each name in folded */
+    uint32_t *folded_idx;
+
+    /* the sorted indices of the names containing trigram t are
+     * postings[trigram_offsets[t]] up to postings[trigram_offsets[t + 1]]
+     */
+    uint32_t *trigram_offsets;
+    uint32_t *postings;
+
+    /* pairs of the index of a name and the offset of one of its words in
+     * folded, sorted by the folded name from that word onwards.
+     */
+    uint32_t *words;
+
+    char *folded;
+};
+
+void namesearch_init (namesearch_t *ns);
+
+/* Index the n_strings names at the offsets into strings */
+bool namesearch_build (namesearch_t *ns, const char *strings,
+                       const uint32_t *offsets, uint32_t n_strings);
+
+/* Use a block of namesearch_build, for example read from a timetable.
+ * The block is freed with the index when allocated is true.
+ */
+bool namesearch_from_block (namesearch_t *ns, void *block, uint64_t size,
+                            bool allocated);
+
+/* Store the indices of up to k names containing the folded query in
+ * results and return their number. Equal names rank first, then names
+ * starting with the query, then names with a word starting with it.
+ * Within a rank shorter names come first.
+ */
+uint32_t namesearch_find (namesearch_t *ns, const char *query,
+                          uint32_t *results, uint32_t k);
+
+/* Point candidates to the sorted indices of the names sharing the rarest
+ * trigram of an ASCII query, which includes each name containing the
+ * query ignoring case. Returns false when there is no such list.
+ */
+bool namesearch_candidates (namesearch_t *ns, const char *query,
+                            const uint32_t **candidates, uint32_t *n_candidates);
+
+void namesearch_destroy (namesearch_t *ns);
+
+#endif /* _NAMESEARCH_H */
@@ -6,9 +6,8 @@
 #include "radixtree.h"
 #include "config.h"
 
-/* All nodes are identical in size, allowing use with no dynamic allocation
- * (in a contiguous block of memory). Only supports insertion and retrieval,
- * not deleting.
+/* All nodes are identical in size and stored in a contiguous pool, which
+ * grows by doubling. Only supports insertion and retrieval, not deleting.
  */
 
 #include <stdint.h>
@@ -21,19 +20,53 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
-static struct rxt_edge *rxt_edge_new () {
-    struct rxt_edge *e = (struct rxt_edge *) malloc(sizeof(struct rxt_edge));
-    if (e == NULL) return NULL;
+/* the capacity of the pool of a new tree */
+#define RXT_MIN_EDGES 64
 
-    e->next = NULL;
-    e->child = NULL;
+/* Make room for more edges, copying the pool when we do not own it */
+static bool rxt_grow (radixtree_t *r) {
+    uint64_t capacity = (uint64_t) r->n_edges * 2;
+    rxt_edge_t *edges;
+
+    if (capacity < RXT_MIN_EDGES) capacity = RXT_MIN_EDGES;
+    if (capacity > RADIXTREE_NONE) capacity = RADIXTREE_NONE;
+    if (capacity == r->n_edges) return false; /* all indices are in use */
+
+    if (r->capacity == 0) {
+        edges = (rxt_edge_t *) malloc (sizeof(rxt_edge_t) * (size_t) capacity);
+        if (edges != NULL && r->n_edges > 0) {
+            memcpy (edges, r->edges, sizeof(rxt_edge_t) * r->n_edges);
+        }
+    } else {
+        edges = (rxt_edge_t *) realloc (r->edges, sizeof(rxt_edge_t) * (size_t) capacity);
+    }
+    if (edges == NULL) return false;
+
+    r->edges = edges;
+    r->capacity = (uint32_t) capacity;
+    return true;
+}
+
+/* Returns the index of a new empty edge, RADIXTREE_NONE when allocation
+ * fails. Any pointer into the pool is invalid afterwards.
+ */
+static uint32_t rxt_edge_new (radixtree_t *r) {
+    rxt_edge_t *e;
+    if (r->n_edges == r->capacity && !rxt_grow (r)) return RADIXTREE_NONE;
+
+    e = r->edges + r->n_edges;
+    e->next = RADIXTREE_NONE;
+    e->child = RADIXTREE_NONE;
     e->value = RADIXTREE_NONE;
-    e->prefix[0] = '\0';
-    return e;
+    /* the bytes after a terminator are zero as well */
+    memset (e->prefix, '\0', RRRR_RADIXTREE_PREFIX_SIZE);
+    return r->n_edges++;
 }
 
 static void rxt_init(radixtree_t *self) {
-    self->root = rxt_edge_new();
+    self->edges = NULL;
+    self->n_edges = 0;
+    self->capacity = 0;
     self->base = NULL;
     self->size = 0;
 }
@@ -44,11 +77,6 @@ radixtree_t *radixtree_new () {
 
     rxt_init(r);
 
-    if (r->root == NULL) {
-        free(r);
-        return NULL;
-    }
-
     return r;
 }
 
@@ -57,23 +85,30 @@ radixtree_t *radixtree_new () {
  */
 bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value) {
     const char *k = key;
-    struct rxt_edge *e = r->root;
+    uint32_t i_edge = 0;
+
+    if (*k == '\0') {
+        fprintf (stderr, "Attempt to insert 0-length string.\n");
+        return false; /* refuse to insert 0-length strings. */
+    }
+
+    /* Edges we borrowed are copied before they are changed */
+    if (r->capacity == 0 && !rxt_grow (r)) return false;
+
+    /* An empty tree gets its root edge list */
+    if (r->n_edges == 0 && rxt_edge_new (r) == RADIXTREE_NONE) return false;
 
     /* Loop over edges labeled to continuation from within nested loops. */
-    tail_recurse: while (e != NULL) {
-        char *p;
-        if (*k == '\0') {
-            fprintf (stderr, "Attempt to insert 0-length string.\n");
-            return false; /* refuse to insert 0-length strings. */
-        }
-        p = e->prefix;
+    tail_recurse: while (i_edge != RADIXTREE_NONE) {
+        rxt_edge_t *e = r->edges + i_edge;
+        char *p = e->prefix;
         if (*p == '\0') {
             /* Case 1: We have key characters and a fresh (empty) edge for
-             * use (whose next pointer should also be NULL).
+             * use (whose next index should also be RADIXTREE_NONE).
              * This section is hit whenever we have an empty tree, add a new
              * edge to an edge list, or add a new level to the tree.
              */
-            uint32_t i;
+            uint32_t i, child;
             for (i = 0; i < RRRR_RADIXTREE_PREFIX_SIZE; ++i, ++k, ++p) {
                 /* copy up to RRRR_RADIXTREE_PREFIX_SIZE characters into this
                  * edge's prefix
@@ -92,16 +127,16 @@ bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value) {
                  */
                 e->value = value;
                 return true;
-            } else {
-                /* Some characters remain in the key, make an empty child edge
-                 * list and tail-recurse.
-                 */
-                e->child = rxt_edge_new();
-                if (e->child == NULL) return false; /* allocation failed */
-
-                e = e->child;
-                goto tail_recurse;
             }
+            /* Some characters remain in the key, make an empty child edge
+             * list and tail-recurse.
+             */
+            child = rxt_edge_new (r);
+            if (child == RADIXTREE_NONE) return false; /* allocation failed */
+
+            r->edges[i_edge].child = child;
+            i_edge = child;
+            goto tail_recurse;
         }
         if (*k == *p) {
             /* Case 2: This edge matches the key at least partially,
@@ -118,29 +153,32 @@ bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value) {
                      * of the for loop, to avoid goto. Then again purpose of
                      * goto is clear.
                      */
-                    struct rxt_edge *new;
-                    uint32_t j;
-                    char *n, *o;
+                    rxt_edge_t *new;
+                    uint32_t i_new, j;
+                    char *n;
+
+                    i_new = rxt_edge_new (r);
+                    if (i_new == RADIXTREE_NONE) return false; /* allocation failed */
 
-                    new = rxt_edge_new();
-                    if (new == NULL) return false; /* allocation failed */
+                    /* the pool may have moved */
+                    e = r->edges + i_edge;
+                    p = e->prefix + i;
+                    new = r->edges + i_new;
 
                     new->value = e->value;
                     new->child = e->child;
                     e->value = RADIXTREE_NONE;
-                    e->child = new;
-                    /* copy the rest of e's prefix into the new child edge */
+                    e->child = i_new;
+                    /* Move the rest of e's prefix into the new child edge,
+                     * which is known to be less than
+                     * RRRR_RADIXTREE_PREFIX_SIZE in length. This truncates
+                     * the old prefix at the point it was split.
+                     */
                     n = new->prefix;
-                    o = p;
-                    for (j = i; j < RRRR_RADIXTREE_PREFIX_SIZE && *o != '\0'; ++j) {
-                        *(n++) = *(o++);
+                    for (j = i; j < RRRR_RADIXTREE_PREFIX_SIZE && *p != '\0'; ++j) {
+                        *(n++) = *p;
+                        *(p++) = '\0';
                     }
-                    *n = '\0';
-                    /* Child string is known to be less than
-                     * RRRR_RADIXTREE_PREFIX_SIZE in length.
-                     */
-                    *p = '\0';
-                    /* Truncate old prefix at the point it was split. */
                     if (*k == '\0') {
                         /* No characters remain in the key.
                          * No need to recurse.
@@ -148,7 +186,7 @@ bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value) {
                         e->value = value;
                         return true;
                     }
-                    e = new;
+                    i_edge = i_new;
                     /* Tail-recurse using new edge list to consume
                      * remaining characters
                      */
@@ -171,36 +209,42 @@ bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value) {
             /* Key characters remain, tail-recurse on those remaining
              * characters, creating a new edge list as needed.
              */
-            if (e->child == NULL) e->child = rxt_edge_new();
-            if (e->child == NULL) return false; /* allocation failed */
-            e = e->child;
+            if (e->child == RADIXTREE_NONE) {
+                uint32_t child = rxt_edge_new (r);
+                if (child == RADIXTREE_NONE) return false; /* allocation failed */
+                r->edges[i_edge].child = child;
+            }
+            i_edge = r->edges[i_edge].child;
             goto tail_recurse;
         }
         /* Case 3: No edges so far have been empty or matched at all.
          * Move on to the next edge in the edge list.
          */
-        if (e->next == NULL) {
+        if (e->next == RADIXTREE_NONE) {
             /* We have remaining characters in they key, no edges match,
              * but no next edge. Make an empty edge to use.
              */
-            e->next = rxt_edge_new();
-            if (e->next == NULL) return false; /* allocation failed */
+            uint32_t next = rxt_edge_new (r);
+            if (next == RADIXTREE_NONE) return false; /* allocation failed */
 
             /* Note this edge will have *prefix == '\0' so will
              * be used to consume characters.
              */
+            r->edges[i_edge].next = next;
         }
-        e = e->next;
+        i_edge = r->edges[i_edge].next;
         /* Move on to the next edge in the list on the same tree level. */
     }
     return false;
-    /* should never happen unless allocation fails, giving a NULL next edge. */
+    /* should never happen */
 }
 
 uint32_t radixtree_find (radixtree_t *r, const char *key) {
+    const rxt_edge_t *edges = r->edges;
     const char *k = key;
-    struct rxt_edge *e = r->root;
-    while (e != NULL) {
+    uint32_t i_edge = (r->n_edges > 0 ? 0 : RADIXTREE_NONE);
+    while (i_edge != RADIXTREE_NONE) {
+        const rxt_edge_t *e = edges + i_edge;
         const char *p = e->prefix;
         if (*k == *p) { /* we have a match, consume some characters */
             uint32_t i;
@@ -217,13 +261,13 @@ uint32_t radixtree_find (radixtree_t *r, const char *key) {
              */
             if (*k == '\0') return e->value;
             /* This edge consumed the entire key. */
-            e = e->child;
+            i_edge = e->child;
             /* Key characters remain, tail-recurse on those
-             * remaining characters. Child might be NULL.
+             * remaining characters. Child might be RADIXTREE_NONE.
              */
             continue;
         }
-        e = e->next;
+        i_edge = e->next;
         /* Next edge in the list on the same tree level */
     }
     return RADIXTREE_NONE;
@@ -295,12 +339,10 @@ radixtree_t *radixtree_load_strings_from_file (char *filename) {
      */
     close (fd);
 
-    #if 0
-    rxt_compress (root);
-    fprintf (stderr, "total number of edges: %d\n", edge_count(root));
-    fprintf (stderr, "size of one edge: %ld\n", sizeof(struct rxt_edge));
-    fprintf (stderr, "total size of all edges: %ld\n",
-                     edge_count(root) * sizeof(struct rxt_edge));
+    radixtree_compact (r);
+    #ifdef RRRR_DEBUG
+    fprintf (stderr, "total size of all %u edges: %lu\n", r->n_edges,
+                     (unsigned long) (r->n_edges * sizeof(rxt_edge_t)));
     #endif
 
     return r;
@@ -319,6 +361,7 @@ radixtree_t *radixtree_load_strings_from_tdata (char *strings, uint32_t width, u
     char *strings_end = strings + (width * length);
     char *s = strings;
     uint32_t idx = 0;
+    if (r == NULL) return NULL;
     #ifdef RRRR_DEBUG
     fprintf (stderr, "Indexing strings...\n");
     #endif
@@ -328,30 +371,104 @@ radixtree_t *radixtree_load_strings_from_tdata (char *strings, uint32_t width, u
         idx += 1;
     }
 
-    #if 0
-    rxt_compress (root);
-    fprintf (stderr, "total number of edges: %d\n", edge_count(root));
-    fprintf (stderr, "size of one edge: %ld\n", sizeof(struct rxt_edge));
-    fprintf (stderr, "total size of all edges: %ld\n",
-                     edge_count(root) * sizeof(struct rxt_edge));
+    radixtree_compact (r);
+    #ifdef RRRR_DEBUG
+    fprintf (stderr, "total size of all %u edges: %lu\n", r->n_edges,
+                     (unsigned long) (r->n_edges * sizeof(rxt_edge_t)));
     #endif
 
     return r;
 }
 
-static void rxt_edge_free (struct rxt_edge *e) {
-    if (e == NULL) return;
+radixtree_t *radixtree_from_flat (rxt_edge_t *edges, uint32_t n_edges, bool allocated) {
+    radixtree_t *r;
+    uint32_t i_edge;
+
+    for (i_edge = 0; i_edge < n_edges; ++i_edge) {
+        if ((edges[i_edge].next != RADIXTREE_NONE && edges[i_edge].next >= n_edges) ||
+            (edges[i_edge].child != RADIXTREE_NONE && edges[i_edge].child >= n_edges)) {
+            fprintf (stderr, "Edge %u of the radixtree refers outside of its %u edges.\n",
+                             i_edge, n_edges);
+            return NULL;
+        }
+    }
 
-    rxt_edge_free (e->next);
-    rxt_edge_free (e->child);
+    r = radixtree_new ();
+    if (r == NULL) return NULL;
 
-    free(e);
+    if (n_edges > 0) {
+        r->edges = edges;
+        r->n_edges = n_edges;
+        if (allocated) r->capacity = n_edges;
+    } else if (allocated) {
+        free (edges);
+    }
+
+    return r;
+}
+
+/* Store the edge list from i_first, returns the index it was stored at */
+static uint32_t rxt_flatten (rxt_edge_t *pool, uint32_t i_first,
+                             rxt_edge_t *edges, uint32_t *n_edges) {
+    uint32_t i_flat = *n_edges;
+    uint32_t i_edge, i_stored;
+
+    /* The list is stored before the lists of its children */
+    for (i_edge = i_first; i_edge != RADIXTREE_NONE; i_edge = pool[i_edge].next) {
+        (*n_edges)++;
+    }
+
+    for (i_edge = i_first, i_stored = i_flat;
+         i_edge != RADIXTREE_NONE;
+         i_edge = pool[i_edge].next, ++i_stored) {
+        uint32_t child = RADIXTREE_NONE;
+
+        if (pool[i_edge].child != RADIXTREE_NONE) {
+            child = rxt_flatten (pool, pool[i_edge].child, edges, n_edges);
+        }
+
+        if (edges) {
+            edges[i_stored] = pool[i_edge];
+            edges[i_stored].next = (pool[i_edge].next != RADIXTREE_NONE ?
+                                    i_stored + 1 : RADIXTREE_NONE);
+            edges[i_stored].child = child;
+        }
+    }
+
+    return i_flat;
+}
+
+uint32_t radixtree_flatten (radixtree_t *r, rxt_edge_t *edges) {
+    uint32_t n_edges = 0;
+
+    if (r->n_edges > 0) rxt_flatten (r->edges, 0, edges, &n_edges);
+
+    return n_edges;
+}
+
+bool radixtree_compact (radixtree_t *r) {
+    rxt_edge_t *edges;
+    uint32_t n_edges = radixtree_flatten (r, NULL);
+
+    if (n_edges == 0) return true;
+
+    edges = (rxt_edge_t *) malloc (sizeof(rxt_edge_t) * n_edges);
+    if (edges == NULL) return false;
+
+    radixtree_flatten (r, edges);
+
+    if (r->capacity > 0) free (r->edges);
+    r->edges = edges;
+    r->n_edges = n_edges;
+    r->capacity = n_edges;
+
+    return true;
 }
 
 void radixtree_destroy (radixtree_t *r) {
     if (r == NULL) return;
 
-    rxt_edge_free (r->root);
+    if (r->capacity > 0) free (r->edges);
 
     #if defined(RRRR_TDATA_IO_MMAP)
     if (r->base) munmap(r->base, r->size);
@@ -363,7 +480,7 @@ void radixtree_destroy (radixtree_t *r) {
 }
 
 #ifdef RRRR_DEBUG
-static uint32_t edge_prefix_length (struct rxt_edge *e) {
+static uint32_t edge_prefix_length (rxt_edge_t *e) {
     uint32_t n = 0;
     char *c = e->prefix;
     while (*c != '\0' && n < RRRR_RADIXTREE_PREFIX_SIZE) {
@@ -373,68 +490,21 @@ static uint32_t edge_prefix_length (struct rxt_edge *e) {
     return n;
 }
 
-uint32_t rxt_edge_count (struct rxt_edge *e) {
-    uint32_t n = 0;
-    if (e != NULL) {
-        n += 1;
-        n += rxt_edge_count(e->child);
-        n += rxt_edge_count(e->next);
-    }
-    return n;
-}
-
-void rxt_edge_print (struct rxt_edge *e) {
-    if (e == NULL) return;
-    fprintf (stderr, "\nedge [%p]\n", (void *) e);
-    /* variable width string format character */
-    fprintf (stderr, "prefix '%.*s'\n", RRRR_RADIXTREE_PREFIX_SIZE, e->prefix);
-    fprintf (stderr, "length %d\n", edge_prefix_length(e));
-    fprintf (stderr, "value  %d\n", e->value);
-    fprintf (stderr, "next   %p\n", (void *) e->next);
-    fprintf (stderr, "child  %p\n", (void *) e->child);
-    rxt_edge_print(e->next);
-    rxt_edge_print(e->child);
-}
-#endif
-
-#if 0
-/* TODO: returns a compacted copy of the tree */
-struct node *compact (struct rxt_edge *root) {
-    return NULL;
+uint32_t radixtree_edge_count (radixtree_t *r) {
+    return radixtree_flatten (r, NULL);
 }
 
-/* Compresses paths in place. Not well tested,
- * and only seems to remove a few edges from 600k when using numbers.
- */
-void rxt_compress (struct rxt_edge *root) {
-    struct rxt_edge *e = root;
-    if (e == NULL) return;
-    while (e->child != NULL &&
-           e->child->next == NULL && e->value == RADIXTREE_NONE) {
-        uint32_t l0 = edge_prefix_length(e);
-        uint32_t l1 = edge_prefix_length(e->child);
-        if (l0 + l1 <= RRRR_RADIXTREE_PREFIX_SIZE) {
-            struct rxt_edge *new_child;
-            uint32_t i;
-            char *c0, *c1;
-
-            fprintf (stderr, "compressing %.*s and %.*s.\n",
-                             RRRR_RADIXTREE_PREFIX_SIZE, e->prefix,
-                             RRRR_RADIXTREE_PREFIX_SIZE, e->child->prefix);
-            c0 = e->prefix + l0;
-            c1 = e->child->prefix;
-
-            for (i = 0; i < l1; ++i) *(c0++) = *(c1++);
-
-            if (l0 + l1 < RRRR_RADIXTREE_PREFIX_SIZE) *c0 = '\0';
-
-            e->value = e->child->value;
-            new_child = e->child->child;
-            free (e->child);
-            e->child = new_child;
-        }
+void radixtree_edge_print (radixtree_t *r) {
+    uint32_t i_edge;
+    for (i_edge = 0; i_edge < r->n_edges; ++i_edge) {
+        rxt_edge_t *e = r->edges + i_edge;
+        fprintf (stderr, "\nedge [%u]\n", i_edge);
+        /* variable width string format character */
+        fprintf (stderr, "prefix '%.*s'\n", RRRR_RADIXTREE_PREFIX_SIZE, e->prefix);
+        fprintf (stderr, "length %d\n", edge_prefix_length(e));
+        fprintf (stderr, "value  %d\n", e->value);
+        fprintf (stderr, "next   %d\n", e->next);
+        fprintf (stderr, "child  %d\n", e->child);
     }
-    rxt_compress (e->child);
-    rxt_compress (e->next);
 }
 #endif
@@ -14,27 +14,36 @@
 
 #define RADIXTREE_NONE UINT32_MAX
 
-/* Represents both an edge and the node it leads to. A zero-length prefix
- * indicates an empty edge list. A NULL next-pointer indicates the last edge
- * in the list.
+/* Represents both an edge and the node it leads to. All edges of a tree
+ * are stored in a single pool, addressed by 32-bit indices instead of
+ * pointers, the same layout as a radixtree stored in a timetable section.
+ * A zero-length prefix indicates an empty edge list. With a prefix size of
+ * 4 an edge takes 16 bytes, four edges share a cache line.
  */
+typedef struct rxt_edge rxt_edge_t;
 struct rxt_edge {
     /* the next parallel edge out of the same parent node,
-     * NULL indicates end of list
+     * RADIXTREE_NONE indicates end of list
      */
-    struct rxt_edge *next;
+    uint32_t next;
 
     /* the first edge in the list reached by traversing this
-     * edge (consuming its prefix)
+     * edge (consuming its prefix), RADIXTREE_NONE if there is none
      */
-    struct rxt_edge *child;
+    uint32_t child;
     uint32_t value;
     char prefix[RRRR_RADIXTREE_PREFIX_SIZE];
 };
 
 typedef struct radixtree_s radixtree_t;
 struct radixtree_s {
-    struct rxt_edge *root;
+    /* the edge pool, the root edge list starts at index 0 */
+    rxt_edge_t *edges;
+    uint32_t n_edges;
+    /* zero while the edges are not ours to change or free, for example
+     * when they are mapped from a timetable, the first insert copies them.
+     */
+    uint32_t capacity;
     void *base;
     size_t size;
 };
@@ -45,6 +54,23 @@ radixtree_t *radixtree_load_strings_from_file (char *filename);
 
 radixtree_t *radixtree_load_strings_from_tdata (char *strings, uint32_t width, uint32_t length);
 
+/* Use the edges, for example mapped from a timetable, as a radixtree.
+ * The edges are freed with the tree when allocated is true. Returns NULL
+ * when an edge refers outside of the array.
+ */
+radixtree_t *radixtree_from_flat (rxt_edge_t *edges, uint32_t n_edges, bool allocated);
+
+/* Store the reachable edges of the tree into edges, unless it is NULL, and
+ * return the number of edges which were or would have been stored. Each
+ * edge list is stored contiguously, before the lists of its children.
+ */
+uint32_t radixtree_flatten (radixtree_t *r, rxt_edge_t *edges);
+
+/* Rewrite the pool in the order of radixtree_flatten, so a lookup scans
+ * the edges of a list within one or two cache lines.
+ */
+bool radixtree_compact (radixtree_t *r);
+
 void radixtree_destroy (radixtree_t *r);
 
 bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value);
@@ -52,9 +78,9 @@ bool radixtree_insert (radixtree_t *r, const char *key, uint32_t value);
 uint32_t radixtree_find (radixtree_t *r, const char *key);
 
 #ifdef RRRR_DEBUG
-uint32_t radixtree_edge_count (struct rxt_edge *e);
+uint32_t radixtree_edge_count (radixtree_t *r);
 
-void radixtree_edge_print (struct rxt_edge *e);
+void radixtree_edge_print (radixtree_t *r);
 #endif
 
 #endif /* _RADIXTREE_H */
@@ -7,12 +7,14 @@
 #include "router.h" /* first to ensure it works alone */
 #include "router_request.h"
 #include "router_dump.h"
+#include "router_result.h"
 
 #include "util.h"
 #include "config.h"
 #include "tdata.h"
 #include "bitset.h"
 #include "hashgrid.h"
+#include "lowerbound.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -21,31 +23,16 @@
 #include <stdint.h>
 #include <math.h>
 
-#ifdef RRRR_FEATURE_LATLON
-static bool router_setup_hashgrid(router_t *router) {
-    coord_t *coords;
-    uint32_t i_stop;
-
-    coords = (coord_t *) malloc(sizeof(coord_t) * router->tdata->n_stops);
-    if (!coords) return false;
-
-    i_stop = router->tdata->n_stops;
-    do {
-        i_stop--;
-        coord_from_latlon(coords + i_stop,
-                          router->tdata->stop_coords + i_stop);
-    } while(i_stop);
-
-    hashgrid_init (&router->hg, 100, 500.0, coords, router->tdata->n_stops);
-    free(coords);
-
-    return true;
-}
-#endif
-
 bool router_setup(router_t *router, tdata_t *tdata) {
     uint64_t n_states = tdata->n_stops * RRRR_DEFAULT_MAX_ROUNDS;
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* Realtime updates may fork journey_patterns after the setup */
+    uint32_t n_journey_patterns = RRRR_DYNAMIC_SLACK * tdata->n_journey_patterns_orig;
+    #else
+    uint32_t n_journey_patterns = tdata->n_journey_patterns;
+    #endif
     router->tdata = tdata;
+    router->tdata_generation = tdata->generation;
     router->best_time = (rtime_t *) malloc(sizeof(rtime_t) * tdata->n_stops);
     router->states_back_journey_pattern = (uint32_t *) malloc(sizeof(uint32_t) * n_states);
     router->states_back_vehicle_journey = (uint32_t *) malloc(sizeof(uint32_t) * n_states);
@@ -54,6 +41,10 @@ bool router_setup(router_t *router, tdata_t *tdata) {
     router->states_walk_time = (rtime_t *) malloc(sizeof(rtime_t) * n_states);
     router->states_time = (rtime_t *) malloc(sizeof(rtime_t) * n_states);
     router->states_board_time = (rtime_t *) malloc(sizeof(rtime_t) * n_states);
+    router->via_plan = (plan_t *) malloc(sizeof(plan_t));
+    router->via_ride_plan = (plan_t *) malloc(sizeof(plan_t));
+    router->via_ride_time = NULL;
+    router->via_walk_time = NULL;
 
     #ifdef RRRR_FEATURE_REALTIME_EXPANDED
     router->states_back_journey_pattern_point = (uint16_t *) malloc(sizeof(uint16_t) * n_states);
@@ -62,10 +53,14 @@ bool router_setup(router_t *router, tdata_t *tdata) {
 
     router->updated_stops  = bitset_new(tdata->n_stops);
     router->updated_walk_stops  = bitset_new(tdata->n_stops);
-    router->updated_journey_patterns = bitset_new(tdata->n_journey_patterns);
+    router->updated_journey_patterns = bitset_new(n_journey_patterns);
 
 #if RRRR_BANNED_JOURNEY_PATTERNS_BITMASK == 1
-    router->banned_journey_patterns = bitset_new(tdata->n_journey_patterns);
+    router->banned_journey_patterns = bitset_new(n_journey_patterns);
+#endif
+
+#ifdef RRRR_FEATURE_LOWER_BOUND
+    router->lb_time = (rtime_t *) malloc(sizeof(rtime_t) * tdata->n_stops);
 #endif
 
     if ( ! (router->best_time
@@ -76,6 +71,8 @@ bool router_setup(router_t *router, tdata_t *tdata) {
             && router->states_walk_time
             && router->states_time
             && router->states_board_time
+            && router->via_plan
+            && router->via_ride_plan
 #ifdef RRRR_FEATURE_REALTIME_EXPANDED
             && router->states_back_journey_pattern_point
             && router->states_journey_pattern_point
@@ -85,6 +82,9 @@ bool router_setup(router_t *router, tdata_t *tdata) {
             && router->updated_journey_patterns
 #if RRRR_BANNED_JOURNEY_PATTERNS_BITMASK == 1
             && router->banned_journey_patterns
+#endif
+#ifdef RRRR_FEATURE_LOWER_BOUND
+            && router->lb_time
 #endif
            )
        ) {
@@ -92,11 +92,19 @@ bool router_setup(router_t *router, tdata_t *tdata) {
         return false;
     }
 
-#ifdef RRRR_FEATURE_LATLON
-    return router_setup_hashgrid (router);
-#else
-    return true;
+#ifdef RRRR_FEATURE_LOWER_BOUND
+    /* The graph itself was built along with the timetable */
+    router->lb_scratch.heap = NULL;
+    router->lb_scratch.n_heap = 0;
+    router->lb_scratch.size = 0;
+    if (tdata->lowerbound &&
+        ! lowerbound_scratch_reserve (&router->lb_scratch, tdata->lowerbound)) {
+        fprintf(stderr, "failed to allocate lower bound scratch space");
+        return false;
+    }
 #endif
+
+    return true;
 }
 
 void router_teardown(router_t *router) {
@@ -108,6 +116,8 @@ void router_teardown(router_t *router) {
     free(router->states_walk_time);
     free(router->states_time);
     free(router->states_board_time);
+    free(router->via_plan);
+    free(router->via_ride_plan);
 #ifdef RRRR_FEATURE_REALTIME_EXPANDED
     free(router->states_back_journey_pattern_point);
     free(router->states_journey_pattern_point);
@@ -120,11 +130,20 @@ void router_teardown(router_t *router) {
     bitset_destroy(router->banned_journey_patterns);
 #endif
 
-#ifdef RRRR_FEATURE_LATLON
-    hashgrid_teardown (&router->hg);
+#ifdef RRRR_FEATURE_LOWER_BOUND
+    free(router->lb_time);
+    lowerbound_scratch_teardown (&router->lb_scratch);
 #endif
 }
 
+bool router_refresh(router_t *router, tdata_t *tdata) {
+    if (router->tdata == tdata &&
+        router->tdata_generation == tdata->generation) return true;
+
+    router_teardown (router);
+    return router_setup (router, tdata);
+}
+
 void router_reset(router_t *router) {
 
     /* Make sure both origin and target are initialised with NONE, so it
@@ -159,20 +178,16 @@ static bool initialize_states (router_t *router) {
  * first day of the calendar.
  */
 static bool initialize_servicedays (router_t *router, router_request_t *req) {
-    /* One bit for the calendar day on which realtime data should be
-     * applied (applying only on the true current calendar day)
+    /* The calendar days for which any realtime data has been applied,
+     * the realtime stoptimes themselves are keyed by their service day.
      */
     serviceday_t yesterday, today, tomorrow;
     uint8_t day_i = 0;
-    calendar_t realtime_mask;
+    calendar_t realtime_mask = 0;
     router->day_mask = req->day_mask;
 
-    /*  Fake realtime_mask if we are QA testing. */
-    #ifdef RRRR_FAKE_REALTIME
-    realtime_mask = ~((calendar_t) 0);
-    #else
-    realtime_mask = ((calendar_t) 1) << ((time(NULL) - router->tdata->calendar_start_time) /
-                                         SEC_IN_ONE_DAY);
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    realtime_mask = router->tdata->rt_days;
     #endif
 
     yesterday.midnight = 0;
@@ -238,6 +253,29 @@ static bool initialize_servicedays (router_t *router, router_request_t *req) {
 }
 
 /* Given a stop index, mark all journey_patterns that serve it as updated. */
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+/* The service days on which a NO_SERVICE alert suspends the journey_pattern,
+ * see alert_index_t.
+ */
+static calendar_t journey_pattern_suspended (tdata_t *tdata, uint32_t jp_index) {
+    alert_index_t *alerts = tdata->alerts;
+    if (alerts && alerts->journey_patterns_suspended &&
+        jp_index < alerts->n_journey_patterns) {
+        return alerts->journey_patterns_suspended[jp_index];
+    }
+    return 0;
+}
+#else
+#define journey_pattern_suspended(tdata, jp_index) ((calendar_t) 0)
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* Delays can make vehicle_journeys overtake each other, see rt_nonfifo */
+#define journey_pattern_fifo(tdata, jp_index) (!bitset_get ((tdata)->rt_nonfifo, (jp_index)))
+#else
+#define journey_pattern_fifo(tdata, jp_index) true
+#endif
+
 static void flag_journey_patterns_for_stop(router_t *router, router_request_t *req,
         uint32_t stop_index) {
     uint32_t *journey_patterns;
@@ -256,7 +294,8 @@ static void flag_journey_patterns_for_stop(router_t *router, router_request_t *r
                          journey_patterns[i_jp], stop_index);
         #endif
 
-        jp_active_flags = router->tdata->journey_pattern_active[journey_patterns[i_jp]];
+        jp_active_flags = router->tdata->journey_pattern_active[journey_patterns[i_jp]] &
+                          ~journey_pattern_suspended (router->tdata, journey_patterns[i_jp]);
 
         /* CHECK that there are any vehicle_journeys running on this journey_pattern
          * (another bitfield)
@@ -277,8 +316,7 @@ static void flag_journey_patterns_for_stop(router_t *router, router_request_t *r
     } while (i_jp);
 
     #ifdef RRRR_FEATURE_REALTIME_EXPANDED
-    if (router->servicedays[1].apply_realtime &&
-        router->tdata->rt_journey_patterns_at_stop[stop_index]) {
+    if (router->tdata->rt_journey_patterns_at_stop[stop_index]) {
         journey_patterns = router->tdata->rt_journey_patterns_at_stop[stop_index]->list;
         i_jp = router->tdata->rt_journey_patterns_at_stop[stop_index]->len;
         if (i_jp == 0) return;
@@ -289,8 +327,12 @@ static void flag_journey_patterns_for_stop(router_t *router, router_request_t *r
             fprintf (stderr, "  flagging changed journey_pattern %d at stop %d\n",
                              journey_patterns[i_jp], stop_index);
             #endif
-            /* extra journey_patterns should only be applied on the current day */
-            if ((req->mode & router->tdata->journey_patterns[journey_patterns[i_jp]].attributes) > 0) {
+            /* a forked journey_pattern is only active on the service day
+             * of the update it was forked for
+             */
+            if ((router->day_mask & router->tdata->journey_pattern_active[journey_patterns[i_jp]] &
+                 ~journey_pattern_suspended (router->tdata, journey_patterns[i_jp])) &&
+                (req->mode & router->tdata->journey_patterns[journey_patterns[i_jp]].attributes) > 0) {
                 bitset_set (router->updated_journey_patterns, journey_patterns[i_jp]);
                 #ifdef RRRR_INFO
                 fprintf (stderr, "  journey_pattern running\n");
@@ -433,9 +475,10 @@ tdata_stoptime (tdata_t* tdata, serviceday_t *serviceday,
 
     /* given that we are at a serviceday the realtime scope applies to */
     if (serviceday->apply_realtime) {
+        uint32_t vj_index = tdata->journey_patterns[jp_index].vj_ids_offset + vj_offset;
 
         /* the expanded stoptimes can be found at the same row as the vehicle_journey */
-        vj_stoptimes = tdata->vj_stoptimes[tdata->journey_patterns[jp_index].vj_ids_offset + vj_offset];
+        vj_stoptimes = tdata_rt_stoptimes_for_days (tdata, vj_index, serviceday->mask);
 
         if (vj_stoptimes) {
             /* if the expanded stoptimes have been added,
@@ -666,6 +709,7 @@ static void apply_transfers (router_t *router, router_request_t *req,
 static void board_vehicle_journeys_within_days(router_t *router, router_request_t *req,
         uint32_t jp_index,
         uint16_t jpp_offset,
+        calendar_t closed,
         rtime_t prev_time,
         serviceday_t **best_serviceday,
         uint32_t *best_vj, rtime_t *best_time) {
@@ -674,7 +718,9 @@ static void board_vehicle_journeys_within_days(router_t *router, router_request_
     vehicle_journey_t *vjs_in_journey_pattern = tdata_vehicle_journeys_in_journey_pattern(router->tdata, jp_index);
     journey_pattern_t *jp = &(router->tdata->journey_patterns[jp_index]);
     serviceday_t *serviceday;
+    calendar_t suspended = journey_pattern_suspended (router->tdata, jp_index);
     bool jp_overlap = jp->min_time < (jp->max_time - RTIME_ONE_DAY);
+    bool jp_fifo = journey_pattern_fifo (router->tdata, jp_index);
 
     /* Search through the servicedays that are assumed to be put in search-order (counterclockwise for arrive_by)
      */
@@ -692,6 +738,11 @@ static void board_vehicle_journeys_within_days(router_t *router, router_request_
                            : prev_time > serviceday->midnight +
                                          jp->max_time) continue;
 
+        /* Skip the days on which an alert suspends this journey_pattern,
+         * or closes the stop.
+         */
+        if (serviceday->mask & (suspended | closed)) continue;
+
         /* Check whether there's any chance of improvement by
          * scanning additional days. Note that day list is
          * reversed for arrive-by searches.
@@ -743,7 +794,9 @@ static void board_vehicle_journeys_within_days(router_t *router, router_request_
 
             if (req->arrive_by ? time < req->time_cutoff
                                : time > req->time_cutoff){
-                return;
+                /* a later vehicle_journey may still be in time */
+                if (jp_fifo) return;
+                continue;
             }
 
             /* Mark vj for boarding if it improves on the last round's
@@ -760,7 +813,7 @@ static void board_vehicle_journeys_within_days(router_t *router, router_request_
                 /* Since FIFO ordering of trips is ensured, we can immediately return if the JourneyPattern does not overlap.
                  * If the JourneyPattern does overlap, we can only return if the time does not fall in the overlapping period
                  */
-                if (!jp_overlap || jp->min_time > time - RTIME_ONE_DAY)
+                if (jp_fifo && (!jp_overlap || jp->min_time > time - RTIME_ONE_DAY))
                     return;
             }
         }  /*  end for (vehicle_journey's within this route) */
@@ -776,6 +829,7 @@ static void board_vehicle_journeys_within_days(router_t *router, router_request_
 static void reboard_vehicle_journeys_within_days(router_t *router, router_request_t *req,
         uint32_t jp_index,
         uint16_t jpp_offset,
+        calendar_t closed,
         serviceday_t *prev_serviceday,
         uint16_t prev_vj_offset,
         rtime_t prev_time,
@@ -785,6 +839,7 @@ static void reboard_vehicle_journeys_within_days(router_t *router, router_reques
     calendar_t *vj_masks = tdata_vj_masks_for_journey_pattern(router->tdata, jp_index);
     vehicle_journey_t *vjs_in_journey_pattern = tdata_vehicle_journeys_in_journey_pattern(router->tdata, jp_index);
     journey_pattern_t *jp = &(router->tdata->journey_patterns[jp_index]);
+    calendar_t suspended = journey_pattern_suspended (router->tdata, jp_index);
 
     serviceday_t *serviceday;
 
@@ -800,6 +855,11 @@ static void reboard_vehicle_journeys_within_days(router_t *router, router_reques
         if (req->arrive_by ? prev_time < serviceday->midnight + jp->min_time
                            : prev_time > serviceday->midnight + jp->max_time) continue;
 
+        /* Skip the days on which an alert suspends this journey_pattern,
+         * or closes the stop.
+         */
+        if (serviceday->mask & (suspended | closed)) continue;
+
         for (i_vj_offset = prev_vj_offset;
              req->arrive_by ? i_vj_offset < jp->n_vjs :
                               i_vj_offset >= 0;
@@ -913,9 +973,94 @@ write_state(router_t *router, router_request_t *req,
     return true;
 }
 
+/* Seed the via stop with the times at which the first leg of a via search
+ * reached it in this round, before the transfers of the round are applied.
+ * The states have no back journey_pattern, which lets the result rendering
+ * continue the itinerary with the first leg. Transfers may only continue
+ * from the ride arrival, the transfer arrival can only board a vehicle.
+ */
+static void initialize_via_round (router_t *router, router_request_t *req,
+                                  uint8_t round) {
+    uint64_t i_state = ((uint64_t) round) * router->tdata->n_stops + req->via;
+    rtime_t ride_time = router->via_ride_time[round];
+    rtime_t walk_time = router->via_walk_time[round];
+    bool seeded = false;
+
+    if (ride_time != UNREACHED &&
+        (router->best_time[req->via] == UNREACHED ||
+         (req->arrive_by ? ride_time > router->best_time[req->via]
+                         : ride_time < router->best_time[req->via]))) {
+        router->best_time[req->via] = ride_time;
+        router->states_time[i_state] = ride_time;
+        router->states_ride_from[i_state] = STOP_NONE;
+        router->states_back_journey_pattern[i_state] = NONE;
+        router->states_back_vehicle_journey[i_state] = NONE;
+        router->states_board_time[i_state] = UNREACHED;
+        bitset_set (router->updated_stops, req->via);
+        seeded = true;
+    }
+
+    if (walk_time != UNREACHED &&
+        (router->best_time[req->via] == UNREACHED ||
+         (req->arrive_by ? walk_time > router->best_time[req->via]
+                         : walk_time < router->best_time[req->via]))) {
+        if (!seeded) {
+            router->states_time[i_state] = walk_time;
+            router->states_ride_from[i_state] = STOP_NONE;
+            router->states_back_journey_pattern[i_state] = NONE;
+            router->states_back_vehicle_journey[i_state] = NONE;
+            router->states_board_time[i_state] = UNREACHED;
+            bitset_unset (router->updated_stops, req->via);
+        }
+        router->best_time[req->via] = walk_time;
+        router->states_walk_time[i_state] = walk_time;
+        router->states_walk_from[i_state] = req->via;
+        bitset_set (router->updated_walk_stops, req->via);
+    }
+}
+
+/* The first leg of a via search may also reach the via stop on foot,
+ * without any ride, when it lies next to the origin. The via stop then
+ * starts the second leg like an origin, as the initial state in round 1,
+ * and the result rendering adds the walk from the origin as its initial
+ * walk. This keeps the search symmetric: the second leg may leave the
+ * via stop on foot, and a reversal of such an itinerary must find it.
+ */
+static void initialize_via_walk (router_t *router, router_request_t *req,
+                                 spidx_t origin) {
+    uint64_t i_state = router->tdata->n_stops + req->via;
+    rtime_t duration = transfer_duration (router->tdata, req, origin, req->via);
+    rtime_t time;
+
+    if (duration == UNREACHED) return;
+
+    time = (req->arrive_by ? req->time - duration : req->time + duration);
+    if (time > RTIME_THREE_DAYS ||
+        (req->arrive_by ? time > req->time : time < req->time)) return;
+
+    /* The rendering of the initial walk starts at the origin state */
+    router->best_time[origin] = req->time;
+    router->states_time[origin] = req->time;
+
+    router->best_time[req->via] = time;
+    router->states_time[i_state] = time;
+    router->states_ride_from[i_state] = STOP_NONE;
+    router->states_back_journey_pattern[i_state] = NONE;
+    router->states_back_vehicle_journey[i_state] = NONE;
+    router->states_board_time[i_state] = UNREACHED;
+    bitset_set (router->updated_stops, req->via);
+
+    /* Only the via stop itself may be boarded from, without transfers */
+    apply_transfers (router, req, 1, false);
+}
+
 static void router_round(router_t *router, router_request_t *req, uint8_t round) {
     /*  TODO restrict pointers? */
     rtime_t *states_walk_time = router->states_walk_time + (((round == 0) ? 1 : round - 1) * router->tdata->n_stops);
+    #ifdef RRRR_FEATURE_REALTIME_ALERTS
+    alert_index_t *alerts = router->tdata->alerts;
+    calendar_t *stops_closed = (alerts ? alerts->stops_closed : NULL);
+    #endif
     uint32_t jp_index;
 
     #ifdef RRRR_INFO
@@ -983,6 +1128,8 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
             bool attempt_board = false;
             bool forboarding = (journey_pattern_point_attributes[jpp_index] & rsa_boarding);
             bool foralighting = (journey_pattern_point_attributes[jpp_index] & rsa_alighting);
+            /* the service days on which the stop is closed */
+            calendar_t closed = 0;
 
             #ifdef RRRR_INFO
             char buf[13];
@@ -1024,6 +1171,18 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
             }
             #endif
 
+            #ifdef RRRR_FEATURE_REALTIME_ALERTS
+            /* A stop closed by a NO_SERVICE alert can't be boarded or
+             * alighted at, but the vehicle still passes through it. Only
+             * the service days on which it is closed are skipped when
+             * boarding.
+             */
+            closed = (stops_closed ? stops_closed[stop_index] : 0);
+            if (vj_index != NONE && (closed & board_serviceday->mask)) {
+                continue;
+            }
+            #endif
+
             /* If we are not already on a vj, or if we might be able to board
              * a better vj on this journey_pattern at this location, indicate that we
              * want to search for a vj.
@@ -1032,11 +1191,8 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
 
             /* Only board at placed that have been reached. */
             if (prev_time != UNREACHED) {
-                if (vj_index == NONE || req->via == stop_index) {
+                if (vj_index == NONE) {
                     attempt_board = true;
-                } else if (vj_index != NONE && req->via != STOP_NONE &&
-                                           req->via == board_stop) {
-                    attempt_board = false;
                 } else {
                     rtime_t vj_stoptime = tdata_stoptime (router->tdata,
                                                         board_serviceday,
@@ -1078,13 +1234,16 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
                 tdata_dump_journey_pattern(router->tdata, jp_index, NONE);
                 #endif
 
-                if (vj_index == NONE) {
+                /* Without FIFO order a better vehicle_journey may be
+                 * anywhere in the journey_pattern.
+                 */
+                if (vj_index == NONE || !journey_pattern_fifo (router->tdata, jp_index)) {
                     board_vehicle_journeys_within_days(router, req, jp_index, (uint16_t) jpp_index,
-                            prev_time, &best_serviceday,
+                            closed, prev_time, &best_serviceday,
                             &best_vj, &best_time);
                 }else{
                     reboard_vehicle_journeys_within_days(router, req, jp_index, (uint16_t) jpp_index,
-                            board_serviceday, vj_index, prev_time, &best_serviceday,
+                            closed, board_serviceday, vj_index, prev_time, &best_serviceday,
                             &best_vj, &best_time);
                 }
 
@@ -1143,6 +1302,26 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
                      */
                     continue;
                 }
+
+                #ifdef RRRR_FEATURE_LOWER_BOUND
+                /* Goal-directed pruning: not even the fastest connection
+                 * from this stop could improve on the target. A stop
+                 * without a bound is never pruned, the graph may lack
+                 * an edge which realtime data added since.
+                 */
+                if (router->lb_time[stop_index] != UNREACHED &&
+                    router->best_time[router->target] != UNREACHED &&
+                    (req->arrive_by ? (int32_t) time - router->lb_time[stop_index] <
+                                      (int32_t) router->best_time[router->target]
+                                    : (uint32_t) time + router->lb_time[stop_index] >
+                                      (uint32_t) router->best_time[router->target])) {
+                    #ifdef RRRR_DEBUG_VEHICLE_JOURNEY
+                    fprintf(stderr, "    (lower bound pruning)\n");
+                    #endif
+                    continue;
+                }
+                #endif
+
                 if ((req->time_cutoff != UNREACHED) &&
                     (req->arrive_by ? time < req->time_cutoff
                                     : time > req->time_cutoff)) {
@@ -1200,6 +1379,8 @@ static void router_round(router_t *router, router_request_t *req, uint8_t round)
     unflag_banned_stops(router, req);
     #endif
 
+    if (router->via_ride_time) initialize_via_round (router, req, round);
+
     /* Also updates the list of journey_patterns for next round
      * based on stops that were touched in this round.
      */
@@ -1402,7 +1583,7 @@ static bool initialize_origin_latlon (router_t *router, router_request_t *req) {
         if (req->to_hg_result.hg == NULL) {
             coord_t coord;
             coord_from_latlon (&coord, &req->to_latlon);
-            hashgrid_query (&router->hg, &req->to_hg_result,
+            hashgrid_query (&router->tdata->stop_hashgrid, &req->to_hg_result,
                             coord, req->walk_max_distance);
         }
         return latlon_best_stop_index (router, req, &req->to_hg_result);
@@ -1415,7 +1596,7 @@ static bool initialize_origin_latlon (router_t *router, router_request_t *req) {
         if (req->from_hg_result.hg == NULL ) {
             coord_t coord;
             coord_from_latlon (&coord, &req->from_latlon);
-            hashgrid_query (&router->hg, &req->from_hg_result,
+            hashgrid_query (&router->tdata->stop_hashgrid, &req->from_hg_result,
                             coord, req->walk_max_distance);
         }
         return latlon_best_stop_index (router, req, &req->from_hg_result);
@@ -1434,7 +1615,7 @@ static bool initialize_target_latlon (router_t *router, router_request_t *req) {
         if (req->from_hg_result.hg == NULL) {
             coord_t coord;
             coord_from_latlon (&coord, &req->from_latlon);
-            hashgrid_query (&router->hg, &req->from_hg_result,
+            hashgrid_query (&router->tdata->stop_hashgrid, &req->from_hg_result,
                             coord, req->walk_max_distance);
         }
         hashgrid_result_reset (&req->from_hg_result);
@@ -1448,7 +1629,7 @@ static bool initialize_target_latlon (router_t *router, router_request_t *req) {
         if (req->to_hg_result.hg == NULL ) {
             coord_t coord;
             coord_from_latlon (&coord, &req->to_latlon);
-            hashgrid_query (&router->hg, &req->to_hg_result,
+            hashgrid_query (&router->tdata->stop_hashgrid, &req->to_hg_result,
                             coord, req->walk_max_distance);
         }
         hashgrid_result_reset (&req->to_hg_result);
@@ -1546,6 +1727,185 @@ static bool initialize_target (router_t *router, router_request_t *req) {
     }
 }
 
+#ifdef RRRR_FEATURE_LOWER_BOUND
+/* Compute the lower bounds towards the target for this search. When the
+ * target was found using a coordinate all nearby stops are considered to
+ * be a target, because the search reversal may choose any of them.
+ */
+static void initialize_lowerbound (router_t *router, router_request_t *req) {
+    lowerbound_t *lb;
+    rtime_t max_time = UNREACHED;
+    bool usable;
+
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    /* Realtime stoptimes may be faster than those the graph was built
+     * from, or be part of a forked journey_pattern it lacks. The version
+     * is read before the graph, which is published before the version.
+     */
+    uint32_t rt_version = rrrr_atomic_get (&router->tdata->rt_version);
+    lb = router->tdata->lowerbound;
+    usable = (lb != NULL && lb->rt_version == rt_version);
+    #else
+    lb = router->tdata->lowerbound;
+    usable = (lb != NULL);
+    #endif
+
+    /* Without a graph no stop is pruned */
+    if ( ! (usable && lowerbound_scratch_reserve (&router->lb_scratch, lb))) {
+        rrrr_memset (router->lb_time, UNREACHED, router->tdata->n_stops);
+        return;
+    }
+
+    if (req->time_cutoff != UNREACHED) {
+        if (req->arrive_by ? req->time_cutoff > req->time
+                           : req->time_cutoff < req->time) {
+            max_time = 0;
+        } else {
+            max_time = (rtime_t) (req->arrive_by ? req->time - req->time_cutoff
+                                                 : req->time_cutoff - req->time);
+        }
+    }
+
+    lowerbound_reset (lb, &router->lb_scratch, router->lb_time);
+
+    #ifdef RRRR_FEATURE_LATLON
+    if ((req->to == STOP_NONE || req->from == STOP_NONE) &&
+        router->target != req->via) {
+        hashgrid_result_t *hg_result = (req->arrive_by ? &req->from_hg_result
+                                                       : &req->to_hg_result);
+        if (hg_result->hg != NULL) {
+            double distance;
+            uint32_t stop_index;
+
+            hashgrid_result_reset (hg_result);
+            stop_index = hashgrid_result_next_filtered (hg_result, &distance);
+            while (stop_index != HASHGRID_NONE) {
+                lowerbound_add_target (lb, &router->lb_scratch,
+                                       router->lb_time, (spidx_t) stop_index);
+                stop_index = hashgrid_result_next_filtered (hg_result, &distance);
+            }
+            hashgrid_result_reset (hg_result);
+        }
+    }
+    #endif
+
+    lowerbound_add_target (lb, &router->lb_scratch, router->lb_time,
+                           router->target);
+    lowerbound_compute (lb, &router->lb_scratch, router->lb_time,
+                        req->arrive_by, max_time);
+}
+#endif
+
+/* A via search consists of two chained searches within the same scratch
+ * space. The first leg searches from the origin to the via stop, and keeps
+ * its itineraries in router->via_plan. The second leg searches from the via
+ * stop to the target. It is seeded with the via arrival of every round of
+ * the first leg, so round N of the second leg has made N transfers in total
+ * and the rounds remain comparable with a normal search.
+ */
+static bool router_route_via (router_t *router, router_request_t *req,
+                              uint8_t n_rounds) {
+    rtime_t via_ride_time[RRRR_DEFAULT_MAX_ROUNDS];
+    rtime_t via_walk_time[RRRR_DEFAULT_MAX_ROUNDS];
+    spidx_t origin = router->origin;
+    spidx_t target = router->target;
+    bool ride_overtaken = false;
+    uint8_t i_round;
+
+    router->target = req->via;
+
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    initialize_lowerbound (router, req);
+    #endif
+
+    for (i_round = 0; i_round < n_rounds; ++i_round) {
+        router_round (router, req, i_round);
+    }
+
+    for (i_round = 0; i_round < n_rounds; ++i_round) {
+        uint64_t i_state = ((uint64_t) i_round) * router->tdata->n_stops +
+                           req->via;
+        via_ride_time[i_round] = UNREACHED;
+        via_walk_time[i_round] = UNREACHED;
+        if (router->states_time[i_state] != UNREACHED &&
+            router->states_back_journey_pattern[i_state] != NONE) {
+            via_ride_time[i_round] = router->states_time[i_state];
+        }
+        if (router->states_walk_time[i_state] != UNREACHED &&
+            router->states_walk_from[i_state] != req->via) {
+            via_walk_time[i_round] = router->states_walk_time[i_state];
+            ride_overtaken |= (via_ride_time[i_round] != UNREACHED);
+        }
+    }
+
+    /* The first leg of the search ends at the via stop. It can only be
+     * rendered when the search started at a stop, a search from a
+     * coordinate is only used to find the best stop for the reversal.
+     * When a transfer improved on a ride arrival at the via stop in the
+     * same round, the itineraries ending with those rides are rendered
+     * separately, the second leg may transfer onwards from either.
+     */
+    router->via_plan->n_itineraries = 0;
+    router->via_ride_plan->n_itineraries = 0;
+    if (req->from != STOP_NONE && req->to != STOP_NONE) {
+        router_request_t via_req = *req;
+        if (req->arrive_by) {
+            via_req.from = req->via;
+        } else {
+            via_req.to = req->via;
+        }
+        router_result_to_plan (router->via_plan, router, &via_req);
+
+        if (ride_overtaken) {
+            rtime_t walk_time[RRRR_DEFAULT_MAX_ROUNDS];
+            spidx_t walk_from[RRRR_DEFAULT_MAX_ROUNDS];
+
+            for (i_round = 0; i_round < RRRR_DEFAULT_MAX_ROUNDS; ++i_round) {
+                uint64_t i_state = ((uint64_t) i_round) * router->tdata->n_stops +
+                                   req->via;
+                walk_time[i_round] = router->states_walk_time[i_state];
+                walk_from[i_round] = router->states_walk_from[i_state];
+                router->states_walk_time[i_state] =
+                        (i_round < n_rounds ? via_ride_time[i_round] : UNREACHED);
+                router->states_walk_from[i_state] = req->via;
+            }
+            router_result_to_plan (router->via_ride_plan, router, &via_req);
+            for (i_round = 0; i_round < RRRR_DEFAULT_MAX_ROUNDS; ++i_round) {
+                uint64_t i_state = ((uint64_t) i_round) * router->tdata->n_stops +
+                                   req->via;
+                router->states_walk_time[i_state] = walk_time[i_round];
+                router->states_walk_from[i_state] = walk_from[i_round];
+            }
+        }
+    }
+
+    /* Start over from the via stop, towards the real target */
+    initialize_states (router);
+    rrrr_memset (router->best_time, UNREACHED, router->tdata->n_stops);
+    bitset_clear (router->updated_stops);
+    bitset_clear (router->updated_walk_stops);
+    bitset_clear (router->updated_journey_patterns);
+    router->origin = req->via;
+    router->target = target;
+
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    initialize_lowerbound (router, req);
+    #endif
+
+    if (req->from != STOP_NONE && req->to != STOP_NONE) {
+        initialize_via_walk (router, req, origin);
+    }
+
+    router->via_ride_time = via_ride_time;
+    router->via_walk_time = via_walk_time;
+    for (i_round = 0; i_round < n_rounds; ++i_round) {
+        router_round (router, req, i_round);
+    }
+    router->via_ride_time = NULL;
+    router->via_walk_time = NULL;
+
+    return true;
+}
 
 bool router_route(router_t *router, router_request_t *req) {
     uint8_t i_round, n_rounds;
@@ -1588,6 +1948,16 @@ bool router_route(router_t *router, router_request_t *req) {
         n_rounds = RRRR_DEFAULT_MAX_ROUNDS;
     }
 
+    if (req->via != STOP_NONE && req->from != ONBOARD &&
+        req->via != router->origin && req->via != router->target) {
+        return router_route_via (router, req, n_rounds);
+    }
+
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    /* populate router->lb_time */
+    initialize_lowerbound (router, req);
+    #endif
+
     /*  Iterate over rounds. In round N, we have made N transfers. */
     for (i_round = 0; i_round < n_rounds; ++i_round) {
         router_round(router, req, i_round);
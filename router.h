@@ -10,6 +10,7 @@
 #include "tdata.h"
 #include "bitset.h"
 #include "hashgrid.h"
+#include "lowerbound.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -25,6 +26,9 @@
  * a vehicle_journey can pass through a stop more than once.
  */
 
+/* Defined in router_result.h, used to hold the first leg of a via search */
+struct plan;
+
 /* Scratch space for use by the routing algorithm.
  * Making this opaque requires more dynamic allocation.
  */
@@ -32,6 +36,8 @@ typedef struct router router_t;
 struct router {
     /* The transit / timetable data tables */
     tdata_t *tdata;
+    /* The generation of tdata when the router was setup */
+    uint32_t tdata_generation;
 
     /* The best known time at each stop */
     rtime_t *best_time;
@@ -80,12 +86,33 @@ struct router {
     spidx_t origin;
     spidx_t target;
 
+    /* The itineraries from the origin to the via stop, one per round.
+     * A via search completes these with the second leg of the search.
+     */
+    struct plan *via_plan;
+
+    /* The itineraries from the origin to the via stop ending with a ride,
+     * for the rounds in which a transfer arrived at the via stop earlier.
+     */
+    struct plan *via_ride_plan;
+
+    /* During the second leg of a via search, the time at which the first
+     * leg reached the via stop in each round, either by riding or by a
+     * transfer. Both are NULL during any other search.
+     */
+    rtime_t *via_ride_time;
+    rtime_t *via_walk_time;
+
     calendar_t day_mask;
     serviceday_t servicedays[3];
     uint8_t n_servicedays;
 
-#ifdef RRRR_FEATURE_LATLON
-    hashgrid_t hg;
+#ifdef RRRR_FEATURE_LOWER_BOUND
+    /* The scratch space to search tdata->lowerbound */
+    lowerbound_scratch_t lb_scratch;
+
+    /* The lower bound towards the target for each stop in this search */
+    rtime_t *lb_time;
 #endif
     /* TODO: We should move more routing state in here,
      * like round and sub-scratch pointers.
@@ -100,6 +127,12 @@ void router_reset(router_t *router);
 
 void router_teardown(router_t*);
 
+/* Setup the router again when tdata differs from the timetable it was
+ * setup for, for example after the timetable was swapped. A timetable
+ * loaded at the address of a closed one is told apart by its generation.
+ */
+bool router_refresh(router_t*, tdata_t*);
+
 bool router_route(router_t*, router_request_t*);
 
 #endif /* _ROUTER_H */
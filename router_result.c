@@ -1,7 +1,14 @@
 #include "rrrr_types.h"
 #include "router_result.h"
+#include "router_request.h"
+
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+#include "tdata_realtime_alerts.h"
+#endif
+
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 /* Reverse the times and stops in a leg. Used for creating arrive-by itineraries. */
 static void leg_swap (leg_t *leg) {
@@ -12,6 +19,71 @@ static void leg_swap (leg_t *leg) {
     leg->t1 = temp.t0;
 }
 
+/* Complete an itinerary of a via search with the first leg of the search,
+ * the itinerary from the origin to the via stop using n_rides rides and
+ * reaching the via stop at via_time, by a ride or by a transfer.
+ * The legs are copied in chronological order to the given slot.
+ */
+static bool via_plan_splice (router_t *router, leg_t *slot, uint32_t n_rides,
+                             rtime_t via_time, bool arrive_by) {
+    plan_t *plans[2];
+    uint32_t i_plan;
+
+    plans[0] = router->via_plan;
+    plans[1] = router->via_ride_plan;
+
+    for (i_plan = 0; i_plan < 2; ++i_plan) {
+        uint32_t i_itinerary;
+        for (i_itinerary = 0; i_itinerary < plans[i_plan]->n_itineraries; ++i_itinerary) {
+            itinerary_t *via_itin = plans[i_plan]->itineraries + i_itinerary;
+            rtime_t time = (arrive_by ? via_itin->legs[0].t0
+                                      : via_itin->legs[via_itin->n_legs - 1].t1);
+            if (via_itin->n_rides == n_rides && time == via_time) {
+                memcpy (slot, via_itin->legs, sizeof(leg_t) * via_itin->n_legs);
+                return true;
+            }
+        }
+    }
+
+    fprintf (stderr, "ERROR: via stop was not reached with %d rides.\n", n_rides);
+    return false;
+}
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* The realtime stoptimes a ride used, or NULL when it was routed on the
+ * schedule: each stoptimes are only used on the service days they apply to,
+ * so look for a service day on which they match the times of the ride.
+ */
+static stoptime_t *leg_realtime_stoptimes (router_t *router, bool arrive_by,
+                                           uint32_t vj_index, uint16_t jpp_from,
+                                           uint16_t jpp_to, rtime_t t_from,
+                                           rtime_t t_to) {
+    uint8_t i_serviceday;
+
+    if (router->tdata->vj_stoptimes[vj_index] == NULL) return NULL;
+
+    for (i_serviceday = 0; i_serviceday < router->n_servicedays; ++i_serviceday) {
+        serviceday_t *serviceday = router->servicedays + i_serviceday;
+        stoptime_t *vj_stoptimes;
+
+        if (!serviceday->apply_realtime) continue;
+
+        vj_stoptimes = tdata_rt_stoptimes_for_days (router->tdata, vj_index, serviceday->mask);
+        if (vj_stoptimes == NULL) continue;
+
+        if (arrive_by ?
+            (serviceday->midnight + vj_stoptimes[jpp_from].arrival == t_from ||
+             serviceday->midnight + vj_stoptimes[jpp_to].departure == t_to) :
+            (serviceday->midnight + vj_stoptimes[jpp_from].departure == t_from ||
+             serviceday->midnight + vj_stoptimes[jpp_to].arrival == t_to)) {
+            return vj_stoptimes;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
 /* Checks charateristics that should be the same for all vj plans produced by this router:
    All stops should chain, all times should be increasing, all waits should be at the ends of walk legs, etc.
    Returns true if any of the checks fail, false if no problems are detected. */
@@ -124,6 +196,7 @@ bool router_result_to_plan (struct plan *plan, router_t *router, router_request_
         leg_t *l = itin->legs; /* the slot in which record a leg, reversing them for forward vehicle_journey's */
         uint32_t stop = router->target; /* Work backward from the target to the origin */
         int16_t j_transfer; /* signed int because we will be decreasing */
+        bool via_spliced = false;
 
         i_state = (i_transfer * router->tdata->n_stops) + stop;
 
@@ -171,6 +244,26 @@ bool router_result_to_plan (struct plan *plan, router_t *router, router_request_
             l->vj = WALK;
 
             if (req->arrive_by) leg_swap (l);
+
+            /* The second leg of a via search starts at a state without a
+             * ride, which continues as the first leg of the search. The
+             * legs of the first leg end at the slot of this walk, which
+             * replaces the final walk of the first leg unless it is empty.
+             */
+            if (ride_stop == req->via && router->target != req->via &&
+                router->states_back_journey_pattern[i_ride] == NONE) {
+                leg_t walk = *l;
+                rtime_t via_time = (walk_stop == req->via ?
+                                    router->states_walk_time[i_walk] :
+                                    router->states_time[i_ride]);
+                if (!via_plan_splice (router, (req->arrive_by ? l : itin->legs),
+                                      j_transfer + 1, via_time,
+                                      req->arrive_by)) return false;
+                if (walk.s0 != walk.s1) *l = walk;
+                via_spliced = true;
+                break;
+            }
+
             l += (req->arrive_by ? 1 : -1); /* next leg */
 
             /* Ride phase */
@@ -185,17 +278,22 @@ bool router_result_to_plan (struct plan *plan, router_t *router, router_request_
             {
                 journey_pattern_t *jp;
                 vehicle_journey_t *vj;
+                stoptime_t *vj_stoptimes;
                 uint32_t vj_index;
 
                 jp = router->tdata->journey_patterns + router->states_back_journey_pattern[i_ride];
                 vj_index = jp->vj_ids_offset + router->states_back_vehicle_journey[i_ride];
                 vj = router->tdata->vjs + vj_index;
+                vj_stoptimes = leg_realtime_stoptimes (router, req->arrive_by, vj_index,
+                                                       router->states_back_journey_pattern_point[i_ride],
+                                                       router->states_journey_pattern_point[i_ride],
+                                                       l->t0, l->t1);
 
-                if (router->tdata->vj_stoptimes[vj_index] &&
+                if (vj_stoptimes &&
                     router->tdata->stop_times[vj->stop_times_offset + router->states_journey_pattern_point[i_ride]].arrival != UNREACHED) {
 
-                    l->d0 = RTIME_TO_SEC_SIGNED(router->tdata->vj_stoptimes[vj_index][router->states_back_journey_pattern_point[i_ride]].departure) - RTIME_TO_SEC_SIGNED(router->tdata->stop_times[vj->stop_times_offset + router->states_back_journey_pattern_point[i_ride]].departure + vj->begin_time);
-                    l->d1 = RTIME_TO_SEC_SIGNED(router->tdata->vj_stoptimes[vj_index][router->states_journey_pattern_point[i_ride]].arrival) - RTIME_TO_SEC_SIGNED(router->tdata->stop_times[vj->stop_times_offset + router->states_journey_pattern_point[i_ride]].arrival + vj->begin_time);
+                    l->d0 = RTIME_TO_SEC_SIGNED(vj_stoptimes[router->states_back_journey_pattern_point[i_ride]].departure) - RTIME_TO_SEC_SIGNED(router->tdata->stop_times[vj->stop_times_offset + router->states_back_journey_pattern_point[i_ride]].departure + vj->begin_time);
+                    l->d1 = RTIME_TO_SEC_SIGNED(vj_stoptimes[router->states_journey_pattern_point[i_ride]].arrival) - RTIME_TO_SEC_SIGNED(router->tdata->stop_times[vj->stop_times_offset + router->states_journey_pattern_point[i_ride]].arrival + vj->begin_time);
                 } else {
                     l->d0 = 0;
                     l->d1 = 0;
@@ -207,7 +305,9 @@ bool router_result_to_plan (struct plan *plan, router_t *router, router_request_
             l += (req->arrive_by ? 1 : -1);   /* next leg */
 
         }
-        if (req->onboard_journey_pattern_offset != NONE) {
+        if (via_spliced) {
+            /* The first leg already provides the initial walk */
+        } else if (req->onboard_journey_pattern_offset != NONE) {
             if (!req->arrive_by) {
                 /* Results starting on board do not have an initial walk leg. */
                 l->s0 = l->s1 = ONBOARD;
@@ -245,9 +345,13 @@ bool router_result_to_plan (struct plan *plan, router_t *router, router_request_
 }
 
 static char *
-plan_render_itinerary (struct itinerary *itin, tdata_t *tdata, char *b, char *b_end) {
+plan_render_itinerary (struct itinerary *itin, tdata_t *tdata, time_t midnight, char *b, char *b_end) {
     leg_t *leg;
 
+    #ifndef RRRR_FEATURE_REALTIME_ALERTS
+    UNUSED(midnight);
+    #endif
+
     b += sprintf (b, "\nITIN %d rides \n", itin->n_rides);
 
     /* Render the legs of this itinerary, which are in chronological order */
@@ -296,33 +400,15 @@ plan_render_itinerary (struct itinerary *itin, tdata_t *tdata, char *b, char *b_
             leg_mode = "INVALID";
 
             #ifdef RRRR_FEATURE_REALTIME_ALERTS
-            if (leg->journey_pattern != WALK && tdata->alerts) {
-                size_t i_entity;
-                for (i_entity = 0; i_entity < tdata->alerts->n_entity; ++i_entity) {
-                    if (tdata->alerts->entity[i_entity] &&
-                        tdata->alerts->entity[i_entity]->alert) {
-
-                        TransitRealtime__Alert *alert = tdata->alerts->entity[i_entity]->alert;
-                        size_t i_informed_entity;
-
-                        for (i_informed_entity = 0; i_informed_entity < alert->n_informed_entity; ++i_informed_entity) {
-                            TransitRealtime__EntitySelector *informed_entity = alert->informed_entity[i_informed_entity];
-
-                            if ( ( (!informed_entity->route_id) || ((uint32_t) *(informed_entity->route_id) == leg->journey_pattern) ) &&
-                                ( (!informed_entity->stop_id)  || ((uint32_t) *(informed_entity->stop_id) == leg->s0) ) &&
-                                ( (!informed_entity->trip)     || (!informed_entity->trip->trip_id) || ((uint32_t) *(informed_entity->trip->trip_id) == leg->vj) )
-                                /* TODO: need to have rtime_to_date  for informed_entity->vj->start_date */
-                                /* TODO: need to have rtime_to_epoch for informed_entity->active_period */
-                            ) {
-                                alert_msg = alert->header_text->translation[0]->text;
-                            }
-
-                            if (alert_msg) break;
-                        }
-
-                        /* TODO: theoretically we could have multiple alert messages */
-                        if (alert_msg) break;
-                    }
+            if (tdata->alerts) {
+                /* TODO: need to have rtime_to_date for informed_entity->trip->start_date */
+                TransitRealtime__Alert *alert;
+                alert = tdata_alert_for_leg (tdata, leg->journey_pattern, leg->vj, leg->s0,
+                                             midnight + RTIME_TO_SEC(leg->t0));
+
+                /* TODO: theoretically we could have multiple alert messages */
+                if (alert && alert->header_text && alert->header_text->n_translation > 0) {
+                    alert_msg = alert->header_text->translation[0]->text;
                 }
             }
             #endif
@@ -354,21 +440,24 @@ static uint32_t
 plan_render(plan_t *plan, tdata_t *tdata, router_request_t *req, char *buf, uint32_t buflen) {
     char *b = buf;
     char *b_end = buf + buflen;
+    struct tm ltm;
+    /* The epoch time of rtime 0, midnight before the day of the request */
+    time_t midnight = req_to_epoch (req, tdata, &ltm) - RTIME_TO_SEC(req->time);
 
     if ((req->optimise & o_all) == o_all) {
         /* Iterate over itineraries in this plan, which are in increasing order of number of rides */
         itinerary_t *itin;
         for (itin = plan->itineraries; itin < plan->itineraries + plan->n_itineraries; ++itin) {
-            b = plan_render_itinerary (itin, tdata, b, b_end);
+            b = plan_render_itinerary (itin, tdata, midnight, b, b_end);
         }
     } else if (plan->n_itineraries > 0) {
         if ((req->optimise & o_transfers) == o_transfers) {
             /* only render the first itinerary, which has the least transfers */
-            b = plan_render_itinerary (plan->itineraries, tdata, b, b_end);
+            b = plan_render_itinerary (plan->itineraries, tdata, midnight, b, b_end);
         }
         if ((req->optimise & o_shortest) == o_shortest) {
             /* only render the last itinerary, which has the most rides and is the shortest in time */
-            b = plan_render_itinerary (&plan->itineraries[plan->n_itineraries - 1], tdata, b, b_end);
+            b = plan_render_itinerary (&plan->itineraries[plan->n_itineraries - 1], tdata, midnight, b, b_end);
         }
     }
     *b = '\0';
@@ -2,6 +2,7 @@ import helper
 from utils import *
 import operator
 import sys
+import collections
 
 NUMBER_OF_DAYS = 32
 
@@ -114,6 +115,108 @@ def make_idx(tdata):
     print '--------------------------'
     return index
 
+def journey_pattern_frequency(index,jp):
+    return len(index.vehicle_journeys_in_journey_pattern[jp.uri])
+
+def hilbert_distance(order,x,y):
+    """ Position of cell (x,y) along a Hilbert curve filling a 2^order by 2^order grid. """
+    n = 1 << order
+    d = 0
+    s = n >> 1
+    while s > 0:
+        rx = 1 if (x & s) > 0 else 0
+        ry = 1 if (y & s) > 0 else 0
+        d += s * s * ((3 * rx) ^ ry)
+        if ry == 0:
+            if rx == 1:
+                x = n - 1 - x
+                y = n - 1 - y
+            x, y = y, x
+        s >>= 1
+    return d
+
+def stop_point_order_hilbert(index):
+    """ Order stop_points along a Hilbert curve over their coordinates, so stops close to each other get close indices. """
+    lats = [sp.latitude or 0.0 for sp in index.stop_points]
+    lons = [sp.longitude or 0.0 for sp in index.stop_points]
+    min_lat, max_lat = min(lats), max(lats)
+    min_lon, max_lon = min(lons), max(lons)
+    scale_lat = 65535.0 / ((max_lat - min_lat) or 1.0)
+    scale_lon = 65535.0 / ((max_lon - min_lon) or 1.0)
+    def key(i):
+        x = int((lons[i] - min_lon) * scale_lon)
+        y = int((lats[i] - min_lat) * scale_lat)
+        return (hilbert_distance(16,x,y), i)
+    return [index.stop_points[i] for i in sorted(range(len(index.stop_points)), key=key)]
+
+def stop_point_order_bfs(index):
+    """ Order stop_points by a breadth-first search over journey_patterns, starting at the most frequent one.
+    Every journey_pattern reached at a stop_point contributes its stop_points in sequence, followed by the
+    transfer targets of the stop_point. The stop_points of a pattern scan therefore end up in nearby indices. """
+    seen = set([])
+    order = []
+    queue = collections.deque()
+    def visit(sp):
+        if sp.uri not in seen:
+            seen.add(sp.uri)
+            order.append(sp)
+            queue.append(sp)
+    def jp_key(jp_uri):
+        jp = index.journey_patterns[index.idx_for_journey_pattern_uri[jp_uri]]
+        return (-journey_pattern_frequency(index,jp), index.idx_for_journey_pattern_uri[jp_uri])
+
+    # every journey_pattern may start a new component of the network
+    for jp in sorted(index.journey_patterns, key=lambda jp: jp_key(jp.uri)):
+        for jpp in jp.points:
+            visit(jpp.stop_point)
+        while len(queue) > 0:
+            sp = queue.popleft()
+            for jp_uri in sorted(index.journey_patterns_at_stop_point[sp.uri], key=jp_key):
+                for jpp in index.journey_patterns[index.idx_for_journey_pattern_uri[jp_uri]].points:
+                    visit(jpp.stop_point)
+            for conn in index.connections_from_stop_point.get(sp.uri,[]):
+                visit(conn.to_stop_point)
+    assert len(order) == len(index.stop_points)
+    return order
+
+def renumber_stop_points(index,stop_order):
+    """ Renumber the stop_points for cache locality in the router, which keeps state arrays indexed by stop_point.
+    All later exports look up stop_point indices through idx_for_stop_point_uri, so they follow the new order. """
+    if stop_order == 'bfs':
+        index.stop_points = stop_point_order_bfs(index)
+    elif stop_order == 'hilbert':
+        index.stop_points = stop_point_order_hilbert(index)
+    elif stop_order is not None:
+        print "Unknown stop order %s, keeping the stop_points in insertion order" % (stop_order)
+    index.idx_for_stop_point_uri = {}
+    for sp in index.stop_points:
+        index.idx_for_stop_point_uri[sp.uri] = len(index.idx_for_stop_point_uri)
+
+def reorder_journey_patterns(index,cluster_size=256):
+    """ Reorder the journey_patterns so patterns flagged together in a router round are adjacent in memory.
+    apply_transfers flags the patterns of updated stop_points in stop_point index order, so patterns are
+    clustered by the block of cluster_size stop_point indices holding their first stop_point, after
+    renumber_stop_points has made nearby stop_points share a block. Within a cluster the most frequent
+    patterns come first. The points, vehicle_journeys and timedemandgroups are written in pattern order,
+    timedemandgroups are therefore reordered by their first use. """
+    def jp_key(jp):
+        first = index.idx_for_stop_point_uri[jp.points[0].stop_point.uri]
+        return (first // cluster_size, -journey_pattern_frequency(index,jp), index.idx_for_journey_pattern_uri[jp.uri])
+    index.journey_patterns = sorted(index.journey_patterns, key=jp_key)
+    index.idx_for_journey_pattern_uri = {}
+    for jp in index.journey_patterns:
+        index.idx_for_journey_pattern_uri[jp.uri] = len(index.idx_for_journey_pattern_uri)
+
+    timedemandgroups = []
+    index.idx_for_timedemandgroup_uri = {}
+    for jp in index.journey_patterns:
+        for vj in index.vehicle_journeys_in_journey_pattern[jp.uri]:
+            if vj.timedemandgroup.uri not in index.idx_for_timedemandgroup_uri:
+                index.idx_for_timedemandgroup_uri[vj.timedemandgroup.uri] = len(timedemandgroups)
+                timedemandgroups.append(vj.timedemandgroup)
+    assert len(timedemandgroups) == len(index.timedemandgroups)
+    index.timedemandgroups = timedemandgroups
+
 def write_stop_point_idx(out,index,stop_uri):
     if len(index.stop_points) <= 65535:
         writeshort(out,index.idx_for_stop_point_uri[stop_uri])
@@ -188,7 +291,7 @@ def export_jpp_at_sp(tdata,index,out):
     index.jpp_at_sp_offsets = []
     n_offset = 0
     for sp in index.stop_points:
-        jp_uris = index.journey_patterns_at_stop_point[sp.uri]
+        jp_uris = sorted(index.journey_patterns_at_stop_point[sp.uri], key=lambda jp_uri: index.idx_for_journey_pattern_uri[jp_uri])
         index.jpp_at_sp_offsets.append(n_offset)
         for jp_uri in jp_uris:
             writeint(out,index.idx_for_journey_pattern_uri[jp_uri])
@@ -480,8 +583,11 @@ def write_header (out,index) :
 
 struct_header = Struct('8sQ51I')
 
-def export(tdata):
+def export(tdata,stop_order='bfs',reorder_patterns=True):
     index = make_idx(tdata)
+    renumber_stop_points(index,stop_order)
+    if reorder_patterns:
+        reorder_journey_patterns(index)
     index.dst_mask = 0
     index.calendar_start_time = time.mktime((tdata.validfrom).timetuple())
     index.n_stops = len(index.stop_points)
@@ -0,0 +1,117 @@
+""" Write a TTABLEV4 timetable.
+
+The TTABLEV4 format stores the same columns as TTABLEV3, but every column is
+a section at a 64 byte aligned offset, described by a section directory with
+the number of items, their width and a CRC-32 per section. See tdata_io_v4.h.
+
+The columns are produced by the TTABLEV3 exporter and converted here, so both
+formats always contain the same data.
+"""
+import sys
+import zlib
+from struct import Struct
+
+import timetable3
+
+SECTION_ALIGN = 64
+SECTION_CRITICAL = 0x80000000
+
+struct_header_v3 = Struct('8sQ51I')
+struct_header_v4 = Struct('8sQIIII32x')
+struct_section = Struct('IIQQII')
+
+# (section id, index of n_ in the v3 header counts, width, sentinel items)
+# A width of None is a string table, which stores its width in the first int.
+# A width of 'spidx' is the width of a stop_point index.
+SECTIONS = [
+    (1,  0,  8,       1), # stops
+    (2,  1,  1,       0), # stop_attributes
+    (3,  2,  8,       0), # stop_coords
+    (4,  3,  28,      1), # journey_patterns
+    (5,  4,  'spidx', 0), # journey_pattern_points
+    (6,  5,  1,       0), # journey_pattern_point_attributes
+    (7,  6,  4,       0), # stop_times
+    (8,  7,  8,       0), # vjs
+    (9,  8,  4,       0), # journey_patterns_at_stop
+    (10, 9,  'spidx', 0), # transfer_target_stops
+    (11, 10, 1,       0), # transfer_dist_meters
+    (12, 11, 4,       0), # vj_active
+    (13, 12, 4,       0), # journey_pattern_active
+    (14, 13, None,    0), # platformcodes
+    (15, 14, 1,       0), # stop_names
+    (16, 15, 4,       0), # stop_nameidx
+    (17, 16, None,    0), # agency_ids
+    (18, 17, None,    0), # agency_names
+    (19, 18, None,    0), # agency_urls
+    (20, 19, 1,       0), # headsigns
+    (21, 20, None,    0), # line_codes
+    (22, 21, None,    0), # productcategories
+    (23, 22, None,    0), # line_ids
+    (24, 23, None,    0), # stop_ids
+    (25, 24, None,    0), # vj_ids
+]
+N_COUNTS = 25
+
+def crc32(data):
+    return zlib.crc32(data) & 0xffffffff
+
+def align(pos):
+    return (pos + SECTION_ALIGN - 1) // SECTION_ALIGN * SECTION_ALIGN
+
+def read_sections_v3(data):
+    """ Return (header fields, [(id, n_items, width, bytes)]) of a TTABLEV3 file. """
+    fields = struct_header_v3.unpack_from(data)
+    if fields[0] != 'TTABLEV3':
+        raise ValueError('not a TTABLEV3 timetable')
+    counts = fields[3:3 + N_COUNTS]
+    locs = fields[3 + N_COUNTS:]
+    spidx_width = 2 if counts[0] <= 65535 else 4
+    sections = []
+    for section_id, i, width, sentinel in SECTIONS:
+        n_items = counts[i]
+        loc = locs[i]
+        if width is None:
+            width = Struct('I').unpack_from(data, loc)[0]
+            loc += 4
+        elif width == 'spidx':
+            width = spidx_width
+        size = (n_items + sentinel) * width
+        if loc + size > len(data):
+            raise ValueError('section %d is outside the file' % section_id)
+        sections.append((section_id, n_items, width, data[loc:loc + size]))
+    return fields, sections
+
+def write_v4(out, fields, sections):
+    """ Write the header, the section directory and the 64 byte aligned sections. """
+    loc_sections = struct_header_v4.size
+    offset = align(loc_sections + struct_section.size * len(sections))
+    directory = ''
+    for section_id, n_items, width, payload in sections:
+        directory += struct_section.pack(section_id | SECTION_CRITICAL, crc32(payload),
+                                         offset, len(payload), n_items, width)
+        offset = align(offset + len(payload))
+
+    out.write(struct_header_v4.pack('TTABLEV4', fields[1], fields[2],
+                                    len(sections), loc_sections, crc32(directory)))
+    out.write(directory)
+    for section_id, n_items, width, payload in sections:
+        out.write('\0' * (align(out.tell()) - out.tell()))
+        out.write(payload)
+
+def convert(v3_filename, v4_filename):
+    with open(v3_filename, 'rb') as f:
+        fields, sections = read_sections_v3(f.read())
+    with open(v4_filename, 'wb') as out:
+        write_v4(out, fields, sections)
+
+def export(tdata, stop_order='bfs', reorder_patterns=True):
+    """ Write timetable.dat in the TTABLEV3 format and timetable4.dat in the TTABLEV4 format. """
+    timetable3.export(tdata, stop_order=stop_order, reorder_patterns=reorder_patterns)
+    print "converting timetable.dat to timetable4.dat"
+    convert('timetable.dat', 'timetable4.dat')
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print "Converts a TTABLEV3 timetable to the TTABLEV4 format.\nusage: timetable4.py <timetable.dat> <timetable4.dat>"
+        sys.exit(1)
+    convert(sys.argv[1], sys.argv[2])
@@ -1,7 +1,7 @@
 import unittest
 import helper
 from model.transit import *
-from exporter.timetable3 import export
+from exporter.timetable3 import export, make_idx, renumber_stop_points, reorder_journey_patterns
 import datetime
 
 class TestSequenceFunctions(unittest.TestCase):
@@ -57,5 +57,44 @@ class TestSequenceFunctions(unittest.TestCase):
         vj.finish()
         export(tdata)
 
+    def test_renumber_stop_points(self):
+        tdata = Timetable(datetime.date(2014,1,1))
+        for i in range(6):
+            StopArea(tdata,'SA%d' % i,name='SA%d' % i)
+            StopPoint(tdata,'SP%d' % i,'SA%d' % i,name='SP%d' % i,latitude=52.0+(i % 3)*0.01,longitude=4.0+(i / 3)*0.01)
+        Connection(tdata,'SP2','SP5',120,type=2)
+        Connection(tdata,'SP5','SP2',120,type=2)
+        op = Operator(tdata,'OP1',name='Operator',url='http://www.example.com')
+        for line,stops in (('L1',('SP0','SP3','SP5')),('L2',('SP1','SP4','SP2','SP0'))):
+            l = Line(tdata,line,'OP1',name=line,code=line)
+            r = Route(tdata,'R'+line,line,direction=1,route_type=3)
+            vj = VehicleJourney(tdata,'VJ'+line,'R'+line)
+            vj.setIsValidOn(datetime.date(2014,1,1))
+            t = 900
+            for sp in stops:
+                vj.add_stop(sp,t,t,forboarding=True,foralighting=True,timingpoint=True)
+                t += 300
+            vj.finish()
+
+        for stop_order in (None,'bfs','hilbert'):
+            index = make_idx(tdata)
+            renumber_stop_points(index,stop_order)
+            self.assertEquals(6,len(index.stop_points))
+            self.assertEquals(set(['SP%d' % i for i in range(6)]),set([sp.uri for sp in index.stop_points]))
+            for sp in index.stop_points:
+                self.assertEquals(sp,index.stop_points[index.idx_for_stop_point_uri[sp.uri]])
+
+        # The stops of a journey_pattern reached from a stop follow each other
+        index = make_idx(tdata)
+        renumber_stop_points(index,'bfs')
+        self.assertEquals(['SP0','SP3','SP5','SP1','SP4','SP2'],[sp.uri for sp in index.stop_points])
+
+        # Patterns are clustered by their first stop_point, timedemandgroups follow their first use
+        reorder_journey_patterns(index,cluster_size=1)
+        self.assertEquals(['RL1','RL2'],[jp.route.uri for jp in index.journey_patterns])
+        for jp in index.journey_patterns:
+            self.assertEquals(jp,index.journey_patterns[index.idx_for_journey_pattern_uri[jp.uri]])
+        self.assertEquals([index.vehicle_journeys_in_journey_pattern[jp.uri][0].timedemandgroup for jp in index.journey_patterns],index.timedemandgroups)
+
 if __name__ == '__main__':
     unittest.main()
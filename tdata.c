@@ -8,6 +8,7 @@
 /* top, make sure it works alone */
 #include "tdata.h"
 #include "tdata_io_v3.h"
+#include "tdata_io_v4.h"
 #include "tdata_validation.h"
 #include "rrrr_types.h"
 #include "util.h"
@@ -15,6 +16,9 @@
 #ifdef RRRR_FEATURE_REALTIME_ALERTS
 #include "tdata_realtime_alerts.h"
 #endif
+#ifdef RRRR_FEATURE_LOWER_BOUND
+#include "lowerbound.h"
+#endif
 #ifdef RRRR_FEATURE_REALTIME_EXPANDED
 #include "tdata_realtime_expanded.h"
 #endif
@@ -91,7 +95,23 @@ const char *tdata_platformcode_for_index(tdata_t *td, spidx_t stop_index) {
 }
 
 spidx_t tdata_stopidx_by_stop_name(tdata_t *td, char* stop_name, spidx_t stop_index_offset) {
+    const uint32_t *candidates;
+    uint32_t n_candidates, i;
     spidx_t stop_index;
+
+    /* Only the stops sharing a trigram with stop_name can contain it */
+    if (namesearch_candidates (&td->stopname_search, stop_name,
+                               &candidates, &n_candidates)) {
+        for (i = 0; i < n_candidates; ++i) {
+            if (candidates[i] < stop_index_offset) continue;
+            if (strcasestr(td->stop_names + td->stop_nameidx[candidates[i]],
+                           stop_name)) {
+                return (spidx_t) candidates[i];
+            }
+        }
+        return STOP_NONE;
+    }
+
     for (stop_index = stop_index_offset;
          stop_index < td->n_stops;
          ++stop_index) {
@@ -103,6 +123,21 @@ spidx_t tdata_stopidx_by_stop_name(tdata_t *td, char* stop_name, spidx_t stop_in
     return STOP_NONE;
 }
 
+uint32_t tdata_stopidx_by_stop_name_ranked(tdata_t *td, const char *query, spidx_t *stops, uint32_t k) {
+    uint32_t results[NAMESEARCH_MAX_RESULTS];
+    uint32_t n_results, i;
+
+    n_results = namesearch_find (&td->stopname_search, query, results, k);
+    for (i = 0; i < n_results; ++i) stops[i] = (spidx_t) results[i];
+
+    return n_results;
+}
+
+spidx_t tdata_stopidx_by_stop_id_exact(tdata_t *td, const char *stop_id) {
+    uint32_t stop_index = hashindex_find (&td->stopid_hash, stop_id);
+    return (stop_index == HASHINDEX_NONE ? STOP_NONE : (spidx_t) stop_index);
+}
+
 spidx_t tdata_stopidx_by_stop_id(tdata_t *td, char* stop_id, spidx_t stop_index_offset) {
     spidx_t stop_index;
     for (stop_index = stop_index_offset;
@@ -118,6 +153,11 @@ spidx_t tdata_stopidx_by_stop_id(tdata_t *td, char* stop_id, spidx_t stop_index_
 
 #define tdata_stopidx_by_stop_id(td, stop_id) tdata_stopidx_by_stop_id(td, stop_id, 0)
 
+uint32_t tdata_journey_pattern_idx_by_line_id_exact(tdata_t *td, const char *line_id) {
+    uint32_t jp_index = hashindex_find (&td->lineid_hash, line_id);
+    return (jp_index == HASHINDEX_NONE ? NONE : jp_index);
+}
+
 uint32_t tdata_journey_pattern_idx_by_line_id(tdata_t *td, char *line_id, uint32_t jp_index_offset) {
     uint32_t jp_index;
     for (jp_index = jp_index_offset;
@@ -187,13 +227,89 @@ const char *tdata_agency_url_for_journey_pattern(tdata_t *td, uint32_t jp_index)
     return td->agency_urls + (td->agency_urls_width * (td->journey_patterns)[jp_index].agency_index);
 }
 
+#ifdef RRRR_FEATURE_LATLON
+bool tdata_hashgrid_build (tdata_t *td, hashgrid_t *hg) {
+    coord_t *coords;
+    spidx_t i_stop;
+    bool success;
+
+    coords = (coord_t *) malloc(sizeof(coord_t) * (td->n_stops + 1));
+    if (!coords) return false;
+
+    for (i_stop = 0; i_stop < td->n_stops; ++i_stop) {
+        coord_from_latlon (coords + i_stop, td->stop_coords + i_stop);
+    }
+
+    /* The hashgrid keeps its own copy of the coordinates */
+    success = hashgrid_init (hg, RRRR_HASHGRID_DIM, RRRR_HASHGRID_BIN_METERS,
+                             coords, td->n_stops);
+    free(coords);
+
+    return success;
+}
+#endif
+
 bool tdata_load(tdata_t *td, char *filename) {
-    if ( !tdata_io_v3_load (td, filename)) return false;
+    td->generation = 0;
+    td->sections = NULL;
+    td->n_sections = 0;
+    td->sections_verified = NULL;
+
+    /* A TTABLEV4 timetable may contain the indexes of its ids */
+    hashindex_init (&td->stopid_hash);
+    hashindex_init (&td->lineid_hash);
+    namesearch_init (&td->stopname_search);
+    #ifdef RRRR_FEATURE_LATLON
+    memset (&td->stop_hashgrid, 0, sizeof(hashgrid_t));
+    #endif
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    td->lowerbound = NULL;
+    #endif
+
+    #ifdef RRRR_FEATURE_REALTIME
+    td->stopid_index = NULL;
+    td->vjid_index = NULL;
+    td->lineid_index = NULL;
+    #endif
+
+    if (tdata_io_v4_detect (filename)) {
+        if ( !tdata_io_v4_load (td, filename)) return false;
+    } else {
+        if ( !tdata_io_v3_load (td, filename)) return false;
+    }
+
+    /* Build the hash indexes the timetable lacks */
+    if ((td->stopid_hash.n_slots == 0 &&
+         ! hashindex_build (&td->stopid_hash, td->stop_ids,
+                            td->stop_ids_width, td->n_stops)) ||
+        (td->lineid_hash.n_slots == 0 &&
+         ! hashindex_build (&td->lineid_hash, td->line_ids,
+                            td->line_ids_width, td->n_journey_patterns)) ||
+        (td->stopname_search.block == NULL &&
+         ! namesearch_build (&td->stopname_search, td->stop_names,
+                             td->stop_nameidx, td->n_stops))) {
+        return false;
+    }
+
+    #ifdef RRRR_FEATURE_LATLON
+    if (td->stop_hashgrid.block == NULL &&
+        ! tdata_hashgrid_build (td, &td->stop_hashgrid)) return false;
+    #endif
 
     #ifdef RRRR_FEATURE_REALTIME_EXPANDED
     if ( !tdata_alloc_expanded (td)) return false;
     #endif
 
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    /* Built once for all routers, from the stoptimes without realtime */
+    td->lowerbound = (lowerbound_t *) malloc (sizeof(lowerbound_t));
+    if ( ! (td->lowerbound && lowerbound_init (td->lowerbound, td))) {
+        free (td->lowerbound);
+        td->lowerbound = NULL;
+        return false;
+    }
+    #endif
+
     #ifdef RRRR_FEATURE_REALTIME_ALERTS
     td->alerts = NULL;
     #endif
@@ -202,6 +318,7 @@ bool tdata_load(tdata_t *td, char *filename) {
      * but does page in all the timetable entries.
      */
     #ifdef RRRR_STRICT
+    if ( !tdata_io_v4_verify (td)) return false;
     return tdata_validation_check_coherent(td);
     #else
     return true;
@@ -216,7 +333,25 @@ void tdata_close(tdata_t *td) {
     tdata_clear_gtfsrt_alerts (td);
     #endif
 
-    tdata_io_v3_close (td);
+    hashindex_destroy (&td->stopid_hash);
+    hashindex_destroy (&td->lineid_hash);
+    namesearch_destroy (&td->stopname_search);
+    #ifdef RRRR_FEATURE_LATLON
+    hashgrid_teardown (&td->stop_hashgrid);
+    #endif
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    if (td->lowerbound) {
+        lowerbound_teardown (td->lowerbound);
+        free (td->lowerbound);
+        td->lowerbound = NULL;
+    }
+    #endif
+
+    if (td->sections) {
+        tdata_io_v4_close (td);
+    } else {
+        tdata_io_v3_close (td);
+    }
 }
 
 spidx_t *tdata_points_for_journey_pattern(tdata_t *td, uint32_t jp_index) {
@@ -243,6 +378,22 @@ vehicle_journey_t *tdata_vehicle_journeys_in_journey_pattern(tdata_t *td, uint32
     return td->vjs + td->journey_patterns[jp_index].vj_ids_offset;
 }
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+stoptime_t *tdata_rt_stoptimes_for_days(tdata_t *td, uint32_t vj_index, calendar_t mask) {
+    tdata_rt_stoptimes_t *rt = td->vj_stoptimes[vj_index];
+
+    /* The list is only read from the head this returns, a concurrent
+     * update publishes a new head.
+     */
+    while (rt != NULL) {
+        if (rt->days & mask) return rt->stop_times;
+        rt = rt->next;
+    }
+
+    return NULL;
+}
+#endif
+
 const char *tdata_stop_name_for_index(tdata_t *td, spidx_t stop_index) {
     switch (stop_index) {
     case STOP_NONE :
@@ -304,10 +455,13 @@ void tdata_dump_journey_pattern(tdata_t *td, uint32_t jp_index, uint32_t vj_inde
                    btimetext(times[si].departure + td->vjs[jp.vj_ids_offset + ti].begin_time + RTIME_ONE_DAY, departure));
 
             #ifdef RRRR_FEATURE_REALTIME_EXPANDED
-            if (td->vj_stoptimes && td->vj_stoptimes[jp.vj_ids_offset + ti]) {
-                printf (" %s %s",
-                        btimetext(td->vj_stoptimes[jp.vj_ids_offset + ti][si].arrival + RTIME_ONE_DAY, arrival),
-                        btimetext(td->vj_stoptimes[jp.vj_ids_offset + ti][si].departure + RTIME_ONE_DAY, departure));
+            if (td->vj_stoptimes) {
+                tdata_rt_stoptimes_t *rt;
+                for (rt = td->vj_stoptimes[jp.vj_ids_offset + ti]; rt; rt = rt->next) {
+                    printf (" %s %s",
+                            btimetext(rt->stop_times[si].arrival + RTIME_ONE_DAY, arrival),
+                            btimetext(rt->stop_times[si].departure + RTIME_ONE_DAY, departure));
+                }
             }
             #endif
 
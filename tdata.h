@@ -8,12 +8,19 @@
 #include "config.h"
 #include "geometry.h"
 #include "rrrr_types.h"
+#include "hashindex.h"
+#include "namesearch.h"
 
 #ifdef RRRR_FEATURE_REALTIME
 #include "gtfs-realtime.pb-c.h"
 #include "radixtree.h"
 #endif
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+#include "arena.h"
+#include "bitset.h"
+#endif
+
 #include <stddef.h>
 #include <stdbool.h>
 
@@ -97,10 +104,71 @@ typedef enum journey_pattern_point_attribute {
     rsa_alighting    =   4
 } journey_pattern_point_attribute_t;
 
+/* Defined in tdata_io_v4.h */
+struct tdata_section;
+
+/* Defined in lowerbound.h */
+struct lowerbound;
+
+/* The number of columns which realtime updates change or append to */
+#define TDATA_N_OVERLAYS 8
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* The realtime stoptimes of a vehicle_journey on some of its service days.
+ * A vehicle_journey has a list of these with disjoint days, so an overnight
+ * instance from yesterday and the one of today each have their own. Once
+ * published a tdata_rt_stoptimes_t is never changed: an update replaces the
+ * head of the list, the days and the stoptimes at once.
+ */
+typedef struct tdata_rt_stoptimes tdata_rt_stoptimes_t;
+struct tdata_rt_stoptimes {
+    tdata_rt_stoptimes_t *next;
+    stoptime_t *stop_times;
+    calendar_t days;
+};
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+/* An informed entity of an alert, each of its indices may select any */
+typedef struct alert_selector alert_selector_t;
+struct alert_selector {
+    /* the entity in alert_index_t.msg */
+    uint32_t alert;
+    uint32_t journey_pattern;
+    uint32_t vj_index;
+    uint32_t stop;
+};
+
+/* The selectors of all alerts in a compressed sparse row layout. They are
+ * grouped by the vehicle_journey they select, or else by the stop, or else
+ * by the journey_pattern; the ones selecting none of these come last.
+ */
+typedef struct alert_index alert_index_t;
+struct alert_index {
+    /* the feed holding the alerts */
+    TransitRealtime__FeedMessage *msg;
+    alert_selector_t *selectors;
+    uint32_t *offsets;
+    /* The service days on which NO_SERVICE alerts close a stop, or suspend
+     * a journey_pattern. NULL without any such alerts.
+     */
+    calendar_t *stops_closed;
+    calendar_t *journey_patterns_suspended;
+    /* the sizes of the timetable the groups were made for */
+    uint32_t n_vjs;
+    uint32_t n_stops;
+    uint32_t n_journey_patterns;
+};
+#endif
+
 typedef struct tdata tdata_t;
 struct tdata {
     void *base;
     size_t size;
+    /* Tells apart the timetables loaded into the same memory over time, a
+     * tdata_swap_t reuses its two slots. Zero outside of a tdata_swap_t.
+     */
+    uint32_t generation;
     /* Midnight of the first day in the 32-day calendar in seconds
      * since the epoch, ignores Daylight Saving Time (DST).
      */
@@ -170,19 +238,99 @@ struct tdata {
     char *stop_ids;
     uint32_t vj_ids_width;
     char *vj_ids;
+    /* Exact lookups of stop_ids and line_ids */
+    hashindex_t stopid_hash;
+    hashindex_t lineid_hash;
+    /* Searches in stop_names ignoring case and accents */
+    namesearch_t stopname_search;
+#ifdef RRRR_FEATURE_LATLON
+    /* The stops by their coordinates, shared by all routers */
+    hashgrid_t stop_hashgrid;
+#endif
+#ifdef RRRR_FEATURE_LOWER_BOUND
+    /* The lower bound graph of the stops, shared by all routers */
+    struct lowerbound *lowerbound;
+#endif
+    /* The section directory of a TTABLEV4 timetable, NULL for TTABLEV3.
+     * sections_verified tells for each section if its checksum was checked.
+     */
+    struct tdata_section *sections;
+    uint32_t n_sections;
+    uint8_t *sections_verified;
+    #if defined(RRRR_TDATA_IO_MMAP) && defined(RRRR_FEATURE_REALTIME_EXPANDED)
+    /* The private copy-on-write mappings of the columns realtime changes */
+    void *overlays[TDATA_N_OVERLAYS];
+    size_t overlays_size[TDATA_N_OVERLAYS];
+    uint8_t n_overlays;
+    #endif
     #ifdef RRRR_FEATURE_REALTIME
     radixtree_t *lineid_index;
     radixtree_t *stopid_index;
     radixtree_t *vjid_index;
     #ifdef RRRR_FEATURE_REALTIME_EXPANDED
-    stoptime_t **vj_stoptimes;
+    /* The realtime stoptimes of every vehicle_journey, the scheduled
+     * stoptimes are used on the days none of them apply to.
+     */
+    tdata_rt_stoptimes_t **vj_stoptimes;
+    /* The days of every tdata_rt_stoptimes_t ever published, service days
+     * outside of it are routed on the schedule without looking at
+     * vj_stoptimes at all. It only grows until tdata_clear_gtfsrt.
+     */
+    calendar_t rt_days;
     uint32_t *vjs_in_journey_pattern;
     list_t **rt_journey_patterns_at_stop;
     calendar_t *vj_active_orig;
     calendar_t *journey_pattern_active_orig;
+    /* Delays widen the min_time and max_time of journey_patterns, and can
+     * make their vehicle_journeys overtake each other. The router does not
+     * assume FIFO order for the journey_patterns set in rt_nonfifo.
+     */
+    rtime_t *journey_pattern_min_time_orig;
+    rtime_t *journey_pattern_max_time_orig;
+    rtime_t max_time_orig;
+    bitset_t *rt_nonfifo;
+    uint32_t n_journey_patterns_orig;
+    uint32_t n_journey_pattern_points_orig;
+    uint32_t n_stop_times_orig;
+    uint32_t n_vjs_orig;
+    /* Holds every allocation of the current realtime feed */
+    arena_t rt_arena;
+    /* The arena the realtime data is moved out of, until no router can
+     * refer to it anymore. See tdata_realtime_enter.
+     */
+    arena_t rt_arena_retired;
+    size_t rt_arena_live;
+    bool rt_retired;
+    uint32_t rt_retired_ticket;
+    volatile uint32_t rt_epoch;
+    volatile uint32_t rt_readers[2];
+    /* Odd while realtime stoptimes are being published or removed, and
+     * made even again once per feed. See tdata_realtime_commit.
+     */
+    volatile uint32_t rt_version;
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    /* The lower bound graph replaced by the last commit */
+    struct lowerbound *rt_lowerbound_retired;
+    #endif
+    /* The scheduled vehicle_journeys with realtime changes, and for each
+     * vehicle_journey the hash of the TripUpdate it was changed by, and the
+     * last feed it was part of.
+     */
+    uint32_t *rt_vjs;
+    uint32_t n_rt_vjs;
+    uint32_t *vj_rt_hash;
+    uint32_t *vj_rt_generation;
+    uint32_t rt_generation;
     #endif
     #ifdef RRRR_FEATURE_REALTIME_ALERTS
-    TransitRealtime__FeedMessage *alerts;
+    /* The alerts of the last feed, or NULL. Applying a feed replaces them
+     * with a single pointer store, see tdata_apply_gtfsrt_alerts.
+     */
+    alert_index_t *alerts;
+    /* The alerts replaced by the last feed, until no router can refer to
+     * them anymore.
+     */
+    alert_index_t *rt_alerts_retired;
     #endif
     #endif
 };
@@ -234,8 +382,27 @@ const char *tdata_platformcode_for_index(tdata_t *td, spidx_t stop_index);
 
 spidx_t tdata_stopidx_by_stop_name(tdata_t *td, char* stop_name, spidx_t start_index);
 
+/* Up to k stops whose name contains query, ignoring case and accents, the
+ * best matches first. See namesearch_find for their order.
+ */
+uint32_t tdata_stopidx_by_stop_name_ranked(tdata_t *td, const char *query, spidx_t *stops, uint32_t k);
+
+#ifdef RRRR_FEATURE_LATLON
+/* Build the hashgrid of the stops, as tdata_load does when the timetable
+ * does not contain one.
+ */
+bool tdata_hashgrid_build (tdata_t *td, hashgrid_t *hg);
+#endif
+
+/* The stop with exactly this id, found in constant time, or STOP_NONE */
+spidx_t tdata_stopidx_by_stop_id_exact(tdata_t *td, const char *stop_id);
+
+/* The first stop from start_index whose id contains the given one */
 spidx_t tdata_stopidx_by_stop_id(tdata_t *td, char* stop_id, spidx_t start_index);
 
+/* The first journey_pattern with exactly this line id, or NONE */
+uint32_t tdata_journey_pattern_idx_by_line_id_exact(tdata_t *td, const char *line_id);
+
 uint32_t tdata_journey_pattern_idx_by_line_id(tdata_t *td, char *line_id, uint32_t start_index);
 
 const char *tdata_vehicle_journey_ids_in_journey_pattern(tdata_t *td, uint32_t jp_index);
@@ -263,6 +430,13 @@ vehicle_journey_t *tdata_vehicle_journeys_in_journey_pattern(tdata_t *td, uint32
 
 const char *tdata_stop_desc_for_index(tdata_t *td, spidx_t stop_index);
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* The realtime stoptimes of a vehicle_journey on one of the days in mask,
+ * or NULL when it runs on the schedule.
+ */
+stoptime_t *tdata_rt_stoptimes_for_days(tdata_t *td, uint32_t vj_index, calendar_t mask);
+#endif
+
 rtime_t transfer_duration (tdata_t *tdata, router_request_t *req, spidx_t stop_index_from, spidx_t stop_index_to);
 
 const char *tdata_stop_name_for_index(tdata_t *td, spidx_t stop_index);
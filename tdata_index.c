@@ -0,0 +1,321 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_index.c : add the indexes of the ids to a TTABLEV4 timetable
+ *
+ * Without them every process using realtime data builds a radixtree of
+ * the stop, vehicle_journey and line ids at startup, and every process
+ * hashes the stop and line ids, indexes the stop names and bins the stops
+ * in a hashgrid. With them the loaders use the indexes in the file, the
+ * mmap loader shares them between all processes mapping the timetable.
+ *
+ *     tdata_index timetable.dat [indexed.dat]
+ *
+ * The sections are appended to the timetable, followed by a new section
+ * directory. Indexes from an earlier run are replaced.
+ */
+
+#include "tdata_io_v4.h"
+#include "radixtree.h"
+#include "hashindex.h"
+#include "namesearch.h"
+#include "hashgrid.h"
+#include "geometry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef enum tdata_index_kind {
+    INDEX_RADIXTREE,
+    INDEX_HASH,
+    INDEX_NAMES,
+    INDEX_HASHGRID
+} tdata_index_kind_t;
+
+typedef struct tdata_index tdata_index_t;
+struct tdata_index {
+    tdata_section_id_t ids;
+    tdata_section_id_t index;
+    tdata_index_kind_t kind;
+};
+
+static const tdata_index_t indexes[] = {
+    { TDATA_SECTION_STOP_IDS,   TDATA_SECTION_STOP_ID_INDEX,    INDEX_RADIXTREE },
+    { TDATA_SECTION_VJ_IDS,     TDATA_SECTION_VJ_ID_INDEX,      INDEX_RADIXTREE },
+    { TDATA_SECTION_LINE_IDS,   TDATA_SECTION_LINE_ID_INDEX,    INDEX_RADIXTREE },
+    { TDATA_SECTION_STOP_IDS,   TDATA_SECTION_STOP_ID_HASH,     INDEX_HASH },
+    { TDATA_SECTION_LINE_IDS,   TDATA_SECTION_LINE_ID_HASH,     INDEX_HASH },
+    { TDATA_SECTION_STOP_NAMES, TDATA_SECTION_STOP_NAME_SEARCH, INDEX_NAMES },
+    { TDATA_SECTION_STOP_COORDS, TDATA_SECTION_STOP_HASHGRID,   INDEX_HASHGRID }
+};
+
+static const uint32_t index_widths[] = {
+    sizeof(rxt_edge_t), sizeof(uint32_t), sizeof(uint8_t), sizeof(uint8_t)
+};
+
+static const char *index_units[] = {
+    "edges", "slots", "bytes", "bytes"
+};
+
+#define N_INDEXES (sizeof(indexes) / sizeof(tdata_index_t))
+
+static const char padding[TDATA_SECTION_ALIGN];
+
+/* Write size bytes, after padding the file up to the next section */
+static bool write_section (FILE *fp, uint64_t *offset, const void *data, uint64_t size) {
+    uint64_t aligned = (*offset + TDATA_SECTION_ALIGN - 1) &
+                       ~((uint64_t) TDATA_SECTION_ALIGN - 1);
+
+    if (fwrite (padding, 1, (size_t) (aligned - *offset), fp) != (size_t) (aligned - *offset) ||
+        fwrite (data, 1, (size_t) size, fp) != (size_t) size) return false;
+
+    *offset = aligned + size;
+    return true;
+}
+
+/* The radixtree of the strings of a section, NULL on failure */
+static void *index_strings (char *data, tdata_section_t *section,
+                            uint32_t *n_edges) {
+    radixtree_t *r;
+    rxt_edge_t *edges;
+
+    r = radixtree_load_strings_from_tdata (data + section->offset,
+                                           section->width, section->n_items);
+    if (r == NULL) return NULL;
+
+    *n_edges = radixtree_flatten (r, NULL);
+    edges = (rxt_edge_t *) malloc (sizeof(rxt_edge_t) * *n_edges);
+    if (edges) radixtree_flatten (r, edges);
+
+    radixtree_destroy (r);
+    return edges;
+}
+
+/* The hash slots of the strings of a section, NULL on failure */
+static void *hash_strings (char *data, tdata_section_t *section,
+                           uint32_t *n_slots) {
+    hashindex_t hi;
+
+    if ( ! hashindex_build (&hi, data + section->offset,
+                            section->width, section->n_items)) return NULL;
+
+    *n_slots = hi.n_slots;
+    return hi.slots;
+}
+
+/* The name search block of the stop names, NULL on failure */
+static void *search_names (char *data, tdata_section_t *sections,
+                           uint32_t n_sections, uint32_t *size) {
+    tdata_section_t *stops = tdata_io_v4_section (sections, n_sections,
+                                                  TDATA_SECTION_STOPS);
+    tdata_section_t *names = tdata_io_v4_section (sections, n_sections,
+                                                  TDATA_SECTION_STOP_NAMES);
+    tdata_section_t *nameidx = tdata_io_v4_section (sections, n_sections,
+                                                    TDATA_SECTION_STOP_NAMEIDX);
+    namesearch_t ns;
+
+    /* The name index may end with a sentinel, a name per stop is indexed */
+    if (stops == NULL || names == NULL || nameidx == NULL ||
+        nameidx->n_items < stops->n_items ||
+        ! namesearch_build (&ns, data + names->offset,
+                            (uint32_t *) (data + nameidx->offset),
+                            stops->n_items)) return NULL;
+
+    *size = (uint32_t) ns.size;
+    return ns.block;
+}
+
+/* The hashgrid block of the stop coordinates, NULL on failure */
+static void *bin_coords (char *data, tdata_section_t *section, uint32_t *size) {
+    latlon_t *latlons = (latlon_t *) (data + section->offset);
+    coord_t *coords;
+    hashgrid_t hg;
+    uint32_t i;
+    bool success;
+
+    coords = (coord_t *) malloc (sizeof(coord_t) * (section->n_items + 1));
+    if (!coords) return NULL;
+
+    for (i = 0; i < section->n_items; ++i) coord_from_latlon (coords + i, latlons + i);
+
+    success = hashgrid_init (&hg, RRRR_HASHGRID_DIM, RRRR_HASHGRID_BIN_METERS,
+                             coords, section->n_items);
+    free (coords);
+    if (!success) return NULL;
+
+    *size = (uint32_t) hg.size;
+    return hg.block;
+}
+
+int main (int argc, char **argv) {
+    char *input, *output, *tmp = NULL;
+    char *data = NULL;
+    FILE *fp = NULL;
+    struct stat st;
+    tdata_v4_header_t header;
+    tdata_section_t *sections, *directory = NULL;
+    void *items[N_INDEXES];
+    uint32_t n_items[N_INDEXES];
+    uint32_t i_section, n_directory = 0;
+    uint64_t offset = sizeof(tdata_v4_header_t);
+    size_t i;
+    int status = EXIT_FAILURE;
+
+    if (argc < 2) {
+        fprintf (stderr, "Usage: %s timetable.dat [indexed.dat]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    input = argv[1];
+    output = (argc > 2 ? argv[2] : argv[1]);
+    memset (items, 0, sizeof(items));
+
+    if (stat (input, &st) == -1 ||
+        (uint64_t) st.st_size < sizeof(tdata_v4_header_t)) {
+        fprintf (stderr, "The input file %s could not be read.\n", input);
+        return EXIT_FAILURE;
+    }
+
+    data = (char *) malloc ((size_t) st.st_size);
+    fp = fopen (input, "rb");
+    if (!data || !fp ||
+        fread (data, 1, (size_t) st.st_size, fp) != (size_t) st.st_size) {
+        fprintf (stderr, "The input file %s could not be read.\n", input);
+        goto clean_exit;
+    }
+    fclose (fp);
+    fp = NULL;
+
+    memcpy (&header, data, sizeof(tdata_v4_header_t));
+    if ( ! tdata_io_v4_check_header (&header, st.st_size, input)) goto clean_exit;
+
+    sections = (tdata_section_t *) (data + header.loc_sections);
+    if (tdata_io_v4_crc32 (0, sections, sizeof(tdata_section_t) * header.n_sections) !=
+        header.crc_sections) {
+        fprintf (stderr, "The section directory of %s is corrupt.\n", input);
+        goto clean_exit;
+    }
+
+    if ( ! tdata_io_v4_check_sections (sections, header.n_sections, st.st_size, input)) {
+        goto clean_exit;
+    }
+
+    directory = (tdata_section_t *) calloc (header.n_sections + N_INDEXES,
+                                            sizeof(tdata_section_t));
+    if (!directory) goto clean_exit;
+
+    /* Keep every section but the indexes we are about to replace */
+    for (i_section = 0; i_section < header.n_sections; ++i_section) {
+        uint32_t id = sections[i_section].id & ~TDATA_SECTION_CRITICAL;
+        bool replaced = false;
+        for (i = 0; i < N_INDEXES; ++i) replaced |= (id == (uint32_t) indexes[i].index);
+        if (replaced) continue;
+
+        directory[n_directory++] = sections[i_section];
+        if (sections[i_section].offset + sections[i_section].size > offset) {
+            offset = sections[i_section].offset + sections[i_section].size;
+        }
+    }
+
+    for (i = 0; i < N_INDEXES; ++i) {
+        tdata_section_t *ids = tdata_io_v4_section (sections, header.n_sections, indexes[i].ids);
+        switch (indexes[i].kind) {
+        case INDEX_RADIXTREE:
+            items[i] = index_strings (data, ids, &n_items[i]);
+            break;
+        case INDEX_HASH:
+            items[i] = hash_strings (data, ids, &n_items[i]);
+            break;
+        case INDEX_NAMES:
+            items[i] = search_names (data, sections, header.n_sections, &n_items[i]);
+            break;
+        case INDEX_HASHGRID:
+            items[i] = bin_coords (data, ids, &n_items[i]);
+            break;
+        }
+        if (!items[i]) {
+            fprintf (stderr, "The index of section %u could not be built.\n", indexes[i].ids);
+            goto clean_exit;
+        }
+    }
+
+    tmp = (char *) malloc (strlen (output) + 5);
+    if (!tmp) goto clean_exit;
+    sprintf (tmp, "%s.tmp", output);
+
+    fp = fopen (tmp, "wb");
+    if (!fp) {
+        fprintf (stderr, "The output file %s could not be created.\n", tmp);
+        goto clean_exit;
+    }
+
+    /* The sections we keep are copied unchanged, the header last */
+    if (fwrite (data, 1, (size_t) offset, fp) != (size_t) offset) goto fail_write;
+
+    for (i = 0; i < N_INDEXES; ++i) {
+        tdata_section_t *section = directory + n_directory++;
+        uint32_t width = index_widths[indexes[i].kind];
+        uint64_t size = width * (uint64_t) n_items[i];
+
+        if ( ! write_section (fp, &offset, items[i], size)) goto fail_write;
+
+        section->id = indexes[i].index;
+        section->crc = tdata_io_v4_crc32 (0, items[i], size);
+        section->offset = offset - size;
+        section->size = size;
+        section->n_items = n_items[i];
+        section->width = width;
+    }
+
+    if ( ! write_section (fp, &offset, directory, sizeof(tdata_section_t) * n_directory)) {
+        goto fail_write;
+    }
+
+    if (offset - sizeof(tdata_section_t) * n_directory > UINT32_MAX) {
+        fprintf (stderr, "The section directory can not be stored beyond 4GB.\n");
+        goto fail_write;
+    }
+
+    header.n_sections = n_directory;
+    header.loc_sections = (uint32_t) (offset - sizeof(tdata_section_t) * n_directory);
+    header.crc_sections = tdata_io_v4_crc32 (0, directory, sizeof(tdata_section_t) * n_directory);
+
+    if (fseek (fp, 0, SEEK_SET) != 0 ||
+        fwrite (&header, sizeof(tdata_v4_header_t), 1, fp) != 1) goto fail_write;
+
+    if (fclose (fp) != 0) {
+        fp = NULL;
+        goto fail_write;
+    }
+    fp = NULL;
+
+    if (rename (tmp, output) != 0) goto fail_write;
+
+    for (i = 0; i < N_INDEXES; ++i) {
+        fprintf (stderr, "section %u: %u %s\n", indexes[i].index, n_items[i],
+                         index_units[indexes[i].kind]);
+    }
+
+    status = EXIT_SUCCESS;
+    goto clean_exit;
+
+fail_write:
+    fprintf (stderr, "The output file %s could not be written.\n", tmp);
+    if (fp) fclose (fp);
+    fp = NULL;
+    remove (tmp);
+
+clean_exit:
+    if (fp) fclose (fp);
+    for (i = 0; i < N_INDEXES; ++i) free (items[i]);
+    free (directory);
+    free (tmp);
+    free (data);
+
+    return status;
+}
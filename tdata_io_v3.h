@@ -66,3 +66,13 @@ struct tdata_header {
 
 bool tdata_io_v3_load(tdata_t *td, char* filename);
 void tdata_io_v3_close(tdata_t *td);
+
+#if defined(RRRR_TDATA_IO_MMAP) && defined(RRRR_FEATURE_REALTIME_EXPANDED)
+/* Map size bytes at offset of the timetable file privately, followed by
+ * zeroed memory up to RRRR_DYNAMIC_SLACK times size. Pages are shared with
+ * the page cache until realtime updates write to them.
+ */
+void *tdata_io_mmap_overlay(tdata_t *td, int fd, uint64_t offset, uint64_t size);
+
+void tdata_io_mmap_overlay_close(tdata_t *td);
+#endif
@@ -28,6 +28,67 @@
     td->storage##_width = *((uint32_t *) (((char *) b) + header->loc_##storage)); \
     td->storage = (char*) (((char *) b) + header->loc_##storage + sizeof(uint32_t))
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* Columns which realtime updates change or append to */
+#define load_mmap_overlay(b, storage, type) \
+    td->n_##storage = header->n_##storage; \
+    td->storage = (type *) tdata_io_mmap_overlay (td, fd, header->loc_##storage, sizeof(type) * (td->n_##storage + 1)); \
+    if (!td->storage) goto fail_munmap_overlays
+
+#define load_mmap_string_overlay(b, storage) \
+    load_mmap_string (b, storage); \
+    td->storage = (char *) tdata_io_mmap_overlay (td, fd, header->loc_##storage + sizeof(uint32_t), ((uint64_t) td->n_##storage) * td->storage##_width); \
+    if (!td->storage) goto fail_munmap_overlays
+#else
+#define load_mmap_overlay(b, storage, type) load_mmap (b, storage, type)
+#define load_mmap_string_overlay(b, storage) load_mmap_string (b, storage)
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+void *tdata_io_mmap_overlay(tdata_t *td, int fd, uint64_t offset, uint64_t size) {
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - (offset % page);
+    uint64_t length = (offset - start) + size;
+    uint64_t reserve = (offset - start) + size * RRRR_DYNAMIC_SLACK;
+    char *region;
+    int fd_zero;
+
+    if (td->n_overlays == TDATA_N_OVERLAYS) return NULL;
+
+    length = (length + page - 1) / page * page;
+    reserve = (reserve + page - 1) / page * page;
+    if (reserve == 0) reserve = page;
+
+    /* Reserve zeroed private memory for the whole column and its slack,
+     * then replace its start with a private mapping of the file.
+     */
+    fd_zero = open("/dev/zero", O_RDWR);
+    if (fd_zero == -1) return NULL;
+    region = (char *) mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd_zero, 0);
+    close (fd_zero);
+    if (region == MAP_FAILED) return NULL;
+
+    if (length > 0 &&
+        mmap(region, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, start) == MAP_FAILED) {
+        munmap(region, reserve);
+        return NULL;
+    }
+
+    td->overlays[td->n_overlays] = region;
+    td->overlays_size[td->n_overlays] = reserve;
+    td->n_overlays++;
+
+    return region + (offset - start);
+}
+
+void tdata_io_mmap_overlay_close(tdata_t *td) {
+    while (td->n_overlays) {
+        td->n_overlays--;
+        munmap(td->overlays[td->n_overlays], td->overlays_size[td->n_overlays]);
+    }
+}
+#endif
+
 /* Set the maximum drivetime of any day in tdata */
 void set_max_time(tdata_t *td){
     uint32_t jp_index;
@@ -71,27 +132,30 @@ bool tdata_io_v3_load(tdata_t *td, char *filename) {
 
     td->calendar_start_time = header->calendar_start_time;
     td->dst_active = header->dst_active;
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    td->n_overlays = 0;
+    #endif
 
     load_mmap (td->base, stops, stop_t);
     load_mmap (td->base, stop_attributes, uint8_t);
     load_mmap (td->base, stop_coords, latlon_t);
-    load_mmap (td->base, journey_patterns, journey_pattern_t);
-    load_mmap (td->base, journey_pattern_points, spidx_t);
-    load_mmap (td->base, journey_pattern_point_attributes, uint8_t);
-    load_mmap (td->base, stop_times, stoptime_t);
-    load_mmap (td->base, vjs, vehicle_journey_t);
+    load_mmap_overlay (td->base, journey_patterns, journey_pattern_t);
+    load_mmap_overlay (td->base, journey_pattern_points, spidx_t);
+    load_mmap_overlay (td->base, journey_pattern_point_attributes, uint8_t);
+    load_mmap_overlay (td->base, stop_times, stoptime_t);
+    load_mmap_overlay (td->base, vjs, vehicle_journey_t);
     load_mmap (td->base, journey_patterns_at_stop, uint32_t);
     load_mmap (td->base, transfer_target_stops, spidx_t);
     load_mmap (td->base, transfer_dist_meters, uint8_t);
-    load_mmap (td->base, vj_active, calendar_t);
-    load_mmap (td->base, journey_pattern_active, calendar_t);
+    load_mmap_overlay (td->base, vj_active, calendar_t);
+    load_mmap_overlay (td->base, journey_pattern_active, calendar_t);
     load_mmap (td->base, headsigns, char);
     load_mmap (td->base, stop_names, char);
     load_mmap (td->base, stop_nameidx, uint32_t);
 
     load_mmap_string (td->base, platformcodes);
     load_mmap_string (td->base, stop_ids);
-    load_mmap_string (td->base, vj_ids);
+    load_mmap_string_overlay (td->base, vj_ids);
     load_mmap_string (td->base, agency_ids);
     load_mmap_string (td->base, agency_names);
     load_mmap_string (td->base, agency_urls);
@@ -109,6 +173,11 @@ bool tdata_io_v3_load(tdata_t *td, char *filename) {
 
     return true;
 
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+fail_munmap_overlays:
+    tdata_io_mmap_overlay_close (td);
+#endif
+
 fail_munmap_base:
     munmap(td->base, td->size);
 
@@ -119,6 +188,9 @@ fail_close_fd:
 }
 
 void tdata_io_v3_close(tdata_t *td) {
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    tdata_io_mmap_overlay_close (td);
+    #endif
     munmap(td->base, td->size);
 }
 
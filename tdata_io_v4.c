@@ -0,0 +1,271 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_io_v4.c : the parts of the TTABLEV4 format shared by both loaders */
+
+#include "tdata_io_v4.h"
+#include "tdata.h"
+#include "radixtree.h"
+#include "rrrr_types.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* The width of the items in the sections this reader understands,
+ * indexed by tdata_section_id_t. Zero is used for string tables, which
+ * store their own width. The sentinel is an extra item after n_items.
+ */
+typedef struct tdata_section_format tdata_section_format_t;
+struct tdata_section_format {
+    uint32_t width;
+    uint32_t sentinel;
+};
+
+static const tdata_section_format_t section_formats[] = {
+    { 0, 0 },                                 /* no section 0 */
+    { sizeof(stop_t), 1 },                    /* STOPS */
+    { sizeof(uint8_t), 0 },                   /* STOP_ATTRIBUTES */
+    { sizeof(latlon_t), 0 },                  /* STOP_COORDS */
+    { sizeof(journey_pattern_t), 1 },         /* JOURNEY_PATTERNS */
+    { sizeof(spidx_t), 0 },                   /* JOURNEY_PATTERN_POINTS */
+    { sizeof(uint8_t), 0 },                   /* JOURNEY_PATTERN_POINT_ATTRIBUTES */
+    { sizeof(stoptime_t), 0 },                /* STOP_TIMES */
+    { sizeof(vehicle_journey_t), 0 },         /* VJS */
+    { sizeof(uint32_t), 0 },                  /* JOURNEY_PATTERNS_AT_STOP */
+    { sizeof(spidx_t), 0 },                   /* TRANSFER_TARGET_STOPS */
+    { sizeof(uint8_t), 0 },                   /* TRANSFER_DIST_METERS */
+    { sizeof(calendar_t), 0 },                /* VJ_ACTIVE */
+    { sizeof(calendar_t), 0 },                /* JOURNEY_PATTERN_ACTIVE */
+    { 0, 0 },                                 /* PLATFORMCODES */
+    { sizeof(char), 0 },                      /* STOP_NAMES */
+    { sizeof(uint32_t), 0 },                  /* STOP_NAMEIDX */
+    { 0, 0 },                                 /* AGENCY_IDS */
+    { 0, 0 },                                 /* AGENCY_NAMES */
+    { 0, 0 },                                 /* AGENCY_URLS */
+    { sizeof(char), 0 },                      /* HEADSIGNS */
+    { 0, 0 },                                 /* LINE_CODES */
+    { 0, 0 },                                 /* PRODUCTCATEGORIES */
+    { 0, 0 },                                 /* LINE_IDS */
+    { 0, 0 },                                 /* STOP_IDS */
+    { 0, 0 },                                 /* VJ_IDS */
+    { sizeof(rxt_edge_t), 0 },                /* STOP_ID_INDEX */
+    { sizeof(rxt_edge_t), 0 },                /* VJ_ID_INDEX */
+    { sizeof(rxt_edge_t), 0 },                /* LINE_ID_INDEX */
+    { sizeof(uint32_t), 0 },                  /* STOP_ID_HASH */
+    { sizeof(uint32_t), 0 },                  /* LINE_ID_HASH */
+    { sizeof(uint8_t), 0 },                   /* STOP_NAME_SEARCH */
+    { sizeof(uint8_t), 0 }                    /* STOP_HASHGRID */
+};
+
+#define N_SECTION_FORMATS (sizeof(section_formats) / sizeof(tdata_section_format_t))
+
+/* CRC-32 as used by zlib and the exporter, computed bytewise. The table
+ * holds the CRC of every byte for the reflected polynomial 0xEDB88320.
+ */
+static const uint32_t crc_table[256] = {
+    0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+    0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+    0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+    0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+    0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+    0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+    0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+    0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+    0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+    0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+    0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+    0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+    0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+    0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+    0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+    0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+    0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+    0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+    0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+    0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+    0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+    0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
+
+uint32_t tdata_io_v4_crc32 (uint32_t crc, const void *data, uint64_t size) {
+    const uint8_t *b = (const uint8_t *) data;
+    const uint8_t *b_end = b + size;
+
+    crc = crc ^ 0xFFFFFFFF;
+    while (b < b_end) {
+        crc = crc_table[(crc ^ *b++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+bool tdata_io_v4_detect (char *filename) {
+    char version_string[8];
+    bool result;
+    int fd = open (filename, O_RDONLY);
+
+    if (fd == -1) return false;
+
+    result = (read (fd, version_string, 8) == 8 &&
+              strncmp (TDATA_V4_VERSION, version_string, 8) == 0);
+    close (fd);
+
+    return result;
+}
+
+bool tdata_io_v4_check_header (tdata_v4_header_t *header, uint64_t file_size,
+                               char *filename) {
+    if (strncmp (TDATA_V4_VERSION, header->version_string, 8)) {
+        fprintf (stderr, "The input file %s does not appear to be a timetable or is of the wrong version.\n", filename);
+        return false;
+    }
+
+    if (header->n_sections == 0 ||
+        header->n_sections > (UINT32_MAX / sizeof(tdata_section_t)) ||
+        header->loc_sections < sizeof(tdata_v4_header_t) ||
+        ((uint64_t) header->loc_sections) +
+        ((uint64_t) header->n_sections) * sizeof(tdata_section_t) > file_size) {
+        fprintf (stderr, "The input file %s has an invalid section directory.\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool tdata_io_v4_check_sections (tdata_section_t *sections,
+                                 uint32_t n_sections, uint64_t file_size,
+                                 char *filename) {
+    uint32_t i_section;
+    uint32_t id;
+
+    for (i_section = 0; i_section < n_sections; ++i_section) {
+        tdata_section_t *section = sections + i_section;
+        uint64_t n_bytes;
+
+        id = section->id & ~TDATA_SECTION_CRITICAL;
+        if (section->offset % TDATA_SECTION_ALIGN != 0 ||
+            section->offset > file_size ||
+            section->size > file_size - section->offset) {
+            fprintf (stderr, "The input file %s has a section %u outside the file.\n",
+                             filename, id);
+            return false;
+        }
+
+        if (id == 0 || id >= N_SECTION_FORMATS) {
+            if (section->id & TDATA_SECTION_CRITICAL) {
+                fprintf (stderr, "The input file %s requires section %u, which is not supported.\n",
+                                 filename, id);
+                return false;
+            }
+            /* an optional section from a newer exporter */
+            continue;
+        }
+
+        if (section_formats[id].width == 0) {
+            /* string tables */
+            if (!(section->width > 0 && section->width < UINT16_MAX)) goto fail_width;
+        } else if (section->width != section_formats[id].width) {
+            goto fail_width;
+        }
+
+        n_bytes = (((uint64_t) section->n_items) + section_formats[id].sentinel) *
+                  section->width;
+        if (section->size < n_bytes) {
+            fprintf (stderr, "The input file %s has a truncated section %u.\n",
+                             filename, id);
+            return false;
+        }
+    }
+
+    /* All sections this reader understands are required, but the indexes */
+    for (id = 1; id <= TDATA_SECTION_LAST_REQUIRED; ++id) {
+        if (tdata_io_v4_section (sections, n_sections, (tdata_section_id_t) id) == NULL) {
+            fprintf (stderr, "The input file %s misses section %u.\n", filename, id);
+            return false;
+        }
+    }
+
+    return true;
+
+fail_width:
+    fprintf (stderr, "The input file %s has a section %u with an unexpected width.\n",
+                     filename, id);
+    return false;
+}
+
+tdata_section_t *tdata_io_v4_section (tdata_section_t *sections,
+                                      uint32_t n_sections,
+                                      tdata_section_id_t id) {
+    uint32_t i_section;
+
+    for (i_section = 0; i_section < n_sections; ++i_section) {
+        if ((sections[i_section].id & ~TDATA_SECTION_CRITICAL) == (uint32_t) id) {
+            return sections + i_section;
+        }
+    }
+
+    return NULL;
+}
+
+bool tdata_io_v4_verify_section (tdata_t *td, tdata_section_id_t id) {
+    tdata_section_t *section;
+    uint32_t i_section;
+
+    if (td->sections == NULL) return true;
+
+    section = tdata_io_v4_section (td->sections, td->n_sections, id);
+    if (section == NULL) return true;
+
+    i_section = (uint32_t) (section - td->sections);
+    if (td->sections_verified[i_section]) return true;
+
+    if (tdata_io_v4_crc32 (0, ((char *) td->base) + section->offset,
+                           section->size) != section->crc) {
+        fprintf (stderr, "The checksum of section %u does not match.\n",
+                         section->id & ~TDATA_SECTION_CRITICAL);
+        return false;
+    }
+
+    td->sections_verified[i_section] = true;
+
+    return true;
+}
+
+bool tdata_io_v4_verify (tdata_t *td) {
+    uint32_t i_section;
+
+    for (i_section = 0; i_section < td->n_sections; ++i_section) {
+        tdata_section_id_t id = (tdata_section_id_t)
+                    (td->sections[i_section].id & ~TDATA_SECTION_CRITICAL);
+        if ( ! tdata_io_v4_verify_section (td, id)) return false;
+    }
+
+    return true;
+}
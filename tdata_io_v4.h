@@ -0,0 +1,139 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_io_v4.h : the TTABLEV4 timetable format
+ *
+ * A TTABLEV4 file starts with a 64 byte header, followed by a directory of
+ * sections. Every section is a single column, stored at a 64 byte aligned
+ * offset, with its own CRC-32. The directory describes the number of items
+ * in a section and their width, so a reader can validate a section against
+ * the structs it was compiled with, and can skip sections it does not know.
+ * Sections with the TDATA_SECTION_CRITICAL bit in their id must be
+ * understood by a reader, all other unknown sections are optional.
+ */
+
+#ifndef _TDATA_IO_V4_H
+#define _TDATA_IO_V4_H
+
+#include "rrrr_types.h"
+#include "tdata.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TDATA_V4_VERSION "TTABLEV4"
+
+/* The alignment of every section, in bytes */
+#define TDATA_SECTION_ALIGN 64
+
+/* A reader must fail on an unknown section with this bit set */
+#define TDATA_SECTION_CRITICAL 0x80000000
+
+typedef enum tdata_section_id {
+    TDATA_SECTION_STOPS = 1,
+    TDATA_SECTION_STOP_ATTRIBUTES,
+    TDATA_SECTION_STOP_COORDS,
+    TDATA_SECTION_JOURNEY_PATTERNS,
+    TDATA_SECTION_JOURNEY_PATTERN_POINTS,
+    TDATA_SECTION_JOURNEY_PATTERN_POINT_ATTRIBUTES,
+    TDATA_SECTION_STOP_TIMES,
+    TDATA_SECTION_VJS,
+    TDATA_SECTION_JOURNEY_PATTERNS_AT_STOP,
+    TDATA_SECTION_TRANSFER_TARGET_STOPS,
+    TDATA_SECTION_TRANSFER_DIST_METERS,
+    TDATA_SECTION_VJ_ACTIVE,
+    TDATA_SECTION_JOURNEY_PATTERN_ACTIVE,
+    TDATA_SECTION_PLATFORMCODES,
+    TDATA_SECTION_STOP_NAMES,
+    TDATA_SECTION_STOP_NAMEIDX,
+    TDATA_SECTION_AGENCY_IDS,
+    TDATA_SECTION_AGENCY_NAMES,
+    TDATA_SECTION_AGENCY_URLS,
+    TDATA_SECTION_HEADSIGNS,
+    TDATA_SECTION_LINE_CODES,
+    TDATA_SECTION_PRODUCTCATEGORIES,
+    TDATA_SECTION_LINE_IDS,
+    TDATA_SECTION_STOP_IDS,
+    TDATA_SECTION_VJ_IDS,
+    /* Optional: the ids above as flat radixtrees, see radixtree_flatten */
+    TDATA_SECTION_STOP_ID_INDEX,
+    TDATA_SECTION_VJ_ID_INDEX,
+    TDATA_SECTION_LINE_ID_INDEX,
+    /* Optional: the slots of the hash indexes of the ids, see hashindex.h */
+    TDATA_SECTION_STOP_ID_HASH,
+    TDATA_SECTION_LINE_ID_HASH,
+    /* Optional: the block of the name search of the stop names */
+    TDATA_SECTION_STOP_NAME_SEARCH,
+    /* Optional: the block of the hashgrid of the stop coordinates */
+    TDATA_SECTION_STOP_HASHGRID
+} tdata_section_id_t;
+
+/* Sections after TDATA_SECTION_VJ_IDS may be absent */
+#define TDATA_SECTION_LAST_REQUIRED TDATA_SECTION_VJ_IDS
+
+/* file-visible structs */
+typedef struct tdata_v4_header tdata_v4_header_t;
+struct tdata_v4_header {
+    /* Contents must read "TTABLEV4" */
+    char version_string[8];
+    uint64_t calendar_start_time;
+    calendar_t dst_active;
+    uint32_t n_sections;
+    /* offset of the section directory */
+    uint32_t loc_sections;
+    /* CRC-32 of the section directory */
+    uint32_t crc_sections;
+    uint8_t reserved[32];
+};
+
+typedef struct tdata_section tdata_section_t;
+struct tdata_section {
+    /* tdata_section_id_t, optionally with TDATA_SECTION_CRITICAL */
+    uint32_t id;
+    /* CRC-32 of the size bytes of the section */
+    uint32_t crc;
+    uint64_t offset;
+    /* length of the section in bytes, including any sentinel */
+    uint64_t size;
+    /* the number of items, as n_<section> in tdata_t */
+    uint32_t n_items;
+    /* the width of an item, or of every string in a string table */
+    uint32_t width;
+};
+
+/* Checks whether the file starts with the TTABLEV4 version string. */
+bool tdata_io_v4_detect(char *filename);
+
+bool tdata_io_v4_load(tdata_t *td, char* filename);
+void tdata_io_v4_close(tdata_t *td);
+
+/* Verify the checksum of a section the first time it is used. Sections
+ * which are not present in the timetable are considered valid.
+ */
+bool tdata_io_v4_verify_section(tdata_t *td, tdata_section_id_t id);
+
+/* Verify the checksums of all sections which were not verified yet. */
+bool tdata_io_v4_verify(tdata_t *td);
+
+/* Shared between the mmap and the dynamic loader */
+
+/* Set the maximum drivetime of any day in tdata, from tdata_io_v3 */
+void set_max_time(tdata_t *td);
+
+uint32_t tdata_io_v4_crc32(uint32_t crc, const void *data, uint64_t size);
+
+bool tdata_io_v4_check_header(tdata_v4_header_t *header, uint64_t file_size,
+                              char *filename);
+
+bool tdata_io_v4_check_sections(tdata_section_t *sections,
+                                uint32_t n_sections, uint64_t file_size,
+                                char *filename);
+
+/* Find a section in the directory, returns NULL when it is not present. */
+tdata_section_t *tdata_io_v4_section(tdata_section_t *sections,
+                                     uint32_t n_sections,
+                                     tdata_section_id_t id);
+
+#endif /* _TDATA_IO_V4_H */
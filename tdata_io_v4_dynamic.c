@@ -0,0 +1,331 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+#include "config.h"
+
+#ifdef RRRR_TDATA_IO_DYNAMIC
+
+#include "tdata_io_v3.h"
+#include "tdata_io_v4.h"
+#include "tdata.h"
+#include "rrrr_types.h"
+
+#ifdef RRRR_FEATURE_REALTIME
+#include "radixtree.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+/* The realtime updates modify the loaded arrays in place, hence the
+ * checksum of every section is verified while it is read.
+ */
+static bool read_section (int fd, tdata_section_t *section, void *storage, uint64_t n_bytes) {
+    if (lseek (fd, section->offset, SEEK_SET) == -1) return false;
+    if (read (fd, storage, n_bytes) != (ssize_t) n_bytes) return false;
+    if (n_bytes == section->size &&
+        tdata_io_v4_crc32 (0, storage, n_bytes) == section->crc) return true;
+
+    fprintf (stderr, "The checksum of section %u does not match.\n",
+                     section->id & ~TDATA_SECTION_CRITICAL);
+    return false;
+}
+
+/* Like the TTABLEV3 loader, keep room for one more item than stored */
+#define load_dynamic(fd, storage, type, section_id) \
+    section = tdata_io_v4_section (sections, n_sections, section_id); \
+    td->n_##storage = section->n_items; \
+    if (section->size > sizeof(type) * (((uint64_t) td->n_##storage) + 1)) goto fail_close_fd; \
+    td->storage = (type*) malloc (sizeof(type) * RRRR_DYNAMIC_SLACK * (td->n_##storage + 1)); \
+    if (!td->storage) goto fail_close_fd; \
+    if (!read_section (fd, section, td->storage, section->size)) goto fail_close_fd;
+
+#define load_dynamic_string(fd, storage, section_id) \
+    section = tdata_io_v4_section (sections, n_sections, section_id); \
+    td->n_##storage = section->n_items; \
+    td->storage##_width = section->width; \
+    if (section->size != ((uint64_t) td->n_##storage) * td->storage##_width) goto fail_close_fd; \
+    td->storage = (char*) malloc (((uint64_t) sizeof(char)) * RRRR_DYNAMIC_SLACK * td->n_##storage * td->storage##_width); \
+    if (!td->storage) goto fail_close_fd; \
+    if (!read_section (fd, section, td->storage, section->size)) goto fail_close_fd;
+
+/* Like the radixtrees below, the slots of a hash index are optional */
+static void load_dynamic_hash (int fd, tdata_section_t *sections,
+                               uint32_t n_sections, tdata_section_id_t section_id,
+                               hashindex_t *hi, const char *strings,
+                               uint32_t width, uint32_t n_strings) {
+    tdata_section_t *section = tdata_io_v4_section (sections, n_sections, section_id);
+    uint32_t *slots;
+
+    if (section == NULL || section->n_items == 0) return;
+
+    slots = (uint32_t *) malloc (section->size);
+    if (!slots) return;
+
+    if (!read_section (fd, section, slots, section->size) ||
+        !hashindex_from_slots (hi, slots, section->n_items, true,
+                               strings, width, n_strings)) {
+        free (slots);
+    }
+}
+
+static void load_dynamic_search (int fd, tdata_section_t *sections,
+                                 uint32_t n_sections, tdata_t *td) {
+    tdata_section_t *section = tdata_io_v4_section (sections, n_sections,
+                                                    TDATA_SECTION_STOP_NAME_SEARCH);
+    void *block;
+
+    if (section == NULL || section->size == 0) return;
+
+    block = malloc (section->size);
+    if (!block) return;
+
+    if (!read_section (fd, section, block, section->size) ||
+        !namesearch_from_block (&td->stopname_search, block, section->size, true)) {
+        free (block);
+        return;
+    }
+
+    /* an index of other names is of no use */
+    if (td->stopname_search.n_strings != td->n_stops) namesearch_destroy (&td->stopname_search);
+}
+
+#ifdef RRRR_FEATURE_LATLON
+static void load_dynamic_hashgrid (int fd, tdata_section_t *sections,
+                                   uint32_t n_sections, tdata_t *td) {
+    tdata_section_t *section = tdata_io_v4_section (sections, n_sections,
+                                                    TDATA_SECTION_STOP_HASHGRID);
+    hashgrid_t *hg = &td->stop_hashgrid;
+    void *block;
+
+    if (section == NULL || section->size == 0) return;
+
+    block = malloc (section->size);
+    if (!block) return;
+
+    if (!read_section (fd, section, block, section->size) ||
+        !hashgrid_from_block (hg, block, section->size, true)) {
+        free (block);
+        return;
+    }
+
+    /* a grid of other stops or dimensions is rebuilt */
+    if (hg->n_items != td->n_stops || hg->grid_dim != RRRR_HASHGRID_DIM ||
+        hg->bin_size_meters != RRRR_HASHGRID_BIN_METERS) {
+        hashgrid_teardown (hg);
+    }
+}
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME
+/* The radixtrees of the ids are optional, they are built when needed if
+ * the timetable doesn't contain them.
+ */
+static radixtree_t *load_dynamic_index (int fd, tdata_section_t *sections,
+                                        uint32_t n_sections,
+                                        tdata_section_id_t section_id) {
+    tdata_section_t *section = tdata_io_v4_section (sections, n_sections, section_id);
+    rxt_edge_t *edges;
+    radixtree_t *r;
+
+    if (section == NULL || section->n_items == 0) return NULL;
+
+    edges = (rxt_edge_t *) malloc (section->size);
+    if (!edges) return NULL;
+
+    if (!read_section (fd, section, edges, section->size)) {
+        free (edges);
+        return NULL;
+    }
+
+    r = radixtree_from_flat (edges, section->n_items, true);
+    if (!r) free (edges);
+
+    return r;
+}
+#endif
+
+/* Unset the columns, so a load failing half way can free the loaded ones */
+static void tdata_io_v4_init_columns (tdata_t *td) {
+    td->stops = NULL;
+    td->stop_attributes = NULL;
+    td->stop_coords = NULL;
+    td->journey_patterns = NULL;
+    td->journey_pattern_points = NULL;
+    td->journey_pattern_point_attributes = NULL;
+    td->stop_times = NULL;
+    td->vjs = NULL;
+    td->journey_patterns_at_stop = NULL;
+    td->transfer_target_stops = NULL;
+    td->transfer_dist_meters = NULL;
+    td->vj_active = NULL;
+    td->journey_pattern_active = NULL;
+    td->headsigns = NULL;
+    td->stop_names = NULL;
+    td->stop_nameidx = NULL;
+
+    td->platformcodes = NULL;
+    td->stop_ids = NULL;
+    td->vj_ids = NULL;
+    td->agency_ids = NULL;
+    td->agency_names = NULL;
+    td->agency_urls = NULL;
+    td->line_codes = NULL;
+    td->line_ids = NULL;
+    td->productcategories = NULL;
+}
+
+bool tdata_io_v4_load(tdata_t *td, char *filename) {
+    tdata_v4_header_t h;
+    tdata_v4_header_t *header = &h;
+    tdata_section_t *sections = NULL;
+    tdata_section_t *section;
+    uint32_t n_sections;
+    struct stat st;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "The input file %s could not be found.\n", filename);
+        return false;
+    }
+
+    tdata_io_v4_init_columns (td);
+
+    if (fstat (fd, &st) == -1) {
+        fprintf(stderr, "The input file %s could not be stat.\n", filename);
+        goto fail_close_fd;
+    }
+
+    if (read (fd, header, sizeof(tdata_v4_header_t)) != sizeof(tdata_v4_header_t)) {
+        goto fail_close_fd;
+    }
+
+    td->base = NULL;
+    td->size = 0;
+
+    if ( ! tdata_io_v4_check_header (header, st.st_size, filename)) {
+        goto fail_close_fd;
+    }
+
+    n_sections = header->n_sections;
+    sections = (tdata_section_t *) malloc (sizeof(tdata_section_t) * n_sections);
+    if (!sections) goto fail_close_fd;
+
+    if (lseek (fd, header->loc_sections, SEEK_SET) == -1 ||
+        read (fd, sections, sizeof(tdata_section_t) * n_sections) !=
+        (ssize_t) (sizeof(tdata_section_t) * n_sections)) {
+        goto fail_close_fd;
+    }
+
+    if (tdata_io_v4_crc32 (0, sections, sizeof(tdata_section_t) * n_sections) !=
+        header->crc_sections) {
+        fprintf(stderr, "The section directory of %s is corrupt.\n", filename);
+        goto fail_close_fd;
+    }
+
+    if ( ! tdata_io_v4_check_sections (sections, n_sections, st.st_size, filename)) {
+        goto fail_close_fd;
+    }
+
+    /* More input validation in the dynamic loading case. */
+    if ( !( tdata_io_v4_section (sections, n_sections, TDATA_SECTION_STOPS)->n_items < ((spidx_t) -2) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_STOP_NAMEIDX)->n_items < ((spidx_t) -2) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_STOP_IDS)->n_items < ((spidx_t) -2) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_JOURNEY_PATTERNS)->n_items < (UINT32_MAX - 1) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_AGENCY_IDS)->n_items < (UINT16_MAX) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_LINE_CODES)->n_items < (UINT16_MAX) &&
+            tdata_io_v4_section (sections, n_sections, TDATA_SECTION_PRODUCTCATEGORIES)->n_items < (UINT16_MAX) ) ) {
+
+        fprintf(stderr, "The input file %s does not appear to be a valid timetable.\n", filename);
+        goto fail_close_fd;
+    }
+
+    td->calendar_start_time = header->calendar_start_time;
+    td->dst_active = header->dst_active;
+
+    load_dynamic (fd, stops, stop_t, TDATA_SECTION_STOPS);
+    load_dynamic (fd, stop_attributes, uint8_t, TDATA_SECTION_STOP_ATTRIBUTES);
+    load_dynamic (fd, stop_coords, latlon_t, TDATA_SECTION_STOP_COORDS);
+    load_dynamic (fd, journey_patterns, journey_pattern_t, TDATA_SECTION_JOURNEY_PATTERNS);
+    load_dynamic (fd, journey_pattern_points, spidx_t, TDATA_SECTION_JOURNEY_PATTERN_POINTS);
+    load_dynamic (fd, journey_pattern_point_attributes, uint8_t, TDATA_SECTION_JOURNEY_PATTERN_POINT_ATTRIBUTES);
+    load_dynamic (fd, stop_times, stoptime_t, TDATA_SECTION_STOP_TIMES);
+    load_dynamic (fd, vjs, vehicle_journey_t, TDATA_SECTION_VJS);
+    load_dynamic (fd, journey_patterns_at_stop, uint32_t, TDATA_SECTION_JOURNEY_PATTERNS_AT_STOP);
+    load_dynamic (fd, transfer_target_stops, spidx_t, TDATA_SECTION_TRANSFER_TARGET_STOPS);
+    load_dynamic (fd, transfer_dist_meters, uint8_t, TDATA_SECTION_TRANSFER_DIST_METERS);
+    load_dynamic (fd, vj_active, calendar_t, TDATA_SECTION_VJ_ACTIVE);
+    load_dynamic (fd, journey_pattern_active, calendar_t, TDATA_SECTION_JOURNEY_PATTERN_ACTIVE);
+    load_dynamic (fd, headsigns, char, TDATA_SECTION_HEADSIGNS);
+    load_dynamic (fd, stop_names, char, TDATA_SECTION_STOP_NAMES);
+    load_dynamic (fd, stop_nameidx, uint32_t, TDATA_SECTION_STOP_NAMEIDX);
+
+    load_dynamic_string (fd, platformcodes, TDATA_SECTION_PLATFORMCODES);
+    load_dynamic_string (fd, stop_ids, TDATA_SECTION_STOP_IDS);
+    load_dynamic_string (fd, vj_ids, TDATA_SECTION_VJ_IDS);
+    load_dynamic_string (fd, agency_ids, TDATA_SECTION_AGENCY_IDS);
+    load_dynamic_string (fd, agency_names, TDATA_SECTION_AGENCY_NAMES);
+    load_dynamic_string (fd, agency_urls, TDATA_SECTION_AGENCY_URLS);
+    load_dynamic_string (fd, line_codes, TDATA_SECTION_LINE_CODES);
+    load_dynamic_string (fd, line_ids, TDATA_SECTION_LINE_IDS);
+    load_dynamic_string (fd, productcategories, TDATA_SECTION_PRODUCTCATEGORIES);
+
+    /* All sections were verified while reading them. */
+    td->sections = sections;
+    td->n_sections = n_sections;
+    td->sections_verified = (uint8_t *) malloc (sizeof(uint8_t) * n_sections);
+    if (!td->sections_verified) goto fail_close_fd;
+    memset (td->sections_verified, true, sizeof(uint8_t) * n_sections);
+
+    set_max_time(td);
+
+    load_dynamic_hash (fd, sections, n_sections, TDATA_SECTION_STOP_ID_HASH, &td->stopid_hash,
+                       td->stop_ids, td->stop_ids_width, td->n_stops);
+    load_dynamic_hash (fd, sections, n_sections, TDATA_SECTION_LINE_ID_HASH, &td->lineid_hash,
+                       td->line_ids, td->line_ids_width, td->n_journey_patterns);
+    load_dynamic_search (fd, sections, n_sections, td);
+    #ifdef RRRR_FEATURE_LATLON
+    load_dynamic_hashgrid (fd, sections, n_sections, td);
+    #endif
+
+    #ifdef RRRR_FEATURE_REALTIME
+    td->stopid_index = load_dynamic_index (fd, sections, n_sections, TDATA_SECTION_STOP_ID_INDEX);
+    td->vjid_index = load_dynamic_index (fd, sections, n_sections, TDATA_SECTION_VJ_ID_INDEX);
+    td->lineid_index = load_dynamic_index (fd, sections, n_sections, TDATA_SECTION_LINE_ID_INDEX);
+    #endif
+
+    close (fd);
+
+    return true;
+
+fail_close_fd:
+    td->sections = NULL;
+    free (sections);
+    free (td->sections_verified);
+    td->sections_verified = NULL;
+    tdata_io_v3_close (td);
+    close (fd);
+
+    return false;
+}
+
+void tdata_io_v4_close(tdata_t *td) {
+    free (td->sections);
+    free (td->sections_verified);
+    td->sections = NULL;
+    td->sections_verified = NULL;
+
+    /* The columns are allocated just like by the TTABLEV3 loader */
+    tdata_io_v3_close (td);
+}
+
+#else
+void tdata_io_v4_dynamic_not_available();
+#endif /* RRRR_TDATA_IO_DYNAMIC */
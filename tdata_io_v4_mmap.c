@@ -0,0 +1,260 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+#include "config.h"
+
+#ifdef RRRR_TDATA_IO_MMAP
+
+#include "tdata_io_v3.h"
+#include "tdata_io_v4.h"
+#include "tdata.h"
+#include "rrrr_types.h"
+
+#ifdef RRRR_FEATURE_REALTIME
+#include "radixtree.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The presence, width and size of every section was checked by
+ * tdata_io_v4_check_sections. Verifying the checksums of the columns would
+ * page in the whole timetable, they are only verified by tdata_load with
+ * RRRR_STRICT. The optional indexes below are verified before they are
+ * used, a damaged one is rebuilt.
+ */
+#define load_mmap(b, storage, type, section_id) \
+    section = tdata_io_v4_section (td->sections, td->n_sections, section_id); \
+    td->n_##storage = section->n_items; \
+    td->storage = (type *) (((char *) b) + section->offset)
+
+#define load_mmap_string(b, storage, section_id) \
+    section = tdata_io_v4_section (td->sections, td->n_sections, section_id); \
+    td->n_##storage = section->n_items; \
+    td->storage##_width = section->width; \
+    td->storage = (char *) (((char *) b) + section->offset)
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+/* Columns which realtime updates change or append to */
+#define load_mmap_overlay(b, storage, type, section_id) \
+    load_mmap (b, storage, type, section_id); \
+    td->storage = (type *) tdata_io_mmap_overlay (td, fd, section->offset, section->size); \
+    if (!td->storage) goto fail_munmap_overlays
+
+#define load_mmap_string_overlay(b, storage, section_id) \
+    load_mmap_string (b, storage, section_id); \
+    td->storage = (char *) tdata_io_mmap_overlay (td, fd, section->offset, section->size); \
+    if (!td->storage) goto fail_munmap_overlays
+#else
+#define load_mmap_overlay(b, storage, type, section_id) load_mmap (b, storage, type, section_id)
+#define load_mmap_string_overlay(b, storage, section_id) load_mmap_string (b, storage, section_id)
+#endif
+
+/* Like the radixtrees below, the slots of a hash index are optional */
+static void load_mmap_hash (tdata_t *td, tdata_section_id_t section_id,
+                            hashindex_t *hi, const char *strings,
+                            uint32_t width, uint32_t n_strings) {
+    tdata_section_t *section = tdata_io_v4_section (td->sections, td->n_sections, section_id);
+
+    if (section == NULL || section->n_items == 0 ||
+        ! tdata_io_v4_verify_section (td, section_id)) return;
+
+    hashindex_from_slots (hi, (uint32_t *) (((char *) td->base) + section->offset),
+                          section->n_items, false, strings, width, n_strings);
+}
+
+static void load_mmap_search (tdata_t *td) {
+    tdata_section_t *section = tdata_io_v4_section (td->sections, td->n_sections,
+                                                    TDATA_SECTION_STOP_NAME_SEARCH);
+
+    if (section == NULL || section->size == 0 ||
+        ! tdata_io_v4_verify_section (td, TDATA_SECTION_STOP_NAME_SEARCH) ||
+        ! namesearch_from_block (&td->stopname_search, ((char *) td->base) + section->offset,
+                                 section->size, false)) return;
+
+    /* an index of other names is of no use */
+    if (td->stopname_search.n_strings != td->n_stops) namesearch_init (&td->stopname_search);
+}
+
+#ifdef RRRR_FEATURE_LATLON
+static void load_mmap_hashgrid (tdata_t *td) {
+    tdata_section_t *section = tdata_io_v4_section (td->sections, td->n_sections,
+                                                    TDATA_SECTION_STOP_HASHGRID);
+    hashgrid_t *hg = &td->stop_hashgrid;
+
+    if (section == NULL || section->size == 0 ||
+        ! tdata_io_v4_verify_section (td, TDATA_SECTION_STOP_HASHGRID) ||
+        ! hashgrid_from_block (hg, ((char *) td->base) + section->offset,
+                               section->size, false)) return;
+
+    /* a grid of other stops or dimensions is rebuilt */
+    if (hg->n_items != td->n_stops || hg->grid_dim != RRRR_HASHGRID_DIM ||
+        hg->bin_size_meters != RRRR_HASHGRID_BIN_METERS) {
+        hashgrid_teardown (hg);
+    }
+}
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME
+/* The radixtrees of the ids are used straight from the mapped file, they are
+ * built when needed if the timetable doesn't contain them.
+ */
+static radixtree_t *load_mmap_index (tdata_t *td, tdata_section_id_t section_id) {
+    tdata_section_t *section = tdata_io_v4_section (td->sections, td->n_sections, section_id);
+
+    if (section == NULL || section->n_items == 0 ||
+        ! tdata_io_v4_verify_section (td, section_id)) return NULL;
+
+    return radixtree_from_flat ((rxt_edge_t *) (((char *) td->base) + section->offset),
+                                section->n_items, false);
+}
+#endif
+
+/* Map an input file into memory and reconstruct pointers to its contents. */
+bool tdata_io_v4_load(tdata_t *td, char *filename) {
+    struct stat st;
+    tdata_v4_header_t *header;
+    tdata_section_t *section;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "The input file %s could not be found.\n", filename);
+        return false;
+    }
+
+    if (stat(filename, &st) == -1) {
+        fprintf(stderr, "The input file %s could not be stat.\n", filename);
+        goto fail_close_fd;
+    }
+
+    if ((uint64_t) st.st_size < sizeof(tdata_v4_header_t)) {
+        fprintf(stderr, "The input file %s is too small to be a timetable.\n", filename);
+        goto fail_close_fd;
+    }
+
+    td->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    td->size = st.st_size;
+    if (td->base == MAP_FAILED) {
+        fprintf(stderr, "The input file %s could not be mapped.\n", filename);
+        goto fail_close_fd;
+    }
+
+    header = (tdata_v4_header_t *) td->base;
+    if ( ! tdata_io_v4_check_header (header, td->size, filename)) {
+        goto fail_munmap_base;
+    }
+
+    td->n_sections = header->n_sections;
+    td->sections = (tdata_section_t *) (((char *) td->base) + header->loc_sections);
+
+    if (tdata_io_v4_crc32 (0, td->sections, sizeof(tdata_section_t) * td->n_sections) !=
+        header->crc_sections) {
+        fprintf(stderr, "The section directory of %s is corrupt.\n", filename);
+        goto fail_munmap_base;
+    }
+
+    if ( ! tdata_io_v4_check_sections (td->sections, td->n_sections, td->size, filename)) {
+        goto fail_munmap_base;
+    }
+
+    td->sections_verified = (uint8_t *) calloc (td->n_sections, sizeof(uint8_t));
+    if ( ! td->sections_verified) goto fail_munmap_base;
+
+    td->calendar_start_time = header->calendar_start_time;
+    td->dst_active = header->dst_active;
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    td->n_overlays = 0;
+    #endif
+
+    load_mmap (td->base, stops, stop_t, TDATA_SECTION_STOPS);
+    load_mmap (td->base, stop_attributes, uint8_t, TDATA_SECTION_STOP_ATTRIBUTES);
+    load_mmap (td->base, stop_coords, latlon_t, TDATA_SECTION_STOP_COORDS);
+    load_mmap_overlay (td->base, journey_patterns, journey_pattern_t, TDATA_SECTION_JOURNEY_PATTERNS);
+    load_mmap_overlay (td->base, journey_pattern_points, spidx_t, TDATA_SECTION_JOURNEY_PATTERN_POINTS);
+    load_mmap_overlay (td->base, journey_pattern_point_attributes, uint8_t, TDATA_SECTION_JOURNEY_PATTERN_POINT_ATTRIBUTES);
+    load_mmap_overlay (td->base, stop_times, stoptime_t, TDATA_SECTION_STOP_TIMES);
+    load_mmap_overlay (td->base, vjs, vehicle_journey_t, TDATA_SECTION_VJS);
+    load_mmap (td->base, journey_patterns_at_stop, uint32_t, TDATA_SECTION_JOURNEY_PATTERNS_AT_STOP);
+    load_mmap (td->base, transfer_target_stops, spidx_t, TDATA_SECTION_TRANSFER_TARGET_STOPS);
+    load_mmap (td->base, transfer_dist_meters, uint8_t, TDATA_SECTION_TRANSFER_DIST_METERS);
+    load_mmap_overlay (td->base, vj_active, calendar_t, TDATA_SECTION_VJ_ACTIVE);
+    load_mmap_overlay (td->base, journey_pattern_active, calendar_t, TDATA_SECTION_JOURNEY_PATTERN_ACTIVE);
+    load_mmap (td->base, headsigns, char, TDATA_SECTION_HEADSIGNS);
+    load_mmap (td->base, stop_names, char, TDATA_SECTION_STOP_NAMES);
+    load_mmap (td->base, stop_nameidx, uint32_t, TDATA_SECTION_STOP_NAMEIDX);
+
+    load_mmap_string (td->base, platformcodes, TDATA_SECTION_PLATFORMCODES);
+    load_mmap_string (td->base, stop_ids, TDATA_SECTION_STOP_IDS);
+    load_mmap_string_overlay (td->base, vj_ids, TDATA_SECTION_VJ_IDS);
+    load_mmap_string (td->base, agency_ids, TDATA_SECTION_AGENCY_IDS);
+    load_mmap_string (td->base, agency_names, TDATA_SECTION_AGENCY_NAMES);
+    load_mmap_string (td->base, agency_urls, TDATA_SECTION_AGENCY_URLS);
+    load_mmap_string (td->base, line_codes, TDATA_SECTION_LINE_CODES);
+    load_mmap_string (td->base, line_ids, TDATA_SECTION_LINE_IDS);
+    load_mmap_string (td->base, productcategories, TDATA_SECTION_PRODUCTCATEGORIES);
+
+    /* Set the maximum drivetime of any day in tdata */
+    set_max_time(td);
+
+    load_mmap_hash (td, TDATA_SECTION_STOP_ID_HASH, &td->stopid_hash,
+                    td->stop_ids, td->stop_ids_width, td->n_stops);
+    load_mmap_hash (td, TDATA_SECTION_LINE_ID_HASH, &td->lineid_hash,
+                    td->line_ids, td->line_ids_width, td->n_journey_patterns);
+    load_mmap_search (td);
+    #ifdef RRRR_FEATURE_LATLON
+    load_mmap_hashgrid (td);
+    #endif
+
+    #ifdef RRRR_FEATURE_REALTIME
+    td->stopid_index = load_mmap_index (td, TDATA_SECTION_STOP_ID_INDEX);
+    td->vjid_index = load_mmap_index (td, TDATA_SECTION_VJ_ID_INDEX);
+    td->lineid_index = load_mmap_index (td, TDATA_SECTION_LINE_ID_INDEX);
+    #endif
+
+    /* We must close the file descriptor otherwise we will
+     * leak it. Because mmap has created a reference to it
+     * there will not be a problem.
+     */
+    close (fd);
+
+    return true;
+
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+fail_munmap_overlays:
+    tdata_io_mmap_overlay_close (td);
+    free (td->sections_verified);
+    td->sections_verified = NULL;
+    #endif
+
+fail_munmap_base:
+    td->sections = NULL;
+    munmap(td->base, td->size);
+
+fail_close_fd:
+    close(fd);
+
+    return false;
+}
+
+void tdata_io_v4_close(tdata_t *td) {
+    #ifdef RRRR_FEATURE_REALTIME_EXPANDED
+    tdata_io_mmap_overlay_close (td);
+    #endif
+    free (td->sections_verified);
+    td->sections_verified = NULL;
+    td->sections = NULL;
+    munmap(td->base, td->size);
+}
+
+#else
+void tdata_io_v4_mmap_not_available();
+#endif /* RRRR_TDATA_IO_MMAP */
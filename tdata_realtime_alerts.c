@@ -8,11 +8,13 @@
 #ifdef RRRR_FEATURE_REALTIME_ALERTS
 
 #include "tdata_realtime_alerts.h"
+#include "tdata_realtime_expanded.h"
 #include "radixtree.h"
 #include "gtfs-realtime.pb-c.h"
 #include "rrrr_types.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -20,8 +22,247 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-void tdata_apply_gtfsrt_alerts (tdata_t *tdata, uint8_t *buf, size_t len) {
+#define alert_bucket_stop(index, stop) ((index)->n_vjs + (stop))
+#define alert_bucket_jp(index, jp) ((index)->n_vjs + (index)->n_stops + (jp))
+#define alert_bucket_any(index) \
+    ((index)->n_vjs + (index)->n_stops + (index)->n_journey_patterns)
+
+/* The first journey_pattern from jp_index on of the line/route route_id,
+ * a line has one journey_pattern for each of its stop sequences.
+ */
+static uint32_t tdata_alert_next_jp (tdata_t *tdata, const char *route_id,
+                                     uint32_t jp_index) {
+    for (; jp_index < tdata->n_journey_patterns; ++jp_index) {
+        if (strcmp (tdata_line_id_for_journey_pattern (tdata, jp_index),
+                    route_id) == 0) return jp_index;
+    }
+    return ALERT_SELECTS_ANY;
+}
+
+/* The number of selectors an informed entity resolves to, one for each
+ * journey_pattern of its route.
+ */
+static uint32_t tdata_alert_n_selectors (tdata_t *tdata,
+                                         TransitRealtime__EntitySelector *informed_entity) {
+    uint32_t jp_index, n = 0;
+
+    if (informed_entity == NULL || informed_entity->route_id == NULL) return 1;
+
+    for (jp_index = tdata_alert_next_jp (tdata, informed_entity->route_id, 0);
+         jp_index != ALERT_SELECTS_ANY;
+         jp_index = tdata_alert_next_jp (tdata, informed_entity->route_id, jp_index + 1)) {
+        n++;
+    }
+    return n;
+}
+
+/* Resolve the ids an informed entity selects, returns false when one of
+ * them is not in the timetable: such an entity never matches a leg. A
+ * route selects its first journey_pattern, see tdata_alert_next_jp for
+ * the others.
+ */
+static bool tdata_alert_selector (tdata_t *tdata,
+                                  TransitRealtime__EntitySelector *informed_entity,
+                                  alert_selector_t *selector) {
+    selector->journey_pattern = ALERT_SELECTS_ANY;
+    selector->vj_index = ALERT_SELECTS_ANY;
+    selector->stop = ALERT_SELECTS_ANY;
+
+    if (informed_entity->route_id) {
+        selector->journey_pattern = tdata_alert_next_jp (tdata,
+                                                         informed_entity->route_id, 0);
+        if (selector->journey_pattern == ALERT_SELECTS_ANY) {
+            #ifdef RRRR_DEBUG
+            fprintf (stderr, "    route id was not found in the line ids.\n");
+            #endif
+            return false;
+        }
+    }
+
+    if (informed_entity->stop_id) {
+        selector->stop = radixtree_find (tdata->stopid_index,
+                                         informed_entity->stop_id);
+        if (selector->stop == RADIXTREE_NONE) {
+            #ifdef RRRR_DEBUG
+            fprintf (stderr, "    stop id was not found in the radix tree.\n");
+            #endif
+            return false;
+        }
+    }
+
+    if (informed_entity->trip && informed_entity->trip->trip_id) {
+        selector->vj_index = radixtree_find (tdata->vjid_index,
+                                             informed_entity->trip->trip_id);
+        if (selector->vj_index == RADIXTREE_NONE) {
+            #ifdef RRRR_DEBUG
+            fprintf (stderr, "    trip id was not found in the radix tree.\n");
+            #endif
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint32_t alert_bucket (alert_index_t *index, alert_selector_t *selector) {
+    if (selector->vj_index != ALERT_SELECTS_ANY) return selector->vj_index;
+    if (selector->stop != ALERT_SELECTS_ANY) return alert_bucket_stop (index, selector->stop);
+    if (selector->journey_pattern != ALERT_SELECTS_ANY) return alert_bucket_jp (index, selector->journey_pattern);
+    return alert_bucket_any (index);
+}
+
+/* The calendar days an alert is active on, for some time at least */
+static calendar_t tdata_alert_days (tdata_t *tdata, TransitRealtime__Alert *alert) {
+    calendar_t days = 0;
+    uint8_t day;
+
+    if (alert->n_active_period == 0) return ~((calendar_t) 0);
+
+    for (day = 0; day < 32; ++day) {
+        uint64_t start = tdata->calendar_start_time + ((uint64_t) day) * SEC_IN_ONE_DAY;
+        uint64_t end = start + SEC_IN_ONE_DAY;
+        size_t i_period;
+
+        for (i_period = 0; i_period < alert->n_active_period; ++i_period) {
+            TransitRealtime__TimeRange *period = alert->active_period[i_period];
+            if (period &&
+                (!period->has_start || period->start < end) &&
+                (!period->has_end   || period->end > start)) {
+                days |= ((calendar_t) 1) << day;
+                break;
+            }
+        }
+    }
+
+    return days;
+}
+
+static bool alert_no_service (TransitRealtime__Alert *alert) {
+    return (alert->has_effect &&
+            alert->effect == TRANSIT_REALTIME__ALERT__EFFECT__NO_SERVICE);
+}
+
+/* Group the informed entities of all alerts in msg, see alert_index_t */
+static bool tdata_alerts_index (tdata_t *tdata, TransitRealtime__FeedMessage *msg,
+                                alert_index_t *index) {
+    alert_selector_t *selectors;
+    uint32_t n_selectors = 0;
+    uint32_t n_buckets, i_selector;
+    bool no_service = false;
     size_t e;
+
+    index->n_vjs = tdata->n_vjs;
+    index->n_stops = tdata->n_stops;
+    index->n_journey_patterns = tdata->n_journey_patterns;
+    n_buckets = alert_bucket_any (index) + 1;
+
+    for (e = 0; e < msg->n_entity; ++e) {
+        if (msg->entity[e] && msg->entity[e]->alert) {
+            TransitRealtime__Alert *alert = msg->entity[e]->alert;
+            size_t ie;
+            for (ie = 0; ie < alert->n_informed_entity; ++ie) {
+                n_selectors += tdata_alert_n_selectors (tdata, alert->informed_entity[ie]);
+            }
+            no_service |= alert_no_service (alert);
+        }
+    }
+
+    index->stops_closed = NULL;
+    index->journey_patterns_suspended = NULL;
+
+    /* Resolved in feed order first, then scattered into their groups */
+    selectors = (alert_selector_t *) malloc (sizeof(alert_selector_t) * (n_selectors + 1));
+    index->selectors = (alert_selector_t *) malloc (sizeof(alert_selector_t) * (n_selectors + 1));
+    index->offsets = (uint32_t *) calloc (n_buckets + 1, sizeof(uint32_t));
+    if (!selectors || !index->selectors || !index->offsets) goto fail;
+
+    if (no_service) {
+        index->stops_closed = (calendar_t *) calloc (index->n_stops, sizeof(calendar_t));
+        index->journey_patterns_suspended = (calendar_t *) calloc (index->n_journey_patterns, sizeof(calendar_t));
+        if (!index->stops_closed || !index->journey_patterns_suspended) goto fail;
+    }
+
+    n_selectors = 0;
+    for (e = 0; e < msg->n_entity; ++e) {
+        TransitRealtime__Alert *alert;
+        calendar_t days = 0;
+        size_t ie;
+
+        if (msg->entity[e] == NULL || msg->entity[e]->alert == NULL) continue;
+
+        #ifdef RRRR_DEBUG
+        fprintf(stderr, "  entity %lu has id %s\n", (unsigned long) e, msg->entity[e]->id);
+        #endif
+
+        alert = msg->entity[e]->alert;
+        if (alert_no_service (alert)) days = tdata_alert_days (tdata, alert);
+
+        for (ie = 0; ie < alert->n_informed_entity; ++ie) {
+            TransitRealtime__EntitySelector *informed_entity = alert->informed_entity[ie];
+            alert_selector_t selector;
+
+            if (!informed_entity ||
+                !tdata_alert_selector (tdata, informed_entity, &selector)) continue;
+
+            selector.alert = (uint32_t) e;
+
+            /* One selector for each journey_pattern of a route */
+            for (;;) {
+                selectors[n_selectors] = selector;
+                index->offsets[alert_bucket (index, &selector) + 1]++;
+                n_selectors++;
+
+                /* Only a whole stop or journey_pattern is closed, trips are
+                 * cancelled by TripUpdates.
+                 */
+                if (days && selector.vj_index == ALERT_SELECTS_ANY) {
+                    if (selector.journey_pattern == ALERT_SELECTS_ANY &&
+                        selector.stop != ALERT_SELECTS_ANY) {
+                        index->stops_closed[selector.stop] |= days;
+                    } else if (selector.stop == ALERT_SELECTS_ANY &&
+                               selector.journey_pattern != ALERT_SELECTS_ANY) {
+                        index->journey_patterns_suspended[selector.journey_pattern] |= days;
+                    }
+                }
+
+                if (informed_entity->route_id == NULL) break;
+                selector.journey_pattern = tdata_alert_next_jp (tdata, informed_entity->route_id,
+                                                                selector.journey_pattern + 1);
+                if (selector.journey_pattern == ALERT_SELECTS_ANY) break;
+            }
+        }
+    }
+
+    for (i_selector = 1; i_selector <= n_buckets; ++i_selector) {
+        index->offsets[i_selector] += index->offsets[i_selector - 1];
+    }
+
+    /* Keeps the feed order within each group, offsets end up shifted by one */
+    for (i_selector = 0; i_selector < n_selectors; ++i_selector) {
+        uint32_t bucket = alert_bucket (index, selectors + i_selector);
+        index->selectors[index->offsets[bucket]++] = selectors[i_selector];
+    }
+    memmove (index->offsets + 1, index->offsets, sizeof(uint32_t) * n_buckets);
+    index->offsets[0] = 0;
+
+    free (selectors);
+    return true;
+
+fail:
+    free (selectors);
+    free (index->selectors);
+    free (index->offsets);
+    free (index->stops_closed);
+    free (index->journey_patterns_suspended);
+    index->selectors = NULL;
+    index->offsets = NULL;
+    index->stops_closed = NULL;
+    index->journey_patterns_suspended = NULL;
+    return false;
+}
+
+void tdata_apply_gtfsrt_alerts (tdata_t *tdata, uint8_t *buf, size_t len) {
+    alert_index_t *index;
     TransitRealtime__FeedMessage *msg = transit_realtime__feed_message__unpack (NULL, len, buf);
     if (msg == NULL) {
         fprintf (stderr, "error unpacking incoming gtfs-rt message\n");
@@ -33,76 +274,98 @@ void tdata_apply_gtfsrt_alerts (tdata_t *tdata, uint8_t *buf, size_t len) {
                     msg->n_entity);
     #endif
 
-    for (e = 0; e < msg->n_entity; ++e) {
-        size_t ie;
-        TransitRealtime__FeedEntity *entity;
-        TransitRealtime__Alert *alert;
+    index = (alert_index_t *) malloc (sizeof(alert_index_t));
+    if (index == NULL || ! tdata_alerts_index (tdata, msg, index)) {
+        fprintf (stderr, "Could not index the alerts.\n");
+        transit_realtime__feed_message__free_unpacked (msg, NULL);
+        free (index);
+        return;
+    }
+    index->msg = msg;
 
-        entity = msg->entity[e];
-        if (entity == NULL) goto cleanup;
-        #ifdef RRRR_REALTIME
-        fprintf(stderr, "  entity %d has id %s\n", e, entity->id);
-        #endif
+    /* Routers keep reading the previous alerts until they are done */
+    if ( ! tdata_realtime_publish_alerts (tdata, index)) {
+        fprintf (stderr, "The previous alerts are still in use, "
+                         "keeping them.\n");
+        tdata_alerts_free (index);
+    }
+}
 
-        alert = entity->alert;
-        if (alert == NULL) goto cleanup;
+/* Whether an alert is active at time, an alert without periods always is */
+static bool tdata_alert_active (TransitRealtime__Alert *alert, time_t time) {
+    size_t i_period;
 
-        for (ie = 0; ie < alert->n_informed_entity; ++ie) {
-            TransitRealtime__EntitySelector *informed_entity =
-                                                    alert->informed_entity[ie];
-            if (!informed_entity) continue;
-
-            if (informed_entity->route_id) {
-                uint32_t jp_index = radixtree_find (tdata->lineid_index,
-                                                    informed_entity->route_id);
-                /*TODO This only applies the alert to one of the journey_patterns in the line/route.*/
-                #ifdef RRRR_DEBUG
-                if (jp_index == RADIXTREE_NONE) {
-                     fprintf (stderr,
-                     "    route id was not found in the radix tree.\n");
-                }
-                #endif
+    if (alert->n_active_period == 0) return true;
 
-                *(informed_entity->route_id) = jp_index;
-            }
+    for (i_period = 0; i_period < alert->n_active_period; ++i_period) {
+        TransitRealtime__TimeRange *period = alert->active_period[i_period];
+        if (period &&
+            (!period->has_start || period->start <= (uint64_t) time) &&
+            (!period->has_end   || (uint64_t) time < period->end)) {
+            return true;
+        }
+    }
 
-            if (informed_entity->stop_id) {
-                uint32_t stop_index = radixtree_find (tdata->stopid_index,
-                                                      informed_entity->stop_id);
-                #ifdef RRRR_DEBUG
-                if (stop_index == RADIXTREE_NONE) {
-                     fprintf (stderr,
-                     "    stop id was not found in the radix tree.\n");
-                }
-                #endif
+    return false;
+}
 
-                *(informed_entity->stop_id) = stop_index;
-            }
+/* The first alert in a group of the index which selects the leg */
+static uint32_t tdata_alert_in_bucket (alert_index_t *index, uint32_t bucket,
+                                       uint32_t jp_index, uint32_t vj_index,
+                                       uint32_t stop_index, time_t time) {
+    uint32_t i_selector;
 
-            if (informed_entity->trip && informed_entity->trip->trip_id) {
-                uint32_t trip_index = radixtree_find (tdata->vjid_index,
-                                                      informed_entity->trip->trip_id);
-                #ifdef RRRR_DEBUG
-                if (trip_index == RADIXTREE_NONE) {
-                     fprintf (stderr,
-                    "    trip id was not found in the radix tree.\n");
-                }
-                #endif
+    for (i_selector = index->offsets[bucket];
+         i_selector < index->offsets[bucket + 1];
+         ++i_selector) {
+        alert_selector_t *selector = index->selectors + i_selector;
 
-                *(informed_entity->trip->trip_id) = trip_index;
-            }
+        if ((selector->journey_pattern == ALERT_SELECTS_ANY || selector->journey_pattern == jp_index) &&
+            (selector->vj_index == ALERT_SELECTS_ANY || selector->vj_index == vj_index) &&
+            (selector->stop == ALERT_SELECTS_ANY || selector->stop == stop_index) &&
+            tdata_alert_active (index->msg->entity[selector->alert]->alert, time)) {
+            return selector->alert;
         }
     }
 
-    /* clean up the existing alerts */
-    tdata_clear_gtfsrt_alerts (tdata);
+    return ALERT_SELECTS_ANY;
+}
+
+TransitRealtime__Alert *tdata_alert_for_leg (tdata_t *tdata, uint32_t jp_index,
+                                             uint32_t vj_offset, spidx_t stop_index,
+                                             time_t time) {
+    alert_index_t *index = tdata->alerts;
+    uint32_t vj_index, alert, first = ALERT_SELECTS_ANY;
 
-    /* assign the new alerts */
-    tdata->alerts = msg;
-    return;
+    if (index == NULL) return NULL;
 
-cleanup:
-    transit_realtime__feed_message__free_unpacked (msg, NULL);
+    vj_index = tdata->journey_patterns[jp_index].vj_ids_offset + vj_offset;
+
+    /* Forked journey_patterns and vehicle_journeys are not indexed */
+    if (vj_index < index->n_vjs) {
+        first = tdata_alert_in_bucket (index, vj_index,
+                                       jp_index, vj_index, stop_index, time);
+    }
+
+    if (stop_index < index->n_stops) {
+        alert = tdata_alert_in_bucket (index, alert_bucket_stop (index, stop_index),
+                                       jp_index, vj_index, stop_index, time);
+        if (alert < first) first = alert;
+    }
+
+    if (jp_index < index->n_journey_patterns) {
+        alert = tdata_alert_in_bucket (index, alert_bucket_jp (index, jp_index),
+                                       jp_index, vj_index, stop_index, time);
+        if (alert < first) first = alert;
+    }
+
+    alert = tdata_alert_in_bucket (index, alert_bucket_any (index),
+                                   jp_index, vj_index, stop_index, time);
+    if (alert < first) first = alert;
+
+    if (first == ALERT_SELECTS_ANY) return NULL;
+
+    return index->msg->entity[first]->alert;
 }
 
 
@@ -135,11 +398,20 @@ fail_clean_fd:
     close (fd);
 }
 
+void tdata_alerts_free (alert_index_t *index) {
+    if (index == NULL) return;
+
+    transit_realtime__feed_message__free_unpacked (index->msg, NULL);
+    free (index->selectors);
+    free (index->offsets);
+    free (index->stops_closed);
+    free (index->journey_patterns_suspended);
+    free (index);
+}
+
 void tdata_clear_gtfsrt_alerts (tdata_t *tdata) {
-    if (tdata->alerts) {
-        transit_realtime__feed_message__free_unpacked (tdata->alerts, NULL);
-        tdata->alerts = NULL;
-    }
+    tdata_alerts_free (tdata->alerts);
+    tdata->alerts = NULL;
 }
 #else
 void tdata_gtfsrt_alerts_not_available() {}
@@ -8,10 +8,30 @@
 
 #include "tdata.h"
 
+#include <time.h>
+
+#define ALERT_SELECTS_ANY UINT32_MAX
+
+/* Replace the alerts by the ones in the feed, and index them by what they
+ * inform about.
+ */
 void tdata_apply_gtfsrt_alerts (tdata_t *td, uint8_t *buf, size_t len);
 
 void tdata_apply_gtfsrt_alerts_file (tdata_t *td, char *filename);
 
+/* Routers may run while alerts are applied, see tdata_realtime_enter; the
+ * alerts are cleared only when none does.
+ */
 void tdata_clear_gtfsrt_alerts (tdata_t *td);
 
+void tdata_alerts_free (alert_index_t *index);
+
+/* The first alert in the feed which informs about riding vehicle_journey
+ * vj_offset of journey_pattern jp_index from stop_index, and is active at
+ * time; or NULL.
+ */
+TransitRealtime__Alert *tdata_alert_for_leg (tdata_t *td, uint32_t jp_index,
+                                             uint32_t vj_offset, spidx_t stop_index,
+                                             time_t time);
+
 #endif /* _TDATA_REALTIME_ALERTS_H */
@@ -8,11 +8,21 @@
 #ifdef RRRR_FEATURE_REALTIME_EXPANDED
 
 #include "tdata_realtime_expanded.h"
+#include "arena.h"
+#include "bitset.h"
 #include "radixtree.h"
 #include "gtfs-realtime.pb-c.h"
 #include "rrrr_types.h"
 #include "util.h"
 
+#ifdef RRRR_FEATURE_LOWER_BOUND
+#include "lowerbound.h"
+#endif
+
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+#include "tdata_realtime_alerts.h"
+#endif
+
 #include <time.h>
 #include <stdio.h>
 #include <alloca.h>
@@ -24,84 +34,339 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-/* rt_journey_patterns_at_stop store the delta to the planned journey_patterns_at_stop */
+/* rt_journey_patterns_at_stop store the delta to the planned journey_patterns_at_stop.
+ * Routers read the lists while they change: an element is written before the
+ * length includes it, and a list which has to grow is copied and published
+ * once it is complete.
+ */
 static void tdata_rt_journey_patterns_at_stop_append(tdata_t *tdata,
         uint32_t stop_index,
         uint32_t jp_index) {
+    list_t *list = tdata->rt_journey_patterns_at_stop[stop_index];
     uint32_t i;
 
-    if (tdata->rt_journey_patterns_at_stop[stop_index]) {
-        for (i = 0; i < tdata->rt_journey_patterns_at_stop[stop_index]->len; ++i) {
-            if (((uint32_t *) tdata->rt_journey_patterns_at_stop[stop_index]->list)[i] ==
-                    jp_index) return;
+    if (list) {
+        for (i = 0; i < list->len; ++i) {
+            if (((uint32_t *) list->list)[i] == jp_index) return;
         }
-    } else {
-        tdata->rt_journey_patterns_at_stop[stop_index] =
-            (list_t *) calloc(1, sizeof(list_t));
     }
 
-    if (tdata->rt_journey_patterns_at_stop[stop_index]->len ==
-        tdata->rt_journey_patterns_at_stop[stop_index]->size) {
-        tdata->rt_journey_patterns_at_stop[stop_index]->list =
-            realloc(tdata->rt_journey_patterns_at_stop[stop_index]->list,
-                    sizeof(uint32_t) *
-                    (tdata->rt_journey_patterns_at_stop[stop_index]->size + 8));
-        tdata->rt_journey_patterns_at_stop[stop_index]->size += 8;
+    if (list == NULL || list->len == list->size) {
+        /* The arena can not grow an allocation, move the list instead */
+        list_t *grown = (list_t *) arena_alloc(&tdata->rt_arena, sizeof(list_t));
+        if (grown == NULL) return;
+        grown->size = (list ? list->size : 0) + 8;
+        grown->len = 0;
+        grown->list = arena_alloc(&tdata->rt_arena, sizeof(uint32_t) * grown->size);
+        if (grown->list == NULL) return;
+        if (list && list->len > 0) {
+            memcpy (grown->list, list->list, sizeof(uint32_t) * list->len);
+            grown->len = list->len;
+        }
+        ((uint32_t *) grown->list)[grown->len++] = jp_index;
+
+        rrrr_memory_barrier ();
+        tdata->rt_journey_patterns_at_stop[stop_index] = grown;
+        return;
     }
 
-    ((uint32_t *) tdata->rt_journey_patterns_at_stop[stop_index]->list)[tdata->rt_journey_patterns_at_stop[stop_index]->len++] = jp_index;
+    ((uint32_t *) list->list)[list->len] = jp_index;
+    rrrr_memory_barrier ();
+    list->len++;
 }
 
 static void tdata_rt_journey_patterns_at_stop_remove(tdata_t *tdata,
         uint32_t stop_index,
         uint32_t jp_index) {
+    list_t *list = tdata->rt_journey_patterns_at_stop[stop_index];
     uint32_t i;
-    for (i = 0; i < tdata->rt_journey_patterns_at_stop[stop_index]->len; ++i) {
-        if (((uint32_t *) tdata->rt_journey_patterns_at_stop[stop_index]->list)[i] ==
-                jp_index) {
-            tdata->rt_journey_patterns_at_stop[stop_index]->len--;
-            ((uint32_t *) tdata->rt_journey_patterns_at_stop[stop_index]->list)[i] =
-                ((uint32_t *) tdata->rt_journey_patterns_at_stop[stop_index]->list)[tdata->rt_journey_patterns_at_stop[stop_index]->len];
+
+    if (list == NULL) return;
+
+    for (i = 0; i < list->len; ++i) {
+        if (((uint32_t *) list->list)[i] == jp_index) {
+            ((uint32_t *) list->list)[i] = ((uint32_t *) list->list)[list->len - 1];
+            rrrr_memory_barrier ();
+            list->len--;
             return;
         }
     }
 }
 
-static void tdata_apply_gtfsrt_time (TransitRealtime__TripUpdate__StopTimeUpdate *update,
-                                     stoptime_t *stoptime) {
+/* What a StopTimeUpdate told about a stop, see tdata_realtime_propagate */
+typedef enum rt_observed {
+    rto_none      = 0,
+    rto_arrival   = 1,
+    rto_departure = 2,
+    /* NO_DATA: the stop keeps its schedule, and delays don't pass it */
+    rto_nodata    = 4
+} rt_observed_t;
+
+/* An absolute time of a StopTimeUpdate as the rtime after the midnight of
+ * the service day of its trip, an overnight trip of yesterday arrives after
+ * 24:00. Returns false for a time outside of the range of an rtime_t.
+ */
+static bool tdata_realtime_rtime (int64_t time, time_t midnight, rtime_t *rtime) {
+    int64_t seconds = time - (int64_t) midnight;
+
+    if (seconds < 0 || seconds >= (((int64_t) UNREACHED) << 2)) return false;
+
+    *rtime = SEC_TO_RTIME(seconds);
+    return true;
+}
+
+/* Returns the rt_observed_t flags of the times which were set */
+static uint8_t tdata_apply_gtfsrt_time (TransitRealtime__TripUpdate__StopTimeUpdate *update,
+                                        time_t midnight, stoptime_t *stoptime) {
+    uint8_t observed = rto_none;
+
     if (update->arrival) {
         if (update->arrival->has_time) {
-            stoptime->arrival  = epoch_to_rtime ((time_t) update->arrival->time, NULL) - RTIME_ONE_DAY;
+            if (tdata_realtime_rtime (update->arrival->time, midnight, &stoptime->arrival)) {
+                observed |= rto_arrival;
+            }
         } else if (update->arrival->has_delay) {
             stoptime->arrival += SEC_TO_RTIME(update->arrival->delay);
+            observed |= rto_arrival;
         }
     }
 
     /* not mutually exclusive */
     if (update->departure) {
         if (update->departure->has_time) {
-            stoptime->departure  = epoch_to_rtime ((time_t) update->departure->time, NULL) - RTIME_ONE_DAY;
+            if (tdata_realtime_rtime (update->departure->time, midnight, &stoptime->departure)) {
+                observed |= rto_departure;
+            }
         } else if (update->departure->has_delay) {
             stoptime->departure += SEC_TO_RTIME(update->departure->delay);
+            observed |= rto_departure;
         }
     }
+
+    return observed;
 }
 
-static void tdata_realtime_free_vj_index(tdata_t *tdata, uint32_t vj_index) {
-    if (tdata->vj_stoptimes[vj_index]) {
-        free(tdata->vj_stoptimes[vj_index]);
-        tdata->vj_stoptimes[vj_index] = NULL;
-        /* TODO: also free a forked journey_pattern and the reference to it */
-        /* TODO: restore original validity
-         * TODO: test if below works
-         */
-        tdata->vj_active[vj_index] = tdata->vj_active_orig[vj_index];
-/*        memcpy (&(tdata->vj_active[vj_index]),
-                &(tdata->vj_active_orig[vj_index]),
-                sizeof(calendar_t));*/
+/* Complete the stoptimes of a vehicle_journey a TripUpdate predicted only
+ * some of, in a single pass over its stops. The rt_stoptimes start out as
+ * the schedule, with the observed times applied.
+ *
+ * The delay of the last observed time carries over to the next stops, but
+ * decreases by a part of the scheduled running time of every segment and
+ * of the scheduled dwell time at every stop. At a waitingpoint a vehicle
+ * never departs before its scheduled time, so the whole dwell absorbs a
+ * delay there and running early ends.
+ */
+static void tdata_realtime_propagate (stoptime_t *rt_stoptimes,
+                                      stoptime_t *stoptimes, rtime_t begin_time,
+                                      uint8_t *attributes, uint8_t *observed,
+                                      uint16_t n_stops) {
+    int32_t delay = 0;
+    uint16_t i_stop;
+
+    for (i_stop = 0; i_stop < n_stops; ++i_stop) {
+        int32_t arrival   = begin_time + stoptimes[i_stop].arrival;
+        int32_t departure = begin_time + stoptimes[i_stop].departure;
+        int32_t dwell = departure - arrival;
+
+        if (observed[i_stop] & rto_nodata) {
+            delay = 0;
+            continue;
+        }
+
+        if (observed[i_stop] & rto_arrival) {
+            delay = rt_stoptimes[i_stop].arrival - arrival;
+        } else {
+            if (delay > 0 && i_stop > 0) {
+                int32_t runtime = arrival - (begin_time + stoptimes[i_stop - 1].departure);
+                int32_t recovery = runtime * RRRR_REALTIME_RECOVERY_RUNTIME / 100;
+                delay = (recovery < delay ? delay - recovery : 0);
+            }
+            rt_stoptimes[i_stop].arrival = (rtime_t) (arrival + delay);
+
+            /* never arrive before the departure at the previous stop */
+            if (i_stop > 0 && rt_stoptimes[i_stop].arrival < rt_stoptimes[i_stop - 1].departure) {
+                rt_stoptimes[i_stop].arrival = rt_stoptimes[i_stop - 1].departure;
+                delay = rt_stoptimes[i_stop].arrival - arrival;
+            }
+        }
+
+        if (observed[i_stop] & rto_departure) {
+            delay = rt_stoptimes[i_stop].departure - departure;
+        } else {
+            if (attributes[i_stop] & rsa_waitingpoint) {
+                delay = (delay > dwell ? delay - dwell : 0);
+            } else if (delay > 0) {
+                int32_t recovery = dwell * RRRR_REALTIME_RECOVERY_DWELL / 100;
+                delay = (recovery < delay ? delay - recovery : 0);
+            }
+            rt_stoptimes[i_stop].departure = (rtime_t) (departure + delay);
+
+            if (rt_stoptimes[i_stop].departure < rt_stoptimes[i_stop].arrival) {
+                rt_stoptimes[i_stop].departure = rt_stoptimes[i_stop].arrival;
+                delay = rt_stoptimes[i_stop].departure - departure;
+            }
+        }
     }
 }
 
+/* Set list to the realtime stoptimes of vj_index without the days given.
+ * The tdata_rt_stoptimes_t after the last one on one of these days are
+ * shared, the ones before it are copied when they apply to other days too.
+ */
+static bool tdata_realtime_without_days (tdata_t *tdata, uint32_t vj_index,
+                                         calendar_t days,
+                                         tdata_rt_stoptimes_t **list) {
+    tdata_rt_stoptimes_t *rt, *last = NULL;
+
+    for (rt = tdata->vj_stoptimes[vj_index]; rt; rt = rt->next) {
+        if (rt->days & days) last = rt;
+    }
+
+    if (last == NULL) {
+        *list = tdata->vj_stoptimes[vj_index];
+        return true;
+    }
+
+    for (rt = tdata->vj_stoptimes[vj_index]; rt != last->next; rt = rt->next) {
+        tdata_rt_stoptimes_t *copy;
+
+        if ((rt->days & ~days) == 0) continue;
+
+        copy = (tdata_rt_stoptimes_t *) arena_alloc (&tdata->rt_arena, sizeof(tdata_rt_stoptimes_t));
+        if (copy == NULL) return false;
+
+        copy->stop_times = rt->stop_times;
+        copy->days = rt->days & ~days;
+        *list = copy;
+        list = &copy->next;
+    }
+
+    *list = last->next;
+    return true;
+}
+
+static void tdata_realtime_free_vj_index(tdata_t *tdata, uint32_t vj_index,
+                                         calendar_t days) {
+    tdata_rt_stoptimes_t *list;
+
+    if (tdata->vj_stoptimes[vj_index] == NULL) return;
+
+    /* the stoptimes remain in the arena until tdata_clear_gtfsrt, without
+     * room for the list of the other days all of them are dropped
+     */
+    if ( ! tdata_realtime_without_days (tdata, vj_index, days, &list)) {
+        list = NULL;
+        days = ~((calendar_t) 0);
+    }
+
+    tdata_realtime_begin (tdata);
+    rrrr_memory_barrier ();
+    tdata->vj_stoptimes[vj_index] = list;
+
+    /* TODO: also free a forked journey_pattern and the reference to it */
+    tdata->vj_active[vj_index] = (tdata->vj_active[vj_index] & ~days) |
+                                 (tdata->vj_active_orig[vj_index] & days);
+}
+
+
+/* The time a vehicle_journey currently arrives or departs at a stop, on
+ * the service days in days.
+ */
+static rtime_t tdata_realtime_time (tdata_t *tdata, uint32_t vj_index,
+                                    calendar_t days, uint16_t i_stop,
+                                    bool arrival) {
+    stoptime_t *stoptime = tdata_rt_stoptimes_for_days (tdata, vj_index, days);
+
+    if (stoptime) {
+        return (arrival ? stoptime[i_stop].arrival : stoptime[i_stop].departure);
+    }
+
+    stoptime = tdata->stop_times + tdata->vjs[vj_index].stop_times_offset + i_stop;
+    return tdata->vjs[vj_index].begin_time +
+           (arrival ? stoptime->arrival : stoptime->departure);
+}
+
+/* Whether the stoptimes of vj_index on days would pass one of the
+ * vehicle_journeys next to it in its journey_pattern, at any stop.
+ */
+static bool tdata_realtime_overtakes (tdata_t *tdata, uint32_t vj_index,
+                                      stoptime_t *vj_stoptimes, calendar_t days) {
+    journey_pattern_t *jp = tdata->journey_patterns + tdata->vjs_in_journey_pattern[vj_index];
+    uint32_t vj_offset = vj_index - jp->vj_ids_offset;
+    uint16_t i_stop;
+
+    for (i_stop = 0; i_stop < jp->n_stops; ++i_stop) {
+        if (vj_stoptimes[i_stop].arrival == UNREACHED ||
+            vj_stoptimes[i_stop].departure == UNREACHED) continue;
+
+        if (vj_offset > 0 &&
+            (tdata_realtime_time (tdata, vj_index - 1, days, i_stop, true)  > vj_stoptimes[i_stop].arrival ||
+             tdata_realtime_time (tdata, vj_index - 1, days, i_stop, false) > vj_stoptimes[i_stop].departure)) {
+            return true;
+        }
+
+        if (vj_offset + 1 < jp->n_vjs &&
+            (tdata_realtime_time (tdata, vj_index + 1, days, i_stop, true)  < vj_stoptimes[i_stop].arrival ||
+             tdata_realtime_time (tdata, vj_index + 1, days, i_stop, false) < vj_stoptimes[i_stop].departure)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Widen min_time and max_time to include the stoptimes of a vehicle_journey */
+static void tdata_realtime_widen (rtime_t *min_time, rtime_t *max_time,
+                                  stoptime_t *vj_stoptimes, uint16_t n_stops) {
+    if (vj_stoptimes[0].arrival != UNREACHED &&
+        vj_stoptimes[0].arrival < *min_time) {
+        *min_time = vj_stoptimes[0].arrival;
+    }
+    if (vj_stoptimes[n_stops - 1].departure != UNREACHED &&
+        vj_stoptimes[n_stops - 1].departure > *max_time) {
+        *max_time = vj_stoptimes[n_stops - 1].departure;
+    }
+}
+
+/* Routers read the stoptimes of a vehicle_journey without locking: a new
+ * list with the stoptimes and their days is published by a single pointer,
+ * and the lists it replaces stay valid until the arena they were allocated
+ * from is retired. The bounds of the journey_pattern only widen, before the
+ * stoptimes become visible. The new list leaves out the earlier stoptimes
+ * on the days in replaced, which include days.
+ */
+static bool tdata_realtime_publish (tdata_t *tdata, uint32_t vj_index,
+                                    stoptime_t *vj_stoptimes, calendar_t days,
+                                    calendar_t replaced) {
+    uint32_t jp_index = tdata->vjs_in_journey_pattern[vj_index];
+    journey_pattern_t *jp = tdata->journey_patterns + jp_index;
+    tdata_rt_stoptimes_t *rt;
+
+    rt = (tdata_rt_stoptimes_t *) arena_alloc (&tdata->rt_arena, sizeof(tdata_rt_stoptimes_t));
+    if (rt == NULL ||
+        ! tdata_realtime_without_days (tdata, vj_index, days | replaced, &rt->next)) return false;
+
+    rt->stop_times = vj_stoptimes;
+    rt->days = days;
+
+    tdata_realtime_widen (&jp->min_time, &jp->max_time, vj_stoptimes, jp->n_stops);
+    if (jp->max_time > tdata->max_time) tdata->max_time = jp->max_time;
+
+    if (!bitset_get (tdata->rt_nonfifo, jp_index) &&
+        tdata_realtime_overtakes (tdata, vj_index, vj_stoptimes, days)) {
+        bitset_set (tdata->rt_nonfifo, jp_index);
+    }
+
+    /* A router which sees the days before the list looks for stoptimes
+     * which are not there yet, and uses the schedule.
+     */
+    tdata->rt_days |= days;
+    tdata_realtime_begin (tdata);
+    rrrr_memory_barrier ();
+    tdata->vj_stoptimes[vj_index] = rt;
+
+    return true;
+}
 
 /* Our datastructure requires us to commit on a fixed number of
  * vehicle_journeys and a fixed number of stops in the journey_pattern.
@@ -131,7 +396,21 @@ static uint32_t tdata_new_journey_pattern(tdata_t *tdata, char *vj_ids,
     uint16_t i_stop;
     uint16_t i_vj;
 
+    /* The loaders reserve RRRR_DYNAMIC_SLACK times the planned columns */
+    if (tdata->n_journey_patterns + 1 >
+            ((uint64_t) RRRR_DYNAMIC_SLACK) * tdata->n_journey_patterns_orig ||
+        tdata->n_vjs + n_vjs >
+            ((uint64_t) RRRR_DYNAMIC_SLACK) * tdata->n_vjs_orig ||
+        tdata->n_journey_pattern_points + n_stops >
+            ((uint64_t) RRRR_DYNAMIC_SLACK) * tdata->n_journey_pattern_points_orig ||
+        tdata->n_stop_times + n_stops >
+            ((uint64_t) RRRR_DYNAMIC_SLACK) * tdata->n_stop_times_orig) {
+        fprintf (stderr, "No room left to fork a journey_pattern.\n");
+        return RADIXTREE_NONE;
+    }
+
     new = &tdata->journey_patterns[tdata->n_journey_patterns];
+    tdata->journey_pattern_active[tdata->n_journey_patterns] = 0;
 
     new->journey_pattern_point_offset = journey_pattern_point_offset;
     new->vj_ids_offset = vj_index;
@@ -162,14 +441,9 @@ static uint32_t tdata_new_journey_pattern(tdata_t *tdata, char *vj_ids,
 
     /* add the last journey_pattern index to the lookup table */
     for (i_vj = 0; i_vj < n_vjs; ++i_vj) {
-        tdata->vj_stoptimes[vj_index] = (stoptime_t *) malloc(sizeof(stoptime_t) * n_stops);
-
-        for (i_stop = 0; i_stop < n_stops; ++i_stop) {
-            /* Initialise the realtime stoptimes */
-            tdata->vj_stoptimes[vj_index][i_stop].arrival   = UNREACHED;
-            tdata->vj_stoptimes[vj_index][i_stop].departure = UNREACHED;
-        }
-
+        /* the realtime stoptimes and days are published by the caller */
+        tdata->vj_stoptimes[vj_index] = NULL;
+        tdata->vj_active[vj_index] = 0;
         tdata->vjs[vj_index].begin_time = UNREACHED;
         tdata->vjs_in_journey_pattern[vj_index] = tdata->n_journey_patterns;
         vj_index++;
@@ -191,97 +465,119 @@ static uint32_t tdata_new_journey_pattern(tdata_t *tdata, char *vj_ids,
     return tdata->n_journey_patterns++;
 }
 
-void tdata_apply_stop_time_update (tdata_t *tdata, uint32_t jp_index, uint32_t vj_index, TransitRealtime__TripUpdate *rt_trip_update) {
-    uint32_t journey_pattern_point_offset = tdata->journey_patterns[jp_index].journey_pattern_point_offset;
-    uint32_t rs = 0;
-    uint32_t i_stu;
+/* The stops a changed vehicle_journey calls at, in the order of the update */
+static void tdata_realtime_stops (tdata_t *tdata, TransitRealtime__TripUpdate *rt_trip_update, spidx_t *stops) {
+    uint16_t rs = 0;
+    size_t i_stu;
 
-    /* We will always overwrite the entire journey_pattern, because we cannot
-     * tell if the journey_pattern is the same length, but consists of different
-     * stops.
-     */
     for (i_stu = 0;
          i_stu < rt_trip_update->n_stop_time_update;
          ++i_stu) {
         TransitRealtime__TripUpdate__StopTimeUpdate *rt_stop_time_update = rt_trip_update->stop_time_update[i_stu];
-        if (rt_stop_time_update->schedule_relationship != TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SKIPPED) {
-            char *stop_id = rt_stop_time_update->stop_id;
-            if (stop_id) {
-
-                uint32_t stop_index = radixtree_find (tdata->stopid_index, stop_id);
-                if (tdata->journey_pattern_points[journey_pattern_point_offset] != stop_index &&
-                    tdata->journey_pattern_points[journey_pattern_point_offset] != NONE) {
-                    tdata_rt_journey_patterns_at_stop_remove(tdata, tdata->journey_pattern_points[journey_pattern_point_offset], jp_index);
-                }
-                /* TODO: Should this be communicated in GTFS-RT? */
-                tdata->journey_pattern_point_attributes[journey_pattern_point_offset] = (rsa_boarding | rsa_alighting);
-                tdata->journey_pattern_points[journey_pattern_point_offset] = stop_index;
-                tdata_apply_gtfsrt_time (rt_stop_time_update, &tdata->vj_stoptimes[vj_index][rs]);
-                tdata_rt_journey_patterns_at_stop_append(tdata, stop_index, jp_index);
-                journey_pattern_point_offset++;
-                rs++;
-            }
+        if (rt_stop_time_update->schedule_relationship != TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SKIPPED &&
+            rt_stop_time_update->stop_id) {
+            stops[rs++] = (spidx_t) radixtree_find (tdata->stopid_index, rt_stop_time_update->stop_id);
         }
     }
+}
 
-    /* update the last stop to be alighting only */
-    tdata->journey_pattern_point_attributes[--journey_pattern_point_offset] = rsa_alighting;
+static void tdata_apply_stop_time_update (stoptime_t *vj_stoptimes, time_t midnight,
+                                          TransitRealtime__TripUpdate *rt_trip_update) {
+    uint32_t rs = 0;
+    size_t i_stu;
 
-    /* update the first stop to be boarding only */
-    journey_pattern_point_offset = tdata->journey_patterns[jp_index].journey_pattern_point_offset;
-    tdata->journey_pattern_point_attributes[journey_pattern_point_offset] = rsa_boarding;
+    for (i_stu = 0;
+         i_stu < rt_trip_update->n_stop_time_update;
+         ++i_stu) {
+        TransitRealtime__TripUpdate__StopTimeUpdate *rt_stop_time_update = rt_trip_update->stop_time_update[i_stu];
+        if (rt_stop_time_update->schedule_relationship != TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SKIPPED &&
+            rt_stop_time_update->stop_id) {
+            tdata_apply_gtfsrt_time (rt_stop_time_update, midnight, &vj_stoptimes[rs]);
+            rs++;
+        }
+    }
 }
 
-static void tdata_realtime_changed_journey_pattern(tdata_t *tdata, uint32_t vj_index, int16_t cal_day, uint16_t n_stops, TransitRealtime__TripUpdate *rt_trip_update) {
-    TransitRealtime__TripDescriptor *rt_trip = rt_trip_update->trip;
-    journey_pattern_t *jp_new = NULL;
-    char *vj_id_new;
-    uint32_t jp_index;
+/* Returns the journey_pattern forked for the vj_id prefixed with '@' */
+static uint32_t tdata_realtime_find_fork (tdata_t *tdata, char *vj_id_new) {
+    uint32_t jp_index = radixtree_find (tdata->lineid_index, vj_id_new);
 
-    /* Don't ever continue if we found that n_stops == 0. */
-    if (n_stops == 0) return;
+    /* tdata_clear_gtfsrt removes the forked journey_patterns, but not their
+     * vj_ids from lineid_index: the index may have been reused since.
+     */
+    if (jp_index != RADIXTREE_NONE &&
+        (jp_index >= tdata->n_journey_patterns ||
+         strncmp (tdata->vj_ids + tdata->journey_patterns[jp_index].vj_ids_offset * tdata->vj_ids_width,
+                  vj_id_new, tdata->vj_ids_width) != 0)) {
+        return RADIXTREE_NONE;
+    }
 
-    #ifdef RRRR_DEBUG
-    fprintf (stderr, "WARNING: this is a changed journey_pattern!\n");
-    #endif
+    return jp_index;
+}
 
-    /* The idea is to fork a vj to a new journey_pattern, based on
-     * the vehicle_journey id to find if the vehicle_journey id already exists
-     */
-    vj_id_new = (char *) alloca (sizeof(char) * tdata->vj_ids_width);
-    vj_id_new[0] = '@';
-    strncpy(&vj_id_new[1], rt_trip->trip_id, tdata->vj_ids_width - 1);
+/* Undo every TripUpdate applied to a scheduled vehicle_journey, including
+ * the journey_pattern it may have been forked into.
+ */
+static void tdata_realtime_revert_vj_index (tdata_t *tdata, uint32_t vj_index) {
+    uint32_t jp_index;
 
-    jp_index = radixtree_find (tdata->lineid_index, vj_id_new);
+    tdata_realtime_begin (tdata);
+    tdata->vj_stoptimes[vj_index] = NULL;
+    tdata->vj_active[vj_index] = tdata->vj_active_orig[vj_index];
 
+    jp_index = tdata_realtime_fork_of (tdata, vj_index);
     if (jp_index != RADIXTREE_NONE) {
-        /* Fixes the case where a vj changes a second time */
-        jp_new = &tdata->journey_patterns[jp_index];
-        if (jp_new->n_stops != n_stops) {
-            uint32_t i_stop_index;
+        /* The fork stays allocated, and is reused when the trip changes again */
+        tdata->journey_pattern_active[jp_index] = 0;
+        tdata->vj_active[tdata->journey_patterns[jp_index].vj_ids_offset] = 0;
+    }
+}
 
-            #ifdef RRRR_DEBUG
-            fprintf (stderr, "WARNING: this is changed vehicle_journey %s being CHANGED again!\n", vj_id_new);
-            #endif
-            tdata->vj_stoptimes[jp_new->vj_ids_offset] = (stoptime_t *) realloc(tdata->vj_stoptimes[jp_new->vj_ids_offset], sizeof(stoptime_t) * n_stops);
+/* Routers may still be scanning a fork, its stops are never changed. A fork
+ * which no longer matches the update is deactivated, and forked again.
+ */
+static void tdata_realtime_retire_fork (tdata_t *tdata, uint32_t jp_index) {
+    journey_pattern_t *jp = tdata->journey_patterns + jp_index;
+    spidx_t *points = tdata->journey_pattern_points + jp->journey_pattern_point_offset;
+    uint16_t i_stop;
 
-            /* Only initialises if the length of the list increased */
-            for (i_stop_index = jp_new->n_stops;
-                 i_stop_index < n_stops;
-                 ++i_stop_index) {
-                tdata->journey_pattern_points[jp_new->journey_pattern_point_offset + i_stop_index] = NONE;
-            }
-            jp_new->n_stops = n_stops;
+    tdata->journey_pattern_active[jp_index] = 0;
+    tdata->vj_active[jp->vj_ids_offset] = 0;
+
+    for (i_stop = 0; i_stop < jp->n_stops; ++i_stop) {
+        if (points[i_stop] != STOP_NONE) {
+            tdata_rt_journey_patterns_at_stop_remove (tdata, points[i_stop], jp_index);
         }
     }
+}
+
+/* Returns the journey_pattern a vehicle_journey is forked into to call at
+ * stops, which is either its earlier fork or a new one.
+ */
+static uint32_t tdata_realtime_fork (tdata_t *tdata, uint32_t vj_index, char *vj_id_new,
+                                     uint16_t n_stops, spidx_t *stops) {
+    journey_pattern_t *jp_new;
+    uint32_t jp_index;
+    uint16_t i_stop;
+
+    jp_index = tdata_realtime_find_fork (tdata, vj_id_new);
 
-    if (jp_new == NULL) {
+    /* Fixes the case where a vj changes a second time */
+    if (jp_index != RADIXTREE_NONE &&
+        (tdata->journey_patterns[jp_index].n_stops != n_stops ||
+         memcmp (tdata->journey_pattern_points + tdata->journey_patterns[jp_index].journey_pattern_point_offset,
+                 stops, sizeof(spidx_t) * n_stops) != 0)) {
+        #ifdef RRRR_DEBUG
+        fprintf (stderr, "WARNING: this is changed vehicle_journey %s being CHANGED again!\n", vj_id_new);
+        #endif
+        tdata_realtime_retire_fork (tdata, jp_index);
+        jp_index = RADIXTREE_NONE;
+    }
+
+    if (jp_index == RADIXTREE_NONE) {
         journey_pattern_t *jp = tdata->journey_patterns + tdata->vjs_in_journey_pattern[vj_index];
         vehicle_journey_t  *vj = tdata->vjs + vj_index;
-        uint16_t i_vj;
-
-        /* remove the planned vj from the operating day */
-        tdata->vj_active[vj_index] &= ~(1 << cal_day);
+        uint8_t *attributes;
 
         /* we fork a new journey_pattern with all of its old properties
          * having one single vj, which is the modification.
@@ -293,33 +589,117 @@ static void tdata_realtime_changed_journey_pattern(tdata_t *tdata, uint32_t vj_i
                 jp->line_code_index,
                 jp->productcategory_index);
 
+        if (jp_index == RADIXTREE_NONE) return RADIXTREE_NONE;
+
         jp_new = &(tdata->journey_patterns[jp_index]);
 
-        /* In the new vj_index we restore the original values
-         * NOTE: if we would have allocated multiple vehicle_journeys this
-         * should be a for loop over n_vjs.
-         */
-        vj_index = jp_new->vj_ids_offset;
+        /* In the new vj_index we restore the original values */
+        tdata->vjs[jp_new->vj_ids_offset].vj_attributes = vj->vj_attributes;
 
-        for (i_vj = 0; i_vj < 1; ++i_vj) {
-            tdata->vjs[vj_index].vj_attributes = vj->vj_attributes;
-            tdata->journey_pattern_active[vj_index] |= (1 << cal_day);
-            tdata->vj_active[vj_index] |= (1 << cal_day);
-            vj_index++;
+        memcpy (tdata->journey_pattern_points + jp_new->journey_pattern_point_offset,
+                stops, sizeof(spidx_t) * n_stops);
+
+        /* TODO: Should this be communicated in GTFS-RT? */
+        attributes = tdata->journey_pattern_point_attributes + jp_new->journey_pattern_point_offset;
+        for (i_stop = 0; i_stop < n_stops; ++i_stop) {
+            attributes[i_stop] = (rsa_boarding | rsa_alighting);
         }
 
-        /* Restore the first vj_index again */
-        vj_index = jp_new->vj_ids_offset;
+        /* update the last stop to be alighting only,
+         * and the first stop to be boarding only */
+        attributes[n_stops - 1] = rsa_alighting;
+        attributes[0] = rsa_boarding;
     }
 
-    tdata_apply_stop_time_update (tdata, jp_index, vj_index, rt_trip_update);
+    return jp_index;
+}
+
+/* Publish the stoptimes of a fork, and move the vehicle_journey from its
+ * planned journey_pattern to the fork on the days in active. With replace
+ * the fork runs on these days only.
+ */
+static bool tdata_realtime_activate_fork (tdata_t *tdata, uint32_t vj_index, uint32_t jp_index,
+                                          stoptime_t *vj_stoptimes, calendar_t active,
+                                          calendar_t rt_days, bool replace) {
+    journey_pattern_t *jp_new = &(tdata->journey_patterns[jp_index]);
+    spidx_t *stops = tdata->journey_pattern_points + jp_new->journey_pattern_point_offset;
+    uint16_t i_stop;
 
     /* being blissfully naive, a journey_pattern having only one vehicle_journey,
-     * will have the same start and end time as its vehicle_journey
+     * will have the same start and end time as its vehicle_journey, on the
+     * days it ran before as well
+     */
+    if (tdata->vj_stoptimes[jp_new->vj_ids_offset] == NULL) {
+        jp_new->min_time = vj_stoptimes[0].arrival;
+        jp_new->max_time = vj_stoptimes[jp_new->n_stops - 1].departure;
+    }
+
+    if ( ! tdata_realtime_publish (tdata, jp_new->vj_ids_offset, vj_stoptimes, rt_days,
+                                   (replace ? ~((calendar_t) 0) : rt_days))) {
+        return false;
+    }
+
+    /* Routers find the fork only once its stops and stoptimes are set */
+    for (i_stop = 0; i_stop < jp_new->n_stops; ++i_stop) {
+        if (stops[i_stop] != STOP_NONE) {
+            tdata_rt_journey_patterns_at_stop_append(tdata, stops[i_stop], jp_index);
+        }
+    }
+
+    /* the fork may have been reverted since it was created */
+    if (replace) {
+        tdata->journey_pattern_active[jp_index] = active;
+        tdata->vj_active[jp_new->vj_ids_offset] = active;
+    } else {
+        tdata->journey_pattern_active[jp_index] |= active;
+        tdata->vj_active[jp_new->vj_ids_offset] |= active;
+    }
+    tdata->vj_active[vj_index] &= ~active;
+
+    return true;
+}
+
+static bool tdata_realtime_changed_journey_pattern(tdata_t *tdata, uint32_t vj_index, int16_t cal_day, calendar_t rt_days, time_t midnight, uint16_t n_stops, TransitRealtime__TripUpdate *rt_trip_update, bool replace) {
+    TransitRealtime__TripDescriptor *rt_trip = rt_trip_update->trip;
+    stoptime_t *vj_stoptimes;
+    spidx_t *stops;
+    char *vj_id_new;
+    uint32_t jp_index;
+    uint16_t i_stop;
+
+    /* Don't ever continue if we found that n_stops == 0. */
+    if (n_stops == 0) return true;
+
+    #ifdef RRRR_DEBUG
+    fprintf (stderr, "WARNING: this is a changed journey_pattern!\n");
+    #endif
+
+    /* The idea is to fork a vj to a new journey_pattern, based on
+     * the vehicle_journey id to find if the vehicle_journey id already exists
      */
-    jp_new->min_time = tdata->vj_stoptimes[jp_new->vj_ids_offset][0].arrival;
-    jp_new->max_time = tdata->vj_stoptimes[vj_index][jp_new->n_stops - 1].departure;
+    vj_id_new = (char *) alloca (sizeof(char) * tdata->vj_ids_width);
+    vj_id_new[0] = '@';
+    strncpy(&vj_id_new[1], rt_trip->trip_id, tdata->vj_ids_width - 1);
+
+    stops = (spidx_t *) alloca (sizeof(spidx_t) * n_stops);
+    tdata_realtime_stops (tdata, rt_trip_update, stops);
+
+    jp_index = tdata_realtime_fork (tdata, vj_index, vj_id_new, n_stops, stops);
+    if (jp_index == RADIXTREE_NONE) return false;
+
+    /* An update of a fork starts over, like one of a planned vehicle_journey */
+    vj_stoptimes = (stoptime_t *) arena_alloc(&tdata->rt_arena, sizeof(stoptime_t) * n_stops);
+    if (vj_stoptimes == NULL) return false;
+
+    for (i_stop = 0; i_stop < n_stops; ++i_stop) {
+        vj_stoptimes[i_stop].arrival   = UNREACHED;
+        vj_stoptimes[i_stop].departure = UNREACHED;
+    }
 
+    tdata_apply_stop_time_update (vj_stoptimes, midnight, rt_trip_update);
+
+    return tdata_realtime_activate_fork (tdata, vj_index, jp_index, vj_stoptimes,
+                                         (calendar_t) (1 << cal_day), rt_days, replace);
 }
 
 static void tdata_realtime_journey_pattern_type(TransitRealtime__TripUpdate *rt_trip_update, uint16_t *n_stops, bool *changed_jp, bool *nodata_jp) {
@@ -342,90 +722,72 @@ static void tdata_realtime_journey_pattern_type(TransitRealtime__TripUpdate *rt_
     }
 }
 
-static void tdata_realtime_apply_tripupdates (tdata_t *tdata, uint32_t vj_index, TransitRealtime__TripUpdate *rt_trip_update) {
-    TransitRealtime__TripUpdate__StopTimeUpdate *rt_stop_time_update_prev = NULL;
+static bool tdata_realtime_apply_tripupdates (tdata_t *tdata, uint32_t vj_index, calendar_t rt_days, time_t midnight, TransitRealtime__TripUpdate *rt_trip_update, bool replace) {
     TransitRealtime__TripUpdate__StopTimeUpdate *rt_stop_time_update;
     journey_pattern_t *jp;
     vehicle_journey_t *vj;
+    spidx_t *journey_pattern_points;
     stoptime_t *vj_stoptimes;
+    stoptime_t *rt_stoptimes;
+    uint8_t *observed;
     size_t i_stu;
     uint32_t rs;
 
     jp = tdata->journey_patterns + tdata->vjs_in_journey_pattern[vj_index];
     vj = tdata->vjs + vj_index;
+    journey_pattern_points = tdata->journey_pattern_points + jp->journey_pattern_point_offset;
 
     /* Normal case: at least one SCHEDULED or some NO_DATA
      * stops have been observed
      */
-    if (tdata->vj_stoptimes[vj_index] == NULL) {
-        /* If the expanded timetable does not contain an entry yet, we are creating one */
-        tdata->vj_stoptimes[vj_index] = (stoptime_t *) malloc(sizeof(stoptime_t) * jp->n_stops);
-    }
+    rt_stoptimes = (stoptime_t *) arena_alloc(&tdata->rt_arena, sizeof(stoptime_t) * jp->n_stops);
+    if (rt_stoptimes == NULL) return false;
+
+    observed = (uint8_t *) alloca (sizeof(uint8_t) * jp->n_stops);
 
     /* The initial time-demand based schedules */
     vj_stoptimes = tdata->stop_times + vj->stop_times_offset;
 
     /* First re-initialise the old values from the schedule */
     for (rs = 0; rs < jp->n_stops; ++rs) {
-        tdata->vj_stoptimes[vj_index][rs].arrival   = vj->begin_time + vj_stoptimes[rs].arrival;
-        tdata->vj_stoptimes[vj_index][rs].departure = vj->begin_time + vj_stoptimes[rs].departure;
+        rt_stoptimes[rs].arrival   = vj->begin_time + vj_stoptimes[rs].arrival;
+        rt_stoptimes[rs].departure = vj->begin_time + vj_stoptimes[rs].departure;
+        observed[rs] = rto_none;
     }
 
+    /* Apply the times the StopTimeUpdates observed, in the order of the
+     * journey_pattern, an update of a stop which isn't next is searched
+     * for further along.
+     */
     rs = 0;
-    for (i_stu = 0; i_stu < rt_trip_update->n_stop_time_update; ++i_stu) {
-        spidx_t *journey_pattern_points = tdata->journey_pattern_points + jp->journey_pattern_point_offset;
-        char *stop_id;
+    for (i_stu = 0; i_stu < rt_trip_update->n_stop_time_update && rs < jp->n_stops; ++i_stu) {
         uint32_t stop_index;
+        uint32_t found = rs;
 
         rt_stop_time_update = rt_trip_update->stop_time_update[i_stu];
-        stop_id = rt_stop_time_update->stop_id;
-        stop_index = radixtree_find (tdata->stopid_index, stop_id);
+        if (rt_stop_time_update->schedule_relationship != TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED &&
+            rt_stop_time_update->schedule_relationship != TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__NO_DATA) continue;
 
+        stop_index = radixtree_find (tdata->stopid_index, rt_stop_time_update->stop_id);
+        while (found < jp->n_stops && journey_pattern_points[found] != stop_index) found++;
 
-        if (journey_pattern_points[rs] == stop_index) {
-            if (rt_stop_time_update->schedule_relationship == TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED) {
-                tdata_apply_gtfsrt_time (rt_stop_time_update, &tdata->vj_stoptimes[vj_index][rs]);
-            }
-            /* In case of NO_DATA we won't do anything */
-            rs++;
+        /* we couldn't find the stop at all */
+        if (found == jp->n_stops) continue;
 
+        if (rt_stop_time_update->schedule_relationship == TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__NO_DATA) {
+            observed[found] = rto_nodata;
         } else {
-            /* we do not align up with the realtime messages */
-            if (rt_stop_time_update->schedule_relationship == TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED) {
-                uint32_t propagate = rs;
-                while (journey_pattern_points[++rs] != stop_index && rs < jp->n_stops);
-                if (journey_pattern_points[rs] == stop_index) {
-                    if (rt_stop_time_update_prev) {
-                        if (rt_stop_time_update_prev->schedule_relationship == TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED &&
-                            rt_stop_time_update_prev->departure && rt_stop_time_update_prev->departure->has_delay) {
-                            for (; propagate < rs; ++propagate) {
-                                tdata->vj_stoptimes[vj_index][propagate].arrival   += SEC_TO_RTIME(rt_stop_time_update_prev->departure->delay);
-                                tdata->vj_stoptimes[vj_index][propagate].departure += SEC_TO_RTIME(rt_stop_time_update_prev->departure->delay);
-                            }
-                        }
-                    }
-                    tdata_apply_gtfsrt_time (rt_stop_time_update, &tdata->vj_stoptimes[vj_index][rs]);
-                } else {
-                    /* we couldn't find the stop at all */
-                    rs = propagate;
-                }
-                rs++;
-            }
+            observed[found] = tdata_apply_gtfsrt_time (rt_stop_time_update, midnight, &rt_stoptimes[found]);
         }
-
-        rt_stop_time_update_prev = rt_stop_time_update;
+        rs = found + 1;
     }
 
-    /* the last StopTimeUpdate isn't the end of journey_pattern_points set SCHEDULED,
-        * and the departure has a delay, naively propagate the delay */
-    rt_stop_time_update = rt_trip_update->stop_time_update[rt_trip_update->n_stop_time_update - 1];
-    if (rt_stop_time_update->schedule_relationship == TRANSIT_REALTIME__TRIP_UPDATE__STOP_TIME_UPDATE__SCHEDULE_RELATIONSHIP__SCHEDULED &&
-        rt_stop_time_update->departure && rt_stop_time_update->departure->has_delay) {
-        for (; rs < jp->n_stops; ++rs) {
-            tdata->vj_stoptimes[vj_index][rs].arrival   += SEC_TO_RTIME(rt_stop_time_update->departure->delay);
-            tdata->vj_stoptimes[vj_index][rs].departure += SEC_TO_RTIME(rt_stop_time_update->departure->delay);
-        }
-    }
+    tdata_realtime_propagate (rt_stoptimes, vj_stoptimes, vj->begin_time,
+                              tdata_stop_attributes_for_journey_pattern (tdata, tdata->vjs_in_journey_pattern[vj_index]),
+                              observed, jp->n_stops);
+
+    return tdata_realtime_publish (tdata, vj_index, rt_stoptimes, rt_days,
+                                   (replace ? ~((calendar_t) 0) : rt_days));
 }
 
 
@@ -433,8 +795,29 @@ static void tdata_realtime_apply_tripupdates (tdata_t *tdata, uint32_t vj_index,
 
 bool tdata_alloc_expanded(tdata_t *td) {
     uint32_t i_jp;
-    td->vj_stoptimes = (stoptime_t **) calloc(td->n_vjs, sizeof(stoptime_t *));
-    td->vjs_in_journey_pattern = (uint32_t *) malloc(sizeof(uint32_t) * td->n_vjs);
+
+    arena_init (&td->rt_arena, RRRR_REALTIME_ARENA_CHUNK);
+    arena_init (&td->rt_arena_retired, RRRR_REALTIME_ARENA_CHUNK);
+    td->rt_arena_live = 0;
+    td->rt_retired = false;
+    td->rt_retired_ticket = 0;
+    td->rt_epoch = 0;
+    td->rt_readers[0] = 0;
+    td->rt_readers[1] = 0;
+    td->rt_version = 0;
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    td->rt_lowerbound_retired = NULL;
+    #endif
+    #ifdef RRRR_FEATURE_REALTIME_ALERTS
+    td->rt_alerts_retired = NULL;
+    #endif
+
+    /* Forked vehicle_journeys are appended, as the loaders do for the
+     * columns they reserve RRRR_DYNAMIC_SLACK for.
+     */
+    td->vj_stoptimes = (tdata_rt_stoptimes_t **) calloc(RRRR_DYNAMIC_SLACK * td->n_vjs, sizeof(tdata_rt_stoptimes_t *));
+    td->vjs_in_journey_pattern = (uint32_t *) malloc(sizeof(uint32_t) * RRRR_DYNAMIC_SLACK * td->n_vjs);
+    td->rt_days = 0;
 
     if (!td->vj_stoptimes || !td->vjs_in_journey_pattern) return false;
 
@@ -450,7 +833,24 @@ bool tdata_alloc_expanded(tdata_t *td) {
 
     td->vj_active_orig = (calendar_t *) malloc(sizeof(calendar_t) * td->n_vjs);
 
-    td->journey_pattern_active_orig = (calendar_t *) malloc(sizeof(calendar_t) * td->n_vjs);
+    td->journey_pattern_active_orig = (calendar_t *) malloc(sizeof(calendar_t) * td->n_journey_patterns);
+
+    td->journey_pattern_min_time_orig = (rtime_t *) malloc(sizeof(rtime_t) * td->n_journey_patterns);
+    td->journey_pattern_max_time_orig = (rtime_t *) malloc(sizeof(rtime_t) * td->n_journey_patterns);
+    td->rt_nonfifo = bitset_new (RRRR_DYNAMIC_SLACK * td->n_journey_patterns);
+    td->max_time_orig = td->max_time;
+
+    /* The planned sizes, to remove the forked journey_patterns again */
+    td->n_journey_patterns_orig = td->n_journey_patterns;
+    td->n_journey_pattern_points_orig = td->n_journey_pattern_points;
+    td->n_stop_times_orig = td->n_stop_times;
+    td->n_vjs_orig = td->n_vjs;
+
+    td->rt_vjs = (uint32_t *) malloc(sizeof(uint32_t) * td->n_vjs);
+    td->vj_rt_hash = (uint32_t *) calloc(td->n_vjs, sizeof(uint32_t));
+    td->vj_rt_generation = (uint32_t *) calloc(td->n_vjs, sizeof(uint32_t));
+    td->n_rt_vjs = 0;
+    td->rt_generation = 0;
 
     memcpy (td->vj_active_orig, td->vj_active,
             sizeof(calendar_t) * td->n_vjs);
@@ -458,172 +858,602 @@ bool tdata_alloc_expanded(tdata_t *td) {
     memcpy (td->journey_pattern_active_orig, td->journey_pattern_active,
             sizeof(calendar_t) * td->n_journey_patterns);
 
-    if (!td->rt_journey_patterns_at_stop) return false;
+    if (!td->rt_journey_patterns_at_stop ||
+        !td->rt_vjs || !td->vj_rt_hash || !td->vj_rt_generation ||
+        !td->journey_pattern_min_time_orig || !td->journey_pattern_max_time_orig ||
+        !td->rt_nonfifo) return false;
+
+    for (i_jp = 0; i_jp < td->n_journey_patterns; ++i_jp) {
+        td->journey_pattern_min_time_orig[i_jp] = td->journey_patterns[i_jp].min_time;
+        td->journey_pattern_max_time_orig[i_jp] = td->journey_patterns[i_jp].max_time;
+    }
 
     return true;
 }
 
 void tdata_free_expanded(tdata_t *td) {
     free (td->vjs_in_journey_pattern);
+    free (td->vj_stoptimes);
+    free (td->rt_journey_patterns_at_stop);
+    free (td->rt_vjs);
+    free (td->vj_rt_hash);
+    free (td->vj_rt_generation);
+    arena_destroy (&td->rt_arena);
+    arena_destroy (&td->rt_arena_retired);
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    if (td->rt_lowerbound_retired) {
+        lowerbound_teardown (td->rt_lowerbound_retired);
+        free (td->rt_lowerbound_retired);
+        td->rt_lowerbound_retired = NULL;
+    }
+    #endif
+    #ifdef RRRR_FEATURE_REALTIME_ALERTS
+    tdata_alerts_free (td->rt_alerts_retired);
+    td->rt_alerts_retired = NULL;
+    #endif
 
-    if (td->vj_stoptimes) {
-        uint32_t i_vj;
-        for (i_vj = 0; i_vj < td->n_vjs; ++i_vj) {
-            free (td->vj_stoptimes[i_vj]);
-        }
+    free (td->vj_active_orig);
+    free (td->journey_pattern_active_orig);
+    free (td->journey_pattern_min_time_orig);
+    free (td->journey_pattern_max_time_orig);
+    bitset_destroy (td->rt_nonfifo);
+}
+
+
+
+/* Apply a single TripUpdate to the vehicle_journey it refers to, returns
+ * false when the update could not be applied. With replace it starts from
+ * the schedule instead of from the earlier TripUpdates, on all days.
+ */
+static bool tdata_realtime_apply_entity (tdata_t *tdata, uint32_t vj_index,
+                                         TransitRealtime__FeedEntity *rt_entity,
+                                         bool replace) {
+    TransitRealtime__TripUpdate *rt_trip_update = rt_entity->trip_update;
+    TransitRealtime__TripDescriptor *rt_trip = rt_trip_update->trip;
+    struct tm ltm;
+    time_t epochtime;
+    int16_t cal_day;
+    calendar_t rt_days, replaced, active;
+    char buf[9];
+
+    if (rt_entity->is_deleted) {
+        tdata_realtime_free_vj_index(tdata, vj_index, ~((calendar_t) 0));
+        return true;
+    }
 
-        free (td->vj_stoptimes);
+    if (!rt_trip->start_date) {
+        #ifdef RRRR_DEBUG
+        fprintf(stderr, "WARNING: not handling realtime updates without a start date!\n");
+        #endif
+        return false;
     }
 
-    if (td->rt_journey_patterns_at_stop) {
-        uint32_t i_stop;
-        for (i_stop = 0; i_stop < td->n_stops; ++i_stop) {
-            if (td->rt_journey_patterns_at_stop[i_stop]) {
-                free (td->rt_journey_patterns_at_stop[i_stop]->list);
+    /* Take care of the realtime validity */
+    memset (&ltm, 0, sizeof(struct tm));
+    strncpy (buf, rt_trip->start_date, 8);
+    buf[8] = '\0';
+    ltm.tm_mday = strtol(&buf[6], NULL, 10);
+    buf[6] = '\0';
+    ltm.tm_mon  = strtol(&buf[4], NULL, 10) - 1;
+    buf[4] = '\0';
+    ltm.tm_year = strtol(&buf[0], NULL, 10) - 1900;
+    ltm.tm_isdst = -1;
+    epochtime = mktime(&ltm);
+
+    cal_day = (epochtime - tdata->calendar_start_time) / SEC_IN_ONE_DAY;
+
+    if (cal_day < 0 || cal_day > 31 ) {
+        #ifdef RRRR_DEBUG
+        fprintf(stderr, "WARNING: the operational day is 32 further than our calendar!\n");
+        #endif
+
+        #ifndef RRRR_FAKE_REALTIME
+        return false;
+        #endif
+    }
+
+    /* The stoptimes of this update only apply to the operational day of
+     * the trip, when QA testing on any day of the calendar.
+     */
+    #ifdef RRRR_FAKE_REALTIME
+    rt_days = ~((calendar_t) 0);
+    #else
+    rt_days = ((calendar_t) 1) << cal_day;
+    #endif
+
+    if (replace) {
+        replaced = ~((calendar_t) 0);
+        active = tdata->vj_active_orig[vj_index];
+    } else {
+        replaced = rt_days;
+        active = tdata->vj_active[vj_index];
+    }
+
+    if (rt_trip->schedule_relationship ==
+        TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__CANCELED) {
+        /* Apply the cancel to the schedule */
+        tdata->vj_active[vj_index] = active & ~(1 << cal_day);
+
+    } else if (rt_trip->schedule_relationship ==
+               TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__SCHEDULED) {
+        /* Mark in the schedule the vj is scheduled */
+        tdata->vj_active[vj_index] = active | (1 << cal_day);
+
+        if (rt_trip_update->n_stop_time_update) {
+            uint16_t n_stops;
+            bool changed_jp;
+            bool nodata_jp;
+
+            tdata_realtime_journey_pattern_type(rt_trip_update, &n_stops, &changed_jp, &nodata_jp);
+
+            /* Don't ever continue if we found that n_stops == 0,
+             * this entire journey_pattern doesn't have any data.
+             */
+            if (nodata_jp || n_stops == 0) {
+                /* If data previously was available, we should fall
+                 * back to the schedule
+                 */
+                tdata_realtime_free_vj_index(tdata, vj_index, replaced);
+            }
+
+            /* If the vj has a different journey_pattern, for example stops
+             * have been added or cancelled we must fork this vj
+             * into a new journey_pattern
+             */
+            else if (changed_jp) {
+                return tdata_realtime_changed_journey_pattern(tdata, vj_index, cal_day, rt_days, epochtime, n_stops, rt_trip_update, replace);
+
+            } else {
+                return tdata_realtime_apply_tripupdates (tdata, vj_index, rt_days, epochtime, rt_trip_update, replace);
+
             }
         }
+    } else {
+        tdata->vj_active[vj_index] = active;
+    }
 
-        free (td->rt_journey_patterns_at_stop);
+    return true;
+}
+
+/* Apply a TripUpdate which replaces the one of an earlier feed. Routers see
+ * the new stoptimes replace the old ones by a single pointer store, never
+ * the schedule in between. What only the earlier TripUpdate set is removed
+ * last: a router may meanwhile find the trip on its fork as well, but does
+ * not miss it.
+ */
+static bool tdata_realtime_replace_entity (tdata_t *tdata, uint32_t vj_index,
+                                           TransitRealtime__FeedEntity *rt_entity) {
+    tdata_rt_stoptimes_t *replaced = tdata->vj_stoptimes[vj_index];
+    tdata_rt_stoptimes_t *replaced_fork = NULL;
+    uint32_t jp_index = tdata_realtime_fork_of (tdata, vj_index);
+    uint32_t fork_vj_index = 0;
+
+    if (jp_index != RADIXTREE_NONE) {
+        fork_vj_index = tdata->journey_patterns[jp_index].vj_ids_offset;
+        replaced_fork = tdata->vj_stoptimes[fork_vj_index];
     }
 
-    free (td->vj_active_orig);
-    free (td->journey_pattern_active_orig);
+    if ( ! tdata_realtime_apply_entity (tdata, vj_index, rt_entity, true)) {
+        tdata_realtime_revert_vj_index (tdata, vj_index);
+        return false;
+    }
+
+    if (replaced && tdata->vj_stoptimes[vj_index] == replaced) {
+        tdata_realtime_begin (tdata);
+        rrrr_memory_barrier ();
+        tdata->vj_stoptimes[vj_index] = NULL;
+    }
+
+    if (jp_index != RADIXTREE_NONE &&
+        tdata->vj_stoptimes[fork_vj_index] == replaced_fork) {
+        tdata->journey_pattern_active[jp_index] = 0;
+        tdata->vj_active[fork_vj_index] = 0;
+    }
+
+    return true;
 }
 
+#define rt_round(size) (((size) + 7) & ~((size_t) 7))
 
+/* Move the realtime data still in use into the spare arena, the stoptimes
+ * replaced by earlier feeds are left behind in the retired one. Returns true
+ * when the arenas were swapped.
+ */
+static bool tdata_realtime_compact (tdata_t *tdata) {
+    arena_t arena;
+    char *block;
+    size_t size = 0;
+    uint32_t i;
 
-/* Decodes the GTFS-RT message of lenth len in buffer buf, extracting vehicle
- * position messages and using the delay extension (1003) to update RRRR's
- * per-vj delay information.
+    /* A single allocation, so a failure leaves everything in place */
+    for (i = 0; i < tdata->n_vjs; ++i) {
+        tdata_rt_stoptimes_t *rt;
+        for (rt = tdata->vj_stoptimes[i]; rt; rt = rt->next) {
+            size += rt_round(sizeof(tdata_rt_stoptimes_t)) +
+                    rt_round(sizeof(stoptime_t) *
+                             tdata->journey_patterns[tdata->vjs_in_journey_pattern[i]].n_stops);
+        }
+    }
+    for (i = 0; i < tdata->n_stops; ++i) {
+        if (tdata->rt_journey_patterns_at_stop[i] == NULL) continue;
+        size += rt_round(sizeof(list_t)) +
+                rt_round(sizeof(uint32_t) * tdata->rt_journey_patterns_at_stop[i]->len);
+    }
+
+    block = (char *) arena_alloc (&tdata->rt_arena_retired, size);
+    if (block == NULL) return false;
+
+    for (i = 0; i < tdata->n_vjs; ++i) {
+        size_t n_bytes = sizeof(stoptime_t) *
+                         tdata->journey_patterns[tdata->vjs_in_journey_pattern[i]].n_stops;
+        tdata_rt_stoptimes_t *rt, *list = NULL, **tail = &list;
+
+        if (tdata->vj_stoptimes[i] == NULL) continue;
+
+        for (rt = tdata->vj_stoptimes[i]; rt; rt = rt->next) {
+            tdata_rt_stoptimes_t *moved = (tdata_rt_stoptimes_t *) block;
+            block += rt_round(sizeof(tdata_rt_stoptimes_t));
+            moved->stop_times = (stoptime_t *) block;
+            moved->days = rt->days;
+            moved->next = NULL;
+            memcpy (moved->stop_times, rt->stop_times, n_bytes);
+            block += rt_round(n_bytes);
+            *tail = moved;
+            tail = &moved->next;
+        }
+
+        rrrr_memory_barrier ();
+        tdata->vj_stoptimes[i] = list;
+    }
+    for (i = 0; i < tdata->n_stops; ++i) {
+        list_t *list = tdata->rt_journey_patterns_at_stop[i];
+        list_t *moved = (list_t *) block;
+        if (list == NULL) continue;
+        block += rt_round(sizeof(list_t));
+        moved->list = block;
+        moved->size = list->len;
+        moved->len = list->len;
+        memcpy (moved->list, list->list, sizeof(uint32_t) * list->len);
+        block += rt_round(sizeof(uint32_t) * list->len);
+
+        rrrr_memory_barrier ();
+        tdata->rt_journey_patterns_at_stop[i] = moved;
+    }
+
+    arena = tdata->rt_arena;
+    tdata->rt_arena = tdata->rt_arena_retired;
+    tdata->rt_arena_retired = arena;
+    tdata->rt_arena_live = tdata->rt_arena.n_bytes;
+
+    /* The bounds widened by stoptimes which have been replaced since */
+    tdata_realtime_bounds (tdata, NULL);
+
+    return true;
+}
+
+#ifdef RRRR_FEATURE_LOWER_BOUND
+/* Replace the lower bound graph by one built from the current stoptimes,
+ * the replaced graph is retired along with the realtime arena.
  */
-void tdata_apply_gtfsrt_tripupdates (tdata_t *tdata, uint8_t *buf, size_t len) {
+static bool tdata_realtime_lowerbound (tdata_t *tdata) {
+    lowerbound_t *lb = (lowerbound_t *) malloc (sizeof(lowerbound_t));
+
+    if (lb == NULL) return false;
+    if ( ! lowerbound_init (lb, tdata)) {
+        free (lb);
+        return false;
+    }
+
+    /* the version which completes the changes it was built from */
+    lb->rt_version = tdata->rt_version + 1;
+    tdata->rt_lowerbound_retired = tdata->lowerbound;
+    rrrr_memory_barrier ();
+    tdata->lowerbound = lb;
+
+    return true;
+}
+#endif
+
+static void tdata_realtime_free_retired (tdata_t *tdata) {
+    arena_reset (&tdata->rt_arena_retired);
+    #ifdef RRRR_FEATURE_LOWER_BOUND
+    if (tdata->rt_lowerbound_retired) {
+        lowerbound_teardown (tdata->rt_lowerbound_retired);
+        free (tdata->rt_lowerbound_retired);
+        tdata->rt_lowerbound_retired = NULL;
+    }
+    #endif
+    #ifdef RRRR_FEATURE_REALTIME_ALERTS
+    tdata_alerts_free (tdata->rt_alerts_retired);
+    tdata->rt_alerts_retired = NULL;
+    #endif
+    tdata->rt_retired = false;
+}
+
+/* Frees what was retired when no router uses it anymore, returns false
+ * while one still does.
+ */
+static bool tdata_realtime_reclaim (tdata_t *tdata) {
+    if (tdata->rt_retired) {
+        if (rrrr_atomic_get (&tdata->rt_readers[tdata->rt_retired_ticket]) != 0) return false;
+        tdata_realtime_free_retired (tdata);
+    }
+    return true;
+}
+
+/* Routers which entered before this point may still use what was just
+ * replaced: the old arena, the old graph or the old alerts.
+ */
+static void tdata_realtime_retire (tdata_t *tdata) {
+    tdata->rt_retired = true;
+    tdata->rt_retired_ticket = rrrr_atomic_get (&tdata->rt_epoch) & 1;
+    rrrr_atomic_add (&tdata->rt_epoch, 1);
+}
+
+void tdata_realtime_begin (tdata_t *tdata) {
+    if ((rrrr_atomic_get (&tdata->rt_version) & 1) == 0) {
+        rrrr_atomic_add (&tdata->rt_version, 1);
+    }
+}
+
+void tdata_realtime_commit (tdata_t *tdata) {
+    bool retire = false;
+
+    /* Only one generation of replaced data is kept. While a router still
+     * uses it, the graph stays out of use until the next commit.
+     */
+    if ( ! tdata_realtime_reclaim (tdata)) return;
+
+    if (rrrr_atomic_get (&tdata->rt_version) & 1) {
+        #ifdef RRRR_FEATURE_LOWER_BOUND
+        if ( ! tdata_realtime_lowerbound (tdata)) {
+            fprintf (stderr, "Could not rebuild the lower bound graph.\n");
+            return;
+        }
+        retire = true;
+        #endif
+        rrrr_atomic_add (&tdata->rt_version, 1);
+    }
+
+    /* Retire the current arena when most of it holds stoptimes which
+     * have been replaced since.
+     */
+    if (tdata->rt_arena.n_bytes > 2 * tdata->rt_arena_live + RRRR_REALTIME_ARENA_CHUNK &&
+        tdata_realtime_compact (tdata)) {
+        retire = true;
+    }
+
+    if (retire) tdata_realtime_retire (tdata);
+}
+
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+bool tdata_realtime_publish_alerts (tdata_t *tdata, alert_index_t *alerts) {
+    if ( ! tdata_realtime_reclaim (tdata)) return false;
+
+    tdata->rt_alerts_retired = tdata->alerts;
+    rrrr_memory_barrier ();
+    tdata->alerts = alerts;
+    tdata_realtime_retire (tdata);
+
+    return true;
+}
+#endif
+
+uint32_t tdata_realtime_enter (tdata_t *tdata) {
+    uint32_t epoch;
+
+    /* The updater may retire an arena between reading the epoch and
+     * counting this reader in: try again.
+     */
+    for (;;) {
+        epoch = rrrr_atomic_get (&tdata->rt_epoch);
+        rrrr_atomic_add (&tdata->rt_readers[epoch & 1], 1);
+        if (rrrr_atomic_get (&tdata->rt_epoch) == epoch) break;
+        rrrr_atomic_sub (&tdata->rt_readers[epoch & 1], 1);
+    }
+
+    return epoch & 1;
+}
+
+void tdata_realtime_leave (tdata_t *tdata, uint32_t ticket) {
+    rrrr_atomic_sub (&tdata->rt_readers[ticket], 1);
+}
+
+/* FNV-1a, over the fields of a TripUpdate which change the timetable */
+#define FNV_OFFSET_BASIS 2166136261U
+#define FNV_PRIME 16777619U
+
+static uint32_t hash_bytes (uint32_t hash, const void *data, size_t len) {
+    const uint8_t *b = (const uint8_t *) data;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ b[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t hash_uint (uint32_t hash, uint32_t value) {
+    return hash_bytes (hash, &value, sizeof(uint32_t));
+}
+
+static uint32_t hash_string (uint32_t hash, const char *s) {
+    if (s == NULL) return hash_uint (hash, 0);
+    return hash_bytes (hash, s, strlen(s) + 1);
+}
+
+static uint32_t hash_stop_time_event (uint32_t hash,
+                                      TransitRealtime__TripUpdate__StopTimeEvent *event) {
+    int64_t time;
+
+    if (event == NULL) return hash_uint (hash, 0);
+
+    time = event->has_time ? event->time : 0;
+    hash = hash_uint (hash, 1);
+    hash = hash_uint (hash, event->has_delay ? (uint32_t) event->delay : 0);
+    hash = hash_uint (hash, (uint32_t) event->has_time);
+    return hash_bytes (hash, &time, sizeof(int64_t));
+}
+
+/* The timestamps in the feed are left out, they change with every feed */
+static uint32_t tdata_realtime_hash_entity (TransitRealtime__FeedEntity *rt_entity) {
+    TransitRealtime__TripUpdate *rt_trip_update = rt_entity->trip_update;
+    TransitRealtime__TripDescriptor *rt_trip = rt_trip_update->trip;
+    uint32_t hash = FNV_OFFSET_BASIS;
+    size_t i_stu;
+
+    hash = hash_uint (hash, (uint32_t) rt_entity->is_deleted);
+    hash = hash_string (hash, rt_trip->trip_id);
+    hash = hash_string (hash, rt_trip->start_date);
+    hash = hash_uint (hash, (uint32_t) rt_trip->schedule_relationship);
+
+    for (i_stu = 0; i_stu < rt_trip_update->n_stop_time_update; ++i_stu) {
+        TransitRealtime__TripUpdate__StopTimeUpdate *rt_stop_time_update = rt_trip_update->stop_time_update[i_stu];
+        hash = hash_string (hash, rt_stop_time_update->stop_id);
+        hash = hash_uint (hash, (uint32_t) rt_stop_time_update->schedule_relationship);
+        hash = hash_stop_time_event (hash, rt_stop_time_update->arrival);
+        hash = hash_stop_time_event (hash, rt_stop_time_update->departure);
+    }
+
+    /* zero marks a vehicle_journey without realtime */
+    return (hash == 0 ? 1 : hash);
+}
+
+/* Remember which scheduled vehicle_journeys carry realtime changes, and
+ * from which TripUpdate.
+ */
+static void tdata_realtime_track_vj_index (tdata_t *tdata, uint32_t vj_index,
+                                           uint32_t hash) {
+    if (tdata->vj_rt_hash[vj_index] == 0) {
+        tdata->rt_vjs[tdata->n_rt_vjs++] = vj_index;
+    }
+    tdata->vj_rt_hash[vj_index] = hash;
+    tdata->vj_rt_generation[vj_index] = tdata->rt_generation;
+}
+
+bool tdata_apply_gtfsrt_feed (tdata_t *tdata, uint8_t *buf, size_t len,
+                              bool replace, tdata_rt_feed_stats_t *stats) {
     size_t e;
     TransitRealtime__FeedMessage *msg;
+
+    memset (stats, 0, sizeof(tdata_rt_feed_stats_t));
+
     msg = transit_realtime__feed_message__unpack (NULL, len, buf);
     if (msg == NULL) {
         fprintf (stderr, "error unpacking incoming gtfs-rt message\n");
-        return;
+        stats->n_errors++;
+        return false;
     }
     #ifdef RRRR_DEBUG
     fprintf(stderr, "Received feed message with " ZU " entities.\n", msg->n_entity);
     #endif
+
+    tdata->rt_generation++;
+    stats->n_entities = (uint32_t) msg->n_entity;
+
     for (e = 0; e < msg->n_entity; ++e) {
-        TransitRealtime__TripUpdate *rt_trip_update;
         TransitRealtime__FeedEntity *rt_entity;
+        uint32_t vj_index;
+        uint32_t hash;
+        bool applied;
 
         rt_entity = msg->entity[e];
-        if (rt_entity == NULL) goto cleanup;
+        if (rt_entity == NULL) {
+            /* skip it, the other entities still count for the revert below */
+            stats->n_errors++;
+            continue;
+        }
 
         #ifdef RRRR_DEBUG
         fprintf(stderr, "  entity %lu has id %s\n", (unsigned long) e, rt_entity->id);
         #endif
-        rt_trip_update = rt_entity->trip_update;
-        if (rt_trip_update) {
-            TransitRealtime__TripDescriptor *rt_trip = rt_trip_update->trip;
-            struct tm ltm;
-            uint32_t vj_index;
-            time_t epochtime;
-            int16_t cal_day;
-            char buf[9];
-
-
-            if (rt_trip == NULL) continue;
-
-            vj_index = radixtree_find (tdata->vjid_index, rt_trip->trip_id);
-            if (vj_index == RADIXTREE_NONE) {
-                #ifdef RRRR_DEBUG
-                fprintf (stderr, "    trip id was not found in the radix tree.\n");
-                #endif
-                continue;
-            }
+        if (rt_entity->trip_update == NULL) continue;
 
-            if (rt_entity->is_deleted) {
-                tdata_realtime_free_vj_index(tdata, vj_index);
-                continue;
-            }
+        if (rt_entity->trip_update->trip == NULL ||
+            rt_entity->trip_update->trip->trip_id == NULL) {
+            stats->n_errors++;
+            continue;
+        }
 
-            if (!rt_trip->start_date) {
-                #ifdef RRRR_DEBUG
-                fprintf(stderr, "WARNING: not handling realtime updates without a start date!\n");
-                #endif
+        vj_index = radixtree_find (tdata->vjid_index, rt_entity->trip_update->trip->trip_id);
+        if (vj_index == RADIXTREE_NONE) {
+            #ifdef RRRR_DEBUG
+            fprintf (stderr, "    trip id was not found in the radix tree.\n");
+            #endif
+            stats->n_errors++;
+            continue;
+        }
+
+        hash = tdata_realtime_hash_entity (rt_entity);
+
+        if (tdata->vj_rt_generation[vj_index] == tdata->rt_generation ||
+            (!replace && tdata->vj_rt_hash[vj_index] != 0)) {
+            /* Applied on top of an earlier TripUpdate, for example one for
+             * another operating day, the result matches neither of them.
+             */
+            hash = hash_uint (tdata->vj_rt_hash[vj_index], hash);
+            applied = tdata_realtime_apply_entity (tdata, vj_index, rt_entity, false);
+        } else if (replace && tdata->vj_rt_hash[vj_index] != 0) {
+            if (tdata->vj_rt_hash[vj_index] == hash) {
+                /* unchanged since the previous feed */
+                tdata->vj_rt_generation[vj_index] = tdata->rt_generation;
+                stats->n_unchanged++;
                 continue;
             }
 
-            /* Take care of the realtime validity */
-            memset (&ltm, 0, sizeof(struct tm));
-            strncpy (buf, rt_trip->start_date, 8);
-            buf[8] = '\0';
-            ltm.tm_mday = strtol(&buf[6], NULL, 10);
-            buf[6] = '\0';
-            ltm.tm_mon  = strtol(&buf[4], NULL, 10) - 1;
-            buf[4] = '\0';
-            ltm.tm_year = strtol(&buf[0], NULL, 10) - 1900;
-            ltm.tm_isdst = -1;
-            epochtime = mktime(&ltm);
-
-            cal_day = (epochtime - tdata->calendar_start_time) / SEC_IN_ONE_DAY;
-
-            if (cal_day < 0 || cal_day > 31 ) {
-                #ifdef RRRR_DEBUG
-                fprintf(stderr, "WARNING: the operational day is 32 further than our calendar!\n");
-                #endif
-
-                #ifndef RRRR_FAKE_REALTIME
+            applied = tdata_realtime_replace_entity (tdata, vj_index, rt_entity);
+        } else {
+            applied = tdata_realtime_apply_entity (tdata, vj_index, rt_entity, false);
+        }
+
+        if (applied) {
+            stats->n_applied++;
+        } else {
+            stats->n_errors++;
+        }
+        tdata_realtime_track_vj_index (tdata, vj_index, hash);
+    }
+
+    if (replace) {
+        /* Revert the vehicle_journeys which are not in this feed anymore */
+        uint32_t i_rt_vj = 0;
+        while (i_rt_vj < tdata->n_rt_vjs) {
+            uint32_t vj_index = tdata->rt_vjs[i_rt_vj];
+            if (tdata->vj_rt_generation[vj_index] == tdata->rt_generation) {
+                ++i_rt_vj;
                 continue;
-                #endif
             }
 
-            if (rt_trip->schedule_relationship ==
-                TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__CANCELED) {
-                /* Apply the cancel to the schedule */
-                tdata->vj_active[vj_index] &= ~(1 << cal_day);
-
-            } else if (rt_trip->schedule_relationship ==
-                       TRANSIT_REALTIME__TRIP_DESCRIPTOR__SCHEDULE_RELATIONSHIP__SCHEDULED) {
-                /* Mark in the schedule the vj is scheduled */
-                tdata->vj_active[vj_index] |=  (1 << cal_day);
-
-                if (rt_trip_update->n_stop_time_update) {
-                    uint16_t n_stops;
-                    bool changed_jp;
-                    bool nodata_jp;
-
-                    tdata_realtime_journey_pattern_type(rt_trip_update, &n_stops, &changed_jp, &nodata_jp);
-
-                    /* Don't ever continue if we found that n_stops == 0,
-                     * this entire journey_pattern doesn't have any data.
-                     */
-                    if (nodata_jp || n_stops == 0) {
-                        /* If data previously was available, we should fall
-                         * back to the schedule
-                         */
-                        tdata_realtime_free_vj_index(tdata, vj_index);
-
-                        /* In any case, we are done with processing this entity. */
-                        continue;
-                    }
-
-                    /* If the vj has a different journey_pattern, for example stops
-                     * have been added or cancelled we must fork this vj
-                     * into a new journey_pattern
-                     */
-                    else if (changed_jp) {
-                        tdata_realtime_changed_journey_pattern(tdata, vj_index, cal_day, n_stops, rt_trip_update);
-
-                    } else {
-                        tdata_realtime_apply_tripupdates (tdata, vj_index, rt_trip_update);
-
-                    }
-                }
-            }
-        } else
-        { continue; }
+            tdata_realtime_revert_vj_index (tdata, vj_index);
+            tdata->vj_rt_hash[vj_index] = 0;
+            stats->n_reverted++;
+            tdata->rt_vjs[i_rt_vj] = tdata->rt_vjs[--tdata->n_rt_vjs];
+        }
     }
-cleanup:
+
+    tdata_realtime_commit (tdata);
+
     transit_realtime__feed_message__free_unpacked (msg, NULL);
+
+    return true;
 }
 
-void tdata_apply_gtfsrt_tripupdates_file (tdata_t *tdata, char *filename) {
+/* Decodes the GTFS-RT message of lenth len in buffer buf, extracting vehicle
+ * position messages and using the delay extension (1003) to update RRRR's
+ * per-vj delay information.
+ */
+void tdata_apply_gtfsrt_tripupdates (tdata_t *tdata, uint8_t *buf, size_t len) {
+    tdata_rt_feed_stats_t stats;
+    tdata_apply_gtfsrt_feed (tdata, buf, len, false, &stats);
+}
+
+void tdata_replace_gtfsrt_tripupdates (tdata_t *tdata, uint8_t *buf, size_t len) {
+    tdata_rt_feed_stats_t stats;
+    tdata_apply_gtfsrt_feed (tdata, buf, len, true, &stats);
+}
+
+static void tdata_apply_gtfsrt_feed_file (tdata_t *tdata, char *filename,
+                                          bool replace) {
+    tdata_rt_feed_stats_t stats;
     struct stat st;
     int fd;
     uint8_t *buf;
@@ -645,22 +1475,172 @@ void tdata_apply_gtfsrt_tripupdates_file (tdata_t *tdata, char *filename) {
         goto fail_clean_fd;
     }
 
-    tdata_apply_gtfsrt_tripupdates (tdata, buf, st.st_size);
+    tdata_apply_gtfsrt_feed (tdata, buf, st.st_size, replace, &stats);
     munmap (buf, st.st_size);
 
 fail_clean_fd:
     close (fd);
 }
 
+void tdata_apply_gtfsrt_tripupdates_file (tdata_t *tdata, char *filename) {
+    tdata_apply_gtfsrt_feed_file (tdata, filename, false);
+}
+
+void tdata_replace_gtfsrt_tripupdates_file (tdata_t *tdata, char *filename) {
+    tdata_apply_gtfsrt_feed_file (tdata, filename, true);
+}
+
 void tdata_clear_gtfsrt (tdata_t *tdata) {
-    uint32_t i_vj_index;
-    for (i_vj_index = 0; i_vj_index < tdata->n_vjs; ++i_vj_index) {
-        tdata_realtime_free_vj_index(tdata, i_vj_index);
+    uint32_t n_forked_jps = tdata->n_journey_patterns - tdata->n_journey_patterns_orig;
+    uint32_t n_forked_points = tdata->n_journey_pattern_points - tdata->n_journey_pattern_points_orig;
+    uint32_t n_forked_vjs = tdata->n_vjs - tdata->n_vjs_orig;
+    uint32_t i_rt_vj;
+
+    for (i_rt_vj = 0; i_rt_vj < tdata->n_rt_vjs; ++i_rt_vj) {
+        tdata->vj_rt_hash[tdata->rt_vjs[i_rt_vj]] = 0;
     }
+    tdata->n_rt_vjs = 0;
+
+    /* Everything realtime allocated lives in the arena */
+    tdata_realtime_begin (tdata);
+    memset (tdata->vj_stoptimes, 0, sizeof(tdata_rt_stoptimes_t *) * tdata->n_vjs);
+    tdata->rt_days = 0;
+    memset (tdata->rt_journey_patterns_at_stop, 0, sizeof(list_t *) * tdata->n_stops);
+    arena_reset (&tdata->rt_arena);
+    tdata_realtime_free_retired (tdata);
+    tdata->rt_arena_live = 0;
+
+    /* Remove the forked journey_patterns from the appended columns */
+    tdata->n_journey_patterns = tdata->n_journey_patterns_orig;
+    tdata->n_journey_pattern_active -= n_forked_jps;
+    tdata->n_journey_pattern_points = tdata->n_journey_pattern_points_orig;
+    tdata->n_journey_pattern_point_attributes -= n_forked_points;
+    tdata->n_stop_times = tdata->n_stop_times_orig;
+    tdata->n_vjs = tdata->n_vjs_orig;
+    tdata->n_vj_ids -= n_forked_vjs;
+    tdata->n_vj_active -= n_forked_vjs;
+
     memcpy (tdata->vj_active, tdata->vj_active_orig,
             sizeof(calendar_t) * tdata->n_vjs);
     memcpy (tdata->journey_pattern_active, tdata->journey_pattern_active_orig,
-            sizeof(calendar_t) * tdata->n_vjs);
+            sizeof(calendar_t) * tdata->n_journey_patterns);
+
+    tdata_realtime_bounds (tdata, NULL);
+    tdata_realtime_commit (tdata);
+}
+
+/* Recompute the bounds of a journey_pattern from the current stoptimes of
+ * its vehicle_journeys. Only values which differ are written, so the pages
+ * of an unchanged journey_pattern are not dirtied.
+ */
+static void tdata_realtime_jp_bounds (tdata_t *tdata, uint32_t jp_index) {
+    journey_pattern_t *jp = tdata->journey_patterns + jp_index;
+    rtime_t min_time = jp->min_time;
+    rtime_t max_time = jp->max_time;
+    bool nonfifo = false;
+    uint32_t i_vj;
+
+    /* A fork only has the vehicle_journey it was made for */
+    if (jp_index < tdata->n_journey_patterns_orig) {
+        min_time = tdata->journey_pattern_min_time_orig[jp_index];
+        max_time = tdata->journey_pattern_max_time_orig[jp_index];
+    }
+
+    for (i_vj = jp->vj_ids_offset; i_vj < jp->vj_ids_offset + jp->n_vjs; ++i_vj) {
+        tdata_rt_stoptimes_t *rt;
+
+        for (rt = tdata->vj_stoptimes[i_vj]; rt; rt = rt->next) {
+            tdata_realtime_widen (&min_time, &max_time, rt->stop_times, jp->n_stops);
+            if (!nonfifo &&
+                tdata_realtime_overtakes (tdata, i_vj, rt->stop_times, rt->days)) {
+                nonfifo = true;
+            }
+        }
+    }
+
+    /* Every stoptime is published already, routers may see the narrower
+     * bounds in any order.
+     */
+    if (jp->min_time != min_time) jp->min_time = min_time;
+    if (jp->max_time != max_time) jp->max_time = max_time;
+
+    if (bitset_get (tdata->rt_nonfifo, jp_index) != nonfifo) {
+        if (nonfifo) {
+            bitset_set (tdata->rt_nonfifo, jp_index);
+        } else {
+            bitset_unset (tdata->rt_nonfifo, jp_index);
+        }
+    }
+}
+
+void tdata_realtime_bounds (tdata_t *tdata, bitset_t *journey_patterns) {
+    rtime_t max_time = tdata->max_time_orig;
+    uint32_t i;
+
+    for (i = 0; i < tdata->n_journey_patterns; ++i) {
+        if (journey_patterns == NULL || bitset_get (journey_patterns, i)) {
+            tdata_realtime_jp_bounds (tdata, i);
+        }
+        if (tdata->journey_patterns[i].max_time > max_time) {
+            max_time = tdata->journey_patterns[i].max_time;
+        }
+    }
+
+    if (tdata->max_time != max_time) tdata->max_time = max_time;
+}
+
+uint32_t tdata_realtime_fork_of (tdata_t *tdata, uint32_t vj_index) {
+    char *vj_id_new;
+
+    vj_id_new = (char *) alloca (sizeof(char) * tdata->vj_ids_width);
+    vj_id_new[0] = '@';
+    strncpy(&vj_id_new[1], tdata_vehicle_journey_id_for_index (tdata, vj_index), tdata->vj_ids_width - 1);
+
+    return tdata_realtime_find_fork (tdata, vj_id_new);
+}
+
+bool tdata_realtime_restore_vj (tdata_t *tdata, uint32_t vj_index,
+                                stoptime_t *vj_stoptimes, calendar_t days,
+                                uint32_t hash) {
+    if (vj_stoptimes) {
+        uint16_t n_stops = tdata->journey_patterns[tdata->vjs_in_journey_pattern[vj_index]].n_stops;
+        stoptime_t *rt_stoptimes;
+
+        rt_stoptimes = (stoptime_t *) arena_alloc(&tdata->rt_arena, sizeof(stoptime_t) * n_stops);
+        if (rt_stoptimes == NULL) return false;
+
+        memcpy (rt_stoptimes, vj_stoptimes, sizeof(stoptime_t) * n_stops);
+        if ( ! tdata_realtime_publish (tdata, vj_index, rt_stoptimes, days, days)) return false;
+    }
+
+    if (hash != 0) tdata_realtime_track_vj_index (tdata, vj_index, hash);
+
+    return true;
+}
+
+bool tdata_realtime_restore_fork (tdata_t *tdata, uint32_t vj_index,
+                                  uint16_t n_stops, spidx_t *stops,
+                                  stoptime_t *vj_stoptimes, calendar_t active,
+                                  calendar_t days) {
+    stoptime_t *rt_stoptimes;
+    char *vj_id_new;
+    uint32_t jp_index;
+
+    if (n_stops == 0) return false;
+
+    vj_id_new = (char *) alloca (sizeof(char) * tdata->vj_ids_width);
+    vj_id_new[0] = '@';
+    strncpy(&vj_id_new[1], tdata_vehicle_journey_id_for_index (tdata, vj_index), tdata->vj_ids_width - 1);
+
+    jp_index = tdata_realtime_fork (tdata, vj_index, vj_id_new, n_stops, stops);
+    if (jp_index == RADIXTREE_NONE) return false;
+
+    rt_stoptimes = (stoptime_t *) arena_alloc(&tdata->rt_arena, sizeof(stoptime_t) * n_stops);
+    if (rt_stoptimes == NULL) return false;
+
+    memcpy (rt_stoptimes, vj_stoptimes, sizeof(stoptime_t) * n_stops);
+
+    return tdata_realtime_activate_fork (tdata, vj_index, jp_index, rt_stoptimes, active, days, false);
 }
 
 #else
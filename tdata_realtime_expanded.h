@@ -8,6 +8,20 @@
 
 #include "tdata.h"
 
+typedef struct tdata_rt_feed_stats tdata_rt_feed_stats_t;
+struct tdata_rt_feed_stats {
+    /* The number of entities in the feed */
+    uint32_t n_entities;
+    /* TripUpdates applied to the timetable */
+    uint32_t n_applied;
+    /* TripUpdates equal to the ones in the previous feed */
+    uint32_t n_unchanged;
+    /* vehicle_journeys reverted because they are not in the feed anymore */
+    uint32_t n_reverted;
+    /* TripUpdates which could not be applied */
+    uint32_t n_errors;
+};
+
 bool tdata_alloc_expanded (tdata_t *td);
 
 void tdata_free_expanded (tdata_t *td);
@@ -16,5 +30,82 @@ void tdata_apply_gtfsrt_tripupdates (tdata_t *td, uint8_t *buf, size_t len);
 
 void tdata_apply_gtfsrt_tripupdates_file (tdata_t *td, char *filename);
 
+/* Apply a feed which holds every TripUpdate, replacing the previous feed.
+ * Only the vehicle_journeys whose TripUpdate changed, or which are not in
+ * the feed anymore, are updated or reverted to the schedule.
+ */
+void tdata_replace_gtfsrt_tripupdates (tdata_t *td, uint8_t *buf, size_t len);
+
+void tdata_replace_gtfsrt_tripupdates_file (tdata_t *td, char *filename);
+
+/* Apply or replace, and count what the feed changed. Returns false when
+ * the feed could not be decoded.
+ */
+bool tdata_apply_gtfsrt_feed (tdata_t *td, uint8_t *buf, size_t len,
+                              bool replace, tdata_rt_feed_stats_t *stats);
+
+/* Routers may run while a single other thread applies the feeds. Every
+ * request enters the realtime epoch for its duration:
+ *
+ *     ticket = tdata_realtime_enter (&tdata);
+ *     router_route (&router, &req);
+ *     ...
+ *     tdata_realtime_leave (&tdata, ticket);
+ *
+ * Stoptimes replaced by a feed remain readable until all routers which
+ * entered before are done. Forked journey_patterns are only found by routers
+ * once they are complete; tdata_clear_gtfsrt must not run concurrently.
+ */
+uint32_t tdata_realtime_enter (tdata_t *td);
+
+void tdata_realtime_leave (tdata_t *td, uint32_t ticket);
+
+/* Changes to the realtime stoptimes are made between a begin and a commit,
+ * applying a feed does so itself. tdata_t.rt_version is odd in between,
+ * and routers do not use the lower bound graph as it may not match the
+ * stoptimes they see. The commit builds a new graph for all routers, and
+ * frees what the previous commit replaced when no router uses it anymore.
+ */
+void tdata_realtime_begin (tdata_t *td);
+
+void tdata_realtime_commit (tdata_t *td);
+
+#ifdef RRRR_FEATURE_REALTIME_ALERTS
+/* Replace the alerts routers read by a single pointer store. Returns false
+ * while routers still use the alerts replaced before, alerts is then not
+ * published.
+ */
+bool tdata_realtime_publish_alerts (tdata_t *td, alert_index_t *alerts);
+#endif
+
 void tdata_clear_gtfsrt (tdata_t *td);
+
+/* Recompute the min_time and max_time of the journey_patterns set in
+ * journey_patterns, or of all when it is NULL, and whether they are FIFO,
+ * from the current stoptimes. Applying updates only ever widens them.
+ */
+void tdata_realtime_bounds (tdata_t *td, bitset_t *journey_patterns);
+
+/* The journey_pattern a scheduled vehicle_journey was forked into by a
+ * TripUpdate which changed its stops, or RADIXTREE_NONE.
+ */
+uint32_t tdata_realtime_fork_of (tdata_t *td, uint32_t vj_index);
+
+/* Restore the realtime state of a scheduled vehicle_journey saved by a
+ * snapshot: its stoptimes, when not NULL, are copied and used on days, and
+ * a hash other than 0 is the TripUpdate a replacing feed compares against.
+ * Called once for each of the stoptimes a vehicle_journey had.
+ */
+bool tdata_realtime_restore_vj (tdata_t *td, uint32_t vj_index,
+                                stoptime_t *vj_stoptimes, calendar_t days,
+                                uint32_t hash);
+
+/* Fork a scheduled vehicle_journey to call at stops on the days in active,
+ * as a TripUpdate which changed its stops did before the snapshot. A fork
+ * restored again with the same stops gets the stoptimes of other days.
+ */
+bool tdata_realtime_restore_fork (tdata_t *td, uint32_t vj_index,
+                                  uint16_t n_stops, spidx_t *stops,
+                                  stoptime_t *vj_stoptimes, calendar_t active,
+                                  calendar_t days);
 #endif /* _TDATA_REALTIME_H */
@@ -0,0 +1,436 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_shared.c : realtime stoptimes shared between processes */
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include "tdata_realtime_shared.h"
+#include "tdata.h"
+#include "tdata_realtime_expanded.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Every buffer starts with this struct, followed by:
+ *     calendar_t vj_active[n_vjs];
+ *     uint32_t   vj_stoptimes[n_vjs];  index into rt_stoptimes, or none
+ *     tdata_rt_shared_stoptimes_t rt_stoptimes[n_rt_stoptimes];
+ *     stoptime_t stop_times[n_stop_times];
+ */
+typedef struct tdata_rt_shared_buffer tdata_rt_shared_buffer_t;
+struct tdata_rt_shared_buffer {
+    uint32_t version;
+    uint32_t n_stop_times;
+    calendar_t rt_days;
+    uint32_t n_rt_stoptimes;
+};
+
+/* A tdata_rt_stoptimes_t of the updater, linked by index */
+typedef struct tdata_rt_shared_stoptimes tdata_rt_shared_stoptimes_t;
+struct tdata_rt_shared_stoptimes {
+    /* offset into stop_times */
+    uint32_t stop_times;
+    /* index into rt_stoptimes, or none */
+    uint32_t next;
+    calendar_t days;
+};
+
+#define buffer_for(header, parity) \
+    ((tdata_rt_shared_buffer_t *) (((char *) header) + header->loc_buffers + \
+                                   (parity) * header->buffer_size))
+
+#define buffer_vj_active(header, buffer) \
+    ((calendar_t *) (((char *) buffer) + sizeof(tdata_rt_shared_buffer_t)))
+
+#define buffer_vj_stoptimes(header, buffer) \
+    ((uint32_t *) (buffer_vj_active(header, buffer) + header->n_vjs))
+
+#define buffer_rt_stoptimes(header, buffer) \
+    ((tdata_rt_shared_stoptimes_t *) (buffer_vj_stoptimes(header, buffer) + header->n_vjs))
+
+#define buffer_stop_times(header, buffer) \
+    ((stoptime_t *) (buffer_rt_stoptimes(header, buffer) + header->n_rt_stoptimes))
+
+static uint64_t round_to_page (uint64_t size) {
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+bool tdata_rt_shared_create (tdata_rt_shared_t *shared, tdata_t *td,
+                             char *filename, uint32_t n_stop_times) {
+    tdata_rt_shared_header_t *header;
+    tdata_rt_shared_buffer_t *buffer;
+    uint64_t loc_buffers, buffer_size;
+    uint32_t n_rt_stoptimes;
+    uint8_t parity;
+    void *base;
+    int fd;
+
+    if (n_stop_times == 0) {
+        uint64_t n_expanded = 0;
+        uint32_t i_jp;
+        for (i_jp = 0; i_jp < td->n_journey_patterns; ++i_jp) {
+            n_expanded += ((uint64_t) td->journey_patterns[i_jp].n_stops) *
+                          td->journey_patterns[i_jp].n_vjs;
+        }
+        n_stop_times = (uint32_t) (n_expanded < UINT32_MAX ? n_expanded : UINT32_MAX);
+    }
+
+    /* Every journey_pattern has at least two stops */
+    n_rt_stoptimes = n_stop_times / 2;
+
+    loc_buffers = round_to_page (sizeof(tdata_rt_shared_header_t));
+    buffer_size = round_to_page (sizeof(tdata_rt_shared_buffer_t) +
+                                 ((uint64_t) td->n_vjs) * (sizeof(calendar_t) + sizeof(uint32_t)) +
+                                 ((uint64_t) n_rt_stoptimes) * sizeof(tdata_rt_shared_stoptimes_t) +
+                                 ((uint64_t) n_stop_times) * sizeof(stoptime_t));
+
+    /* Workers that still map a previous file keep a valid, but stale, copy */
+    unlink (filename);
+
+    fd = open (filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        fprintf (stderr, "Could not create the shared realtime file %s.\n", filename);
+        return false;
+    }
+
+    /* Extend the file by writing its last byte */
+    if (lseek (fd, (off_t) (loc_buffers + 2 * buffer_size - 1), SEEK_SET) == -1 ||
+        write (fd, "", 1) != 1) {
+        fprintf (stderr, "Could not resize the shared realtime file %s.\n", filename);
+        goto fail_close_fd;
+    }
+
+    base = mmap (NULL, loc_buffers + 2 * buffer_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf (stderr, "Could not map the shared realtime file %s.\n", filename);
+        goto fail_close_fd;
+    }
+    close (fd);
+
+    header = (tdata_rt_shared_header_t *) base;
+    header->calendar_start_time = td->calendar_start_time;
+    header->n_vjs = td->n_vjs;
+    header->n_stop_times = n_stop_times;
+    header->n_rt_stoptimes = n_rt_stoptimes;
+    header->loc_buffers = loc_buffers;
+    header->buffer_size = buffer_size;
+    header->version = 0;
+    header->readers[0] = 0;
+    header->readers[1] = 0;
+
+    /* Both buffers start out as the schedule */
+    for (parity = 0; parity < 2; ++parity) {
+        uint32_t i_vj;
+        buffer = buffer_for (header, parity);
+        buffer->version = 0;
+        buffer->n_stop_times = 0;
+        buffer->rt_days = 0;
+        buffer->n_rt_stoptimes = 0;
+        memcpy (buffer_vj_active (header, buffer), td->vj_active_orig,
+                sizeof(calendar_t) * td->n_vjs);
+        for (i_vj = 0; i_vj < td->n_vjs; ++i_vj) {
+            buffer_vj_stoptimes (header, buffer)[i_vj] = TDATA_RT_SHARED_NONE;
+        }
+    }
+
+    /* Workers reject the file until the version string is written */
+    rrrr_memory_barrier ();
+    memcpy (header->version_string, TDATA_RT_SHARED_VERSION, 8);
+
+    shared->header = header;
+    shared->size = (size_t) (loc_buffers + 2 * buffer_size);
+    shared->version = TDATA_RT_SHARED_NONE;
+    shared->changed = NULL;
+
+    return true;
+
+fail_close_fd:
+    close (fd);
+    return false;
+}
+
+bool tdata_rt_shared_open (tdata_rt_shared_t *shared, tdata_t *td,
+                           char *filename) {
+    tdata_rt_shared_header_t *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open (filename, O_RDWR);
+    if (fd == -1) {
+        fprintf (stderr, "Could not open the shared realtime file %s.\n", filename);
+        return false;
+    }
+
+    if (fstat (fd, &st) == -1 ||
+        (uint64_t) st.st_size < sizeof(tdata_rt_shared_header_t)) {
+        fprintf (stderr, "The shared realtime file %s is truncated.\n", filename);
+        goto fail_close_fd;
+    }
+
+    base = mmap (NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf (stderr, "Could not map the shared realtime file %s.\n", filename);
+        goto fail_close_fd;
+    }
+    close (fd);
+
+    header = (tdata_rt_shared_header_t *) base;
+    if (strncmp (TDATA_RT_SHARED_VERSION, header->version_string, 8) ||
+        header->loc_buffers + 2 * header->buffer_size > (uint64_t) st.st_size) {
+        fprintf (stderr, "The shared realtime file %s is not ready or of the wrong version.\n", filename);
+        goto fail_munmap;
+    }
+
+    if (header->calendar_start_time != td->calendar_start_time ||
+        header->n_vjs != td->n_vjs) {
+        fprintf (stderr, "The shared realtime file %s belongs to another timetable.\n", filename);
+        goto fail_munmap;
+    }
+
+    /* Only the reader counters are ever written by a worker */
+    if (mprotect (((char *) base) + header->loc_buffers,
+                  (size_t) (2 * header->buffer_size), PROT_READ) == -1) {
+        fprintf (stderr, "Could not protect the shared realtime file %s.\n", filename);
+        goto fail_munmap;
+    }
+
+    shared->changed = bitset_new (td->rt_nonfifo->capacity);
+    if (!shared->changed) goto fail_munmap;
+
+    shared->header = header;
+    shared->size = (size_t) st.st_size;
+    shared->version = TDATA_RT_SHARED_NONE;
+
+    return true;
+
+fail_munmap:
+    munmap (base, (size_t) st.st_size);
+    return false;
+
+fail_close_fd:
+    close (fd);
+    return false;
+}
+
+void tdata_rt_shared_close (tdata_rt_shared_t *shared, tdata_t *td) {
+    if (shared->version != TDATA_RT_SHARED_NONE) {
+        uint32_t i_vj;
+        tdata_realtime_begin (td);
+        for (i_vj = 0; i_vj < shared->header->n_vjs; ++i_vj) {
+            td->vj_stoptimes[i_vj] = NULL;
+        }
+        memcpy (td->vj_active, td->vj_active_orig,
+                sizeof(calendar_t) * shared->header->n_vjs);
+        td->rt_days = 0;
+        tdata_realtime_bounds (td, NULL);
+        tdata_realtime_commit (td);
+        shared->version = TDATA_RT_SHARED_NONE;
+    }
+
+    bitset_destroy (shared->changed);
+    shared->changed = NULL;
+    munmap (shared->header, shared->size);
+    shared->header = NULL;
+}
+
+bool tdata_rt_shared_publish (tdata_rt_shared_t *shared, tdata_t *td) {
+    tdata_rt_shared_header_t *header = shared->header;
+    tdata_rt_shared_buffer_t *buffer;
+    tdata_rt_shared_stoptimes_t *rt_stoptimes;
+    stoptime_t *stop_times;
+    uint32_t *vj_stoptimes;
+    calendar_t *vj_active;
+    uint32_t version, n_stop_times, n_rt_stoptimes, i_vj;
+
+    version = rrrr_atomic_get (&header->version) + 1;
+
+    if (rrrr_atomic_get (&header->readers[version & 1]) != 0) {
+        fprintf (stderr, "The shared realtime buffer is still in use.\n");
+        return false;
+    }
+
+    buffer = buffer_for (header, version & 1);
+    vj_stoptimes = buffer_vj_stoptimes (header, buffer);
+    rt_stoptimes = buffer_rt_stoptimes (header, buffer);
+    stop_times = buffer_stop_times (header, buffer);
+    n_stop_times = 0;
+    n_rt_stoptimes = 0;
+
+    /* Vehicle_journeys forked by the updater are not part of the file */
+    for (i_vj = 0; i_vj < header->n_vjs; ++i_vj) {
+        uint32_t n_stops = td->journey_patterns[td->vjs_in_journey_pattern[i_vj]].n_stops;
+        uint32_t *next = vj_stoptimes + i_vj;
+        tdata_rt_stoptimes_t *rt;
+
+        for (rt = td->vj_stoptimes[i_vj]; rt; rt = rt->next) {
+            if (n_stop_times + n_stops > header->n_stop_times ||
+                n_rt_stoptimes == header->n_rt_stoptimes) {
+                fprintf (stderr, "The shared realtime buffer can not hold all stoptimes.\n");
+                return false;
+            }
+
+            memcpy (stop_times + n_stop_times, rt->stop_times,
+                    sizeof(stoptime_t) * n_stops);
+            rt_stoptimes[n_rt_stoptimes].stop_times = n_stop_times;
+            rt_stoptimes[n_rt_stoptimes].days = rt->days;
+            *next = n_rt_stoptimes;
+            next = &rt_stoptimes[n_rt_stoptimes].next;
+            n_stop_times += n_stops;
+            n_rt_stoptimes++;
+        }
+        *next = TDATA_RT_SHARED_NONE;
+    }
+
+    vj_active = buffer_vj_active (header, buffer);
+    for (i_vj = 0; i_vj < header->n_vjs; ++i_vj) {
+        vj_active[i_vj] = td->vj_active[i_vj];
+
+        /* A forked vehicle_journey keeps running its scheduled stops on
+         * the days it was moved to the fork, which workers lack.
+         */
+        if (td->vj_active[i_vj] != td->vj_active_orig[i_vj]) {
+            uint32_t jp_index = tdata_realtime_fork_of (td, i_vj);
+            if (jp_index != RADIXTREE_NONE) {
+                vj_active[i_vj] |= td->vj_active_orig[i_vj] &
+                                   td->vj_active[td->journey_patterns[jp_index].vj_ids_offset];
+            }
+        }
+    }
+    buffer->rt_days = td->rt_days;
+    buffer->n_stop_times = n_stop_times;
+    buffer->n_rt_stoptimes = n_rt_stoptimes;
+    buffer->version = version;
+
+    rrrr_atomic_set (&header->version, version);
+
+    return true;
+}
+
+/* Whether the stoptimes of a vehicle_journey in a buffer differ from the
+ * ones the timetable of the worker uses now.
+ */
+static bool tdata_rt_shared_differs (tdata_rt_shared_header_t *header,
+                                     tdata_rt_shared_buffer_t *buffer,
+                                     tdata_t *td, uint32_t vj_index) {
+    tdata_rt_shared_stoptimes_t *rt_stoptimes = buffer_rt_stoptimes (header, buffer);
+    stoptime_t *stop_times = buffer_stop_times (header, buffer);
+    uint16_t n_stops = td->journey_patterns[td->vjs_in_journey_pattern[vj_index]].n_stops;
+    uint32_t i_rt = buffer_vj_stoptimes (header, buffer)[vj_index];
+    tdata_rt_stoptimes_t *rt = td->vj_stoptimes[vj_index];
+
+    while (rt != NULL && i_rt != TDATA_RT_SHARED_NONE) {
+        if (rt->days != rt_stoptimes[i_rt].days ||
+            memcmp (rt->stop_times, stop_times + rt_stoptimes[i_rt].stop_times,
+                    sizeof(stoptime_t) * n_stops) != 0) {
+            return true;
+        }
+        rt = rt->next;
+        i_rt = rt_stoptimes[i_rt].next;
+    }
+
+    return (rt != NULL || i_rt != TDATA_RT_SHARED_NONE);
+}
+
+/* Point the timetable of a worker at the stoptimes of a buffer. The lists
+ * of stoptimes are rebuilt in the realtime arena of the worker, which no
+ * router uses during a switch.
+ */
+static void tdata_rt_shared_switch (tdata_rt_shared_t *shared, tdata_t *td,
+                                    uint32_t version) {
+    tdata_rt_shared_header_t *header = shared->header;
+    tdata_rt_shared_buffer_t *buffer = buffer_for (header, version & 1);
+    tdata_rt_shared_stoptimes_t *rt_stoptimes = buffer_rt_stoptimes (header, buffer);
+    uint32_t *vj_stoptimes = buffer_vj_stoptimes (header, buffer);
+    stoptime_t *stop_times = buffer_stop_times (header, buffer);
+    uint32_t i_vj;
+
+    bitset_clear (shared->changed);
+
+    /* The other buffer mostly holds the same stoptimes */
+    for (i_vj = 0; i_vj < header->n_vjs; ++i_vj) {
+        if (tdata_rt_shared_differs (header, buffer, td, i_vj)) {
+            bitset_set (shared->changed, td->vjs_in_journey_pattern[i_vj]);
+        }
+    }
+
+    tdata_realtime_begin (td);
+    arena_reset (&td->rt_arena);
+
+    for (i_vj = 0; i_vj < header->n_vjs; ++i_vj) {
+        tdata_rt_stoptimes_t **tail = td->vj_stoptimes + i_vj;
+        uint32_t i_rt;
+
+        for (i_rt = vj_stoptimes[i_vj]; i_rt != TDATA_RT_SHARED_NONE;
+             i_rt = rt_stoptimes[i_rt].next) {
+            tdata_rt_stoptimes_t *rt;
+
+            rt = (tdata_rt_stoptimes_t *) arena_alloc (&td->rt_arena, sizeof(tdata_rt_stoptimes_t));
+            if (rt == NULL) {
+                /* the remaining days are routed on the schedule */
+                fprintf (stderr, "Could not switch to the shared realtime buffer.\n");
+                bitset_set (shared->changed, td->vjs_in_journey_pattern[i_vj]);
+                break;
+            }
+
+            rt->stop_times = stop_times + rt_stoptimes[i_rt].stop_times;
+            rt->days = rt_stoptimes[i_rt].days;
+            *tail = rt;
+            tail = &rt->next;
+        }
+        *tail = NULL;
+    }
+
+    memcpy (td->vj_active, buffer_vj_active (header, buffer),
+            sizeof(calendar_t) * header->n_vjs);
+    td->rt_days = buffer->rt_days;
+
+    /* The journey_patterns are not part of the file, only their stoptimes */
+    tdata_realtime_bounds (td, shared->changed);
+    tdata_realtime_commit (td);
+
+    shared->version = version;
+}
+
+uint32_t tdata_rt_shared_acquire (tdata_rt_shared_t *shared, tdata_t *td) {
+    tdata_rt_shared_header_t *header = shared->header;
+    uint32_t version;
+
+    /* The updater may publish between reading the version and pinning its
+     * buffer, then the buffer may already be rewritten: try again.
+     */
+    for (;;) {
+        version = rrrr_atomic_get (&header->version);
+        rrrr_atomic_add (&header->readers[version & 1], 1);
+        if (rrrr_atomic_get (&header->version) == version) break;
+        rrrr_atomic_sub (&header->readers[version & 1], 1);
+    }
+
+    if (version != shared->version) {
+        tdata_rt_shared_switch (shared, td, version);
+    }
+
+    return version & 1;
+}
+
+void tdata_rt_shared_release (tdata_rt_shared_t *shared, uint32_t ticket) {
+    rrrr_atomic_sub (&shared->header->readers[ticket], 1);
+}
+
+#else
+void tdata_realtime_shared_not_available() {}
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
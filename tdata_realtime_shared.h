@@ -0,0 +1,114 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_shared.h : realtime stoptimes shared between processes
+ *
+ * One updater process applies the GTFS-RT feeds to its own timetable and
+ * publishes the result into a file, typically on /dev/shm. Routing workers
+ * load the same timetable, map the file and use the published stoptimes
+ * instead of decoding the feeds themselves.
+ *
+ * The file holds two buffers. The updater always writes the buffer which is
+ * not published, and publishing increments the version; the parity of the
+ * version tells which buffer is current. Workers pin the current buffer for
+ * the duration of one request:
+ *
+ *     ticket = tdata_rt_shared_acquire (&shared, &tdata);
+ *     router_route (&router, &req);
+ *     ...
+ *     tdata_rt_shared_release (&shared, ticket);
+ *
+ * A publish fails while a worker still pins the buffer it would write,
+ * the updater should retry with its next feed. A worker which dies during a
+ * request keeps its buffer pinned until the updater creates the file again,
+ * after which the workers have to open the new file.
+ *
+ * Only delays and cancellations of scheduled vehicle_journeys are shared,
+ * trip updates which change the stops of a vehicle_journey are applied by
+ * the updater only. Workers route such a vehicle_journey on its schedule.
+ */
+
+#ifndef _TDATA_REALTIME_SHARED_H
+#define _TDATA_REALTIME_SHARED_H
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include "tdata.h"
+#include "rrrr_types.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TDATA_RT_SHARED_VERSION "RRRRRTS3"
+
+#define TDATA_RT_SHARED_NONE UINT32_MAX
+
+typedef struct tdata_rt_shared_header tdata_rt_shared_header_t;
+struct tdata_rt_shared_header {
+    /* Contents must read "RRRRRTS3" */
+    char version_string[8];
+    /* Must match the timetable of the worker */
+    uint64_t calendar_start_time;
+    uint32_t n_vjs;
+    /* The number of stoptimes each buffer can hold */
+    uint32_t n_stop_times;
+    /* The buffers are page aligned, so workers can map them read-only */
+    uint64_t loc_buffers;
+    uint64_t buffer_size;
+    /* Incremented by every publish, the parity is the current buffer */
+    volatile uint32_t version;
+    /* The number of workers using each buffer */
+    volatile uint32_t readers[2];
+    /* The number of tdata_rt_stoptimes_t each buffer can hold */
+    uint32_t n_rt_stoptimes;
+};
+
+typedef struct tdata_rt_shared tdata_rt_shared_t;
+struct tdata_rt_shared {
+    tdata_rt_shared_header_t *header;
+    size_t size;
+    /* The version the timetable of a worker reflects, or
+     * TDATA_RT_SHARED_NONE before its first request and for the updater.
+     */
+    uint32_t version;
+    /* The journey_patterns whose stoptimes a switch changed */
+    bitset_t *changed;
+};
+
+/* Create the file for an updater, with room for n_stop_times realtime
+ * stoptimes in each buffer, or for every scheduled vehicle_journey when
+ * n_stop_times is 0; pages which are never written take no memory.
+ * Version 0 is published without any changes.
+ */
+bool tdata_rt_shared_create (tdata_rt_shared_t *shared, tdata_t *td,
+                             char *filename, uint32_t n_stop_times);
+
+/* Map the file of an updater into a worker. */
+bool tdata_rt_shared_open (tdata_rt_shared_t *shared, tdata_t *td,
+                           char *filename);
+
+/* Unmap the file. A worker must call this before tdata_close, it restores
+ * the scheduled stoptimes and the vj_active of the timetable.
+ */
+void tdata_rt_shared_close (tdata_rt_shared_t *shared, tdata_t *td);
+
+/* Write the realtime state of the updaters timetable into the buffer which
+ * is not in use and publish it.
+ */
+bool tdata_rt_shared_publish (tdata_rt_shared_t *shared, tdata_t *td);
+
+/* Pin the current buffer, and switch the timetable over to it when the
+ * version changed since the previous request.
+ */
+uint32_t tdata_rt_shared_acquire (tdata_rt_shared_t *shared, tdata_t *td);
+
+void tdata_rt_shared_release (tdata_rt_shared_t *shared, uint32_t ticket);
+
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
+
+#endif /* _TDATA_REALTIME_SHARED_H */
@@ -0,0 +1,372 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_snapshot.c : the realtime state of a timetable on disk */
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include "tdata_realtime_snapshot.h"
+#include "tdata_realtime_expanded.h"
+#include "radixtree.h"
+#include "tdata.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* A snapshot starts with this struct, followed by:
+ *     calendar_t vj_active[n_vjs];
+ *     uint32_t   vj_rt_hash[n_vjs];
+ *     tdata_rt_snapshot_stoptimes_t rt_stoptimes[n_rt_stoptimes];
+ *     tdata_rt_snapshot_fork_t forks[n_forks];
+ *     spidx_t    fork_stops[n_fork_stops];
+ *     stoptime_t stop_times[n_stop_times];
+ */
+typedef struct tdata_rt_snapshot_header tdata_rt_snapshot_header_t;
+struct tdata_rt_snapshot_header {
+    /* Contents must read "RRRRRTP2" */
+    char version_string[8];
+    /* Must match the timetable loading the snapshot */
+    uint64_t calendar_start_time;
+    uint32_t n_vjs;
+    uint32_t n_stop_times;
+    uint32_t n_rt_stoptimes;
+    uint32_t n_forks;
+    uint32_t n_fork_stops;
+    uint32_t reserved;
+};
+
+/* The realtime stoptimes of a scheduled vehicle_journey on some days */
+typedef struct tdata_rt_snapshot_stoptimes tdata_rt_snapshot_stoptimes_t;
+struct tdata_rt_snapshot_stoptimes {
+    uint32_t vj_index;
+    /* offset into stop_times */
+    uint32_t stop_times;
+    calendar_t days;
+};
+
+/* The stoptimes on some days of a scheduled vehicle_journey forked into a
+ * journey_pattern of its own, a fork has one of these for every list entry.
+ */
+typedef struct tdata_rt_snapshot_fork tdata_rt_snapshot_fork_t;
+struct tdata_rt_snapshot_fork {
+    uint32_t vj_index;
+    /* offsets into stop_times and fork_stops */
+    uint32_t stop_times;
+    uint32_t stops;
+    calendar_t active;
+    calendar_t days;
+    uint16_t n_stops;
+    uint16_t reserved;
+};
+
+#define snapshot_size(header) \
+    (sizeof(tdata_rt_snapshot_header_t) + \
+     ((uint64_t) (header)->n_vjs) * (sizeof(calendar_t) + sizeof(uint32_t)) + \
+     ((uint64_t) (header)->n_rt_stoptimes) * sizeof(tdata_rt_snapshot_stoptimes_t) + \
+     ((uint64_t) (header)->n_forks) * sizeof(tdata_rt_snapshot_fork_t) + \
+     ((uint64_t) (header)->n_fork_stops) * sizeof(spidx_t) + \
+     ((uint64_t) (header)->n_stop_times) * sizeof(stoptime_t))
+
+static uint16_t vj_n_stops (tdata_t *td, uint32_t vj_index) {
+    return td->journey_patterns[td->vjs_in_journey_pattern[vj_index]].n_stops;
+}
+
+/* The number of entries in the list of realtime stoptimes of vj_index */
+static uint32_t vj_n_rt_stoptimes (tdata_t *td, uint32_t vj_index) {
+    tdata_rt_stoptimes_t *rt;
+    uint32_t n = 0;
+
+    for (rt = td->vj_stoptimes[vj_index]; rt; rt = rt->next) n++;
+
+    return n;
+}
+
+bool tdata_realtime_snapshot_write (tdata_t *td, char *filename) {
+    tdata_rt_snapshot_header_t header;
+    tdata_rt_snapshot_stoptimes_t *rt_stoptimes = NULL;
+    tdata_rt_snapshot_fork_t *forks = NULL;
+    char *filename_tmp = NULL;
+    FILE *fp = NULL;
+    uint32_t i_vj, i_rt, i_fork, i_rt_vj, n_rt_stoptimes = 0, n_forks = 0;
+    bool status = false;
+
+    memset (&header, 0, sizeof(tdata_rt_snapshot_header_t));
+    memcpy (header.version_string, TDATA_RT_SNAPSHOT_VERSION, 8);
+    header.calendar_start_time = td->calendar_start_time;
+    header.n_vjs = td->n_vjs_orig;
+
+    for (i_vj = 0; i_vj < td->n_vjs_orig; ++i_vj) {
+        n_rt_stoptimes += vj_n_rt_stoptimes (td, i_vj);
+    }
+    for (i_rt_vj = 0; i_rt_vj < td->n_rt_vjs; ++i_rt_vj) {
+        uint32_t jp_index = tdata_realtime_fork_of (td, td->rt_vjs[i_rt_vj]);
+        if (jp_index == RADIXTREE_NONE) continue;
+        n_forks += vj_n_rt_stoptimes (td, td->journey_patterns[jp_index].vj_ids_offset);
+    }
+
+    rt_stoptimes = (tdata_rt_snapshot_stoptimes_t *) malloc (sizeof(tdata_rt_snapshot_stoptimes_t) * (n_rt_stoptimes + 1));
+    forks = (tdata_rt_snapshot_fork_t *) malloc (sizeof(tdata_rt_snapshot_fork_t) * (n_forks + 1));
+    filename_tmp = (char *) malloc (strlen (filename) + 5);
+    if (!rt_stoptimes || !forks || !filename_tmp) goto cleanup;
+
+    for (i_vj = 0; i_vj < td->n_vjs_orig; ++i_vj) {
+        tdata_rt_stoptimes_t *rt;
+        for (rt = td->vj_stoptimes[i_vj]; rt; rt = rt->next) {
+            tdata_rt_snapshot_stoptimes_t *rt_stoptime = rt_stoptimes + header.n_rt_stoptimes;
+            rt_stoptime->vj_index = i_vj;
+            rt_stoptime->stop_times = header.n_stop_times;
+            rt_stoptime->days = rt->days;
+            header.n_stop_times += vj_n_stops (td, i_vj);
+            header.n_rt_stoptimes++;
+        }
+    }
+
+    /* Only vehicle_journeys changed by a TripUpdate can have been forked */
+    for (i_rt_vj = 0; i_rt_vj < td->n_rt_vjs; ++i_rt_vj) {
+        uint32_t vj_index = td->rt_vjs[i_rt_vj];
+        uint32_t jp_index = tdata_realtime_fork_of (td, vj_index);
+        tdata_rt_stoptimes_t *rt;
+        journey_pattern_t *jp;
+
+        if (jp_index == RADIXTREE_NONE ||
+            td->journey_pattern_active[jp_index] == 0) continue;
+
+        jp = td->journey_patterns + jp_index;
+        if (td->vj_stoptimes[jp->vj_ids_offset] == NULL) continue;
+
+        for (rt = td->vj_stoptimes[jp->vj_ids_offset]; rt; rt = rt->next) {
+            tdata_rt_snapshot_fork_t *fork = forks + header.n_forks;
+
+            fork->vj_index = vj_index;
+            fork->stop_times = header.n_stop_times;
+            fork->stops = header.n_fork_stops;
+            fork->active = td->journey_pattern_active[jp_index];
+            fork->days = rt->days;
+            fork->n_stops = jp->n_stops;
+            fork->reserved = 0;
+
+            header.n_stop_times += jp->n_stops;
+            header.n_forks++;
+        }
+        header.n_fork_stops += jp->n_stops;
+    }
+
+    /* A reader never sees a partially written snapshot */
+    sprintf (filename_tmp, "%s.tmp", filename);
+    fp = fopen (filename_tmp, "wb");
+    if (fp == NULL) {
+        fprintf (stderr, "Could not create the realtime snapshot %s.\n", filename_tmp);
+        goto cleanup;
+    }
+
+    if (fwrite (&header, sizeof(tdata_rt_snapshot_header_t), 1, fp) != 1 ||
+        fwrite (td->vj_active, sizeof(calendar_t), td->n_vjs_orig, fp) != td->n_vjs_orig ||
+        fwrite (td->vj_rt_hash, sizeof(uint32_t), td->n_vjs_orig, fp) != td->n_vjs_orig ||
+        fwrite (rt_stoptimes, sizeof(tdata_rt_snapshot_stoptimes_t), header.n_rt_stoptimes, fp) != header.n_rt_stoptimes ||
+        fwrite (forks, sizeof(tdata_rt_snapshot_fork_t), header.n_forks, fp) != header.n_forks) {
+        goto fail_write;
+    }
+
+    /* The stops of a fork are written once, for its first list entry */
+    for (i_fork = 0; i_fork < header.n_forks; ++i_fork) {
+        journey_pattern_t *jp;
+        if (i_fork > 0 && forks[i_fork].stops == forks[i_fork - 1].stops) continue;
+        jp = td->journey_patterns + tdata_realtime_fork_of (td, forks[i_fork].vj_index);
+        if (fwrite (td->journey_pattern_points + jp->journey_pattern_point_offset,
+                    sizeof(spidx_t), jp->n_stops, fp) != jp->n_stops) goto fail_write;
+    }
+
+    for (i_vj = 0; i_vj < td->n_vjs_orig; ++i_vj) {
+        uint16_t n_stops = vj_n_stops (td, i_vj);
+        tdata_rt_stoptimes_t *rt;
+        for (rt = td->vj_stoptimes[i_vj]; rt; rt = rt->next) {
+            if (fwrite (rt->stop_times, sizeof(stoptime_t), n_stops, fp) != n_stops) goto fail_write;
+        }
+    }
+
+    for (i_fork = 0; i_fork < header.n_forks; i_fork += i_rt) {
+        journey_pattern_t *jp = td->journey_patterns +
+                                tdata_realtime_fork_of (td, forks[i_fork].vj_index);
+        tdata_rt_stoptimes_t *rt;
+        i_rt = 0;
+        for (rt = td->vj_stoptimes[jp->vj_ids_offset]; rt; rt = rt->next, ++i_rt) {
+            if (fwrite (rt->stop_times, sizeof(stoptime_t), jp->n_stops, fp) != jp->n_stops) goto fail_write;
+        }
+    }
+
+    if (fclose (fp) != 0) {
+        fp = NULL;
+        goto fail_write;
+    }
+    fp = NULL;
+
+    if (rename (filename_tmp, filename) != 0) {
+        fprintf (stderr, "Could not replace the realtime snapshot %s.\n", filename);
+        unlink (filename_tmp);
+        goto cleanup;
+    }
+
+    status = true;
+    goto cleanup;
+
+fail_write:
+    fprintf (stderr, "Could not write the realtime snapshot %s.\n", filename_tmp);
+    if (fp) fclose (fp);
+    unlink (filename_tmp);
+
+cleanup:
+    free (rt_stoptimes);
+    free (forks);
+    free (filename_tmp);
+
+    return status;
+}
+
+/* Check every offset of a snapshot before any of it is applied */
+static bool tdata_realtime_snapshot_validate (tdata_t *td,
+                                              tdata_rt_snapshot_header_t *header,
+                                              tdata_rt_snapshot_stoptimes_t *rt_stoptimes,
+                                              tdata_rt_snapshot_fork_t *forks,
+                                              spidx_t *fork_stops) {
+    uint32_t i_rt, i_fork, i_stop;
+
+    for (i_rt = 0; i_rt < header->n_rt_stoptimes; ++i_rt) {
+        tdata_rt_snapshot_stoptimes_t *rt = rt_stoptimes + i_rt;
+
+        if (rt->vj_index >= header->n_vjs || rt->days == 0 ||
+            ((uint64_t) rt->stop_times) + vj_n_stops (td, rt->vj_index) > header->n_stop_times) {
+            return false;
+        }
+    }
+
+    for (i_fork = 0; i_fork < header->n_forks; ++i_fork) {
+        tdata_rt_snapshot_fork_t *fork = forks + i_fork;
+
+        if (fork->vj_index >= header->n_vjs || fork->n_stops == 0 || fork->days == 0 ||
+            ((uint64_t) fork->stop_times) + fork->n_stops > header->n_stop_times ||
+            ((uint64_t) fork->stops) + fork->n_stops > header->n_fork_stops) {
+            return false;
+        }
+
+        for (i_stop = 0; i_stop < fork->n_stops; ++i_stop) {
+            spidx_t stop = fork_stops[fork->stops + i_stop];
+            if (stop != STOP_NONE && stop >= td->n_stops) return false;
+        }
+    }
+
+    return true;
+}
+
+bool tdata_realtime_snapshot_load (tdata_t *td, char *filename) {
+    tdata_rt_snapshot_header_t *header;
+    tdata_rt_snapshot_stoptimes_t *rt_stoptimes;
+    tdata_rt_snapshot_fork_t *forks;
+    calendar_t *vj_active;
+    uint32_t *vj_rt_hash;
+    spidx_t *fork_stops;
+    stoptime_t *stop_times;
+    uint32_t i_vj, i_rt, i_fork;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open (filename, O_RDONLY);
+    if (fd == -1) {
+        fprintf (stderr, "Could not open the realtime snapshot %s.\n", filename);
+        return false;
+    }
+
+    if (fstat (fd, &st) == -1 ||
+        (uint64_t) st.st_size < sizeof(tdata_rt_snapshot_header_t)) {
+        fprintf (stderr, "The realtime snapshot %s is truncated.\n", filename);
+        close (fd);
+        return false;
+    }
+
+    base = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED) {
+        fprintf (stderr, "Could not map the realtime snapshot %s.\n", filename);
+        return false;
+    }
+
+    header = (tdata_rt_snapshot_header_t *) base;
+    if (strncmp (TDATA_RT_SNAPSHOT_VERSION, header->version_string, 8) ||
+        snapshot_size (header) > (uint64_t) st.st_size) {
+        fprintf (stderr, "The realtime snapshot %s is truncated or of the wrong version.\n", filename);
+        goto fail_munmap;
+    }
+
+    if (header->calendar_start_time != td->calendar_start_time ||
+        header->n_vjs != td->n_vjs_orig) {
+        fprintf (stderr, "The realtime snapshot %s belongs to another timetable.\n", filename);
+        goto fail_munmap;
+    }
+
+    vj_active = (calendar_t *) (header + 1);
+    vj_rt_hash = (uint32_t *) (vj_active + header->n_vjs);
+    rt_stoptimes = (tdata_rt_snapshot_stoptimes_t *) (vj_rt_hash + header->n_vjs);
+    forks = (tdata_rt_snapshot_fork_t *) (rt_stoptimes + header->n_rt_stoptimes);
+    fork_stops = (spidx_t *) (forks + header->n_forks);
+    stop_times = (stoptime_t *) (fork_stops + header->n_fork_stops);
+
+    if ( ! tdata_realtime_snapshot_validate (td, header, rt_stoptimes, forks, fork_stops)) {
+        fprintf (stderr, "The realtime snapshot %s is corrupt.\n", filename);
+        goto fail_munmap;
+    }
+
+    tdata_clear_gtfsrt (td);
+
+    for (i_fork = 0; i_fork < header->n_forks; ++i_fork) {
+        tdata_rt_snapshot_fork_t *fork = forks + i_fork;
+        if ( ! tdata_realtime_restore_fork (td, fork->vj_index, fork->n_stops,
+                                            fork_stops + fork->stops,
+                                            stop_times + fork->stop_times,
+                                            fork->active, fork->days)) {
+            goto fail_clear;
+        }
+    }
+
+    for (i_rt = 0; i_rt < header->n_rt_stoptimes; ++i_rt) {
+        tdata_rt_snapshot_stoptimes_t *rt = rt_stoptimes + i_rt;
+        if ( ! tdata_realtime_restore_vj (td, rt->vj_index,
+                                          stop_times + rt->stop_times, rt->days, 0)) {
+            goto fail_clear;
+        }
+    }
+
+    for (i_vj = 0; i_vj < header->n_vjs; ++i_vj) {
+        if ( ! tdata_realtime_restore_vj (td, i_vj, NULL, 0, vj_rt_hash[i_vj])) {
+            goto fail_clear;
+        }
+    }
+
+    /* Includes the vehicle_journeys moved to a fork, and cancellations */
+    memcpy (td->vj_active, vj_active, sizeof(calendar_t) * header->n_vjs);
+    tdata_realtime_commit (td);
+
+    munmap (base, (size_t) st.st_size);
+    return true;
+
+fail_clear:
+    fprintf (stderr, "Could not restore the realtime snapshot %s.\n", filename);
+    tdata_clear_gtfsrt (td);
+
+fail_munmap:
+    munmap (base, (size_t) st.st_size);
+    return false;
+}
+
+#else
+void tdata_realtime_snapshot_not_available() {}
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
@@ -0,0 +1,47 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_snapshot.h : the realtime state of a timetable on disk
+ *
+ * Decoding and applying a large GTFS-RT feed takes seconds, a process which
+ * restarts would route on the schedule until then. An updater writes the
+ * stoptimes, forked journey_patterns and cancellations the feeds applied
+ * to a snapshot, which a restarted process loads in a single pass:
+ *
+ *     tdata_realtime_snapshot_load (&tdata, "/var/lib/rrrr/realtime.snap");
+ *     ...
+ *     tdata_replace_gtfsrt_tripupdates (&tdata, buf, len);
+ *     tdata_realtime_snapshot_write (&tdata, "/var/lib/rrrr/realtime.snap");
+ *
+ * The TripUpdates are remembered by their hash, so the first feed replacing
+ * a loaded snapshot only applies what changed since it was written.
+ */
+
+#ifndef _TDATA_REALTIME_SNAPSHOT_H
+#define _TDATA_REALTIME_SNAPSHOT_H
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include "tdata.h"
+
+#include <stdbool.h>
+
+#define TDATA_RT_SNAPSHOT_VERSION "RRRRRTP2"
+
+/* Write the realtime state of the timetable into filename, replacing the
+ * previous snapshot only once the new one is complete.
+ */
+bool tdata_realtime_snapshot_write (tdata_t *td, char *filename);
+
+/* Replace the realtime state of the timetable by the one in filename.
+ * No router may use the timetable meanwhile, as for tdata_clear_gtfsrt.
+ */
+bool tdata_realtime_snapshot_load (tdata_t *td, char *filename);
+
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
+
+#endif /* _TDATA_REALTIME_SNAPSHOT_H */
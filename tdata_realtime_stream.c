@@ -0,0 +1,328 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_stream.c : GTFS-RT feed messages read from a local source */
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include "tdata_realtime_stream.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STREAM_SOCKET_PREFIX "unix:"
+
+static bool stream_reserve (tdata_rt_stream_t *stream, size_t len) {
+    uint8_t *buf;
+
+    if (len <= stream->buf_size) return true;
+
+    buf = (uint8_t *) realloc (stream->buf, len);
+    if (buf == NULL) {
+        fprintf (stderr, "Could not allocate %lu bytes for a GTFS-RT message.\n",
+                         (unsigned long) len);
+        return false;
+    }
+
+    stream->buf = buf;
+    stream->buf_size = len;
+    return true;
+}
+
+/* Wait until fd can be read from, or without fd (-1) until the timeout
+ * expires. Returns false once the stream is stopped: the wake pipe stays
+ * readable from then on, also when the stop came before the select.
+ */
+static bool stream_wait (tdata_rt_stream_t *stream, int fd,
+                         struct timeval *timeout) {
+    for (;;) {
+        fd_set fds;
+        int n;
+
+        if (stream->stopped) return false;
+
+        FD_ZERO (&fds);
+        FD_SET (stream->wake[0], &fds);
+        if (fd != -1) FD_SET (fd, &fds);
+
+        n = select ((fd > stream->wake[0] ? fd : stream->wake[0]) + 1,
+                    &fds, NULL, NULL, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        if (FD_ISSET (stream->wake[0], &fds)) return false;
+        if (n == 0 || FD_ISSET (fd, &fds)) return true;
+    }
+}
+
+/* Read exactly len bytes, fails on the end of the file, on an error and once
+ * the stream is stopped. A regular file is read without a stream.
+ */
+static bool stream_read (tdata_rt_stream_t *stream, int fd, uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n;
+
+        if (stream && ! stream_wait (stream, fd, NULL)) return false;
+
+        n = read (fd, buf, len);
+        if (n <= 0) return false;
+        buf += n;
+        len -= (size_t) n;
+    }
+    return true;
+}
+
+/* A 32 bit length in network byte order, followed by the message */
+static bool stream_read_framed (tdata_rt_stream_t *stream, int fd, size_t *len) {
+    uint8_t header[4];
+    uint32_t size;
+
+    if ( ! stream_read (stream, fd, header, 4)) return false;
+
+    size = ((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) |
+           ((uint32_t) header[2] <<  8) |  (uint32_t) header[3];
+
+    if (size > RRRR_REALTIME_STREAM_MAX_MESSAGE) {
+        fprintf (stderr, "GTFS-RT message of %u bytes on %s exceeds the maximum size.\n",
+                         size, stream->source);
+        return false;
+    }
+
+    if ( ! stream_reserve (stream, size + 1) ||
+         ! stream_read (stream, fd, stream->buf, size)) return false;
+
+    *len = size;
+    return true;
+}
+
+/* The first file name after the previous one, files starting with a dot are
+ * skipped: a producer writes a message under such a name and renames it once
+ * it is complete.
+ */
+static bool stream_next_filename (tdata_rt_stream_t *stream, char *filename) {
+    DIR *dir;
+    struct dirent *entry;
+    bool found = false;
+
+    dir = opendir (stream->source);
+    if (dir == NULL) return false;
+
+    while ((entry = readdir (dir)) != NULL) {
+        if (entry->d_name[0] == '.' ||
+            strlen (entry->d_name) >= sizeof(stream->last) ||
+            strcmp (entry->d_name, stream->last) <= 0) continue;
+
+        if ( ! found || strcmp (entry->d_name, filename) < 0) {
+            strcpy (filename, entry->d_name);
+            found = true;
+        }
+    }
+
+    closedir (dir);
+    return found;
+}
+
+static bool stream_read_file (tdata_rt_stream_t *stream, char *filename,
+                              size_t *len) {
+    char *path;
+    struct stat st;
+    int fd;
+
+    path = (char *) malloc (strlen (stream->source) + strlen (filename) + 2);
+    if (path == NULL) return false;
+    sprintf (path, "%s/%s", stream->source, filename);
+
+    fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        fprintf (stderr, "Could not open GTFS-RT message %s.\n", path);
+        free (path);
+        return false;
+    }
+
+    if (fstat (fd, &st) == -1 ||
+        st.st_size > RRRR_REALTIME_STREAM_MAX_MESSAGE ||
+        ! stream_reserve (stream, (size_t) st.st_size + 1) ||
+        ! stream_read (NULL, fd, stream->buf, (size_t) st.st_size)) {
+        fprintf (stderr, "Could not read GTFS-RT message %s.\n", path);
+        close (fd);
+        free (path);
+        return false;
+    }
+
+    close (fd);
+    free (path);
+    *len = (size_t) st.st_size;
+    return true;
+}
+
+bool tdata_rt_stream_open (tdata_rt_stream_t *stream, char *source) {
+    struct stat st;
+
+    memset (stream, 0, sizeof(tdata_rt_stream_t));
+    stream->source = source;
+    stream->fd = -1;
+    stream->conn = -1;
+    stream->wake[0] = -1;
+    stream->wake[1] = -1;
+
+    /* Non-blocking, a stop never waits for a full pipe to be read */
+    if (pipe (stream->wake) == -1) {
+        stream->wake[0] = -1;
+        stream->wake[1] = -1;
+        goto fail;
+    }
+    fcntl (stream->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl (stream->wake[1], F_SETFL, O_NONBLOCK);
+
+    if (strncmp (source, STREAM_SOCKET_PREFIX, strlen(STREAM_SOCKET_PREFIX)) == 0) {
+        struct sockaddr_un addr;
+        char *path = source + strlen(STREAM_SOCKET_PREFIX);
+
+        if (strlen (path) >= sizeof(addr.sun_path)) {
+            fprintf (stderr, "The socket path %s is too long.\n", path);
+            return false;
+        }
+
+        memset (&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy (addr.sun_path, path);
+
+        stream->type = rts_socket;
+        stream->fd = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (stream->fd == -1) goto fail;
+
+        unlink (path);
+        if (bind (stream->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+            listen (stream->fd, 1) == -1) goto fail;
+
+        return true;
+    }
+
+    if (stat (source, &st) == -1) goto fail;
+
+    if (S_ISDIR(st.st_mode)) {
+        stream->type = rts_directory;
+        return true;
+    }
+
+    if (S_ISFIFO(st.st_mode)) {
+        stream->type = rts_fifo;
+        /* Blocks until the producer opens the pipe, or a signal comes */
+        stream->fd = open (source, O_RDONLY);
+        if (stream->fd == -1) {
+            if (errno == EINTR) return false;
+            goto fail;
+        }
+        return true;
+    }
+
+    fprintf (stderr, "GTFS-RT source %s is not a directory, named pipe or socket.\n", source);
+    return false;
+
+fail:
+    fprintf (stderr, "Could not open GTFS-RT source %s.\n", source);
+    tdata_rt_stream_close (stream);
+    return false;
+}
+
+bool tdata_rt_stream_next (tdata_rt_stream_t *stream, uint8_t **buf, size_t *len) {
+    struct timeval interval;
+
+    if (stream->stopped) return false;
+
+    switch (stream->type) {
+    case rts_directory:
+        for (;;) {
+            char filename[sizeof(stream->last)];
+
+            if (stream->stopped) return false;
+
+            if (stream_next_filename (stream, filename)) {
+                memcpy (stream->last, filename, sizeof(stream->last));
+                if (stream_read_file (stream, filename, len)) break;
+                continue;
+            }
+
+            interval.tv_sec = RRRR_REALTIME_STREAM_POLL;
+            interval.tv_usec = 0;
+            if ( ! stream_wait (stream, -1, &interval)) return false;
+        }
+        break;
+
+    case rts_fifo:
+        if ( ! stream_read_framed (stream, stream->fd, len)) return false;
+        break;
+
+    case rts_socket:
+        for (;;) {
+            if (stream->conn == -1) {
+                if ( ! stream_wait (stream, stream->fd, NULL)) return false;
+                stream->conn = accept (stream->fd, NULL, NULL);
+                if (stream->conn == -1) return false;
+            }
+
+            if (stream_read_framed (stream, stream->conn, len)) break;
+            if (stream->stopped) return false;
+
+            /* The producer went away, wait for the next one */
+            close (stream->conn);
+            stream->conn = -1;
+        }
+        break;
+    }
+
+    *buf = stream->buf;
+    return true;
+}
+
+void tdata_rt_stream_stop (tdata_rt_stream_t *stream) {
+    int saved_errno = errno;
+
+    stream->stopped = 1;
+    if (stream->wake[1] != -1) {
+        ssize_t n = write (stream->wake[1], "", 1);
+        UNUSED(n);
+    }
+
+    errno = saved_errno;
+}
+
+void tdata_rt_stream_close (tdata_rt_stream_t *stream) {
+    if (stream->conn != -1) close (stream->conn);
+    if (stream->fd != -1) close (stream->fd);
+    if (stream->wake[0] != -1) close (stream->wake[0]);
+    if (stream->wake[1] != -1) close (stream->wake[1]);
+    if (stream->type == rts_socket) {
+        unlink (stream->source + strlen(STREAM_SOCKET_PREFIX));
+    }
+
+    free (stream->buf);
+    stream->buf = NULL;
+    stream->buf_size = 0;
+    stream->conn = -1;
+    stream->fd = -1;
+    stream->wake[0] = -1;
+    stream->wake[1] = -1;
+}
+
+#else
+void tdata_realtime_stream_not_available() {}
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
@@ -0,0 +1,79 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_realtime_stream.h : GTFS-RT feed messages read from a local source
+ *
+ * A long running updater reads one FeedMessage after another from:
+ *
+ *   a directory    every file is one message, files are read once in the
+ *                  order of their names, new files are picked up as they
+ *                  appear;
+ *   a named pipe   every message is preceded by its length, as a 32 bit
+ *                  integer in network byte order;
+ *   unix:path      a Unix domain socket is created at path, a producer
+ *                  connects and writes messages framed as on a named pipe.
+ *
+ * The stream ends when a named pipe is closed by its producer, or after
+ * tdata_rt_stream_stop, which may be called from a signal handler. It wakes
+ * up a wait for a message through a pipe of the stream itself, so a signal
+ * which comes just before the wait is not lost.
+ */
+
+#ifndef _TDATA_REALTIME_STREAM_H
+#define _TDATA_REALTIME_STREAM_H
+
+#include "config.h"
+
+#ifdef RRRR_FEATURE_REALTIME_EXPANDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+
+typedef enum tdata_rt_stream_type {
+    rts_directory,
+    rts_fifo,
+    rts_socket
+} tdata_rt_stream_type_t;
+
+typedef struct tdata_rt_stream tdata_rt_stream_t;
+struct tdata_rt_stream {
+    char *source;
+    tdata_rt_stream_type_t type;
+    /* the named pipe or the listening socket */
+    int fd;
+    /* the connection of the producer to the socket */
+    int conn;
+    /* tdata_rt_stream_stop writes to wake[1], every wait watches wake[0] */
+    int wake[2];
+    /* the name of the last file read from a directory */
+    char last[256];
+    /* holds the current message */
+    uint8_t *buf;
+    size_t buf_size;
+    volatile sig_atomic_t stopped;
+};
+
+/* Opening a named pipe waits for its producer, and returns false without a
+ * message when a signal interrupts the wait.
+ */
+bool tdata_rt_stream_open (tdata_rt_stream_t *stream, char *source);
+
+/* Wait for the next message, which remains valid until the next call.
+ * Returns false at the end of the stream.
+ */
+bool tdata_rt_stream_next (tdata_rt_stream_t *stream, uint8_t **buf, size_t *len);
+
+/* End the stream, a wait for a message returns false. Safe to call from a
+ * signal handler.
+ */
+void tdata_rt_stream_stop (tdata_rt_stream_t *stream);
+
+void tdata_rt_stream_close (tdata_rt_stream_t *stream);
+
+#endif /* RRRR_FEATURE_REALTIME_EXPANDED */
+
+#endif /* _TDATA_REALTIME_STREAM_H */
@@ -0,0 +1,155 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_swap.c : replace the timetable while routers keep running */
+
+#include "tdata_swap.h"
+#include "tdata.h"
+#include "util.h"
+
+#ifdef RRRR_FEATURE_REALTIME
+#include "radixtree.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+/* Load a timetable into a slot, including everything derived from it,
+ * so it is ready for use the moment it is published. tdata_load builds
+ * the state shared by all routers, such as the lower bound graph; a
+ * router refreshed for the new timetable only allocates its scratch.
+ */
+static bool tdata_swap_load_slot (tdata_swap_t *swap, tdata_t *td,
+                                  char *filename) {
+    memset (td, 0, sizeof(tdata_t));
+
+    if ( ! tdata_load (td, filename)) return false;
+
+    /* A router setup for the timetable this slot held before must notice
+     * it is a different one, even though its address is the same.
+     */
+    td->generation = ++swap->generation;
+
+    #ifdef RRRR_FEATURE_REALTIME
+    /* unless the timetable contains them already */
+    if (!td->stopid_index) td->stopid_index = radixtree_load_strings_from_tdata (td->stop_ids, td->stop_ids_width, td->n_stops);
+    if (!td->vjid_index) td->vjid_index = radixtree_load_strings_from_tdata (td->vj_ids, td->vj_ids_width, td->n_vjs);
+    if (!td->lineid_index) td->lineid_index = radixtree_load_strings_from_tdata (td->line_ids, td->line_ids_width, td->n_journey_patterns);
+
+    if (!(td->stopid_index &&
+          td->vjid_index &&
+          td->lineid_index)) {
+        fprintf (stderr, "The indexes of %s could not be built.\n", filename);
+        goto fail_close;
+    }
+    #endif
+
+    return true;
+
+    #ifdef RRRR_FEATURE_REALTIME
+fail_close:
+    if (td->stopid_index) radixtree_destroy (td->stopid_index);
+    if (td->vjid_index) radixtree_destroy (td->vjid_index);
+    if (td->lineid_index) radixtree_destroy (td->lineid_index);
+    tdata_close (td);
+    return false;
+    #endif
+}
+
+static void tdata_swap_close_slot (tdata_t *td) {
+    #ifdef RRRR_FEATURE_REALTIME
+    if (td->stopid_index) radixtree_destroy (td->stopid_index);
+    if (td->vjid_index) radixtree_destroy (td->vjid_index);
+    if (td->lineid_index) radixtree_destroy (td->lineid_index);
+    #endif
+
+    tdata_close (td);
+}
+
+bool tdata_swap_init (tdata_swap_t *swap, char *filename) {
+    swap->current = NULL;
+    swap->retired = NULL;
+    swap->epoch = 0;
+    swap->readers[0] = 0;
+    swap->readers[1] = 0;
+    swap->retired_ticket = 0;
+    swap->generation = 0;
+
+    if ( ! tdata_swap_load_slot (swap, &swap->slots[0], filename)) return false;
+
+    rrrr_atomic_set (&swap->current, &swap->slots[0]);
+
+    return true;
+}
+
+void tdata_swap_close (tdata_swap_t *swap) {
+    if (swap->retired) {
+        tdata_swap_close_slot (swap->retired);
+        swap->retired = NULL;
+    }
+
+    if (swap->current) {
+        tdata_swap_close_slot (swap->current);
+        swap->current = NULL;
+    }
+}
+
+tdata_t *tdata_swap_acquire (tdata_swap_t *swap, uint32_t *ticket) {
+    uint32_t epoch;
+
+    /* Only count ourselves in an epoch that did not end in the meantime,
+     * otherwise the reclaimer may already have seen the old counter at zero.
+     */
+    for (;;) {
+        epoch = rrrr_atomic_get (&swap->epoch);
+        rrrr_atomic_add (&swap->readers[epoch & 1], 1);
+        if (rrrr_atomic_get (&swap->epoch) == epoch) break;
+        rrrr_atomic_sub (&swap->readers[epoch & 1], 1);
+    }
+
+    *ticket = epoch & 1;
+
+    return rrrr_atomic_get (&swap->current);
+}
+
+void tdata_swap_release (tdata_swap_t *swap, uint32_t ticket) {
+    rrrr_atomic_sub (&swap->readers[ticket], 1);
+}
+
+bool tdata_swap_reclaim (tdata_swap_t *swap) {
+    if (swap->retired == NULL) return true;
+
+    if (rrrr_atomic_get (&swap->readers[swap->retired_ticket]) != 0) return false;
+
+    tdata_swap_close_slot (swap->retired);
+    swap->retired = NULL;
+
+    return true;
+}
+
+bool tdata_swap_reload (tdata_swap_t *swap, char *filename) {
+    tdata_t *previous = rrrr_atomic_get (&swap->current);
+    tdata_t *next = (previous == &swap->slots[0] ? &swap->slots[1]
+                                                 : &swap->slots[0]);
+
+    if ( ! tdata_swap_reclaim (swap)) {
+        fprintf (stderr, "The previous timetable is still in use, not loading %s.\n", filename);
+        return false;
+    }
+
+    if ( ! tdata_swap_load_slot (swap, next, filename)) return false;
+
+    /* Publish the new timetable before ending the epoch, all readers
+     * entering the next epoch will see it.
+     */
+    rrrr_atomic_set (&swap->current, next);
+    swap->retired = previous;
+    swap->retired_ticket = rrrr_atomic_get (&swap->epoch) & 1;
+    rrrr_atomic_add (&swap->epoch, 1);
+
+    tdata_swap_reclaim (swap);
+
+    return true;
+}
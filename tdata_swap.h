@@ -0,0 +1,84 @@
+/* Copyright 2013 Bliksem Labs.
+ * See the LICENSE file at the top-level directory of this distribution and at
+ * https://github.com/bliksemlabs/rrrr/
+ */
+
+/* tdata_swap.h : replace the timetable while routers keep running
+ *
+ * A tdata_swap_t holds two timetables: the published one, and either a
+ * free slot or the previously published timetable. A reload loads a new
+ * file into the free slot, builds its indexes and only then publishes it.
+ *
+ * Routers enter an epoch for the duration of one request:
+ *
+ *     tdata_t *td = tdata_swap_acquire (&swap, &ticket);
+ *     router_refresh (&router, td);
+ *     router_route (&router, &req);
+ *     ...
+ *     tdata_swap_release (&swap, ticket);
+ *
+ * Readers increment the counter of the current epoch. Publishing advances
+ * the epoch, so the previous timetable can be closed as soon as the counter
+ * of the epoch before the switch drops to zero.
+ *
+ * Any number of threads may acquire and release, tdata_swap_reload and
+ * tdata_swap_reclaim must be called from a single thread.
+ */
+
+#ifndef _TDATA_SWAP_H
+#define _TDATA_SWAP_H
+
+#include "config.h"
+#include "tdata.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct tdata_swap tdata_swap_t;
+struct tdata_swap {
+    tdata_t slots[2];
+
+    /* The timetable new requests will use */
+    tdata_t * volatile current;
+
+    /* The timetable which was replaced, until it is closed */
+    tdata_t *retired;
+
+    /* Incremented every time a timetable is published */
+    volatile uint32_t epoch;
+
+    /* The number of readers that entered in an even or odd epoch */
+    volatile uint32_t readers[2];
+
+    /* The parity of the epoch in which the retired timetable was replaced */
+    uint32_t retired_ticket;
+
+    /* The generation of the last timetable loaded into a slot */
+    uint32_t generation;
+};
+
+/* Load the initial timetable. */
+bool tdata_swap_init (tdata_swap_t *swap, char *filename);
+
+/* Close all timetables, no reader may hold a ticket. */
+void tdata_swap_close (tdata_swap_t *swap);
+
+/* Returns the published timetable, which stays valid until the returned
+ * ticket is released.
+ */
+tdata_t *tdata_swap_acquire (tdata_swap_t *swap, uint32_t *ticket);
+
+void tdata_swap_release (tdata_swap_t *swap, uint32_t ticket);
+
+/* Load a new timetable and publish it. Fails without changing the published
+ * timetable when the file cannot be loaded, or when the timetable replaced by
+ * the previous reload is still in use.
+ */
+bool tdata_swap_reload (tdata_swap_t *swap, char *filename);
+
+/* Close the replaced timetable when no reader uses it anymore. Returns true
+ * when there is no replaced timetable left.
+ */
+bool tdata_swap_reclaim (tdata_swap_t *swap);
+
+#endif /* _TDATA_SWAP_H */
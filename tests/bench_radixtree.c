@@ -0,0 +1,102 @@
+/* Measures the throughput of radixtree_find on the ids of a timetable:
+ *
+ *     bench_radixtree timetable.dat [rounds]
+ *
+ * For the stop, vehicle_journey and line ids it looks up every id in a
+ * scattered order, in the pool as filled by inserting the ids, in the
+ * compacted pool and in the index stored in the timetable, if any.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../tdata_io_v4.h"
+#include "../radixtree.h"
+
+static const tdata_section_id_t ids[] = {
+    TDATA_SECTION_STOP_IDS, TDATA_SECTION_VJ_IDS, TDATA_SECTION_LINE_IDS
+};
+
+static const tdata_section_id_t indexes[] = {
+    TDATA_SECTION_STOP_ID_INDEX, TDATA_SECTION_VJ_ID_INDEX, TDATA_SECTION_LINE_ID_INDEX
+};
+
+static void bench (const char *name, radixtree_t *r, char *strings,
+                   tdata_section_t *section, uint32_t rounds) {
+    clock_t start = clock();
+    uint32_t round, i, n_wrong = 0;
+    double seconds;
+
+    for (round = 0; round < rounds; ++round) {
+        for (i = 0; i < section->n_items; ++i) {
+            /* a large odd multiplier scatters the lookups over the pool */
+            uint32_t idx = (uint32_t) ((i * 2654435761UL) % section->n_items);
+            if (radixtree_find (r, strings + idx * section->width) != idx) n_wrong++;
+        }
+    }
+
+    seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+    printf ("%-10s %8u edges %10.2f Mfinds/s%s\n", name, r->n_edges,
+            (double) rounds * section->n_items / (seconds > 0 ? seconds : 1e-9) / 1e6,
+            (n_wrong ? " (duplicate ids)" : ""));
+}
+
+int main (int argc, char **argv) {
+    tdata_v4_header_t header;
+    tdata_section_t *sections;
+    struct stat st;
+    char *data;
+    FILE *fp;
+    uint32_t rounds, i;
+
+    if (argc < 2) {
+        fprintf (stderr, "Usage: %s timetable.dat [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    rounds = (argc > 2 ? (uint32_t) atoi (argv[2]) : 100);
+
+    if (stat (argv[1], &st) == -1 ||
+        (data = (char *) malloc ((size_t) st.st_size)) == NULL ||
+        (fp = fopen (argv[1], "rb")) == NULL) return EXIT_FAILURE;
+    if (fread (data, 1, (size_t) st.st_size, fp) != (size_t) st.st_size) return EXIT_FAILURE;
+    fclose (fp);
+
+    memcpy (&header, data, sizeof(tdata_v4_header_t));
+    if ( ! tdata_io_v4_check_header (&header, st.st_size, argv[1])) return EXIT_FAILURE;
+    sections = (tdata_section_t *) (data + header.loc_sections);
+    if ( ! tdata_io_v4_check_sections (sections, header.n_sections, st.st_size, argv[1])) {
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        tdata_section_t *section = tdata_io_v4_section (sections, header.n_sections, ids[i]);
+        tdata_section_t *index = tdata_io_v4_section (sections, header.n_sections, indexes[i]);
+        char *strings = data + section->offset;
+        radixtree_t *r = radixtree_new ();
+        clock_t start = clock();
+        uint32_t idx;
+
+        for (idx = 0; idx < section->n_items; ++idx) {
+            radixtree_insert (r, strings + idx * section->width, idx);
+        }
+        printf ("section %u: %u ids, inserted in %.3f s\n", ids[i], section->n_items,
+                (double) (clock() - start) / CLOCKS_PER_SEC);
+
+        bench ("inserted", r, strings, section, rounds);
+        radixtree_compact (r);
+        bench ("compacted", r, strings, section, rounds);
+        radixtree_destroy (r);
+
+        if (index) {
+            r = radixtree_from_flat ((rxt_edge_t *) (data + index->offset),
+                                     index->n_items, false);
+            if (r) bench ("stored", r, strings, section, rounds);
+            radixtree_destroy (r);
+        }
+    }
+
+    free (data);
+    return EXIT_SUCCESS;
+}
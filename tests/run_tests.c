@@ -3,11 +3,10 @@
 
 /* could be in a header, but simpler here */
 Suite *make_bitset_suite (void);
-
-#if 0
-Suite *make_hashgrid_suite (void);
+Suite *make_arena_suite (void);
 Suite *make_radixtree_suite (void);
-#endif
+Suite *make_namesearch_suite (void);
+Suite *make_hashgrid_suite (void);
 
 Suite *make_master_suite (void) {
     Suite *s = suite_create ("Master");
@@ -19,10 +18,10 @@ int main (void) {
     SRunner *sr;
     sr = srunner_create (make_master_suite ());
     srunner_add_suite (sr, make_bitset_suite ());
-    #if 0
-    srunner_add_suite (sr, make_hashgrid_suite ());
+    srunner_add_suite (sr, make_arena_suite ());
     srunner_add_suite (sr, make_radixtree_suite ());
-    #endif
+    srunner_add_suite (sr, make_namesearch_suite ());
+    srunner_add_suite (sr, make_hashgrid_suite ());
     srunner_set_log (sr, "test.log");
     srunner_run_all (sr, CK_VERBOSE); /* CK_NORMAL */
     number_failed = srunner_ntests_failed (sr);
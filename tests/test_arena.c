@@ -0,0 +1,57 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../arena.h"
+
+START_TEST (test_arena)
+    {
+        arena_t arena;
+        char *a, *b, *big, *reused;
+        uint32_t i;
+
+        arena_init(&arena, 256);
+
+        /* Allocations are aligned and do not overlap */
+        a = (char *) arena_alloc(&arena, 3);
+        b = (char *) arena_alloc(&arena, 5);
+        ck_assert(a != NULL && b != NULL);
+        ck_assert_int_eq(0, ((size_t) a) % 8);
+        ck_assert_int_eq(0, ((size_t) b) % 8);
+        ck_assert(b >= a + 3);
+        memset(a, 'a', 3);
+        memset(b, 'b', 5);
+        ck_assert(a[2] == 'a');
+
+        /* Filling a chunk continues in a new one */
+        for (i = 0; i < 100; ++i) {
+            char *c = (char *) arena_alloc(&arena, 16);
+            ck_assert(c != NULL);
+            memset(c, 'c', 16);
+        }
+        ck_assert(arena.head->next != NULL);
+        ck_assert(b[4] == 'b');
+
+        /* A single allocation may be larger than a chunk */
+        big = (char *) arena_alloc(&arena, 1000);
+        ck_assert(big != NULL);
+        memset(big, 'd', 1000);
+        ck_assert_int_eq(8 + 8 + 100 * 16 + 1000, arena.n_bytes);
+
+        /* A reset hands out the first chunk again */
+        arena_reset(&arena);
+        reused = (char *) arena_alloc(&arena, 3);
+        ck_assert(reused == a);
+        ck_assert_int_eq(8, arena.n_bytes);
+
+        arena_destroy(&arena);
+        ck_assert(arena.head == NULL);
+    }
+END_TEST
+
+Suite *make_arena_suite(void) {
+    Suite *s = suite_create("arena_t");
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test  (tc_core, test_arena);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,131 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hashgrid.h"
+
+#define N_COORDS 2000
+
+/* The items within radius_meters of coord by brute force, nearest first */
+static uint32_t knn_scan (coord_t *coords, coord_t coord, double radius_meters,
+                          uint32_t k, uint32_t *items) {
+    double distances[N_COORDS];
+    uint32_t i, n = 0;
+
+    for (i = 0; i < N_COORDS; ++i) {
+        double distance = coord_distance_meters (&coord, coords + i);
+        uint32_t j = n;
+        if (distance >= radius_meters) continue;
+        while (j > 0 && distances[j - 1] > distance) {
+            items[j] = items[j - 1];
+            distances[j] = distances[j - 1];
+            j--;
+        }
+        items[j] = i;
+        distances[j] = distance;
+        n++;
+    }
+
+    return (n < k ? n : k);
+}
+
+static int compare_items (const void *a, const void *b) {
+    uint32_t ia = *(const uint32_t *) a, ib = *(const uint32_t *) b;
+    return (ia > ib) - (ia < ib);
+}
+
+static uint32_t items_all[N_COORDS];
+
+START_TEST (test_hashgrid)
+    {
+        /* grids wrapping in both axes, with an odd and an even size */
+        uint32_t grid_dims[] = { 100, 7, 4 };
+        coord_t *coords = (coord_t *) malloc(sizeof(coord_t) * N_COORDS);
+        uint32_t *expected = (uint32_t *) malloc(sizeof(uint32_t) * N_COORDS);
+        uint32_t items[16];
+        double distances[16];
+        uint32_t i, g;
+
+        /* stops scattered over about 20 by 20 km */
+        srand(1);
+        for (i = 0; i < N_COORDS; ++i) {
+            coord_from_lat_lon (coords + i, 52.0 + (rand() % 20000) / 100000.0,
+                                             4.0 + (rand() % 30000) / 100000.0);
+        }
+
+        for (g = 0; g < sizeof(grid_dims) / sizeof(uint32_t); ++g) {
+            hashgrid_t hg;
+            ck_assert(hashgrid_init (&hg, grid_dims[g], 500.0, coords, N_COORDS));
+
+            for (i = 0; i < 50; ++i) {
+                coord_t coord;
+                uint32_t k = 1 + i % 16, n, j;
+                double radius = (i % 3 == 0 ? 150.0 : 2000.0);
+
+                coord_from_lat_lon (&coord, 52.0 + (rand() % 20000) / 100000.0,
+                                            4.0 + (rand() % 30000) / 100000.0);
+                n = hashgrid_knn (&hg, coord, radius, k, items, distances);
+                ck_assert_int_eq(knn_scan (coords, coord, radius, k, expected), n);
+                for (j = 0; j < n; ++j) {
+                    ck_assert(distances[j] < radius);
+                    ck_assert(j == 0 || distances[j - 1] <= distances[j]);
+                    ck_assert(distances[j] == coord_distance_meters (&coord, coords + expected[j]));
+                }
+            }
+
+            /* The closest item of a query is the nearest neighbour, and
+             * the filtered results are every item within the radius once,
+             * as long as the bounding box is narrower than the grid.
+             */
+            if (grid_dims[g] * 500.0 > 2 * 2000.0) {
+                hashgrid_result_t result;
+                uint32_t item, n = 0;
+                double distance;
+
+                hashgrid_query (&hg, &result, coords[0], 2000.0);
+                ck_assert_int_eq(0, hashgrid_result_closest (&result));
+
+                hashgrid_result_reset (&result);
+                while ((item = hashgrid_result_next_filtered (&result, &distance)) != HASHGRID_NONE) {
+                    ck_assert(distance < 2000.0);
+                    expected[n++] = item;
+                }
+                ck_assert_int_eq(knn_scan (coords, coords[0], 2000.0, N_COORDS, items_all), n);
+                qsort(expected, n, sizeof(uint32_t), compare_items);
+                for (i = 1; i < n; ++i) ck_assert(expected[i - 1] < expected[i]);
+            }
+
+            ck_assert_int_eq(0, hashgrid_knn (&hg, coords[0], 2000.0, 0, items, distances));
+
+            /* A copy of the block finds the same items, a damaged one is refused */
+            {
+                hashgrid_t stored;
+                uint32_t stored_items[16];
+                void *block = malloc(hg.size);
+
+                memcpy(block, hg.block, hg.size);
+                ck_assert(hashgrid_from_block (&stored, block, hg.size, true));
+                ck_assert_int_eq(16, hashgrid_knn (&hg, coords[1], 2000.0, 16, items, distances));
+                ck_assert_int_eq(16, hashgrid_knn (&stored, coords[1], 2000.0, 16, stored_items, distances));
+                ck_assert(memcmp(items, stored_items, sizeof(items)) == 0);
+
+                stored.item_coords[0].x += 10 * stored.bin_size.x;
+                ck_assert(!hashgrid_from_block (&stored, block, stored.size, false));
+                ck_assert(!hashgrid_from_block (&stored, hg.block, hg.size - 1, false));
+                free(block);
+            }
+
+            hashgrid_teardown (&hg);
+        }
+
+        free(expected);
+        free(coords);
+    }
+END_TEST
+
+Suite *make_hashgrid_suite(void) {
+    Suite *s = suite_create("hashgrid_t");
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test  (tc_core, test_hashgrid);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,75 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../namesearch.h"
+
+/* "Zürich HB", "Zurich Oerlikon", "Bahnhof Zürich-Altstetten",
+ * "Oberzurichweg" and "Zug", the ü in UTF-8.
+ */
+static const char names[] = "Z\303\274rich HB\0Zurich Oerlikon\0"
+                            "Bahnhof Z\303\274rich-Altstetten\0Oberzurichweg\0Zug";
+static const uint32_t offsets[] = { 0, 11, 27, 54, 68 };
+
+START_TEST (test_namesearch)
+    {
+        namesearch_t ns, stored;
+        uint32_t results[NAMESEARCH_MAX_RESULTS];
+        const uint32_t *candidates;
+        uint32_t n;
+        void *block;
+
+        ck_assert(namesearch_build(&ns, names, offsets, 5));
+        ck_assert_int_eq(5, ns.n_strings);
+
+        /* Names starting with the query rank before the other matches,
+         * the shorter names first.
+         */
+        n = namesearch_find(&ns, "zurich", results, NAMESEARCH_MAX_RESULTS);
+        ck_assert_int_eq(4, n);
+        ck_assert_int_eq(0, results[0]);
+        ck_assert_int_eq(1, results[1]);
+        ck_assert_int_eq(2, results[2]);
+        ck_assert_int_eq(3, results[3]);
+
+        /* Accents and case are folded in the query as well */
+        ck_assert_int_eq(4, namesearch_find(&ns, "Z\303\234RICH", results, 4));
+        ck_assert_int_eq(1, namesearch_find(&ns, "rich  hb", results, 1));
+        ck_assert_int_eq(0, results[0]);
+        ck_assert_int_eq(2, namesearch_find(&ns, "zurich", results, 2));
+
+        /* Short queries match the start of words only */
+        n = namesearch_find(&ns, "zu", results, NAMESEARCH_MAX_RESULTS);
+        ck_assert_int_eq(4, n);
+        ck_assert_int_eq(4, results[0]);
+        ck_assert_int_eq(1, namesearch_find(&ns, "a", results, NAMESEARCH_MAX_RESULTS));
+        ck_assert_int_eq(0, namesearch_find(&ns, "x", results, NAMESEARCH_MAX_RESULTS));
+        ck_assert_int_eq(0, namesearch_find(&ns, "", results, NAMESEARCH_MAX_RESULTS));
+
+        /* The candidates of an ASCII query include every name containing it */
+        ck_assert(namesearch_candidates(&ns, "RICHW", &candidates, &n));
+        ck_assert(n >= 1);
+        ck_assert(!namesearch_candidates(&ns, "ri", &candidates, &n));
+        ck_assert(!namesearch_candidates(&ns, "Z\303\274ri", &candidates, &n));
+
+        /* A copy of the block finds the same names */
+        block = malloc(ns.size);
+        memcpy(block, ns.block, ns.size);
+        ck_assert(namesearch_from_block(&stored, block, ns.size, true));
+        ck_assert_int_eq(4, namesearch_find(&stored, "zurich", results, NAMESEARCH_MAX_RESULTS));
+        ck_assert_int_eq(3, results[3]);
+        namesearch_destroy(&stored);
+
+        /* A truncated block is refused */
+        ck_assert(!namesearch_from_block(&stored, ns.block, ns.size - 4, false));
+
+        namesearch_destroy(&ns);
+    }
+END_TEST
+
+Suite *make_namesearch_suite(void) {
+    Suite *s = suite_create("namesearch_t");
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test  (tc_core, test_namesearch);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
@@ -0,0 +1,80 @@
+#include <check.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../radixtree.h"
+
+START_TEST (test_radixtree)
+    {
+        radixtree_t *r, *flat;
+        rxt_edge_t *edges;
+        uint32_t i, n_edges;
+        char key[16];
+
+        r = radixtree_new();
+        ck_assert(r != NULL);
+        ck_assert_int_eq(RADIXTREE_NONE, radixtree_find(r, "a"));
+
+        /* Keys sharing prefixes longer and shorter than an edge split
+         * edges, which grows the pool beyond its initial capacity.
+         */
+        for (i = 0; i < 2000; ++i) {
+            sprintf(key, "stop:%u", i * 7);
+            ck_assert(radixtree_insert(r, key, i));
+        }
+        ck_assert(radixtree_insert(r, "stop", 2000));
+        ck_assert(radixtree_insert(r, "st", 2001));
+        ck_assert(!radixtree_insert(r, "", 2002));
+
+        for (i = 0; i < 2000; ++i) {
+            sprintf(key, "stop:%u", i * 7);
+            ck_assert_int_eq(i, radixtree_find(r, key));
+        }
+        ck_assert_int_eq(2000, radixtree_find(r, "stop"));
+        ck_assert_int_eq(2001, radixtree_find(r, "st"));
+        ck_assert_int_eq(RADIXTREE_NONE, radixtree_find(r, "sto"));
+        ck_assert_int_eq(RADIXTREE_NONE, radixtree_find(r, "stop:1"));
+        ck_assert_int_eq(RADIXTREE_NONE, radixtree_find(r, "stop:00"));
+
+        /* A replaced value */
+        ck_assert(radixtree_insert(r, "stop:7", 7000));
+        ck_assert_int_eq(7000, radixtree_find(r, "stop:7"));
+
+        /* Compaction keeps every key */
+        ck_assert(radixtree_compact(r));
+        ck_assert_int_eq(r->n_edges, radixtree_flatten(r, NULL));
+        ck_assert_int_eq(7000, radixtree_find(r, "stop:7"));
+        ck_assert_int_eq(2001, radixtree_find(r, "st"));
+
+        /* A tree on borrowed edges copies them at the first insert */
+        n_edges = radixtree_flatten(r, NULL);
+        edges = (rxt_edge_t *) malloc(sizeof(rxt_edge_t) * n_edges);
+        ck_assert_int_eq(n_edges, radixtree_flatten(r, edges));
+        flat = radixtree_from_flat(edges, n_edges, false);
+        ck_assert(flat != NULL);
+        for (i = 2; i < 2000; ++i) {
+            sprintf(key, "stop:%u", i * 7);
+            ck_assert_int_eq(i, radixtree_find(flat, key));
+        }
+        ck_assert(radixtree_insert(flat, "@trip", 3000));
+        ck_assert(flat->edges != edges);
+        ck_assert_int_eq(3000, radixtree_find(flat, "@trip"));
+        ck_assert_int_eq(2000, radixtree_find(flat, "stop"));
+        ck_assert_int_eq(RADIXTREE_NONE, radixtree_find(r, "@trip"));
+        radixtree_destroy(flat);
+
+        /* Edges referring outside of the array are refused */
+        edges[0].child = n_edges;
+        ck_assert(radixtree_from_flat(edges, n_edges, false) == NULL);
+        free(edges);
+
+        radixtree_destroy(r);
+    }
+END_TEST
+
+Suite *make_radixtree_suite(void) {
+    Suite *s = suite_create("radixtree_t");
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test  (tc_core, test_radixtree);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
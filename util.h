@@ -29,6 +29,22 @@
 
 #define UNUSED(expr) (void)(expr)
 
+/* Atomic operations on counters and pointers, each a full memory barrier */
+#if defined (__GNUC__)
+    #define rrrr_atomic_get(p) __sync_add_and_fetch(p, 0)
+    #define rrrr_atomic_set(p, v) { while ( ! __sync_bool_compare_and_swap(p, *(p), v)); }
+    #define rrrr_atomic_add(p, v) __sync_add_and_fetch(p, v)
+    #define rrrr_atomic_sub(p, v) __sync_sub_and_fetch(p, v)
+    #define rrrr_memory_barrier() __sync_synchronize()
+#else
+    /* only safe when a single thread uses the timetable */
+    #define rrrr_atomic_get(p) (*(p))
+    #define rrrr_atomic_set(p, v) { *(p) = (v); }
+    #define rrrr_atomic_add(p, v) (*(p) += (v))
+    #define rrrr_atomic_sub(p, v) (*(p) -= (v))
+    #define rrrr_memory_barrier()
+#endif
+
 #define rrrr_memset(s, u, n) { size_t i = n; do { i--; s[i] = u; } while (i); }
 
 uint32_t rrrrandom(uint32_t limit);